@@ -0,0 +1,544 @@
+// broker.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "string.h"
+#include "broker.h"
+
+// the slots are waited on with named events on Windows, and with futexes on the
+// words of the shared region elsewhere.
+
+#ifdef _WIN32
+
+#define _atomic_load(v)			(*(volatile uint32_t *)&(v))
+#define _atomic_store(v, x)		InterlockedExchange((volatile LONG *)&(v), (LONG)(x))
+#define _atomic_cas(v, x, c)	((uint32_t)InterlockedCompareExchange((volatile LONG *)&(v), (LONG)(x), (LONG)(c)) == (uint32_t)(c))
+#define _atomic_add(v, x)		(InterlockedExchangeAdd((volatile LONG *)&(v), (LONG)(x)) + (LONG)(x))
+#define _counter_inc(v)			InterlockedIncrement((volatile LONG *)&(v))
+#define _counter_add64(v, x)	InterlockedExchangeAdd64((volatile LONGLONG *)&(v), (LONGLONG)(x))
+
+#define BROKER_OPEN_TIMEOUT	100		// ms the creator has to initialize the region
+
+static const wchar_t broker_name[] = L"itecard_broker_";
+static const wchar_t broker_event_name[] = L"itecard_brokerev";
+static const wchar_t broker_guid[] = L"_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}";
+
+#else
+
+#define _atomic_load(v)			__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define _atomic_store(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#define _atomic_cas(v, x, c)	__sync_bool_compare_and_swap(&(v), (c), (x))
+#define _atomic_add(v, x)		__atomic_add_fetch(&(v), (x), __ATOMIC_SEQ_CST)
+#define _counter_inc(v)			__atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+#define _counter_add64(v, x)	__atomic_add_fetch(&(v), (x), __ATOMIC_RELAXED)
+
+#endif
+
+#ifdef _WIN32
+
+C_ASSERT((sizeof(struct broker_shared_slot) % BROKER_CACHE_LINE_SIZE) == 0);
+C_ASSERT(offsetof(struct broker_shared_info, slot) == BROKER_CACHE_LINE_SIZE * 4);
+
+static bool _broker_is_process_alive(const uint32_t pid)
+{
+	HANDLE process;
+	DWORD ret;
+
+	process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == NULL) {
+		// the process exists if we are only denied access to it
+		return (GetLastError() == ERROR_ACCESS_DENIED) ? true : false;
+	}
+
+	ret = WaitForSingleObject(process, 0);
+	CloseHandle(process);
+
+	return (ret == WAIT_TIMEOUT) ? true : false;
+}
+
+// the waits return on a signal, a timeout or a spurious wakeup alike, and the
+// callers check the state again
+static void _broker_wait(broker *const b, const uint32_t n, volatile void *const addr, const uint32_t val, const uint32_t timeout)
+{
+	WaitForSingleObject(b->event[n], timeout);
+}
+
+static void _broker_wake(broker *const b, const uint32_t n, volatile void *const addr)
+{
+	SetEvent(b->event[n]);
+}
+
+bool broker_open(broker *const b, const wchar_t *const name)
+{
+	wchar_t obj_name[256];
+	uint32_t name_len, len;
+	HANDLE shmem;
+	struct broker_shared_info *info;
+	DWORD le;
+
+	memset(b, 0, sizeof(broker));
+	b->pid = GetCurrentProcessId();
+
+	name_len = wstrLen(name);
+	if (name_len >= 128) {
+		internal_err("broker_open: name is too long");
+		return false;
+	}
+
+	len = (sizeof(broker_name) / sizeof(wchar_t)) - 1;
+	memcpy(obj_name, broker_name, len * sizeof(wchar_t));
+	memcpy(obj_name + len, name, name_len * sizeof(wchar_t));
+	memcpy(obj_name + len + name_len, broker_guid, sizeof(broker_guid));
+
+	shmem = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(struct broker_shared_info), obj_name);
+	le = GetLastError();
+	if (shmem == NULL) {
+		win32_err("broker_open: CreateFileMappingW");
+		return false;
+	}
+
+	info = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+	if (info == NULL) {
+		win32_err("broker_open: MapViewOfFile");
+		CloseHandle(shmem);
+		return false;
+	}
+
+	if (le != ERROR_ALREADY_EXISTS)
+	{
+		info->version = BROKER_SHARED_INFO_VERSION;
+		info->slot_num = BROKER_SLOT_NUM;
+		info->data_size = BROKER_MAX_DATA_SIZE;
+		InterlockedExchange((volatile LONG *)&info->signature, BROKER_SHARED_INFO_SIGNATURE);
+	}
+	else
+	{
+		// the creator may not have initialized it yet
+		for (DWORD tick = GetTickCount(); _atomic_load(info->signature) == 0 && (GetTickCount() - tick) < BROKER_OPEN_TIMEOUT; ) {
+			Sleep(1);
+		}
+	}
+
+	if (info->signature != BROKER_SHARED_INFO_SIGNATURE || info->version != BROKER_SHARED_INFO_VERSION || info->slot_num != BROKER_SLOT_NUM || info->data_size != BROKER_MAX_DATA_SIZE) {
+		internal_err("broker_open: incorrect signature or version");
+		UnmapViewOfFile(info);
+		CloseHandle(shmem);
+		return false;
+	}
+
+	b->shmem = shmem;
+	b->info = info;
+
+	// itecard_brokerev<n>_<name>_{guid}
+	len = (sizeof(broker_event_name) / sizeof(wchar_t)) - 1;
+	memcpy(obj_name, broker_event_name, len * sizeof(wchar_t));
+
+	for (uint32_t i = 0; i < 1 + BROKER_SLOT_NUM; i++)
+	{
+		uint32_t n = len + wstrFromUInt32(obj_name + len, 11, i, 10);
+
+		obj_name[n++] = L'_';
+		memcpy(obj_name + n, name, name_len * sizeof(wchar_t));
+		memcpy(obj_name + n + name_len, broker_guid, sizeof(broker_guid));
+
+		b->event[i] = CreateEventW(NULL, FALSE, FALSE, obj_name);
+		if (b->event[i] == NULL) {
+			win32_err("broker_open: CreateEventW");
+			broker_close(b);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void broker_close(broker *const b)
+{
+	for (uint32_t i = 0; i < 1 + BROKER_SLOT_NUM; i++) {
+		if (b->event[i] != NULL) {
+			CloseHandle(b->event[i]);
+			b->event[i] = NULL;
+		}
+	}
+
+	if (b->info != NULL) {
+		UnmapViewOfFile(b->info);
+		b->info = NULL;
+	}
+
+	if (b->shmem != NULL) {
+		CloseHandle(b->shmem);
+		b->shmem = NULL;
+	}
+}
+
+#else
+
+static bool _broker_is_process_alive(const uint32_t pid)
+{
+	// the process exists if we are only denied access to it
+	return (kill((pid_t)pid, 0) == 0 || errno == EPERM) ? true : false;
+}
+
+static void _broker_wait(broker *const b, const uint32_t n, volatile void *const addr, const uint32_t val, const uint32_t timeout)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void _broker_wake(broker *const b, const uint32_t n, volatile void *const addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// the region is /dev/shm/itecard_broker_<name>. it is left there when the last
+// process closes it, as a named object of Windows is not.
+bool broker_open(broker *const b, const wchar_t *const name)
+{
+	char obj_name[256];
+	struct broker_shared_info *info;
+	size_t len;
+	bool created = true;
+	int fd;
+
+	memset(b, 0, sizeof(broker));
+	b->fd = -1;
+	b->pid = (uint32_t)getpid();
+
+	memcpy(obj_name, "/itecard_broker_", 16);
+	len = wcstombs(obj_name + 16, name, sizeof(obj_name) - 16);
+	if (len == (size_t)-1 || len >= sizeof(obj_name) - 16) {
+		internal_err("broker_open: name is too long");
+		return false;
+	}
+
+	for (size_t i = 16; i < 16 + len; i++) {
+		if (obj_name[i] == '/')
+			obj_name[i] = '_';
+	}
+
+	fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		created = false;
+		fd = shm_open(obj_name, O_RDWR, 0600);
+	}
+	if (fd == -1) {
+		internal_err("broker_open: shm_open failed");
+		return false;
+	}
+
+	if (created == true && ftruncate(fd, sizeof(struct broker_shared_info)) != 0) {
+		internal_err("broker_open: ftruncate failed");
+		close(fd);
+		return false;
+	}
+
+	// the creator may not have sized it yet
+	for (int i = 0; i < 100; i++) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct broker_shared_info))
+			break;
+
+		usleep(1000);
+	}
+
+	info = mmap(NULL, sizeof(struct broker_shared_info), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (info == MAP_FAILED) {
+		internal_err("broker_open: mmap failed");
+		close(fd);
+		return false;
+	}
+
+	if (created == true)
+	{
+		info->version = BROKER_SHARED_INFO_VERSION;
+		info->slot_num = BROKER_SLOT_NUM;
+		info->data_size = BROKER_MAX_DATA_SIZE;
+		_atomic_store(info->signature, BROKER_SHARED_INFO_SIGNATURE);
+	}
+	else
+	{
+		for (int i = 0; i < 100 && _atomic_load(info->signature) == 0; i++) {
+			usleep(1000);
+		}
+	}
+
+	if (info->signature != BROKER_SHARED_INFO_SIGNATURE || info->version != BROKER_SHARED_INFO_VERSION || info->slot_num != BROKER_SLOT_NUM || info->data_size != BROKER_MAX_DATA_SIZE) {
+		internal_err("broker_open: incorrect signature or version");
+		munmap(info, sizeof(struct broker_shared_info));
+		close(fd);
+		return false;
+	}
+
+	b->fd = fd;
+	b->info = info;
+
+	return true;
+}
+
+void broker_close(broker *const b)
+{
+	if (b->info != NULL) {
+		munmap(b->info, sizeof(struct broker_shared_info));
+		b->info = NULL;
+	}
+
+	if (b->fd != -1) {
+		close(b->fd);
+		b->fd = -1;
+	}
+}
+
+#endif
+
+#define _broker_wait_owner(b, val, timeout)		_broker_wait((b), 0, &(b)->info->pending, (uint32_t)(val), (timeout))
+#define _broker_wake_owner(b)					_broker_wake((b), 0, &(b)->info->pending)
+#define _broker_wait_slot(b, i, val, timeout)	_broker_wait((b), 1 + (i), &(b)->info->slot[(i)].state, (val), (timeout))
+#define _broker_wake_slot(b, i)					_broker_wake((b), 1 + (i), &(b)->info->slot[(i)].state)
+
+// becomes the owner if there is none, or if it has gone
+bool broker_claim(broker *const b)
+{
+	struct broker_shared_info *info = b->info;
+	uint32_t owner = _atomic_load(info->owner);
+	int32_t pending = 0;
+
+	if (owner == b->pid)
+		return true;
+
+	if (owner != 0 && _broker_is_process_alive(owner) == true)
+		return false;
+
+	if (!_atomic_cas(info->owner, b->pid, owner))
+		return false;
+
+	dbg("broker_claim: owner: %u -> %u", owner, b->pid);
+
+	// the count is left as it was if the last owner had gone
+	for (uint32_t i = 0; i < BROKER_SLOT_NUM; i++) {
+		if (_atomic_load(info->slot[i].state) == BROKER_SLOT_SUBMITTED)
+			pending++;
+	}
+
+	_atomic_store(info->pending, pending);
+
+	return true;
+}
+
+// stops being the owner. the slots which have been submitted and not executed are
+// given back to their clients, which do the I/O themselves.
+void broker_release(broker *const b)
+{
+	struct broker_shared_info *info = b->info;
+
+	if (!_atomic_cas(info->owner, 0, b->pid))
+		return;
+
+	for (uint32_t i = 0; i < BROKER_SLOT_NUM; i++)
+	{
+		struct broker_shared_slot *slot = &info->slot[i];
+
+		if (_atomic_cas(slot->state, BROKER_SLOT_EXECUTING, BROKER_SLOT_SUBMITTED)) {
+			(void)_atomic_add(info->pending, -1);
+			slot->status = BROKER_E_NO_OWNER;
+			_atomic_store(slot->state, BROKER_SLOT_DONE);
+			_broker_wake_slot(b, i);
+		}
+	}
+}
+
+bool broker_is_owner(broker *const b)
+{
+	return (_atomic_load(b->info->owner) == b->pid) ? true : false;
+}
+
+// waits for the requests up to timeout milliseconds, and executes the submitted
+// ones under one acquisition of the lock. returns the number of executed requests.
+uint32_t broker_serve(broker *const b, const struct broker_ops *const ops, void *ctx, const uint32_t timeout)
+{
+	struct broker_shared_info *info = b->info;
+	int32_t pending = (int32_t)_atomic_load(info->pending);
+	uint32_t n = 0, i;
+
+	if (pending <= 0) {
+		_broker_wait_owner(b, pending, timeout);
+	}
+
+	// the slots are scanned after a timeout too, in case the count was lost with an owner
+	for (i = 0; i < BROKER_SLOT_NUM; i++) {
+		if (_atomic_load(info->slot[i].state) == BROKER_SLOT_SUBMITTED)
+			break;
+	}
+
+	if (i == BROKER_SLOT_NUM)
+		return 0;
+
+	ops->lock(ctx);
+
+	for (; i < BROKER_SLOT_NUM; i++)
+	{
+		struct broker_shared_slot *slot = &info->slot[i];
+		struct broker_request req;
+		uint32_t recv_len;
+
+		if (_atomic_load(slot->state) != BROKER_SLOT_SUBMITTED)
+			continue;
+
+		// set before the state, since the client checks it once the slot is executing
+		slot->server = b->pid;
+		if (!_atomic_cas(slot->state, BROKER_SLOT_EXECUTING, BROKER_SLOT_SUBMITTED))
+			continue;
+
+		recv_len = slot->recv_len;
+
+		req.id = slot->id;
+		req.protocol = slot->protocol;
+		req.send = slot->send;
+		req.send_len = slot->send_len;
+		req.recv = slot->recv;
+		req.recv_len = &recv_len;
+
+		slot->result = ops->execute(ctx, &req);
+		slot->recv_len = recv_len;
+		slot->status = BROKER_S_OK;
+
+		_atomic_store(slot->state, BROKER_SLOT_DONE);
+		_broker_wake_slot(b, i);
+
+		n++;
+	}
+
+	ops->unlock(ctx);
+
+	if (n != 0) {
+		(void)_atomic_add(info->pending, -(int32_t)n);
+		_counter_add64(info->stats.request, n);
+		_counter_add64(info->stats.batch, 1);
+	}
+
+	return n;
+}
+
+// has the owner execute the command. the result of the execution is in result,
+// and BROKER_E_NO_OWNER or BROKER_E_BUSY means the command has not been sent.
+broker_status_t broker_call(broker *const b, const uint32_t id, const uint32_t protocol, const uint8_t *const send, const uint32_t send_len, uint8_t *const recv, uint32_t *const recv_len, int32_t *const result)
+{
+	struct broker_shared_info *info = b->info;
+	struct broker_shared_slot *slot = NULL;
+	uint32_t owner, i, state;
+	broker_status_t status;
+
+	if (send_len > BROKER_MAX_DATA_SIZE)
+		return BROKER_E_TOO_LARGE;
+
+	owner = _atomic_load(info->owner);
+	if (owner == 0 || owner == b->pid)
+		return BROKER_E_NO_OWNER;
+
+	for (i = 0; i < BROKER_SLOT_NUM; i++)
+	{
+		uint32_t n = (b->next + i) % BROKER_SLOT_NUM;
+
+		if (_atomic_load(info->slot[n].state) == BROKER_SLOT_FREE && _atomic_cas(info->slot[n].state, BROKER_SLOT_CLAIMED, BROKER_SLOT_FREE)) {
+			slot = &info->slot[n];
+			i = n;
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		_counter_inc(info->stats.busy);
+		return BROKER_E_BUSY;
+	}
+
+	b->next = i + 1;
+
+	slot->client = b->pid;
+	slot->status = BROKER_E_NO_OWNER;
+	slot->id = id;
+	slot->protocol = protocol;
+	slot->send_len = send_len;
+	slot->recv_len = (*recv_len < BROKER_MAX_DATA_SIZE) ? *recv_len : BROKER_MAX_DATA_SIZE;
+	memcpy(slot->send, send, send_len);
+
+	_atomic_store(slot->state, BROKER_SLOT_SUBMITTED);
+
+	// the owner runs until the count drops to 0, so only the first one wakes it
+	if (_atomic_add(info->pending, 1) == 1)
+		_broker_wake_owner(b);
+
+	while ((state = _atomic_load(slot->state)) != BROKER_SLOT_DONE)
+	{
+		_broker_wait_slot(b, i, state, BROKER_CHECK_INTERVAL);
+
+		state = _atomic_load(slot->state);
+		if (state == BROKER_SLOT_DONE)
+			break;
+
+		if (state == BROKER_SLOT_SUBMITTED)
+		{
+			owner = _atomic_load(info->owner);
+			if (owner != 0 && _broker_is_process_alive(owner) == true)
+				continue;
+
+			if (_atomic_cas(slot->state, BROKER_SLOT_CLAIMED, BROKER_SLOT_SUBMITTED)) {
+				(void)_atomic_add(info->pending, -1);
+				break;
+			}
+		}
+		else if (state == BROKER_SLOT_EXECUTING)
+		{
+			if (_broker_is_process_alive(slot->server) == true)
+				continue;
+
+			// the exchange may have been cut off: the T=1 error handling of the
+			// next transmit takes care of it
+			if (_atomic_cas(slot->state, BROKER_SLOT_CLAIMED, BROKER_SLOT_EXECUTING)) {
+				_counter_inc(info->stats.reclaimed);
+				break;
+			}
+		}
+	}
+
+	if (state != BROKER_SLOT_DONE) {
+		dbg("broker_call: the owner has gone");
+		status = BROKER_E_NO_OWNER;
+	}
+	else {
+		status = slot->status;
+		if (status == BROKER_S_OK) {
+			*result = slot->result;
+			*recv_len = slot->recv_len;
+			memcpy(recv, slot->recv, slot->recv_len);
+		}
+	}
+
+	_atomic_store(slot->state, BROKER_SLOT_FREE);
+
+	return status;
+}
@@ -0,0 +1,146 @@
+// broker.h
+
+#pragma once
+
+// the layout of the shared region is the same on every platform: the broker also
+// builds outside of Windows (POSIX shared memory and futexes), where it can be
+// benchmarked between processes.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define BROKER_SHARED_INFO_SIGNATURE	0x4B524249	// "IBRK"
+#define BROKER_SHARED_INFO_VERSION		1
+
+#define BROKER_CACHE_LINE_SIZE	64
+#define BROKER_SLOT_NUM			16
+#define BROKER_MAX_DATA_SIZE	512		// larger commands and responses are not brokered
+#define BROKER_CHECK_INTERVAL	100		// milliseconds, how often the owner is checked while waiting
+
+// one process, the owner, does the I/O of the devices for the other processes.
+// a client claims a free slot, puts its command in it and waits for the slot to
+// be done. the owner executes every submitted slot under one acquisition of the
+// lock of the devices.
+//
+//   FREE -> CLAIMED (client) -> SUBMITTED (client) -> EXECUTING (owner) -> DONE (owner) -> FREE (client)
+//
+// a client takes its slot back if the owner goes away before executing it.
+
+typedef enum _broker_slot_state_t
+{
+	BROKER_SLOT_FREE = 0,
+	BROKER_SLOT_CLAIMED,
+	BROKER_SLOT_SUBMITTED,
+	BROKER_SLOT_EXECUTING,
+	BROKER_SLOT_DONE,
+} broker_slot_state_t;
+
+typedef enum _broker_status_t
+{
+	BROKER_S_OK = 0,
+	BROKER_E_NO_OWNER,		// no process serves the requests: do the I/O yourself
+	BROKER_E_BUSY,			// no free slot
+	BROKER_E_TOO_LARGE,
+} broker_status_t;
+
+struct broker_shared_slot
+{
+	union {
+		struct {
+			uint32_t state;		// broker_slot_state_t, also waited on
+			uint32_t client;	// pid
+			uint32_t server;	// pid of the process which executes the slot
+			uint32_t status;	// broker_status_t
+			uint32_t id;		// device
+			uint32_t protocol;
+			uint32_t send_len;
+			uint32_t recv_len;	// size of the buffer of the client, then the length of the response
+			int32_t result;
+		};
+		uint8_t line0[BROKER_CACHE_LINE_SIZE];
+	};
+	uint8_t send[BROKER_MAX_DATA_SIZE];
+	uint8_t recv[BROKER_MAX_DATA_SIZE];
+};
+
+struct broker_stats
+{
+	uint64_t request;		// executed requests
+	uint64_t batch;			// acquisitions of the lock by the owner
+	uint32_t busy;			// requests made without the broker since all the slots were in use
+	uint32_t reclaimed;		// slots taken back from an owner which had gone
+};
+
+struct broker_shared_info
+{
+	union {
+		struct {
+			uint32_t signature;
+			uint32_t version;
+			uint32_t slot_num;
+			uint32_t data_size;
+		};
+		uint8_t line0[BROKER_CACHE_LINE_SIZE];
+	};
+
+	union {
+		uint32_t owner;		// pid, 0 if there is none
+		uint8_t line1[BROKER_CACHE_LINE_SIZE];
+	};
+
+	union {
+		int32_t pending;	// submitted slots, waited on by the owner
+		uint8_t line2[BROKER_CACHE_LINE_SIZE];
+	};
+
+	union {
+		struct broker_stats stats;
+		uint8_t line3[BROKER_CACHE_LINE_SIZE];
+	};
+
+	struct broker_shared_slot slot[BROKER_SLOT_NUM];
+};
+
+// local
+
+struct broker_request
+{
+	uint32_t id;
+	uint32_t protocol;
+	const uint8_t *send;
+	uint32_t send_len;
+	uint8_t *recv;
+	uint32_t *recv_len;
+};
+
+struct broker_ops
+{
+	void (*lock)(void *ctx);		// before a batch of requests
+	void (*unlock)(void *ctx);		// after it
+	int32_t (*execute)(void *ctx, const struct broker_request *const req);
+};
+
+typedef struct _broker
+{
+#ifdef _WIN32
+	HANDLE shmem;
+	HANDLE event[1 + BROKER_SLOT_NUM];	// the owner, then the slots
+#else
+	int fd;
+#endif
+	struct broker_shared_info *info;
+	uint32_t pid;
+	uint32_t next;		// slot to try first
+} broker;
+
+extern bool broker_open(broker *const b, const wchar_t *const name);
+extern void broker_close(broker *const b);
+extern bool broker_claim(broker *const b);
+extern void broker_release(broker *const b);
+extern bool broker_is_owner(broker *const b);
+extern uint32_t broker_serve(broker *const b, const struct broker_ops *const ops, void *ctx, const uint32_t timeout);
+extern broker_status_t broker_call(broker *const b, const uint32_t id, const uint32_t protocol, const uint8_t *const send, const uint32_t send_len, uint8_t *const recv, uint32_t *const recv_len, int32_t *const result);
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <string.h>
 
+#define DBG_CATEGORY	DBG_CAT_T1
+
 #include "debug.h"
 #include "card.h"
 
@@ -353,28 +355,28 @@ int card_T1MakeBlock(struct card_info *const card, uint8_t *const p, const uint8
 {
 	int r;
 
-	dbg("card_T1MakeBlock: code: %02X, inf_len: %d", code, inf_len);
+	dbg_trace("card_T1MakeBlock: code: %02X, inf_len: %d", code, inf_len);
 
 	p[0] = 0;
 	
 	switch (code & 0xC0) {
 	case 0x00:
 		// I
-		dbg("card_T1MakeBlock: I");
+		dbg_trace("card_T1MakeBlock: I");
 		p[1] = (card->T1.seq & 0x01) << 6;
 		r = 0;
 		break;
 
 	case 0x80:
 		// R
-		dbg("card_T1MakeBlock: R");
+		dbg_trace("card_T1MakeBlock: R");
 		p[1] = (code & 0xAF) | ((card->T1.seq & 0x01) << 4);
 		r = 1;
 		break;
 
 	case 0xC0:
 		// S
-		dbg("card_T1MakeBlock: S");
+		dbg_trace("card_T1MakeBlock: S");
 		p[1] = (code & 0xE3);
 		r = 2;
 		break;
@@ -6,11 +6,39 @@
 #include <stdarg.h>
 #include <windows.h>
 
+#include "debug.h"
+#include "memory.h"
+#include "logring.h"
+
+uint32_t dbg_mask = 0;
+
 #if defined(_DEBUG) || defined(_DEBUG_MSG)
 
+// messages are put into a ring of the calling thread and written by the flusher thread,
+// so that the threads which hold the devdb lock do not wait for the output.
+
+#define _DBG_MAX_RING_NUM		64		// threads which have a ring at the same time
+#define _DBG_FLUSH_INTERVAL		100		// ms
+#define _DBG_FLUSH_BATCH		4096	// records written before the rings are looked at again
+#define _DBG_STOP_TIMEOUT		1000	// ms
+
 static bool enable = false;
 static HANDLE _hFile = INVALID_HANDLE_VALUE;
 
+static bool _async = false;
+static DWORD _tls = TLS_OUT_OF_INDEXES;
+static struct logring *volatile _ring_list = NULL;
+static volatile LONG _ring_num = 0;
+static volatile LONG _ring_drop = 0;			// messages of the threads which could not get a ring
+static LONG _ring_drop_reported = 0;
+static SRWLOCK _flush_lock;						// taken by the consumer only
+static HANDLE _hFlushEvent = NULL;
+static HANDLE _hFlushDone = NULL;
+static HANDLE _hFlushThread = NULL;
+static volatile LONG _flush_requested = 0;
+static volatile LONG _flush_running = 0;
+static volatile LONG _flush_stop = 0;
+
 void _dbg_write_W(const wchar_t *const str, const int c)
 {
 	OutputDebugStringW(str);
@@ -38,12 +66,364 @@ void _dbg_write_A(const char *const str, const int c)
 	}
 }
 
+static void _dbg_vwprintf_sync(const wchar_t *const format, va_list args)
+{
+	wchar_t buf[0x400];
+	int c;
+
+	c = vswprintf_s(buf, 0x400, format, args);
+	if (c > 0) {
+		_dbg_write_W(buf, c);
+	}
+}
+
+static void _dbg_vprintf_sync(const char *const format, va_list args)
+{
+	char buf[0x400];
+	int c;
+
+	c = vsprintf_s(buf, 0x400, format, args);
+	if (c > 0) {
+		_dbg_write_A(buf, c);
+	}
+}
+
+static void _dbg_printf_sync(const char *const format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	_dbg_vprintf_sync(format, args);
+	va_end(args);
+}
+
+// producer
+
+static struct logring * _dbg_get_ring()
+{
+	struct logring *ring = TlsGetValue(_tls);
+
+	if (ring != NULL)
+		return ring;
+
+	// a ring left by a thread which has exited
+	for (ring = _ring_list; ring != NULL; ring = ring->next) {
+		if (ring->in_use == 0 && InterlockedCompareExchange((volatile LONG *)&ring->in_use, 1, 0) == 0)
+			goto found;
+	}
+
+	if (InterlockedIncrement(&_ring_num) > _DBG_MAX_RING_NUM) {
+		InterlockedDecrement(&_ring_num);
+		return NULL;
+	}
+
+	ring = memAllocRaw(sizeof(struct logring));
+	if (ring == NULL) {
+		InterlockedDecrement(&_ring_num);
+		return NULL;
+	}
+
+	logring_init(ring);
+	ring->in_use = 1;
+
+	do {
+		ring->next = _ring_list;
+	} while (InterlockedCompareExchangePointer((PVOID volatile *)&_ring_list, ring, ring->next) != ring->next);
+
+found:
+	ring->thread_id = GetCurrentThreadId();
+	TlsSetValue(_tls, ring);
+
+	return ring;
+}
+
+static void _dbg_write_async(const bool wide, const void *const format, va_list args)
+{
+	DWORD e = GetLastError();
+	struct logring *ring = _dbg_get_ring();
+
+	if (ring != NULL)
+	{
+		LARGE_INTEGER t;
+
+		QueryPerformanceCounter(&t);
+		logring_write(ring, wide, format, args, ring->thread_id, t.QuadPart);
+
+		// wake the flusher before the ring fills up
+		if (logring_get_used(ring) > (LOGRING_SIZE / 2) && _flush_requested == 0 && InterlockedCompareExchange(&_flush_requested, 1, 0) == 0) {
+			SetEvent(_hFlushEvent);
+		}
+	}
+	else {
+		InterlockedIncrement(&_ring_drop);
+	}
+
+	// the caller may still look at the error of the last call
+	SetLastError(e);
+}
+
+// consumer
+
+static void _dbg_output(const struct logring_record *const rec)
+{
+	if (rec->wide) {
+		wchar_t buf[0x400];
+		size_t c = logring_format(rec, buf, 0x400);
+
+		if (c > 0) {
+			_dbg_write_W(buf, (int)c);
+		}
+	}
+	else {
+		char buf[0x400];
+		size_t c = logring_format(rec, buf, 0x400);
+
+		if (c > 0) {
+			_dbg_write_A(buf, (int)c);
+		}
+	}
+}
+
+// writes the records of all threads in the order of the time, with _flush_lock held.
+// returns false if some are left.
+static bool _dbg_flush_nolock()
+{
+	struct logring *ring;
+	uint32_t n;
+
+	for (n = 0; n < _DBG_FLUSH_BATCH; n++)
+	{
+		struct logring *oldest = NULL;
+		const struct logring_record *oldest_rec = NULL;
+
+		for (ring = _ring_list; ring != NULL; ring = ring->next) {
+			const struct logring_record *rec = logring_peek(ring);
+
+			if (rec != NULL && (oldest_rec == NULL || rec->time < oldest_rec->time)) {
+				oldest = ring;
+				oldest_rec = rec;
+			}
+		}
+
+		if (oldest == NULL)
+			break;
+
+		_dbg_output(oldest_rec);
+		logring_pop(oldest, oldest_rec);
+	}
+
+	for (ring = _ring_list; ring != NULL; ring = ring->next) {
+		uint32_t drop = ring->drop;
+
+		if (drop != ring->drop_reported) {
+			_dbg_printf_sync("dbg: %u messages of thread %u were dropped\n", drop - ring->drop_reported, ring->thread_id);
+			ring->drop_reported = drop;
+		}
+	}
+
+	{
+		LONG drop = _ring_drop;
+
+		if (drop != _ring_drop_reported) {
+			_dbg_printf_sync("dbg: %u messages were dropped (no ring)\n", (uint32_t)(drop - _ring_drop_reported));
+			_ring_drop_reported = drop;
+		}
+	}
+
+	return (n < _DBG_FLUSH_BATCH) ? true : false;
+}
+
+static bool _dbg_flush()
+{
+	bool r;
+
+	AcquireSRWLockExclusive(&_flush_lock);
+	r = _dbg_flush_nolock();
+	ReleaseSRWLockExclusive(&_flush_lock);
+
+	return r;
+}
+
+static DWORD WINAPI _dbg_flush_thread(LPVOID lpParameter)
+{
+	_flush_running = 1;
+
+	while (_flush_stop == 0)
+	{
+		WaitForSingleObject(_hFlushEvent, _DBG_FLUSH_INTERVAL);
+		_flush_requested = 0;
+
+		while (_dbg_flush() == false);
+	}
+
+	SetEvent(_hFlushDone);
+
+	return 0;
+}
+
+static void _dbg_async_init()
+{
+	InitializeSRWLock(&_flush_lock);
+
+	_tls = TlsAlloc();
+	if (_tls == TLS_OUT_OF_INDEXES)
+		return;
+
+	_hFlushEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	_hFlushDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	if (_hFlushEvent == NULL || _hFlushDone == NULL) {
+		if (_hFlushEvent != NULL) {
+			CloseHandle(_hFlushEvent);
+			_hFlushEvent = NULL;
+		}
+		if (_hFlushDone != NULL) {
+			CloseHandle(_hFlushDone);
+			_hFlushDone = NULL;
+		}
+
+		TlsFree(_tls);
+		_tls = TLS_OUT_OF_INDEXES;
+
+		return;
+	}
+
+	// messages are kept in the rings until the flusher is started by dbg_start
+	_async = true;
+}
+
+// terminating is set when the process is exiting, where the other threads have been
+// killed wherever they were.
+static void _dbg_async_deinit(const bool terminating)
+{
+	struct logring *ring;
+	bool stopped = true;
+
+	if (_async == false)
+		return;
+
+	if (_hFlushThread != NULL)
+	{
+		// the thread is already gone when the process is terminating
+		if (terminating == false && _flush_running != 0 && WaitForSingleObject(_hFlushThread, 0) == WAIT_TIMEOUT) {
+			_flush_stop = 1;
+			SetEvent(_hFlushEvent);
+
+			if (WaitForSingleObject(_hFlushDone, _DBG_STOP_TIMEOUT) != WAIT_OBJECT_0) {
+				stopped = false;
+			}
+		}
+
+		CloseHandle(_hFlushThread);
+		_hFlushThread = NULL;
+	}
+
+	_async = false;
+
+	// the rings may have been cut off in the middle of a record, and the flusher killed
+	// with _flush_lock held, unless it has stopped on its own: they are left unread.
+	if (terminating == true || stopped == false)
+		return;
+
+	// whatever is left is written here. the lock is not waited for, as a thread which
+	// has been killed in the flush would never release it.
+	if (TryAcquireSRWLockExclusive(&_flush_lock) != FALSE) {
+		while (_dbg_flush_nolock() == false);
+		ReleaseSRWLockExclusive(&_flush_lock);
+	}
+
+	ring = _ring_list;
+
+	while (ring != NULL) {
+		struct logring *next = ring->next;
+
+		memFree(ring);
+		ring = next;
+	}
+
+	_ring_list = NULL;
+	_ring_num = 0;
+
+	CloseHandle(_hFlushEvent);
+	CloseHandle(_hFlushDone);
+	_hFlushEvent = NULL;
+	_hFlushDone = NULL;
+
+	TlsFree(_tls);
+	_tls = TLS_OUT_OF_INDEXES;
+}
+
 #endif
 
 void dbg_enable(const bool b)
 {
 #if defined(_DEBUG) || defined(_DEBUG_MSG)
 	enable = b;
+	dbg_mask = 0;
+
+	if (b == true) {
+		for (uint32_t cat = 0; cat < DBG_CAT_NUM; cat++)
+			dbg_set_level(cat, DBG_LEVEL_INFO);
+	}
+
+	if (b == true && _async == false && _tls == TLS_OUT_OF_INDEXES) {
+		_dbg_async_init();
+	}
+#endif
+}
+
+void dbg_set_level(const uint32_t cat, const uint32_t level)
+{
+#if defined(_DEBUG) || defined(_DEBUG_MSG)
+	uint32_t mask = dbg_mask;
+
+	if (enable == false || cat >= DBG_CAT_NUM)
+		return;
+
+	for (uint32_t l = DBG_LEVEL_ERROR; l <= DBG_LEVEL_TRACE; l++) {
+		if (l <= level)
+			mask |= DBG_MASK(cat, l);
+		else
+			mask &= ~DBG_MASK(cat, l);
+	}
+
+	dbg_mask = mask;
+#endif
+}
+
+// starts the flusher. called after the module has been initialized, since the
+// thread does not run while the loader lock is held.
+void dbg_start()
+{
+#if defined(_DEBUG) || defined(_DEBUG_MSG)
+	if (_async == false || _hFlushThread != NULL)
+		return;
+
+	_flush_stop = 0;
+	_hFlushThread = CreateThread(NULL, 0, _dbg_flush_thread, NULL, 0, NULL);
+
+	if (_hFlushThread == NULL) {
+		// written synchronously from now on
+		_async = false;
+		while (_dbg_flush() == false);
+	}
+#endif
+}
+
+// releases the ring of the calling thread. called on DLL_THREAD_DETACH.
+void dbg_thread_detach()
+{
+#if defined(_DEBUG) || defined(_DEBUG_MSG)
+	struct logring *ring;
+
+	if (_async == false)
+		return;
+
+	ring = TlsGetValue(_tls);
+	if (ring != NULL) {
+		TlsSetValue(_tls, NULL);
+		InterlockedExchange((volatile LONG *)&ring->in_use, 0);
+	}
 #endif
 }
 
@@ -59,9 +439,12 @@ void dbg_open(const wchar_t *const path)
 #endif
 }
 
-void dbg_close()
+// terminating is set on DLL_PROCESS_DETACH of the termination of the process
+void dbg_close(const bool terminating)
 {
 #if defined(_DEBUG) || defined(_DEBUG_MSG)
+	_dbg_async_deinit(terminating);
+
 	if (_hFile != INVALID_HANDLE_VALUE) {
 		CloseHandle(_hFile);
 		_hFile = INVALID_HANDLE_VALUE;
@@ -76,15 +459,13 @@ void dbg_wprintf(const wchar_t *const format, ...)
 		return;
 
 	va_list args;
-	wchar_t buf[0x400];
-	int c;
 
 	va_start(args, format);
-	c = vswprintf_s(buf, 0x400, format, args);
+	if (_async == true)
+		_dbg_write_async(true, format, args);
+	else
+		_dbg_vwprintf_sync(format, args);
 	va_end(args);
-	if (c > 0) {
-		_dbg_write_W(buf, c);
-	}
 #endif
 }
 
@@ -95,19 +476,17 @@ void dbg_printf(const char *const format, ...)
 		return;
 
 	va_list args;
-	char buf[0x400];
-	int c;
 
 	va_start(args, format);
-	c = vsprintf_s(buf, 0x400, format, args);
+	if (_async == true)
+		_dbg_write_async(false, format, args);
+	else
+		_dbg_vprintf_sync(format, args);
 	va_end(args);
-	if (c > 0) {
-		_dbg_write_A(buf, c);
-	}
 #endif
 }
 
-void win32_err(const char *const str)
+void dbg_win32_err(const char *const str)
 {
 #if defined(_DEBUG) || defined(_DEBUG_MSG)
 	if (enable == false)
@@ -2,19 +2,59 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// categories. a source file selects its own by defining DBG_CATEGORY before including this header.
+#define DBG_CAT_API			0	// winscard.c, handles and statistics
+#define DBG_CAT_TRANSPORT	1	// device control
+#define DBG_CAT_T1			2	// ATR and T=1 protocol
+#define DBG_CAT_DEVDB		3	// shared device database
+#define DBG_CAT_NUM			4
+
+// levels
+#define DBG_LEVEL_NONE		0
+#define DBG_LEVEL_ERROR		1
+#define DBG_LEVEL_INFO		2
+#define DBG_LEVEL_TRACE		3	// every block, lock and polled call
+
+#define DBG_MASK(cat, level)	(1UL << (((cat) * 4) + ((level) - 1)))
+
+#ifndef DBG_CATEGORY
+#define DBG_CATEGORY	DBG_CAT_API
+#endif
+
+// one bit for each pair of a category and a level, zero while the output is disabled
+extern uint32_t dbg_mask;
+
 extern void dbg_enable(const bool b);
+extern void dbg_set_level(const uint32_t cat, const uint32_t level);
+extern void dbg_start();
+extern void dbg_thread_detach();
 extern void dbg_open(const wchar_t *const path);
-extern void dbg_close();
+extern void dbg_close(const bool terminating);
+// the format is formatted later on another thread, so it has to be a string literal
 extern void dbg_wprintf(const wchar_t *const format, ...);
 extern void dbg_printf(const char *const format, ...);
-extern void win32_err(const char *const str);
+extern void dbg_win32_err(const char *const str);
 
 #if defined(_DEBUG) || defined(_DEBUG_MSG)
-#define dbg(msg, ...)	dbg_printf(msg "\n", ##__VA_ARGS__)
-#define dbgW(msg, ...)	dbg_wprintf(msg L"\n", ##__VA_ARGS__)
-#define internal_err dbg
+// nothing is evaluated unless the category is enabled at the level
+#define dbg_log(cat, level, msg, ...) \
+	do { if (dbg_mask & DBG_MASK(cat, level)) dbg_printf(msg "\n", ##__VA_ARGS__); } while (0)
+#define dbg(msg, ...)			dbg_log(DBG_CATEGORY, DBG_LEVEL_INFO, msg, ##__VA_ARGS__)
+#define dbg_trace(msg, ...)		dbg_log(DBG_CATEGORY, DBG_LEVEL_TRACE, msg, ##__VA_ARGS__)
+#define dbgW(msg, ...) \
+	do { if (dbg_mask & DBG_MASK(DBG_CATEGORY, DBG_LEVEL_INFO)) dbg_wprintf(msg L"\n", ##__VA_ARGS__); } while (0)
+#define internal_err(msg, ...)	dbg_log(DBG_CATEGORY, DBG_LEVEL_ERROR, msg, ##__VA_ARGS__)
+#define win32_err(str) \
+	do { if (dbg_mask & DBG_MASK(DBG_CATEGORY, DBG_LEVEL_ERROR)) dbg_win32_err(str); } while (0)
 #else
+#define dbg_log(cat, level, msg, ...)
 #define dbg(msg, ...)
+#define dbg_trace(msg, ...)
 #define dbgW(msg, ...)
-#define internal_err dbg
+#define internal_err(msg, ...)
+#define win32_err(str)
 #endif
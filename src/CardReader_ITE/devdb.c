@@ -2,211 +2,1167 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef _WIN32
 #include <windows.h>
 #include <SetupAPI.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_DEVDB
 
 #include "debug.h"
 #include "memory.h"
 #include "string.h"
 #include "devdb.h"
 #include "devdb_userdef.h"
+#include "itesim.h"
+
+#ifdef _WIN32
 
 #pragma comment(lib, "SetupAPI.lib")
 
-static const wchar_t event_name[] = L"devdb_" DEVDB_UNIQUE_NAME L"_event_";
+static const wchar_t sem_name[] = L"devdb_" DEVDB_UNIQUE_NAME L"_sem_";
 static const wchar_t shmem_name[] = L"devdb_" DEVDB_UNIQUE_NAME L"_shmem_";
+static const wchar_t table_name[] = L"devdb_" DEVDB_UNIQUE_NAME L"_table_";
 static const wchar_t devdb_guid[] = L"_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}";
 
-#define DEVDB_SHARED_INFO_SIGNATURE	0x935FBC8A
+#define _devdb_cas(v, x, c)		InterlockedCompareExchange(&(v), (x), (c))
+#define _devdb_cas64(v, x, c)	((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)&(v), (LONGLONG)(x), (LONGLONG)(c)))
+#define _devdb_read64(v)		((uint64_t)InterlockedCompareExchange64((volatile LONGLONG *)&(v), 0, 0))
+#define _devdb_inc(v)			InterlockedIncrement(&(v))
+#define _devdb_xchg(v, x)		InterlockedExchange(&(v), (x))
+#define _devdb_get_pid()		GetCurrentProcessId()
+#define _devdb_get_tick()		GetTickCount()
+#define _devdb_pause()			YieldProcessor()
+#define _devdb_yield()			Sleep(0)
+#define _devdb_sleep(ms)		Sleep(ms)
+
+#else
+
+// /dev/shm/devdb_itedev_shmem_<name> and devdb_itedev_table_<name>_<generation>. they
+// are left there when the last process closes them, as the named objects of Windows
+// are not, so the state of the devices outlives the processes in between.
+static const wchar_t shmem_name[] = L"/devdb_" DEVDB_UNIQUE_NAME L"_shmem_";
+static const wchar_t table_name[] = L"/devdb_" DEVDB_UNIQUE_NAME L"_table_";
+
+#define C_ASSERT(e)				_Static_assert((e), #e)
+
+#define _devdb_cas(v, x, c)		__sync_val_compare_and_swap(&(v), (c), (x))
+#define _devdb_cas64(v, x, c)	__sync_val_compare_and_swap(&(v), (c), (x))
+#define _devdb_read64(v)		__atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define _devdb_inc(v)			__sync_add_and_fetch(&(v), 1)
+#define _devdb_xchg(v, x)		__atomic_exchange_n(&(v), (x), __ATOMIC_SEQ_CST)
+#define _devdb_get_pid()		((uint32_t)getpid())
+#if defined(__i386__) || defined(__x86_64__)
+#define _devdb_pause()			__builtin_ia32_pause()
+#else
+#define _devdb_pause()			__asm__ __volatile__("" ::: "memory")
+#endif
+#define _devdb_yield()			sched_yield()
+#define _devdb_sleep(ms)		usleep((ms) * 1000)
+
+static uint32_t _devdb_get_tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+#endif
+
+// version 2: cache line aligned layout, device names moved out of the slots.
+// the signature is changed as well so that older modules, which only check the
+// signature, refuse the new layout too.
+// version 3: the waiters for the lock sleep on the slot of their ticket.
+// version 4: the claim of the lock carries the pid of its owner.
+// version 5: the owner table follows the user area and grows with the device table.
+#define DEVDB_SHARED_INFO_SIGNATURE	0x935FBC8D
+#define DEVDB_SHARED_INFO_VERSION	5
+
+C_ASSERT(offsetof(struct devdb_shared_info, lock) == DEVDB_CACHE_LINE_SIZE * 1);
+C_ASSERT(offsetof(struct devdb_shared_info, ticket) == DEVDB_CACHE_LINE_SIZE * 2);
+C_ASSERT(offsetof(struct devdb_shared_info, serving) == DEVDB_CACHE_LINE_SIZE * 3);
+C_ASSERT((offsetof(struct devdb_shared_info, claim) % 8) == 0);
+C_ASSERT(offsetof(struct devdb_shared_info, spin) == DEVDB_CACHE_LINE_SIZE * 4);
+C_ASSERT(offsetof(struct devdb_shared_info, stats) == DEVDB_CACHE_LINE_SIZE * 5);
+C_ASSERT(offsetof(struct devdb_shared_info, slot) == DEVDB_CACHE_LINE_SIZE * 6);
+C_ASSERT(sizeof(struct devdb_shared_info) == DEVDB_CACHE_LINE_SIZE * (6 + DEVDB_LOCK_SLOT_NUM));
+C_ASSERT(offsetof(struct devdb_shared_devinfo, user) == DEVDB_CACHE_LINE_SIZE);
+
+#define DEVDB_LOCK_SPIN_MIN		16
+#define DEVDB_LOCK_SPIN_MAX		4096
+
+#define DEVDB_UPDATE_ARENA_SIZE	0x4000
+
+#define DEVDB_LOCK_CHECK_INTERVAL	100		// milliseconds
+#define DEVDB_LOCK_CLAIM_TIMEOUT	1000	// milliseconds
+#define DEVDB_OPEN_TIMEOUT			1000	// milliseconds the creator of the control block has to initialize it
+
+static uint64_t _qpc_freq = 0;
+
+// the device table holds all the slots first, then all the names
+#define _devdb_get_shared_devinfo(db, id) ((struct devdb_shared_devinfo *)((db)->table + ((db)->size * (id))))
+#define _devdb_get_shared_devname(db, id) ((struct devdb_shared_devname *)((db)->table + ((db)->size * (db)->count) + (sizeof(struct devdb_shared_devname) * (id))))
+#define _devdb_get_owner(db, devinfo) ((struct devdb_shared_devref *)((uint8_t *)(devinfo) + (db)->info->owner_offset))
+#define _devdb_get_slot_size(owner_offset, owner_num) (((owner_offset) + ((uint32_t)sizeof(struct devdb_shared_devref) * (owner_num)) + (DEVDB_CACHE_LINE_SIZE - 1)) & ~(DEVDB_CACHE_LINE_SIZE - 1))
+
+#ifdef _WIN32
 
 #define make_obj_name(buf, name1, name1_len, name2) \
 	memcpy((buf), (name2), sizeof((name2)) - (1 * sizeof(wchar_t))); \
 	memcpy((buf) + ((sizeof((name2)) / sizeof(wchar_t)) - 1), (name1), (name1_len) * sizeof(wchar_t)); \
 	memcpy((buf) + ((sizeof((name2)) / sizeof(wchar_t)) - 1) + (name1_len), devdb_guid, sizeof(devdb_guid))
 
-devdb_status_t devdb_open(devdb *const db, const wchar_t *const name, const wchar_t *const id, const uint32_t user_size)
+static void _devdb_close_table(devdb *const db)
+{
+	if (db->table != NULL) {
+		UnmapViewOfFile(db->table);
+		db->table = NULL;
+	}
+
+	if (db->table_shmem != NULL) {
+		CloseHandle(db->table_shmem);
+		db->table_shmem = NULL;
+	}
+
+	db->generation = 0;
+	db->count = 0;
+	db->size = 0;
+	db->owner_num = 0;
+}
+
+// map the device table of the given generation (called with the lock held).
+// the table currently mapped is kept, and its contents are carried over if the
+// mapping had to be created.
+static devdb_status_t _devdb_map_table_nolock(devdb *const db, const uint32_t generation, const uint32_t count, const uint32_t owner_num)
+{
+	wchar_t obj_name[256];
+	uint32_t name_len, len;
+	HANDLE shmem;
+	uint8_t *table;
+	uint32_t slot_size;
+	uint64_t size;
+
+	name_len = wstrLen(db->name);
+	make_obj_name(obj_name, db->name, name_len, table_name);
+	len = (sizeof(table_name) / sizeof(wchar_t)) - 1 + name_len + (sizeof(devdb_guid) / sizeof(wchar_t)) - 1;
+	obj_name[len++] = L'_';
+	wstrFromUInt32(obj_name + len, 11, generation, 10);
+
+	slot_size = _devdb_get_slot_size(db->info->owner_offset, owner_num);
+	size = ((uint64_t)slot_size + sizeof(struct devdb_shared_devname)) * count;
+	if (size == 0 || size > 0x7FFFFFFF) {
+		internal_err("_devdb_map_table_nolock: invalid size");
+		return DEVDB_E_INTERNAL_LIMIT;
+	}
+
+	shmem = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, obj_name);
+	if (shmem == NULL) {
+		win32_err("_devdb_map_table_nolock: CreateFileMappingW");
+		return DEVDB_E_API;
+	}
+
+	bool created = (GetLastError() != ERROR_ALREADY_EXISTS) ? true : false;
+
+	table = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+	if (table == NULL) {
+		win32_err("_devdb_map_table_nolock: MapViewOfFile");
+		CloseHandle(shmem);
+		return DEVDB_E_API;
+	}
+
+	if (created == true && db->table != NULL) {
+		uint32_t n = (db->count < count) ? db->count : count;
+
+		// slot by slot, as the owner tables may have grown
+		for (uint32_t i = 0; i < n; i++) {
+			memcpy(table + ((size_t)slot_size * i), _devdb_get_shared_devinfo(db, i), (db->size < slot_size) ? db->size : slot_size);
+		}
+		memcpy(table + ((size_t)slot_size * count), _devdb_get_shared_devname(db, 0), sizeof(struct devdb_shared_devname) * n);
+	}
+
+	_devdb_close_table(db);
+
+	db->table_shmem = shmem;
+	db->table = table;
+	db->generation = generation;
+	db->count = count;
+	db->size = slot_size;
+	db->owner_num = owner_num;
+
+	return DEVDB_S_OK;
+}
+
+// the control block, and the semaphores the waiters for the lock are blocked on, one
+// for each slot. initialized is set if the control block was already there.
+static devdb_status_t _devdb_open_shared(devdb *const db, const wchar_t *const name, bool *const initialized)
+{
+	uint32_t name_len = wstrLen(name);
+	devdb_status_t r = DEVDB_E_INTERNAL;
+	wchar_t obj_name[256];
+	uint32_t i;
+
+	if (_qpc_freq == 0) {
+		LARGE_INTEGER freq;
+
+		QueryPerformanceFrequency(&freq);
+		_qpc_freq = freq.QuadPart;
+	}
+
+	// semaphores
+
+	for (i = 0; i < DEVDB_LOCK_SLOT_NUM; i++)
+	{
+		uint32_t len;
+
+		make_obj_name(obj_name, name, name_len, sem_name);
+		len = wstrLen(obj_name);
+		obj_name[len++] = L'_';
+		wstrFromUInt32(obj_name + len, 11, i, 10);
+		dbg("devdb_open: obj_name(1): %ws", obj_name);
+
+		db->sem[i] = CreateSemaphoreW(NULL, 0, LONG_MAX, obj_name);
+		if (db->sem[i] == NULL) {
+			r = (GetLastError() == ERROR_ACCESS_DENIED) ? DEVDB_E_ACCESS_DENIED : DEVDB_E_API;
+			win32_err("devdb_open: CreateSemaphoreW");
+			goto end1;
+		}
+	}
+
+	// shared memory
+
+	HANDLE shmem;
+	DWORD le;
+	struct devdb_shared_info *info;
+
+	make_obj_name(obj_name, name, name_len, shmem_name);
+	dbg("devdb_open: obj_name(2): %ws", obj_name);
+
+	shmem = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(struct devdb_shared_info), obj_name);
+	if (shmem == NULL) {
+		r = (GetLastError() == ERROR_ACCESS_DENIED) ? DEVDB_E_ACCESS_DENIED : DEVDB_E_API;
+		win32_err("devdb_open: CreateFileMappingW");
+		goto end1;
+	}
+
+	le = GetLastError();
+
+	info = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+	if (info == NULL) {
+		win32_err("devdb_open: MapViewOfFile");
+		r = DEVDB_E_API;
+		goto end2;
+	}
+
+	db->shmem = shmem;
+	db->info = info;
+	db->table_shmem = NULL;
+	*initialized = (le == ERROR_ALREADY_EXISTS) ? true : false;
+
+	return DEVDB_S_OK;
+
+end2:
+	CloseHandle(shmem);
+end1:
+	while (i > 0) {
+		CloseHandle(db->sem[--i]);
+		db->sem[i] = NULL;
+	}
+	return r;
+}
+
+static void _devdb_close_shared(devdb *const db)
+{
+	if (db->info != NULL) {
+		UnmapViewOfFile(db->info);
+		db->info = NULL;
+	}
+
+	if (db->shmem != NULL) {
+		CloseHandle(db->shmem);
+		db->shmem = NULL;
+	}
+
+	for (uint32_t i = 0; i < DEVDB_LOCK_SLOT_NUM; i++) {
+		if (db->sem[i] != NULL) {
+			CloseHandle(db->sem[i]);
+			db->sem[i] = NULL;
+		}
+	}
+}
+
+#else
+
+// /devdb_itedev_<kind>_<name>, with the characters a name of POSIX shared memory can not have replaced
+static bool _devdb_make_obj_name(char *const buf, const size_t size, const wchar_t *const kind, const wchar_t *const name)
+{
+	uint32_t len, len2;
+
+	len = wstrToUtf8(buf, size, kind);
+	if (len == 0)
+		return false;
+
+	len2 = wstrToUtf8(buf + len, size - len, name);
+	if (len2 == 0)
+		return false;
+
+	for (uint32_t i = len; i < len + len2; i++) {
+		if (buf[i] == '/')
+			buf[i] = '_';
+	}
+
+	return true;
+}
+
+static uint32_t _access_mode = DEVDB_DEFAULT_ACCESS_MODE;
+static uint32_t _access_group = DEVDB_NO_GROUP;
+
+// the permissions of the objects created from here on, for the whole process. group is
+// a gid, or DEVDB_NO_GROUP for the group of the process.
+void devdb_set_access(const uint32_t mode, const uint32_t group)
+{
+	_access_mode = mode & 0777;
+	_access_group = group;
+}
+
+uint32_t devdb_get_access_mode(void)
+{
+	return _access_mode;
+}
+
+// an object just created gets the permissions the umask may have taken away, and its group.
+// also used for the other shared objects of the module (the statistics and the trace).
+void devdb_set_obj_access(const int fd)
+{
+	if (fchmod(fd, (mode_t)_access_mode) != 0) {
+		internal_err("devdb_set_obj_access: fchmod failed (%d)", errno);
+	}
+
+	if (_access_group != DEVDB_NO_GROUP && fchown(fd, (uid_t)-1, (gid_t)_access_group) != 0) {
+		internal_err("devdb_set_obj_access: fchown failed (%d)", errno);
+	}
+}
+
+static void _devdb_close_table(devdb *const db)
+{
+	if (db->table != NULL) {
+		munmap(db->table, db->table_size);
+		db->table = NULL;
+	}
+
+	if (db->table_fd != -1) {
+		close(db->table_fd);
+		db->table_fd = -1;
+	}
+
+	db->table_size = 0;
+	db->generation = 0;
+	db->count = 0;
+	db->size = 0;
+	db->owner_num = 0;
+}
+
+// map the device table of the given generation (called with the lock held).
+// the table currently mapped is kept, and its contents are carried over if the
+// mapping had to be created.
+static devdb_status_t _devdb_map_table_nolock(devdb *const db, const uint32_t generation, const uint32_t count, const uint32_t owner_num)
+{
+	char obj_name[512];
+	uint32_t len;
+	uint8_t *table;
+	uint32_t slot_size;
+	uint64_t size;
+	bool created = true;
+	int fd;
+
+	if (_devdb_make_obj_name(obj_name, sizeof(obj_name) - 12, table_name, db->name) == false) {
+		internal_err("_devdb_map_table_nolock: name is too long");
+		return DEVDB_E_INVALID_PARAMETER;
+	}
+
+	len = strLen(obj_name);
+	obj_name[len++] = '_';
+	strFromUInt32(obj_name + len, 11, generation, 10);
+
+	slot_size = _devdb_get_slot_size(db->info->owner_offset, owner_num);
+	size = ((uint64_t)slot_size + sizeof(struct devdb_shared_devname)) * count;
+	if (size == 0 || size > 0x7FFFFFFF) {
+		internal_err("_devdb_map_table_nolock: invalid size");
+		return DEVDB_E_INTERNAL_LIMIT;
+	}
+
+	fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, (mode_t)_access_mode);
+	if (fd == -1 && errno == EEXIST) {
+		created = false;
+		fd = shm_open(obj_name, O_RDWR, 0);
+	}
+	if (fd == -1) {
+		if (errno == EACCES) {
+			internal_err("_devdb_map_table_nolock: shm_open: access denied");
+			return DEVDB_E_ACCESS_DENIED;
+		}
+		internal_err("_devdb_map_table_nolock: shm_open failed (%d)", errno);
+		return DEVDB_E_API;
+	}
+
+	if (created == true) {
+		devdb_set_obj_access(fd);
+	}
+	else {
+		struct stat st;
+
+		// the table is only created with the lock held, so it has its size already unless
+		// its creator was killed in between. it is then sized and filled again, as ours.
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)size) {
+			internal_err("_devdb_map_table_nolock: the table has not been sized");
+			created = true;
+		}
+	}
+
+	if (created == true && ftruncate(fd, (off_t)size) != 0) {
+		internal_err("_devdb_map_table_nolock: ftruncate failed");
+		close(fd);
+		shm_unlink(obj_name);
+		return DEVDB_E_API;
+	}
+
+	table = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		internal_err("_devdb_map_table_nolock: mmap failed");
+		close(fd);
+		return DEVDB_E_API;
+	}
+
+	if (created == true && db->table != NULL) {
+		uint32_t n = (db->count < count) ? db->count : count;
+
+		// slot by slot, as the owner tables may have grown
+		for (uint32_t i = 0; i < n; i++) {
+			memcpy(table + ((size_t)slot_size * i), _devdb_get_shared_devinfo(db, i), (db->size < slot_size) ? db->size : slot_size);
+		}
+		memcpy(table + ((size_t)slot_size * count), _devdb_get_shared_devname(db, 0), sizeof(struct devdb_shared_devname) * n);
+	}
+
+	// the previous generation is only mapped by the processes which have not followed yet
+	if (created == true && db->table != NULL) {
+		obj_name[len] = '\0';
+		strFromUInt32(obj_name + len, 11, db->generation, 10);
+		shm_unlink(obj_name);
+	}
+
+	_devdb_close_table(db);
+
+	db->table_fd = fd;
+	db->table_size = (uint32_t)size;
+	db->table = table;
+	db->generation = generation;
+	db->count = count;
+	db->size = slot_size;
+	db->owner_num = owner_num;
+
+	return DEVDB_S_OK;
+}
+
+// the control block, whose words the waiters for the lock sleep on.
+// initialized is set if the control block was already there.
+static devdb_status_t _devdb_open_shared(devdb *const db, const wchar_t *const name, bool *const initialized)
+{
+	char obj_name[512];
+	struct devdb_shared_info *info;
+	bool created = true;
+	int fd;
+
+	_qpc_freq = 1000000000;
+
+	if (_devdb_make_obj_name(obj_name, sizeof(obj_name), shmem_name, name) == false) {
+		internal_err("devdb_open: name is too long");
+		return DEVDB_E_INVALID_PARAMETER;
+	}
+
+	dbg("devdb_open: obj_name: %s", obj_name);
+
+	fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, (mode_t)_access_mode);
+	if (fd == -1 && errno == EEXIST) {
+		created = false;
+		fd = shm_open(obj_name, O_RDWR, 0);
+	}
+	if (fd == -1) {
+		// the control block of another user, or of a group this process is not in
+		if (errno == EACCES) {
+			internal_err("devdb_open: shm_open: access denied");
+			return DEVDB_E_ACCESS_DENIED;
+		}
+		internal_err("devdb_open: shm_open failed (%d)", errno);
+		return DEVDB_E_API;
+	}
+
+	if (created == true) {
+		devdb_set_obj_access(fd);
+	}
+
+	if (created == true && ftruncate(fd, sizeof(struct devdb_shared_info)) != 0) {
+		internal_err("devdb_open: ftruncate failed");
+		close(fd);
+		shm_unlink(obj_name);
+		return DEVDB_E_API;
+	}
+
+	// the creator may not have sized it yet. the memory beyond the size of the object
+	// cannot be touched, so it is not mapped until then.
+	for (uint32_t tick = _devdb_get_tick(); ; _devdb_sleep(1)) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct devdb_shared_info))
+			break;
+
+		if ((uint32_t)(_devdb_get_tick() - tick) >= DEVDB_OPEN_TIMEOUT) {
+			internal_err("devdb_open: the control block has not been sized by its creator");
+			close(fd);
+			return DEVDB_E_INTERNAL;
+		}
+	}
+
+	info = mmap(NULL, sizeof(struct devdb_shared_info), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (info == MAP_FAILED) {
+		internal_err("devdb_open: mmap failed");
+		close(fd);
+		return DEVDB_E_API;
+	}
+
+	db->fd = fd;
+	db->info = info;
+	db->table_fd = -1;
+	db->table_size = 0;
+	db->device = NULL;
+	*initialized = (created == false) ? true : false;
+
+	return DEVDB_S_OK;
+}
+
+static void _devdb_close_shared(devdb *const db)
+{
+	if (db->info != NULL) {
+		munmap(db->info, sizeof(struct devdb_shared_info));
+		db->info = NULL;
+	}
+
+	if (db->fd != -1) {
+		close(db->fd);
+		db->fd = -1;
+	}
+
+	if (db->device != NULL) {
+		memFree(db->device);
+		db->device = NULL;
+	}
+}
+
+#endif
+
+// move the device table to a new generation with more slots, or larger owner tables
+// (called with the lock held)
+static devdb_status_t _devdb_grow_nolock(devdb *const db, const uint32_t count, const uint32_t owner_num)
+{
+	struct devdb_shared_info *info = db->info;
+	devdb_status_t r;
+
+	dbg("_devdb_grow_nolock: generation: %u, count: %u -> %u, owner_num: %u -> %u", info->generation + 1, db->count, count, db->owner_num, owner_num);
+
+	r = _devdb_map_table_nolock(db, info->generation + 1, count, owner_num);
+	if (r != DEVDB_S_OK) {
+		internal_err("_devdb_grow_nolock: _devdb_map_table_nolock failed");
+		return r;
+	}
+
+	info->count = count;
+	info->owner_num = owner_num;
+	info->size = db->size;
+	info->generation = db->generation;
+
+	return DEVDB_S_OK;
+}
+
+// follow the device table to the current generation (called with the lock held)
+static void _devdb_sync_nolock(devdb *const db)
+{
+	struct devdb_shared_info *info = db->info;
+
+	if (db->generation == info->generation)
+		return;
+
+	// if the process which made this generation has already exited, the mapping
+	// is created again from the contents of the previous one
+	if (_devdb_map_table_nolock(db, info->generation, info->count, info->owner_num) != DEVDB_S_OK) {
+		internal_err("_devdb_sync_nolock: _devdb_map_table_nolock failed");
+	}
+}
+
+devdb_status_t devdb_open(devdb *const db, const wchar_t *const name, const wchar_t *const id, const uint32_t user_size, const uint32_t capacity)
 {
 	uint32_t name_len;
 	uint32_t id_len;
 
-	name_len = wstrLen(name);
-	if (name_len >= DEVDB_MAX_NAME_SIZE) {
-		internal_err("devdb_open: name_len >= DEVDB_MAX_NAME_SIZE");
-		return DEVDB_E_INVALID_PARAMETER;
-	}
+	name_len = wstrLen(name);
+	if (name_len >= DEVDB_MAX_NAME_SIZE) {
+		internal_err("devdb_open: name_len >= DEVDB_MAX_NAME_SIZE");
+		return DEVDB_E_INVALID_PARAMETER;
+	}
+
+	id_len = wstrLen(id);
+	if (id_len >= DEVDB_MAX_ID_SIZE) {
+		internal_err("devdb_open: id_len >= DEVDB_MAX_ID_SIZE");
+		return DEVDB_E_INVALID_PARAMETER;
+	}
+
+	devdb_status_t r;
+	uint32_t owner_offset;
+	struct devdb_shared_info *info;
+	bool initialized = false;
+
+	// each slot starts on its own cache line, and so does its owner table
+	owner_offset = (uint32_t)offsetof(struct devdb_shared_devinfo, user) + user_size;
+	owner_offset = (owner_offset + (DEVDB_CACHE_LINE_SIZE - 1)) & ~(DEVDB_CACHE_LINE_SIZE - 1);
+
+	r = _devdb_open_shared(db, name, &initialized);
+	if (r != DEVDB_S_OK) {
+		internal_err("devdb_open: _devdb_open_shared failed");
+		return r;
+	}
+
+	info = db->info;
+
+	if (initialized == false)
+	{
+		info->version = DEVDB_SHARED_INFO_VERSION;
+		info->lock = 0;
+		info->ticket = 0;
+		info->serving = 0;
+		info->reserved = 0;
+		info->claim = 0xFFFFFFFF;
+		memset(info->slot, 0, sizeof(info->slot));
+		info->spin = DEVDB_LOCK_SPIN_MIN;
+		info->stall_ticket = 0;
+		info->stall_tick = 0;
+		memset(&info->stats, 0, sizeof(info->stats));
+
+		info->generation = 0;
+		info->count = 0;
+		info->owner_num = DEVDB_DEFAULT_DEV_OWNER_NUM;
+		info->owner_offset = owner_offset;
+		info->size = _devdb_get_slot_size(owner_offset, DEVDB_DEFAULT_DEV_OWNER_NUM);
+
+		_devdb_xchg(info->signature, DEVDB_SHARED_INFO_SIGNATURE);
+	}
+	else
+	{
+		uint32_t tick = _devdb_get_tick();
+
+		// a creator which has died before initializing it would leave the others waiting
+		while (*(volatile uint32_t *)&info->signature == 0) {
+			if ((uint32_t)(_devdb_get_tick() - tick) >= DEVDB_OPEN_TIMEOUT) {
+				internal_err("devdb_open: the control block has not been initialized by its creator");
+				r = DEVDB_E_INTERNAL;
+				goto end;
+			}
+			_devdb_sleep(1);
+		}
+		if (info->signature != DEVDB_SHARED_INFO_SIGNATURE) {
+			internal_err("devdb_open: incorrect signature");
+			r = DEVDB_E_INTERNAL;
+			goto end;
+		}
+		else if (info->version != DEVDB_SHARED_INFO_VERSION) {
+			internal_err("devdb_open: incorrect version");
+			r = DEVDB_E_INTERNAL;
+			goto end;
+		}
+		else if (info->owner_offset != owner_offset) {
+			internal_err("devdb_open: couldn't use it");
+			r = DEVDB_E_INTERNAL;
+			goto end;
+		}
+	}
+
+	db->table = NULL;
+	db->generation = 0;
+	db->count = 0;
+	db->size = 0;
+	db->owner_num = 0;
+	memcpy(db->name, name, (name_len + 1) * sizeof(wchar_t));
+	memcpy(db->id, id, (id_len + 1) * sizeof(wchar_t));
+	db->sim_num = 0;
+	db->sim_script[0] = L'\0';
+
+	// device table
+
+	devdb_lock(db);
+
+	if (info->count < capacity || info->generation == 0) {
+		r = _devdb_grow_nolock(db, (info->count < capacity) ? capacity : info->count, info->owner_num);
+	}
+	else {
+		r = (db->generation == info->generation) ? DEVDB_S_OK : DEVDB_E_INTERNAL;
+	}
+
+	devdb_unlock(db);
+
+	if (r != DEVDB_S_OK) {
+		internal_err("devdb_open: couldn't map the device table");
+		_devdb_close_table(db);
+		goto end;
+	}
+
+	return DEVDB_S_OK;
+
+end:
+	_devdb_close_shared(db);
+	return r;
+}
+
+devdb_status_t devdb_close(devdb *const db)
+{
+	_devdb_close_table(db);
+	_devdb_close_shared(db);
+
+	return DEVDB_S_OK;
+}
+
+// the simulated devices are listed after the ones found on the system, with the ids 1 to num
+devdb_status_t devdb_set_simulated(devdb *const db, const wchar_t *const script, const uint32_t num)
+{
+	if (wstrLen(script) > DEVDB_MAX_SCRIPT_SIZE)
+		return DEVDB_E_INVALID_PARAMETER;
+
+	wstrCopy(db->sim_script, script);
+	db->sim_num = (wstrIsEmpty(script)) ? 0 : num;
+
+	return DEVDB_S_OK;
+}
+
+#ifndef _WIN32
+
+// the paths of the devices, which are enumerated by SetupAPI on Windows
+devdb_status_t devdb_set_devices(devdb *const db, const wchar_t *const paths)
+{
+	const wchar_t *p = paths;
+	wchar_t *device;
+
+	while (*p != L'\0')
+		p += wstrLen(p) + 1;
+
+	device = memAllocRaw(((p - paths) + 1) * sizeof(wchar_t));
+	if (device == NULL) {
+		internal_err("devdb_set_devices: memAllocRaw failed");
+		return DEVDB_E_NO_MEMORY;
+	}
+
+	memcpy(device, paths, ((p - paths) + 1) * sizeof(wchar_t));
+
+	if (db->device != NULL)
+		memFree(db->device);
+
+	db->device = device;
+
+	return DEVDB_S_OK;
+}
+
+#endif
+
+#define _devdb_read(v) (*(volatile uint32_t *)&(v))
+
+#ifdef _WIN32
+
+static bool _devdb_is_process_alive(const uint32_t pid)
+{
+	HANDLE process;
+	DWORD ret;
+
+	process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+	if (process == NULL) {
+		// the process exists if we are only denied access to it
+		return (GetLastError() == ERROR_ACCESS_DENIED) ? true : false;
+	}
+
+	ret = WaitForSingleObject(process, 0);
+	CloseHandle(process);
+
+	return (ret == WAIT_TIMEOUT) ? true : false;
+}
+
+static uint64_t _devdb_get_time(void)
+{
+	LARGE_INTEGER t;
+
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+// block until the slot is woken up. returns true if the wait timed out.
+static bool _devdb_sem_wait(devdb *const db, const uint32_t slot, const uint32_t seq)
+{
+	return (WaitForSingleObject(db->sem[slot], DEVDB_LOCK_CHECK_INTERVAL) == WAIT_TIMEOUT) ? true : false;
+}
+
+static void _devdb_sem_release(devdb *const db, const uint32_t slot, const uint32_t waiting)
+{
+	ReleaseSemaphore(db->sem[slot], waiting, NULL);
+}
+
+// a waiter which timed out after it was counted in a wakeup takes back its count, so
+// that the semaphore does not wake the next waiter of the slot for nothing
+static void _devdb_sem_take(devdb *const db, const uint32_t slot)
+{
+	WaitForSingleObject(db->sem[slot], 0);
+}
+
+#else
+
+static bool _devdb_is_process_alive(const uint32_t pid)
+{
+	// the process exists if we are only denied to signal it
+	return (kill((pid_t)pid, 0) == 0 || errno == EPERM) ? true : false;
+}
+
+static uint64_t _devdb_get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+// block until the slot is woken up, which is seen as a change of its seq. returns true if the wait timed out.
+static bool _devdb_sem_wait(devdb *const db, const uint32_t slot, const uint32_t seq)
+{
+	struct timespec ts = { 0, DEVDB_LOCK_CHECK_INTERVAL * 1000000 };
+
+	if (syscall(SYS_futex, &db->info->slot[slot].seq, FUTEX_WAIT, seq, &ts, NULL, 0) == -1 && errno == ETIMEDOUT)
+		return true;
+
+	return false;
+}
+
+static void _devdb_sem_release(devdb *const db, const uint32_t slot, const uint32_t waiting)
+{
+	syscall(SYS_futex, &db->info->slot[slot].seq, FUTEX_WAKE, (waiting > INT_MAX) ? INT_MAX : (int)waiting, NULL, NULL, 0);
+}
+
+// the futex keeps no count
+#define _devdb_sem_take(db, slot)
+
+#endif
+
+static void _devdb_spin_lock(devdb *const db)
+{
+	uint32_t pid = _devdb_get_pid();
+	uint32_t i = 0;
+	uint32_t holder;
+
+	while ((holder = _devdb_cas(db->info->lock, pid, 0)) != 0)
+	{
+		// the internal lock is only held for a few instructions
+		if (++i < DEVDB_LOCK_SPIN_MIN) {
+			_devdb_pause();
+			continue;
+		}
+
+		if ((i % 1024) == 0 && _devdb_is_process_alive(holder) == false) {
+			internal_err("_devdb_spin_lock: holder (%u) is dead", holder);
+			_devdb_cas(db->info->lock, 0, holder);
+			continue;
+		}
+
+		_devdb_yield();
+	}
+}
+
+static void _devdb_spin_unlock(devdb *const db)
+{
+	_devdb_xchg(db->info->lock, 0);
+}
+
+// wake up the waiters of the slot of the ticket being served (called with the internal
+// lock held). returns the number of them, which is released from the slot once the
+// internal lock is released.
+static uint32_t _devdb_wake_nolock(devdb *const db, uint32_t *const slot)
+{
+	struct devdb_shared_lock_slot *s;
+	uint32_t waiting;
+
+	*slot = db->info->serving % DEVDB_LOCK_SLOT_NUM;
+	s = &db->info->slot[*slot];
+
+	waiting = s->waiting;
+	if (waiting != 0) {
+		s->waiting = 0;
+		_devdb_inc(s->seq);
+	}
+
+	return waiting;
+}
+
+#define _devdb_claim_ticket(c)	((uint32_t)(c))
+#define _devdb_claim_pid(c)		((uint32_t)((c) >> 32))
+
+// take the lock back if its owner has died, or if the ticket being served is never claimed
+// (called with the internal lock held)
+static bool _devdb_lock_recover_nolock(devdb *const db)
+{
+	struct devdb_shared_info *info = db->info;
+	uint32_t serving = info->serving;
+	uint64_t claim = _devdb_read64(info->claim);
+	uint32_t tick = _devdb_get_tick();
+
+	if (_devdb_claim_ticket(claim) == serving)
+	{
+		// claimed: forced through only once its owner is known to be dead
+		uint32_t owner = _devdb_claim_pid(claim);
+
+		if (_devdb_is_process_alive(owner) == true)
+			return false;
+
+		internal_err("_devdb_lock_recover_nolock: owner (%u) is dead", owner);
+	}
+	else
+	{
+		if (info->stall_ticket != serving || info->stall_tick == 0) {
+			info->stall_ticket = serving;
+			info->stall_tick = tick | 1;
+			return false;
+		}
+
+		if ((tick - info->stall_tick) < DEVDB_LOCK_CLAIM_TIMEOUT)
+			return false;
+
+		// skip the ticket, unless it has been claimed meanwhile; a live waiter which
+		// lost it takes a new one
+		if (_devdb_cas64(info->claim, (uint64_t)serving, claim) != claim)
+			return false;
+
+		internal_err("_devdb_lock_recover_nolock: ticket %u is not claimed", serving);
+	}
+
+	// the claim is left on the old ticket, which reads as unclaimed for the next one
+	info->serving = serving + 1;
+	info->stall_tick = 0;
+	info->stats.recover++;
+
+	return true;
+}
+
+// claim the lock for the ticket being served
+static bool _devdb_lock_claim(devdb *const db, const uint32_t ticket)
+{
+	struct devdb_shared_info *info = db->info;
+	uint64_t claim = _devdb_read64(info->claim);
+
+	// the ticket has been skipped if the claim has moved past the previous ticket
+	if (_devdb_claim_ticket(claim) != ticket - 1)
+		return false;
 
-	id_len = wstrLen(id);
-	if (id_len >= DEVDB_MAX_ID_SIZE) {
-		internal_err("devdb_open: id_len >= DEVDB_MAX_ID_SIZE");
-		return DEVDB_E_INVALID_PARAMETER;
-	}
+	if (_devdb_cas64(info->claim, ((uint64_t)_devdb_get_pid() << 32) | ticket, claim) != claim)
+		return false;
 
-	devdb_status_t r = DEVDB_E_INTERNAL;
-	wchar_t obj_name[256];
+	return true;
+}
 
-	// event
+void devdb_lock(devdb *const db)
+{
+	dbg_trace("devdb_lock");
 
-	HANDLE ev;
+	struct devdb_shared_info *info = db->info;
+	uint32_t ticket;
 
-	make_obj_name(obj_name, name, name_len, event_name);
-	dbg("devdb_open: obj_name(1): %ws", obj_name);
+	// take a ticket; the lock is handed over in ticket order
+	ticket = _devdb_inc(info->ticket) - 1;
 
-	ev = CreateEventW(NULL, FALSE, FALSE, obj_name);
-	if (ev == NULL) {
-		win32_err("devdb_open: CreateEventW");
-		r = DEVDB_E_API;
-		goto end1;
+	if (_devdb_read(info->serving) == ticket && _devdb_lock_claim(db, ticket) == true) {
+		info->stats.acquire++;
+		_devdb_sync_nolock(db);
+		return;
 	}
 
-	// shared memory
+	uint64_t start = _devdb_get_time();
+	bool slept = false;
 
-	HANDLE shmem;
-	uint32_t devinfo_size, shmem_size;
-	DWORD le;
-	struct devdb_shared_info *info;
+	if (_devdb_read(info->serving) + 1 == ticket)
+	{
+		// next in line: spin for a while before blocking
 
-	make_obj_name(obj_name, name, name_len, shmem_name);
-	dbg("devdb_open: obj_name(2): %ws", obj_name);
+		uint32_t spin, max_spin, i;
 
-	devinfo_size = (sizeof(struct devdb_shared_devinfo) - sizeof(((struct devdb_shared_devinfo *)NULL)->user) + user_size);
-	shmem_size = (sizeof(struct devdb_shared_info) - sizeof(struct devdb_shared_devinfo)) + (devinfo_size * DEVDB_MAX_DEV_NUM);
+		spin = _devdb_read(info->spin);
+		max_spin = (spin * 2 + 10 < DEVDB_LOCK_SPIN_MAX) ? spin * 2 + 10 : DEVDB_LOCK_SPIN_MAX;
 
-	shmem = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, shmem_size, obj_name);
-	if (shmem == NULL) {
-		win32_err("devdb_open: CreateFileMappingW");
-		r = DEVDB_E_API;
-		goto end2;
-	}
+		for (i = 0; i < max_spin; i++) {
+			if (_devdb_read(info->serving) == ticket)
+				break;
 
-	le = GetLastError();
+			_devdb_pause();
+		}
 
-	info = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
-	if (info == NULL) {
-		win32_err("devdb_open: MapViewOfFile");
-		r = DEVDB_E_API;
-		goto end3;
+		// adapt the spin count to how long the lock has recently been held
+		spin += ((int32_t)i - (int32_t)spin) / 8;
+		info->spin = (spin < DEVDB_LOCK_SPIN_MIN) ? DEVDB_LOCK_SPIN_MIN : spin;
 	}
 
-	if (le != ERROR_ALREADY_EXISTS)
+	while (1)
 	{
-		info->lock = 0;
-		info->available = 1;
-		info->waiting = 0;
+		uint32_t waiting = 0, slot, wake_slot, seq;
+		bool timeout;
 
-		info->count = DEVDB_MAX_DEV_NUM;
-		info->size = devinfo_size;
-		memset(info->dev, 0, (devinfo_size * DEVDB_MAX_DEV_NUM));
+		_devdb_spin_lock(db);
 
-		InterlockedExchange(&info->signature, DEVDB_SHARED_INFO_SIGNATURE);
-	}
-	else
-	{
-		while (info->signature == 0) {
-			Sleep(0);
+		if ((int32_t)(info->serving - ticket) > 0) {
+			// our ticket was skipped while we were not running
+			ticket = _devdb_inc(info->ticket) - 1;
 		}
-		if (info->signature != DEVDB_SHARED_INFO_SIGNATURE) {
-			internal_err("devdb_open: incorrect signature");
-			r = DEVDB_E_INTERNAL;
-			goto end4;
+
+		if (info->serving == ticket) {
+			_devdb_spin_unlock(db);
+
+			if (_devdb_lock_claim(db, ticket) == true)
+				break;
+
+			continue;
 		}
-		else if (info->size != devinfo_size) {
-			internal_err("devdb_open: couldn't use it");
-			r = DEVDB_E_INTERNAL;
-			goto end4;
+
+		slot = ticket % DEVDB_LOCK_SLOT_NUM;
+		info->slot[slot].waiting++;
+		seq = info->slot[slot].seq;
+		_devdb_spin_unlock(db);
+
+		timeout = _devdb_sem_wait(db, slot, seq);
+
+		_devdb_spin_lock(db);
+
+		if (info->slot[slot].seq == seq) {
+			// not woken up: no longer counted as waiting
+			info->slot[slot].waiting--;
+		}
+		else if (timeout == true) {
+			_devdb_sem_take(db, slot);
 		}
-	}
 
-	db->ev = ev;
-	db->shmem = shmem;
-	db->info = info;
-	memcpy(db->name, name, (name_len + 1) * sizeof(wchar_t));
-	memcpy(db->id, id, (id_len + 1) * sizeof(wchar_t));
+		if (timeout == true && _devdb_lock_recover_nolock(db) == true) {
+			waiting = _devdb_wake_nolock(db, &wake_slot);
+		}
 
-	return DEVDB_S_OK;
+		_devdb_spin_unlock(db);
 
-end4:
-	UnmapViewOfFile(info);
-end3:
-	CloseHandle(shmem);
-end2:
-	CloseHandle(ev);
-end1:
-	return r;
-}
+		if (waiting) {
+			_devdb_sem_release(db, wake_slot, waiting);
+		}
 
-devdb_status_t devdb_close(devdb *const db)
-{
-	if (db->info != NULL) {
-		UnmapViewOfFile(db->info);
-		db->info = NULL;
+		slept = true;
 	}
 
-	if (db->shmem != NULL) {
-		CloseHandle(db->shmem);
-		db->shmem = NULL;
-	}
+	// the lock is owned from here
 
-	if (db->ev != NULL) {
-		CloseHandle(db->ev);
-		db->ev = NULL;
+	uint32_t wait = (uint32_t)(((_devdb_get_time() - start) * 1000000) / _qpc_freq);
+
+	info->stats.acquire++;
+	info->stats.contended++;
+	if (slept == true) {
+		info->stats.sleep++;
+	}
+	info->stats.wait_total += wait;
+	if (info->stats.wait_max < wait) {
+		info->stats.wait_max = wait;
 	}
 
-	return DEVDB_S_OK;
+	_devdb_sync_nolock(db);
 }
 
-static void _devdb_spin_lock(devdb *const db)
+// takes the lock only if it is free and nobody waits for it, without blocking
+bool devdb_trylock(devdb *const db)
 {
-	while (InterlockedExchange(&db->info->lock, 1))
-		Sleep(0);
-}
+	dbg_trace("devdb_trylock");
 
-static void _devdb_spin_unlock(devdb *const db)
-{
-	InterlockedExchange(&db->info->lock, 0);
-}
+	struct devdb_shared_info *info = db->info;
+	uint32_t serving = _devdb_read(info->serving);
 
-void devdb_lock(devdb *const db)
-{
-	dbg("devdb_lock");
+	if (_devdb_read(info->ticket) != serving)
+		return false;
 
-	while (1)
-	{
-		_devdb_spin_lock(db);
+	if (_devdb_cas(info->ticket, serving + 1, serving) != serving)
+		return false;
 
-		if (db->info->available > 0) {
-			db->info->available--;
-			_devdb_spin_unlock(db);
-			return;
-		}
+	// the ticket is ours. if it has been skipped meanwhile, it is simply given up.
+	if (_devdb_lock_claim(db, serving) == false)
+		return false;
 
-		db->info->waiting++;
-		_devdb_spin_unlock(db);
+	info->stats.acquire++;
+	_devdb_sync_nolock(db);
 
-		WaitForSingleObject(db->ev, INFINITE);
-	}
+	return true;
 }
 
 void devdb_unlock(devdb *const db)
 {
-	dbg("devdb_unlock");
+	dbg_trace("devdb_unlock");
+
+	struct devdb_shared_info *info = db->info;
+	uint32_t waiting, slot;
 
 	_devdb_spin_lock(db);
 
-	db->info->available++;
-	if (db->info->waiting) {
-		db->info->waiting--;
-		SetEvent(db->ev);
-	}
+	info->serving++;
+	waiting = _devdb_wake_nolock(db, &slot);
 
 	_devdb_spin_unlock(db);
 
+	// only the waiters of the slot of the next ticket are woken up
+	if (waiting) {
+		_devdb_sem_release(db, slot, waiting);
+	}
+
 	return;
 }
 
+void devdb_get_lock_stats(devdb *const db, struct devdb_lock_stats *const stats)
+{
+	_devdb_spin_lock(db);
+	memcpy(stats, &db->info->stats, sizeof(struct devdb_lock_stats));
+	_devdb_spin_unlock(db);
+}
+
 bool _devdb_parse_interface_path(const wchar_t *const path, wchar_t *const id)
 {
 	wchar_t *p;
 
+#ifndef _WIN32
+	// a device node (/dev/...) is known by its name
+	if (path[0] == L'/') {
+		const wchar_t *name = path;
+
+		for (p = (wchar_t *)path; *p != L'\0'; p++) {
+			if (*p == L'/')
+				name = p + 1;
+		}
+
+		if (*name == L'\0' || wstrLen(name) >= DEVDB_MAX_ID_SIZE)
+			return false;
+
+		wstrCopy(id, name);
+
+		return true;
+	}
+#endif
+
 	p = wstrGetWCharPtr(path, L'\\');
 	if (p == NULL) {
 		return false;
@@ -245,10 +1201,34 @@ bool _devdb_parse_interface_path(const wchar_t *const path, wchar_t *const id)
 	return true;
 }
 
-devdb_status_t devdb_update_nolock(devdb *const db)
+// append a path to the list of the devices found by devdb_update_nolock
+static bool _devdb_add_path(mem_arena arena, const wchar_t ***const array, uint32_t *const index, uint32_t *const max_index, const wchar_t *const path)
 {
-	dbg("devdb_update_nolock");
+	if (*index >= *max_index)
+	{
+		const wchar_t **a;
+
+		a = memArenaAlloc(arena, sizeof(wchar_t *) * (*max_index) * 2);
+		if (a == NULL) {
+			internal_err("_devdb_add_path: memArenaAlloc failed");
+			return false;
+		}
 
+		memcpy(a, *array, sizeof(wchar_t *) * (*index));
+		*array = a;
+		*max_index *= 2;
+	}
+
+	(*array)[(*index)++] = path;
+
+	return true;
+}
+
+#ifdef _WIN32
+
+// the devices of the class whose friendly name is the name of the database
+static devdb_status_t _devdb_enum_paths(devdb *const db, mem_arena arena, const wchar_t ***const array, uint32_t *const index, uint32_t *const max_index)
+{
 	HDEVINFO devInfo;
 
 	devInfo = SetupDiGetClassDevsW(&(const GUID) { DEVDB_DEVICE_CLASS }, NULL, NULL, DIGCF_DEVICEINTERFACE | DIGCF_PRESENT);
@@ -257,17 +1237,8 @@ devdb_status_t devdb_update_nolock(devdb *const db)
 		return DEVDB_E_API;
 	}
 
-	PSP_DEVICE_INTERFACE_DETAIL_DATA_W *detailDataArray;
-	uint32_t detailDataIndex = 0, detailDataMaxIndex = db->info->count - 1;
-
-	detailDataArray = memAlloc(sizeof(PSP_DEVICE_INTERFACE_DETAIL_DATA_W) * db->info->count);
-	if (detailDataArray == NULL) {
-		internal_err("devdb_update_nolock: memAlloc failed 1");
-		SetupDiDestroyDeviceInfoList(devInfo);
-		return DEVDB_E_NO_MEMORY;
-	}
-
 	SP_DEVICE_INTERFACE_DATA interfaceData;
+	PSP_DEVICE_INTERFACE_DETAIL_DATA_W detailData = NULL;
 	uint32_t i = 0;
 	devdb_status_t r = DEVDB_E_NO_DEVICES;
 
@@ -275,20 +1246,20 @@ devdb_status_t devdb_update_nolock(devdb *const db)
 
 	while (SetupDiEnumDeviceInterfaces(devInfo, NULL, &(const GUID) { DEVDB_DEVICE_CLASS }, i, &interfaceData) == TRUE)
 	{
-		PSP_DEVICE_INTERFACE_DETAIL_DATA_W detailData;
-
-		detailData = memAlloc(sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W) + sizeof(WCHAR) * (512 - ANYSIZE_ARRAY));
+		// the buffer of an interface which was not taken is used again
 		if (detailData == NULL) {
-			internal_err("devdb_update_nolock: memAlloc failed 2");
-			r = DEVDB_E_NO_MEMORY;
-			break;
+			detailData = memArenaAlloc(arena, sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W) + sizeof(WCHAR) * (512 - ANYSIZE_ARRAY));
+			if (detailData == NULL) {
+				internal_err("devdb_update_nolock: memArenaAlloc failed 2");
+				r = DEVDB_E_NO_MEMORY;
+				break;
+			}
 		}
 
 		detailData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
 
 		if (SetupDiGetDeviceInterfaceDetailW(devInfo, &interfaceData, detailData, sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W) + sizeof(WCHAR) * (512 - ANYSIZE_ARRAY), NULL, NULL) == FALSE) {
 			win32_err("devdb_update_nolock: SetupDiGetDeviceInterfaceDetailW");
-			memFree(detailData);
 			i++;
 			continue;
 		}
@@ -298,7 +1269,6 @@ devdb_status_t devdb_update_nolock(devdb *const db)
 		hKey = SetupDiOpenDeviceInterfaceRegKey(devInfo, &interfaceData, 0, KEY_READ);
 		if (hKey == INVALID_HANDLE_VALUE) {
 			win32_err("devdb_update_nolock: SetupDiOpenDeviceInterfaceRegKey");
-			memFree(detailData);
 			i++;
 			continue;
 		}
@@ -319,55 +1289,141 @@ devdb_status_t devdb_update_nolock(devdb *const db)
 		else
 		{
 			if (wstrCompare(fn, db->name) == false) {
-				memFree(detailData);
 				i++;
 				continue;
 			}
 
-			if (detailDataIndex >= detailDataMaxIndex) {
-				internal_err("devdb_update_nolock: internal limit");
-				memFree(detailData);
+			if (_devdb_add_path(arena, array, index, max_index, detailData->DevicePath) == false) {
+				r = DEVDB_E_NO_MEMORY;
 				break;
 			}
 
-			detailDataArray[detailDataIndex++] = detailData;
+			detailData = NULL;
 			i++;
 
 			r = DEVDB_S_OK;
 			continue;
 		}
 
-		memFree(detailData);
 		i++;
 	}
 
 	SetupDiDestroyDeviceInfoList(devInfo);
 
+	return r;
+}
+
+#else
+
+// the devices given to devdb_set_devices which are there
+static devdb_status_t _devdb_enum_paths(devdb *const db, mem_arena arena, const wchar_t ***const array, uint32_t *const index, uint32_t *const max_index)
+{
+	devdb_status_t r = DEVDB_E_NO_DEVICES;
+
+	if (db->device == NULL)
+		return r;
+
+	for (const wchar_t *p = db->device; *p != L'\0'; p += wstrLen(p) + 1)
+	{
+		char name[DEVDB_MAX_PATH_SIZE * 4];
+
+		// the ones which are not device nodes are taken as they are, for the transports
+		if (p[0] == L'/' && (wstrToUtf8(name, sizeof(name), p) == 0 || access(name, F_OK) != 0))
+			continue;
+
+		if (_devdb_add_path(arena, array, index, max_index, p) == false)
+			return DEVDB_E_NO_MEMORY;
+
+		r = DEVDB_S_OK;
+	}
+
+	return r;
+}
+
+#endif
+
+devdb_status_t devdb_update_nolock(devdb *const db)
+{
+	dbg("devdb_update_nolock");
+
+	// everything allocated during the enumeration is released at once
+	mem_arena arena;
+
+	arena = memArenaCreate(DEVDB_UPDATE_ARENA_SIZE);
+	if (arena == NULL) {
+		internal_err("devdb_update_nolock: memArenaCreate failed");
+		return DEVDB_E_NO_MEMORY;
+	}
+
+	const wchar_t **pathArray;
+	uint32_t pathIndex = 0, pathMaxIndex = (db->count != 0) ? db->count : 1;
+
+	pathArray = memArenaAlloc(arena, sizeof(wchar_t *) * pathMaxIndex);
+	if (pathArray == NULL) {
+		internal_err("devdb_update_nolock: memArenaAlloc failed 1");
+		memArenaDestroy(arena);
+		return DEVDB_E_NO_MEMORY;
+	}
+
+	devdb_status_t r;
+
+	r = _devdb_enum_paths(db, arena, &pathArray, &pathIndex, &pathMaxIndex);
+	if (r == DEVDB_E_API) {
+		memArenaDestroy(arena);
+		return r;
+	}
+
+	for (uint32_t j = 0; j < db->sim_num && r != DEVDB_E_NO_MEMORY; j++)
+	{
+		wchar_t *path;
+		uint32_t len;
+
+		path = memArenaAlloc(arena, sizeof(wchar_t) * DEVDB_MAX_PATH_SIZE);
+		if (path == NULL) {
+			internal_err("devdb_update_nolock: memArenaAlloc failed 3");
+			r = DEVDB_E_NO_MEMORY;
+			break;
+		}
+
+		// \\?\itecard#sim#<id>#<script>
+		memcpy(path, ITESIM_PATH_PREFIX, ITESIM_PATH_PREFIX_LEN * sizeof(wchar_t));
+		len = ITESIM_PATH_PREFIX_LEN;
+		len += wstrFromUInt32(path + len, 11, j + 1, 10);
+		path[len++] = L'#';
+		wstrCopy(path + len, db->sim_script);
+
+		if (_devdb_add_path(arena, &pathArray, &pathIndex, &pathMaxIndex, path) == false) {
+			r = DEVDB_E_NO_MEMORY;
+			break;
+		}
+
+		r = DEVDB_S_OK;
+	}
+
 	{
-		struct devdb_shared_info *info = db->info;
-		uint8_t *p = (uint8_t *)info->dev;
-		uint32_t c = info->count, s = info->size;
+		uint8_t *p = db->table;
+		uint32_t c = db->count, s = db->size;
 
 		for (uint32_t j = 0; j < c; j++, p += s)
 		{
 			struct devdb_shared_devinfo *devinfo = (struct devdb_shared_devinfo *)p;
+			struct devdb_shared_devname *devname = _devdb_get_shared_devname(db, j);
 			uint32_t k;
 
-			if (wstrIsEmpty(devinfo->path))
+			if (wstrIsEmpty(devname->path))
 				continue;
 
-			for (k = 0; k < detailDataIndex; k++)
+			for (k = 0; k < pathIndex; k++)
 			{
-				if (detailDataArray[k] != NULL && wstrCompare(detailDataArray[k]->DevicePath, devinfo->path) == true) {
+				if (pathArray[k] != NULL && wstrCompare(pathArray[k], devname->path) == true) {
 					// システム上に存在する(利用可能)
 					devinfo->available = 1;
-					memFree(detailDataArray[k]);
-					detailDataArray[k] = NULL;
+					pathArray[k] = NULL;
 					break;
 				}
 			}
 
-			if (k == detailDataIndex) {
+			if (k == pathIndex) {
 				// システム上に存在しない
 				if (devinfo->ref > 0) {
 					// 開かれているが利用できない
@@ -376,58 +1432,81 @@ devdb_status_t devdb_update_nolock(devdb *const db)
 				else {
 					// 開かれていない
 					memset(devinfo, 0, s);
+					memset(devname, 0, sizeof(struct devdb_shared_devname));
 				}
 			}
 		}
 	}
 
+	{
+		// make room for the new devices
+
+		uint32_t pending = 0, empty = 0;
+
+		for (uint32_t j = 0; j < pathIndex; j++) {
+			if (pathArray[j] != NULL) {
+				pending++;
+			}
+		}
+
+		for (uint32_t j = 0; j < db->count; j++) {
+			if (wstrIsEmpty(_devdb_get_shared_devname(db, j)->path)) {
+				empty++;
+			}
+		}
+
+		if (pending > empty) {
+			if (_devdb_grow_nolock(db, db->count + (pending - empty), db->owner_num) != DEVDB_S_OK) {
+				internal_err("devdb_update_nolock: _devdb_grow_nolock failed");
+			}
+		}
+	}
+
 	{
 		uint32_t lid = 0;
 
-		for (uint32_t j = 0; j < detailDataIndex; j++)
+		for (uint32_t j = 0; j < pathIndex; j++)
 		{
-			if (detailDataArray[j] == NULL)
+			if (pathArray[j] == NULL)
 				continue;
 
-			struct devdb_shared_info *info = db->info;
-			uint8_t *p = (uint8_t *)info->dev;
-			uint32_t c = info->count, s = info->size;
+			uint8_t *p = db->table + (db->size * lid);
+			uint32_t c = db->count, s = db->size;
 
 			for (uint32_t k = lid; k < c; k++)
 			{
 				struct devdb_shared_devinfo *devinfo = (struct devdb_shared_devinfo *)p;
+				struct devdb_shared_devname *devname = _devdb_get_shared_devname(db, k);
 
-				if (wstrIsEmpty(devinfo->path))
+				if (wstrIsEmpty(devname->path))
 				{
 					// 空きエントリ
 
-					if (_devdb_parse_interface_path(detailDataArray[j]->DevicePath, devinfo->id) == true) {
+					if (_devdb_parse_interface_path(pathArray[j], devname->id) == true) {
 						// 利用可能
-						wstrCopyN(devinfo->path, detailDataArray[j]->DevicePath, 512);
+						wstrCopyN(devname->path, pathArray[j], DEVDB_MAX_PATH_SIZE);
 						devinfo->available = 1;
 						lid = k + 1;
 					}
 					else {
 						dbg("devdb_update_nolock: _devdb_parse_interface_path failed");
 					}
-					memFree(detailDataArray[j]);
-					detailDataArray[j] = NULL;
+					pathArray[j] = NULL;
 					break;
 				}
 
 				p += s;
 			}
 
-			if (detailDataArray[j] != NULL) {
+			if (pathArray[j] != NULL) {
 				// 空きがない
-				memFree(detailDataArray[j]);
-				detailDataArray[j] = NULL;
+				pathArray[j] = NULL;
 				lid = c;
 			}
 		}
 	}
 
-	memFree(detailDataArray);
+	memArenaDestroy(arena);
 
 	return r;
 }
@@ -443,18 +1522,17 @@ devdb_status_t devdb_update(devdb *const db)
 	return r;
 }
 
-#define _devdb_get_shared_devinfo(db, id) ((struct devdb_shared_devinfo *)(((uint8_t *)((db)->info->dev)) + ((db)->info->size * (id))))
-#define _devdb_is_valid_devinfo(db, devinfo) (!wstrIsEmpty((devinfo)->path) && (wstrIsEmpty((db)->id) || wstrCompareEx((devinfo)->id, (db)->id, L'*') == true) && ((devinfo)->available != 0))
+#define _devdb_is_valid_devinfo(db, i, devinfo) (((devinfo)->available != 0) && !wstrIsEmpty(_devdb_get_shared_devname((db), (i))->path) && (wstrIsEmpty((db)->id) || wstrCompareEx(_devdb_get_shared_devname((db), (i))->id, (db)->id, L'*') == true))
 
 devdb_status_t devdb_enum_nolock(devdb *const db, const devdb_enum_callback callback, void *prm)
 {
 	devdb_status_t r = DEVDB_E_NO_DEVICES;
 
-	for (uint32_t i = 0, c = db->info->count; i < c; i++)
+	for (uint32_t i = 0, c = db->count; i < c; i++)
 	{
 		struct devdb_shared_devinfo *devinfo = _devdb_get_shared_devinfo(db, i);
 
-		if (_devdb_is_valid_devinfo(db, devinfo))
+		if (_devdb_is_valid_devinfo(db, i, devinfo))
 		{
 			r = DEVDB_S_OK;
 
@@ -481,7 +1559,7 @@ devdb_status_t devdb_get_shared_devinfo_nolock(devdb *const db, const uint32_t i
 {
 	*devinfo = NULL;
 
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
@@ -489,7 +1567,7 @@ devdb_status_t devdb_get_shared_devinfo_nolock(devdb *const db, const uint32_t i
 
 	di = _devdb_get_shared_devinfo(db, id);
 
-	if (!_devdb_is_valid_devinfo(db, di))
+	if (!_devdb_is_valid_devinfo(db, id, di))
 	{
 		devdb_status_t r;
 
@@ -497,7 +1575,7 @@ devdb_status_t devdb_get_shared_devinfo_nolock(devdb *const db, const uint32_t i
 		if (r != DEVDB_S_OK)
 			return r;
 
-		if (!_devdb_is_valid_devinfo(db, di)) {
+		if (!_devdb_is_valid_devinfo(db, id, di)) {
 			return DEVDB_E_DEVICE_NOT_FOUND;
 		}
 	}
@@ -518,15 +1596,22 @@ devdb_status_t devdb_get_shared_devinfo(devdb *const db, const uint32_t id, stru
 	return r;
 }
 
+devdb_status_t devdb_get_count_nolock(devdb *const db, uint32_t *const count)
+{
+	*count = db->count;
+
+	return DEVDB_S_OK;
+}
+
 devdb_status_t devdb_get_path_nolock(devdb *const db, const uint32_t id, const wchar_t **const path)
 {
 	*path = NULL;
 
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
-	*path = _devdb_get_shared_devinfo(db, id)->path;
+	*path = _devdb_get_shared_devname(db, id)->path;
 
 	return DEVDB_S_OK;
 }
@@ -544,7 +1629,7 @@ devdb_status_t devdb_get_path(devdb *const db, const uint32_t id, const wchar_t
 
 devdb_status_t devdb_get_ref_count_nolock(devdb *const db, const uint32_t id, uint32_t *const ref)
 {
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
@@ -568,7 +1653,7 @@ devdb_status_t devdb_get_userdata_nolock(devdb *const db, const uint32_t id, voi
 {
 	*pp = NULL;
 
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
@@ -588,25 +1673,65 @@ devdb_status_t devdb_get_userdata(devdb *const db, const uint32_t id, void **pp)
 	return r;
 }
 
+static struct devdb_shared_devref * _devdb_get_devref(devdb *const db, struct devdb_shared_devinfo *const devinfo, const uint32_t pid)
+{
+	struct devdb_shared_devref *owner = _devdb_get_owner(db, devinfo);
+
+	for (uint32_t i = 0; i < db->owner_num; i++) {
+		if (owner[i].pid == pid) {
+			return &owner[i];
+		}
+	}
+
+	return NULL;
+}
+
 devdb_status_t devdb_ref_nolock(devdb *const db, const uint32_t id, uint32_t *const ref)
 {
 	struct devdb_shared_devinfo *devinfo;
+	struct devdb_shared_devref *devref;
+	uint32_t pid = _devdb_get_pid();
 
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
 	devinfo = _devdb_get_shared_devinfo(db, id);
 
-	if (devinfo->ref > DEVDB_MAX_DEV_REF_NUM) {
-		internal_err("devdb_ref: ref > DEVDB_MAX_DEV_REF_NUM");
-		return DEVDB_E_INTERNAL;
-	}
-	else if (devinfo->ref == DEVDB_MAX_DEV_REF_NUM) {
-		internal_err("devdb_ref: ref == DEVDB_MAX_DEV_REF_NUM");
+	if (devinfo->ref == UINT32_MAX) {
+		internal_err("devdb_ref: ref == UINT32_MAX");
 		return DEVDB_E_INTERNAL_LIMIT;
 	}
 
+	devref = _devdb_get_devref(db, devinfo, pid);
+	if (devref == NULL) {
+		devref = _devdb_get_devref(db, devinfo, 0);
+		if (devref == NULL)
+		{
+			devdb_status_t r;
+
+			// every entry is held by another process: the table moves to a generation
+			// with owner tables twice as large, so the slots of the caller move as well
+			if (db->owner_num >= DEVDB_MAX_DEV_OWNER_NUM) {
+				internal_err("devdb_ref: no free owner entry");
+				return DEVDB_E_INTERNAL_LIMIT;
+			}
+
+			r = _devdb_grow_nolock(db, db->count, db->owner_num * 2);
+			if (r != DEVDB_S_OK) {
+				internal_err("devdb_ref: _devdb_grow_nolock failed");
+				return r;
+			}
+
+			devinfo = _devdb_get_shared_devinfo(db, id);
+			devref = _devdb_get_devref(db, devinfo, 0);
+		}
+
+		devref->pid = pid;
+		devref->count = 0;
+	}
+
+	devref->count++;
 	devinfo->ref++;
 
 	if (ref != NULL)
@@ -629,22 +1754,30 @@ devdb_status_t devdb_ref(devdb *const db, const uint32_t id, uint32_t *const ref
 devdb_status_t devdb_unref_nolock(devdb *const db, const uint32_t id, uint32_t *const ref)
 {
 	struct devdb_shared_devinfo *devinfo;
+	struct devdb_shared_devref *devref;
 
-	if (db->info->count <= id) {
+	if (db->count <= id) {
 		return DEVDB_E_INVALID_PARAMETER;
 	}
 
 	devinfo = _devdb_get_shared_devinfo(db, id);
 
-	if (devinfo->ref > DEVDB_MAX_DEV_REF_NUM) {
-		internal_err("devdb_unref: ref > DEVDB_MAX_DEV_REF_NUM");
-		return DEVDB_E_INTERNAL;
-	}
-	else if (devinfo->ref == DEVDB_MAX_DEV_REF_NUM) {
+	if (devinfo->ref == 0) {
 		internal_err("devdb_unref: unref == 0");
 		return DEVDB_E_INTERNAL_LIMIT;
 	}
 
+	devref = _devdb_get_devref(db, devinfo, _devdb_get_pid());
+	if (devref == NULL || devref->count == 0) {
+		// the references of this process have already been reclaimed
+		internal_err("devdb_unref: not referenced by this process");
+		return DEVDB_E_INTERNAL;
+	}
+
+	if (--devref->count == 0) {
+		devref->pid = 0;
+	}
+
 	devinfo->ref--;
 
 	if (ref != NULL)
@@ -663,3 +1796,39 @@ devdb_status_t devdb_unref(devdb *const db, const uint32_t id, uint32_t *const r
 
 	return r;
 }
+
+// drop the references held by processes which no longer exist
+devdb_status_t devdb_reclaim_nolock(devdb *const db, const uint32_t id, uint32_t *const reclaimed)
+{
+	struct devdb_shared_devinfo *devinfo;
+	struct devdb_shared_devref *owner;
+	uint32_t pid = _devdb_get_pid();
+	uint32_t n = 0;
+
+	if (db->count <= id) {
+		return DEVDB_E_INVALID_PARAMETER;
+	}
+
+	devinfo = _devdb_get_shared_devinfo(db, id);
+	owner = _devdb_get_owner(db, devinfo);
+
+	for (uint32_t i = 0; i < db->owner_num; i++)
+	{
+		struct devdb_shared_devref *devref = &owner[i];
+
+		if (devref->pid == 0 || devref->pid == pid || _devdb_is_process_alive(devref->pid) == true)
+			continue;
+
+		dbg("devdb_reclaim_nolock: pid: %u, count: %u", devref->pid, devref->count);
+
+		n += devref->count;
+		devinfo->ref = (devinfo->ref > devref->count) ? devinfo->ref - devref->count : 0;
+		devref->pid = 0;
+		devref->count = 0;
+	}
+
+	if (reclaimed != NULL)
+		*reclaimed = n;
+
+	return DEVDB_S_OK;
+}
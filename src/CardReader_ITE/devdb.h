@@ -2,48 +2,181 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
-#define DEVDB_MAX_DEV_NUM		8
-#define DEVDB_MAX_DEV_REF_NUM	16
+// outside of Windows, the control block and the device tables are POSIX shared memory,
+// and the waiters for the lock sleep on a futex instead of the named semaphores. the
+// devices are not enumerated there: they are the ones given to devdb_set_devices.
+// the objects are created with the mode and the group given to devdb_set_access, so
+// that the processes of other users (pcscd, the card server and the applications) can
+// share them; an object they may not open is DEVDB_E_ACCESS_DENIED.
+
+#define DEVDB_DEFAULT_DEV_NUM	8
+#define DEVDB_DEFAULT_DEV_OWNER_NUM	32
+#define DEVDB_MAX_DEV_OWNER_NUM	0x10000
 #define DEVDB_MAX_PATH_SIZE		512
 #define DEVDB_MAX_ID_SIZE		64
 #define DEVDB_MAX_NAME_SIZE		128
+#define DEVDB_MAX_SCRIPT_SIZE	260
+
+#define DEVDB_CACHE_LINE_SIZE	64
+#define DEVDB_LOCK_SLOT_NUM		16
+
+#ifndef _WIN32
+#define DEVDB_DEFAULT_ACCESS_MODE	0600
+#define DEVDB_NO_GROUP				0xFFFFFFFF
+#endif
+
+// the shared structures are laid out so that data written by different parties
+// (arriving waiters, the lock owner, each device slot) never share a cache line.
+
+struct devdb_shared_devref
+{
+	uint32_t pid;	// process which holds the references
+	uint32_t count;
+};
 
-#pragma pack(1)
+// device slot (hot): one slot per device, each starting on its own cache line.
+// the user area follows the first line, and the owner table (one entry per process
+// which holds references) follows the user area on a line of its own. the slot is
+// padded to a whole line. the owner table starts with DEVDB_DEFAULT_DEV_OWNER_NUM
+// entries and is doubled, with a new generation of the device table, when it is full.
 
 struct devdb_shared_devinfo
+{
+	union {
+		struct {
+			uint32_t ref;
+			uint32_t available;
+		};
+		uint8_t line0[DEVDB_CACHE_LINE_SIZE];
+	};
+	uint8_t user[4];
+};
+
+// device name (cold): only used when enumerating and opening devices.
+
+struct devdb_shared_devname
 {
 	wchar_t path[DEVDB_MAX_PATH_SIZE];
 	wchar_t id[DEVDB_MAX_ID_SIZE];
-	uint32_t ref;
-	uint32_t available;
-	uint8_t user[4];
 };
 
+// the waiters for the lock sleep on the slot of their ticket, so that a handoff only
+// wakes the next one in line (and those whose ticket is DEVDB_LOCK_SLOT_NUM apart).
+
+struct devdb_shared_lock_slot
+{
+	union {
+		struct {
+			uint32_t seq;		// incremented by each wakeup of the slot
+			uint32_t waiting;	// number of waiters blocked on the slot
+		};
+		uint8_t line[DEVDB_CACHE_LINE_SIZE];
+	};
+};
+
+struct devdb_lock_stats
+{
+	uint32_t acquire;		// number of acquisitions
+	uint32_t contended;		// number of acquisitions that had to wait
+	uint32_t sleep;			// number of acquisitions which had to block
+	uint32_t wait_max;		// longest wait (microseconds)
+	uint64_t wait_total;	// total wait (microseconds)
+	uint32_t recover;		// number of times the lock was taken back from a dead process
+};
+
+// control block, shared by every process under a fixed name.
+// the device table lives in a separate mapping which is replaced by a larger one
+// (a new generation) when more slots, or larger owner tables, are needed. it holds the slots of all devices
+// followed by their names.
+
 struct devdb_shared_info
 {
-	uint32_t signature;
+	union {
+		struct {
+			uint32_t signature;
+			uint32_t version;
+			uint32_t generation;	// generation of the device table
+			uint32_t count;			// number of slots in the device table
+			uint32_t size;			// size of a slot
+			uint32_t owner_num;		// number of entries in the owner table of a slot
+			uint32_t owner_offset;	// offset of the owner table in a slot
+		};
+		uint8_t line0[DEVDB_CACHE_LINE_SIZE];
+	};
 
-	uint32_t lock;
-	uint32_t available;
-	uint32_t waiting;
+	union {
+		uint32_t lock;		// internal spin lock (pid of the holder)
+		uint8_t line1[DEVDB_CACHE_LINE_SIZE];
+	};
 
-	uint32_t count;
-	uint32_t size;
-	struct devdb_shared_devinfo dev[1];
-};
+	union {
+		uint32_t ticket;	// next ticket
+		uint8_t line2[DEVDB_CACHE_LINE_SIZE];
+	};
+
+	union {
+		struct {
+			uint32_t serving;	// ticket which owns the lock
+			uint32_t reserved;
+			// the ticket in the low half, the pid which claimed it in the high half. the
+			// ticket is serving if the owner has claimed the lock, serving - 1 otherwise.
+			// both are published by a single compare-and-swap, so that a claimed ticket
+			// always names its owner.
+			uint64_t claim;
+		};
+		uint8_t line3[DEVDB_CACHE_LINE_SIZE];
+	};
+
+	union {
+		struct {
+			uint32_t spin;		// adaptive spin count
+			uint32_t stall_ticket;
+			uint32_t stall_tick;
+		};
+		uint8_t line4[DEVDB_CACHE_LINE_SIZE];
+	};
 
-#pragma pack()
+	union {
+		struct devdb_lock_stats stats;
+		uint8_t line5[DEVDB_CACHE_LINE_SIZE];
+	};
+
+	struct devdb_shared_lock_slot slot[DEVDB_LOCK_SLOT_NUM];
+};
 
 typedef struct _devdb
 {
-	HANDLE ev;
+#ifdef _WIN32
+	HANDLE sem[DEVDB_LOCK_SLOT_NUM];
 	HANDLE shmem;
+#else
+	int fd;
+#endif
 	struct devdb_shared_info *info;
+#ifdef _WIN32
+	HANDLE table_shmem;
+#else
+	int table_fd;
+	uint32_t table_size;
+#endif
+	uint8_t *table;
+	uint32_t generation;
+	uint32_t count;
+	uint32_t size;			// size of a slot of the mapped generation
+	uint32_t owner_num;
 	wchar_t name[DEVDB_MAX_NAME_SIZE];
 	wchar_t id[DEVDB_MAX_ID_SIZE];
+	uint32_t sim_num;		// simulated devices added to the ones on the system
+	wchar_t sim_script[DEVDB_MAX_SCRIPT_SIZE + 1];
+#ifndef _WIN32
+	wchar_t *device;		// paths of the devices, each followed by a terminator, and a terminator after the last one
+#endif
 } devdb;
 
 typedef enum
@@ -56,14 +189,24 @@ typedef enum
 	DEVDB_E_INTERNAL_LIMIT,
 	DEVDB_E_NO_DEVICES,
 	DEVDB_E_DEVICE_NOT_FOUND,
+	DEVDB_E_ACCESS_DENIED,
 } devdb_status_t;
 
 typedef int(*devdb_enum_callback)(devdb *const db, const uint32_t id, const struct devdb_shared_devinfo *const devinfo, void *prm);
 
-extern devdb_status_t devdb_open(devdb *const db, const wchar_t *const name, const wchar_t *const id, const uint32_t user_size);
+extern devdb_status_t devdb_open(devdb *const db, const wchar_t *const name, const wchar_t *const id, const uint32_t user_size, const uint32_t capacity);
 extern devdb_status_t devdb_close(devdb *const db);
+extern devdb_status_t devdb_set_simulated(devdb *const db, const wchar_t *const script, const uint32_t num);
+#ifndef _WIN32
+extern devdb_status_t devdb_set_devices(devdb *const db, const wchar_t *const paths);
+extern void devdb_set_access(const uint32_t mode, const uint32_t group);
+extern uint32_t devdb_get_access_mode(void);
+extern void devdb_set_obj_access(const int fd);
+#endif
 extern void devdb_lock(devdb *const db);
+extern bool devdb_trylock(devdb *const db);
 extern void devdb_unlock(devdb *const db);
+extern void devdb_get_lock_stats(devdb *const db, struct devdb_lock_stats *const stats);
 extern devdb_status_t devdb_update_nolock(devdb *const db);
 extern devdb_status_t devdb_update(devdb *const db);
 extern devdb_status_t devdb_enum_nolock(devdb *const db, const devdb_enum_callback callback, void *prm);
@@ -80,5 +223,7 @@ extern devdb_status_t devdb_ref_nolock(devdb *const db, const uint32_t id, uint3
 extern devdb_status_t devdb_ref(devdb *const db, const uint32_t id, uint32_t *const ref);
 extern devdb_status_t devdb_unref_nolock(devdb *const db, const uint32_t id, uint32_t *const ref);
 extern devdb_status_t devdb_unref(devdb *const db, const uint32_t id, uint32_t *const ref);
+extern devdb_status_t devdb_get_count_nolock(devdb *const db, uint32_t *const count);
+extern devdb_status_t devdb_reclaim_nolock(devdb *const db, const uint32_t id, uint32_t *const reclaimed);
 
 #define devdb_v_name(devdb) ((devdb)->name)
@@ -2,11 +2,15 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include <windows.h>
 #include <ks.h>
 #include <ksmedia.h>
 #include <bdatypes.h>
 #include <bdamedia.h>
+#endif
 
 #define DEVDB_UNIQUE_NAME	L"itedev"
+#ifdef _WIN32
 #define DEVDB_DEVICE_CLASS	STATIC_KSCATEGORY_BDA_NETWORK_TUNER
+#endif
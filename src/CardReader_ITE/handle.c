@@ -3,14 +3,42 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
 
 #include "debug.h"
 #include "memory.h"
 #include "handle.h"
 
+// the list also builds outside of Windows so that it can be benchmarked there, as the allocator
+
+#ifdef _WIN32
+
+typedef CRITICAL_SECTION _handle_lock;
+
+#define _lock_init(l)		InitializeCriticalSection((l))
+#define _lock_deinit(l)		DeleteCriticalSection((l))
+#define _lock_acquire(l)	EnterCriticalSection((l))
+#define _lock_release(l)	LeaveCriticalSection((l))
+
+#else
+
+typedef pthread_mutex_t _handle_lock;
+
+#define _lock_init(l)		pthread_mutex_init((l), NULL)
+#define _lock_deinit(l)		pthread_mutex_destroy((l))
+#define _lock_acquire(l)	pthread_mutex_lock((l))
+#define _lock_release(l)	pthread_mutex_unlock((l))
+
+#endif
+
 struct handle_list_info {
-	CRITICAL_SECTION sct;
+	_handle_lock sct;
 	uintptr_t base;
 	uintptr_t num;
 	handle_release_callback callback;
@@ -30,7 +58,7 @@ bool handle_list_init(handle_list *const h, const uintptr_t base, const uintptr_
 		return false;
 	}
 
-	InitializeCriticalSection(&info->sct);
+	_lock_init(&info->sct);
 	info->base = base;
 	info->num = num;
 	info->callback = callback;
@@ -51,7 +79,7 @@ bool handle_list_deinit(handle_list h)
 		}
 	}
 
-	DeleteCriticalSection(&info->sct);
+	_lock_deinit(&info->sct);
 	memFree(info);
 
 	return true;
@@ -61,14 +89,14 @@ void handle_list_lock(handle_list h)
 {
 	struct handle_list_info *info = h;
 
-	EnterCriticalSection(&info->sct);
+	_lock_acquire(&info->sct);
 }
 
 void handle_list_unlock(handle_list h)
 {
 	struct handle_list_info *info = h;
 
-	LeaveCriticalSection(&info->sct);
+	_lock_release(&info->sct);
 }
 
 bool handle_list_put_nolock(handle_list h, void *const p, uintptr_t *const rv)
@@ -2,11 +2,28 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#ifdef _WIN32
 #include <windows.h>
 #include <ks.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
 
 #include "debug.h"
 #include "ite.h"
+#include "iterec.h"
+#include "itefault.h"
+#include "itesim.h"
+
+// outside of Windows, the devices are the simulated ones, the replayed recordings and
+// those of the registered transports
+
+#ifndef _WIN32
+static const struct ite_transport *_transport[ITE_MAX_TRANSPORT_NUM];
+static uint32_t _transport_num = 0;
+#endif
+
+#ifdef _WIN32
 
 static const GUID KSPROPSETID_IteStandard = { 0xc6efe5eb, 0x855a, 0x4f1b, { 0xb7, 0xaa, 0x87, 0xb5, 0xe1, 0xdc, 0x41, 0x13} };
 static const GUID KSPROPSETID_IteDeviceControl = { 0xf23fac2d, 0xe1af, 0x48e0, { 0x8b, 0xbe, 0xa1, 0x40, 0x29, 0xc9, 0x2f, 0x11 } };
@@ -89,15 +106,44 @@ static bool _is_supported(ite_dev *const dev, const GUID *const guid, uint32_t i
 	return r;
 }
 
+#endif
+
 bool ite_open(ite_dev *const dev, const wchar_t *const path)
 {
-	HANDLE device;
-
 	if (ite_close(dev) == false) {
 		internal_err("ite_open: ite_close failed");
 		return false;
 	}
 
+	if (iterec_replay_is_path(path) == true) {
+		dev->replay = iterec_replay_open(path);
+		if (dev->replay == NULL) {
+			internal_err("ite_open: iterec_replay_open failed");
+			return false;
+		}
+
+		dev->supported_private_ioctl = iterec_v_supported_private_ioctl(dev->replay);
+		return true;
+	}
+
+	if (dev->rec != NULL) {
+		dev->session = iterec_new_session();
+	}
+
+	if (itesim_is_path(path) == true) {
+		dev->sim = itesim_open(path);
+		if (dev->sim == NULL) {
+			internal_err("ite_open: itesim_open failed");
+			return false;
+		}
+
+		dev->supported_private_ioctl = itesim_v_supported_private_ioctl(dev->sim);
+		return true;
+	}
+
+#ifdef _WIN32
+	HANDLE device;
+
 	device = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
 	if (device == INVALID_HANDLE_VALUE) {
 		win32_err("ite_open: CreateFileW");
@@ -113,26 +159,74 @@ bool ite_open(ite_dev *const dev, const wchar_t *const path)
 	}
 
 	return true;
+#else
+	uint32_t num = __atomic_load_n(&_transport_num, __ATOMIC_ACQUIRE);
+
+	for (uint32_t i = 0; i < num; i++)
+	{
+		const struct ite_transport *t = _transport[i];
+		bool b = false;
+
+		if (t->is_path(path) == false)
+			continue;
+
+		dev->ctx = t->open(path, &b);
+		if (dev->ctx == NULL) {
+			internal_err("ite_open: open of the transport failed");
+			return false;
+		}
+
+		dev->transport = t;
+		dev->supported_private_ioctl = b;
+		return true;
+	}
+
+	internal_err("ite_open: no transport for the path");
+	return false;
+#endif
 }
 
 bool ite_close(ite_dev *const dev)
 {
+#ifdef _WIN32
 	if (dev->dev != INVALID_HANDLE_VALUE) {
 		CloseHandle(dev->dev);
 		dev->dev = INVALID_HANDLE_VALUE;
 	}
+#else
+	if (dev->transport != NULL) {
+		dev->transport->close(dev->ctx);
+		dev->transport = NULL;
+		dev->ctx = NULL;
+	}
+#endif
+
+	if (dev->sim != NULL) {
+		itesim_close(dev->sim);
+		dev->sim = NULL;
+	}
+
+	if (dev->replay != NULL) {
+		iterec_replay_close(dev->replay);
+		dev->replay = NULL;
+	}
 
 	dev->supported_private_ioctl = false;
 
 	return true;
 }
 
+#ifdef _WIN32
+
 bool ite_dev_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type type, const void *const in, const uint32_t in_size, const void *const out, const uint32_t out_size)
 {
 	KSPROPERTY prop;
 	ULONG rb = 0;
 	OVERLAPPED overlapped;
 
+	if (dev->sim != NULL)
+		return false;
+
 	prop.Set = KSPROPSETID_IteDeviceControl;
 	prop.Id = code;
 	prop.Flags = KSPROPERTY_TYPE_SET;
@@ -179,10 +273,10 @@ end:
 	return r;
 }
 
-bool ite_devctl(ite_dev *const dev, const ite_ioctl_type type, struct ite_devctl_data *const data)
+static bool _ite_devctl(ite_dev *const dev, const ite_ioctl_type type, struct ite_devctl_data *const data)
 {
-	if (dev == NULL || data == NULL)
-		return false;
+	if (dev->sim != NULL)
+		return itesim_devctl(dev->sim, type, data);
 
 	return ite_dev_ioctl(dev, 1, type, data, sizeof(struct ite_devctl_data), data, sizeof(struct ite_devctl_data));
 }
@@ -193,6 +287,9 @@ bool ite_sat_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type
 	ULONG rb = 0;
 	OVERLAPPED overlapped;
 
+	if (dev->sim != NULL)
+		return false;
+
 	prop.Set = KSPROPSETID_IteSatControl;
 	prop.Id = code;
 
@@ -230,12 +327,15 @@ bool ite_sat_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type
 	return r;
 }
 
-bool ite_private_ioctl(ite_dev *const dev, const ite_ioctl_type type, const uint32_t ioctl_code)
+static bool _ite_private_ioctl(ite_dev *const dev, const ite_ioctl_type type, const uint32_t ioctl_code)
 {
 	KSPROPERTY prop;
 	ULONG rb = 0;
 	OVERLAPPED overlapped;
 
+	if (dev->sim != NULL)
+		return itesim_private_ioctl(dev->sim, type, ioctl_code);
+
 	prop.Set = KSPROPSETID_ItePrivateControlForDigiBest;
 	prop.Id = 0;
 
@@ -263,3 +363,113 @@ bool ite_private_ioctl(ite_dev *const dev, const ite_ioctl_type type, const uint
 
 	return r;
 }
+
+#else
+
+// called while the library is being loaded, before any device is opened
+bool ite_register_transport(const struct ite_transport *const transport)
+{
+	uint32_t num = _transport_num;
+
+	if (num >= ITE_MAX_TRANSPORT_NUM) {
+		internal_err("ite_register_transport: too many transports");
+		return false;
+	}
+
+	// the slot is filled before it is counted
+	_transport[num] = transport;
+	__atomic_store_n(&_transport_num, num + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+bool ite_dev_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type type, const void *const in, const uint32_t in_size, const void *const out, const uint32_t out_size)
+{
+	return false;
+}
+
+static bool _ite_devctl(ite_dev *const dev, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	if (dev->sim != NULL)
+		return itesim_devctl(dev->sim, type, data);
+
+	if (dev->transport != NULL)
+		return dev->transport->devctl(dev->ctx, type, data);
+
+	return false;
+}
+
+bool ite_sat_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type type, const void *const data, const uint32_t data_size)
+{
+	return false;
+}
+
+static bool _ite_private_ioctl(ite_dev *const dev, const ite_ioctl_type type, const uint32_t ioctl_code)
+{
+	if (dev->sim != NULL)
+		return itesim_private_ioctl(dev->sim, type, ioctl_code);
+
+	if (dev->transport != NULL)
+		return dev->transport->private_ioctl(dev->ctx, type, ioctl_code);
+
+	return false;
+}
+
+#endif
+
+static bool _ite_devctl_rec(ite_dev *const dev, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	if (dev->replay != NULL)
+		return iterec_replay_devctl(dev->replay, type, data);
+
+	if (dev->rec != NULL) {
+		struct iterec_io io;
+		bool r;
+
+		iterec_devctl_begin(&io, type, data);
+		r = _ite_devctl(dev, type, data);
+		iterec_devctl_end(dev->rec, dev->session, &io, data, r);
+
+		return r;
+	}
+
+	return _ite_devctl(dev, type, data);
+}
+
+bool ite_devctl(ite_dev *const dev, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	uint32_t code;
+	bool r;
+
+	if (dev == NULL || data == NULL)
+		return false;
+
+	if (dev->fault == NULL)
+		return _ite_devctl_rec(dev, type, data);
+
+	if (itefault_devctl_begin(dev->fault, type, data, &r) == true)
+		return r;
+
+	code = data->code;
+	r = _ite_devctl_rec(dev, type, data);
+
+	return itefault_devctl_end(dev->fault, type, code, data, r);
+}
+
+bool ite_private_ioctl(ite_dev *const dev, const ite_ioctl_type type, const uint32_t ioctl_code)
+{
+	if (dev->replay != NULL)
+		return iterec_replay_private_ioctl(dev->replay, type, ioctl_code);
+
+	if (dev->rec != NULL) {
+		uint64_t start = iterec_get_time();
+		bool r;
+
+		r = _ite_private_ioctl(dev, type, ioctl_code);
+		iterec_private_ioctl(dev->rec, dev->session, type, ioctl_code, r, start);
+
+		return r;
+	}
+
+	return _ite_private_ioctl(dev, type, ioctl_code);
+}
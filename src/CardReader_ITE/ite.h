@@ -2,12 +2,27 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
+
+struct ite_transport;
 
 typedef struct _ite_dev {
+#ifdef _WIN32
 	HANDLE dev;
+#else
+	const struct ite_transport *transport;	// not NULL if the device is reached through a registered transport
+	void *ctx;				// of the transport
+#endif
+	struct _itesim *sim;	// not NULL if the device is simulated
 	bool supported_private_ioctl;
+	struct _iterec_replay *replay;	// not NULL if the device is replayed
+	struct _iterec *rec;	// the requests are recorded if not NULL, set before ite_open
+	uint32_t session;		// of the recording
+	struct _itefault *fault;	// faults are injected into the requests if not NULL, set before ite_open
 } ite_dev;
 
 #pragma pack(2)
@@ -177,6 +192,26 @@ typedef enum _ite_ioctl_type {
 	ITE_IOCTL_OUT,	// to device
 } ite_ioctl_type;
 
+#ifndef _WIN32
+
+#define ITE_MAX_TRANSPORT_NUM	4
+
+// outside of Windows, the devices other than the simulated and the replayed ones are
+// reached through the transports registered by the application (e.g. one over the
+// character device of a driver). the first transport which takes the path opens it.
+struct ite_transport
+{
+	bool (*is_path)(const wchar_t *const path);
+	void * (*open)(const wchar_t *const path, bool *const supported_private_ioctl);	// NULL on failure
+	void (*close)(void *ctx);
+	bool (*devctl)(void *ctx, const ite_ioctl_type type, struct ite_devctl_data *const data);
+	bool (*private_ioctl)(void *ctx, const ite_ioctl_type type, const uint32_t ioctl_code);
+};
+
+extern bool ite_register_transport(const struct ite_transport *const transport);
+
+#endif
+
 extern bool ite_open(ite_dev *const dev, const wchar_t *const path);
 extern bool ite_close(ite_dev *const dev);
 extern bool ite_dev_ioctl(ite_dev *const dev, const uint32_t code, const ite_ioctl_type type, const void *const in, const uint32_t in_size, const void *const out, const uint32_t out_size);
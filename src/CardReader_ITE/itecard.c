@@ -2,15 +2,69 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
 
 #include "debug.h"
 #include "memory.h"
 #include "itecard.h"
 #include "ite.h"
+#include "iterec.h"
+
+// the stack also builds outside of Windows, where a recording is replayed through it
+
+#ifdef _WIN32
+#define _sleep(milliseconds)	Sleep((milliseconds))
+#else
+#define _sleep(milliseconds)	usleep((milliseconds) * 1000)
+#endif
 
 #define micro2milli(microseconds) (((microseconds) / 1000) + 1)
 
+// an exchange run by the event loop gives its thread back instead of sleeping
+static void _itecard_wait(struct itecard_handle *const handle, const uint32_t milliseconds)
+{
+	if (handle->loop != NULL)
+		iteloop_sleep(handle->loop, milliseconds);
+	else
+		_sleep(milliseconds);
+}
+
+// forget the card, and the responses it gave
+static void _itecard_clear_reader(struct itecard_shared_readerinfo *const reader)
+{
+	card_clear(&reader->card);
+	reader->flight.valid = 0;
+
+	for (uint32_t i = 0; i < ITECARD_CACHE_ENTRY_NUM; i++)
+		reader->cache[i].send_len = 0;
+}
+
+#define _itecard_clear(handle)	_itecard_clear_reader((handle)->reader)
+
+// the private requests which switch the power of the card
+static bool _itecard_power(ite_dev *const ite, const bool on)
+{
+	bool r = true;
+
+	r &= ite_private_ioctl(ite, ITE_IOCTL_OUT, 1);
+	r &= ite_private_ioctl(ite, ITE_IOCTL_OUT, (on == true) ? 2 : 3);
+	r &= ite_private_ioctl(ite, ITE_IOCTL_OUT, 0);
+
+	return r;
+}
+
+// the calls are recorded after the requests they made
+#define _rec_start(handle)	(((handle)->ite.rec != NULL) ? iterec_get_time() : 0)
+#define _rec_call(handle, call, result, start, in, in_len, out, out_len) \
+	do { if ((handle)->ite.rec != NULL) iterec_call((handle)->ite.rec, (handle)->ite.session, (call), (result), (start), (in), (in_len), (out), (out_len)); } while (0)
+
 itecard_status_t itecard_open(struct itecard_handle *const handle, const wchar_t *const path, struct itecard_shared_readerinfo *const reader, const itecard_protocol_t protocol, const bool exclusive, const bool power_on)
 {
 	itecard_status_t r = ITECARD_E_INTERNAL;
@@ -18,6 +72,8 @@ itecard_status_t itecard_open(struct itecard_handle *const handle, const wchar_t
 	if (handle->init == true)
 		return ITECARD_S_OK;
 
+	uint64_t start = _rec_start(handle);
+
 	if (protocol != ITECARD_PROTOCOL_UNDEFINED)
 	{
 		if (reader->exclusive == 1) {
@@ -40,16 +96,24 @@ itecard_status_t itecard_open(struct itecard_handle *const handle, const wchar_t
 	if (power_on != false) {
 		if (ite_v_supported_private_ioctl(ite) == true) {
 			dbg("itecard_open: private ioctl is supported");
-			ite_private_ioctl(ite, ITE_IOCTL_OUT, 1);
-			ite_private_ioctl(ite, ITE_IOCTL_OUT, 2);
-			ite_private_ioctl(ite, ITE_IOCTL_OUT, 0);
-			dbg("itecard_open: power on");
+
+			if (reader->power != ITECARD_POWER_ON) {
+				reader->power = (_itecard_power(ite, true) == true) ? ITECARD_POWER_ON : ITECARD_POWER_UNKNOWN;
+				// a card which was not powered answers again after a reset
+				_itecard_clear_reader(reader);
+				dbg("itecard_open: power on");
+			}
 		}
 		else {
 			dbg("itecard_open: private ioctl is not supported");
 		}
 	}
 
+	// the card is kept powered for a handle on it
+	if (protocol != ITECARD_PROTOCOL_UNDEFINED) {
+		reader->power_off = 0;
+	}
+
 	if (exclusive == true) {
 		reader->exclusive = 1;
 	}
@@ -58,6 +122,12 @@ itecard_status_t itecard_open(struct itecard_handle *const handle, const wchar_t
 	handle->exclusive = exclusive;
 	handle->protocol = protocol;
 	handle->reader = reader;
+	handle->stats = NULL;
+	handle->trace = NULL;
+
+	if (ite->rec != NULL) {
+		iterec_call_open(ite->rec, ite->session, ITECARD_S_OK, start, (uint8_t)protocol, exclusive, power_on, path);
+	}
 
 	return ITECARD_S_OK;
 
@@ -72,17 +142,31 @@ itecard_status_t itecard_close(struct itecard_handle *const handle, const bool r
 	if (handle->init == false)
 		return ITECARD_S_OK;
 
-	if (noref == true)
+	uint64_t start = _rec_start(handle);
+
+	if (noref == true && handle->reader != NULL)
 	{
 		ite_dev *ite = &handle->ite;
+		struct itecard_shared_readerinfo *reader = handle->reader;
 
 		if (power_off != false) {
 			if (ite_v_supported_private_ioctl(ite) == true) {
 				dbg("itecard_close: private ioctl is supported");
-				ite_private_ioctl(ite, ITE_IOCTL_OUT, 1);
-				ite_private_ioctl(ite, ITE_IOCTL_OUT, 3);
-				ite_private_ioctl(ite, ITE_IOCTL_OUT, 0);
-				dbg("itecard_close: power off");
+
+				if (reader->power == ITECARD_POWER_OFF) {
+					reader->power_off = 0;
+				}
+				else if (handle->power_delay != 0 && reader->power == ITECARD_POWER_ON) {
+					// left to itecard_power_off_due, unless a handle comes before
+					reader->power_off = stats_get_time();
+					reader->power_delay = handle->power_delay;
+					dbg("itecard_close: power off deferred");
+				}
+				else {
+					reader->power = (_itecard_power(ite, false) == true) ? ITECARD_POWER_OFF : ITECARD_POWER_UNKNOWN;
+					reader->power_off = 0;
+					dbg("itecard_close: power off");
+				}
 			}
 			else {
 				dbg("itecard_close: private ioctl is not supported");
@@ -90,6 +174,12 @@ itecard_status_t itecard_close(struct itecard_handle *const handle, const bool r
 		}
 	}
 
+	if (handle->ite.rec != NULL) {
+		uint8_t in[3] = { reset, noref, power_off };
+
+		_rec_call(handle, ITEREC_CALL_CLOSE, ITECARD_S_OK, start, in, sizeof(in), NULL, 0);
+	}
+
 	ite_close(&handle->ite);
 
 	if (handle->reader != NULL)
@@ -100,7 +190,7 @@ itecard_status_t itecard_close(struct itecard_handle *const handle, const bool r
 
 		if (reset == true || handle->reader->reset == 1) {
 			if (noref == true) {
-				card_clear(&handle->reader->card);
+				_itecard_clear(handle);
 				handle->reader->reset = 0;
 			}
 			else {
@@ -116,17 +206,46 @@ itecard_status_t itecard_close(struct itecard_handle *const handle, const bool r
 	return ITECARD_S_OK;
 }
 
+bool itecard_power_off_due(const struct itecard_shared_readerinfo *const reader, const uint64_t now, uint32_t *const wait)
+{
+	if (reader->power_off == 0)
+		return false;
+
+	uint64_t elapsed = stats_get_us(reader->power_off, now) / 1000;
+
+	if (elapsed >= reader->power_delay)
+		return true;
+
+	if (wait != NULL)
+		*wait = reader->power_delay - (uint32_t)elapsed;
+
+	return false;
+}
+
+static bool _itecard_devctl(struct itecard_handle *const handle, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	trace_count(handle->trace, ioctl);
+
+	return ite_devctl(&handle->ite, type, data);
+}
+
 static itecard_status_t _itecard_detect(struct itecard_handle *const handle, bool *const b)
 {
 	struct ite_devctl_data d;
 
 	d.code = ITE_DEVCTL_CARD_DETECT;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_IN, &d) == false) {
+	stats_inc(handle->stats, detect);
+	trace_begin(handle->trace, TRACE_STAGE_DETECT);
+
+	if (_itecard_devctl(handle, ITE_IOCTL_IN, &d) == false) {
 		internal_err("_itecard_detect: ite_devctl failed");
+		trace_end(handle->trace, TRACE_STAGE_DETECT);
 		return ITECARD_E_FAILED;
 	}
 
+	trace_end(handle->trace, TRACE_STAGE_DETECT);
+
 	*b = (d.card_present == 0) ? false : true;
 
 	return ITECARD_S_OK;
@@ -138,7 +257,7 @@ static itecard_status_t _itecard_reset(struct itecard_handle *const handle)
 
 	d.code = ITE_DEVCTL_CARD_RESET;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_OUT, &d) == false) {
+	if (_itecard_devctl(handle, ITE_IOCTL_OUT, &d) == false) {
 		internal_err("_itecard_reset: ite_devctl failed");
 		return ITECARD_E_FAILED;
 	}
@@ -153,7 +272,7 @@ static itecard_status_t _itecard_set_baudrate(struct itecard_handle *const handl
 	d.code = ITE_DEVCTL_UART_SET_BAUDRATE;
 	d.uart_baudrate = baudrate;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_OUT, &d) == false) {
+	if (_itecard_devctl(handle, ITE_IOCTL_OUT, &d) == false) {
 		internal_err("_itecard_set_baudrate: ite_devctl failed");
 		return ITECARD_E_FAILED;
 	}
@@ -169,7 +288,7 @@ static itecard_status_t _itecard_send(struct itecard_handle *const handle, const
 	memcpy(d.uart_data.buffer, sendBuf, sendLen);
 	d.uart_data.length = sendLen;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_OUT, &d) == false) {
+	if (_itecard_devctl(handle, ITE_IOCTL_OUT, &d) == false) {
 		internal_err("_itecard_send: ite_devctl failed");
 		return ITECARD_E_FAILED;
 	}
@@ -183,7 +302,7 @@ static itecard_status_t _itecard_recv(struct itecard_handle *const handle, uint8
 
 	d.code = ITE_DEVCTL_UART_CHECK_READY;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_IN, &d) == false) {
+	if (_itecard_devctl(handle, ITE_IOCTL_IN, &d) == false) {
 		internal_err("_itecard_recv: ite_devctl failed 1");
 		return ITECARD_E_FAILED;
 	}
@@ -194,7 +313,7 @@ static itecard_status_t _itecard_recv(struct itecard_handle *const handle, uint8
 	d.code = ITE_DEVCTL_UART_RECV_DATA;
 	d.uart_data.length = *recvLen;
 
-	if (ite_devctl(&handle->ite, ITE_IOCTL_IN, &d) == false) {
+	if (_itecard_devctl(handle, ITE_IOCTL_IN, &d) == false) {
 		internal_err("_itecard_recv: ite_devctl failed 2");
 		return ITECARD_E_FAILED;
 	}
@@ -241,7 +360,7 @@ static itecard_status_t _itecard_get_atr(struct itecard_handle *const handle)
 			ct += st;
 		}
 
-		Sleep(st);
+		_itecard_wait(handle, st);
 	}
 
 	memcpy(card->atr, atr, atr_len);
@@ -255,6 +374,8 @@ static itecard_status_t _itecard_t1_transceive(struct itecard_handle *const hand
 	itecard_status_t ret;
 	struct card_info *card = &handle->reader->card;
 
+	trace_begin(handle->trace, TRACE_STAGE_SEND);
+
 	{
 		uint8_t pos = 0;
 
@@ -266,14 +387,19 @@ static itecard_status_t _itecard_t1_transceive(struct itecard_handle *const hand
 
 			ret = _itecard_send(handle, sendBuf + pos, send_len);
 			if (ret != ITECARD_S_OK) {
-				internal_err("_itecard_t1_transceive: _itecard_send failed");
+				dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transceive: _itecard_send failed");
+				trace_end(handle->trace, TRACE_STAGE_SEND);
 				return ret;
 			}
 			pos += send_len;
 		}
 	}
 
-	Sleep(micro2milli(card->T1.BGT));
+	trace_end(handle->trace, TRACE_STAGE_SEND);
+
+	trace_begin(handle->trace, TRACE_STAGE_BGT);
+	_itecard_wait(handle, micro2milli(card->T1.BGT));
+	trace_end(handle->trace, TRACE_STAGE_BGT);
 
 	uint32_t wt;	// time limit (in milliseconds)
 	uint32_t st;
@@ -285,6 +411,8 @@ static itecard_status_t _itecard_t1_transceive(struct itecard_handle *const hand
 	ct = 0;
 	cl = 0;
 
+	trace_begin(handle->trace, TRACE_STAGE_RECV);
+
 	while (ct <= wt)
 	{
 		uint8_t rl = ((*recvLen - cl) > 255) ? 255 : ((*recvLen - cl));
@@ -292,6 +420,8 @@ static itecard_status_t _itecard_t1_transceive(struct itecard_handle *const hand
 		if (rl == 0)
 			break;
 
+		trace_count(handle->trace, poll);
+
 		ret = _itecard_recv(handle, recvBuf + cl, &rl);
 		if (ret == ITECARD_S_OK) {
 			if (cl == 0) {
@@ -304,9 +434,11 @@ static itecard_status_t _itecard_t1_transceive(struct itecard_handle *const hand
 			ct += st;
 		}
 
-		Sleep(st);
+		_itecard_wait(handle, st);
 	}
 
+	trace_end(handle->trace, TRACE_STAGE_RECV);
+
 	*recvLen = cl;
 
 	return (cl == 0) ? ITECARD_E_NO_DATA : ITECARD_S_OK;
@@ -328,7 +460,7 @@ static itecard_status_t _itecard_t1_transmit(struct itecard_handle *const handle
 
 		r = card_T1MakeBlock(card, block, code, req, req_len & 0xff);
 		if (r == -1) {
-			internal_err("_itecard_t1_transmit: card_T1MakeBlock failed");
+			dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transmit: card_T1MakeBlock failed");
 			return ITECARD_E_INTERNAL;
 		}
 
@@ -352,14 +484,16 @@ static itecard_status_t _itecard_t1_transmit(struct itecard_handle *const handle
 			uint8_t res[254];
 			uint32_t res_len = 254;
 
+			trace_begin(handle->trace, TRACE_STAGE_IFSD);
 			ret = _itecard_t1_transmit(handle, 0xC1, &ifsd, sizeof(ifsd), res, &res_len);
+			trace_end(handle->trace, TRACE_STAGE_IFSD);
 			if (ret != ITECARD_S_OK) {
-				dbg("_itecard_t1_transmit: IFS request failed");
+				dbg_log(DBG_CAT_T1, DBG_LEVEL_INFO, "_itecard_t1_transmit: IFS request failed");
 				r = ret;
 				break;
 			}
 			else if (res[0] != 254) {
-				dbg("_itecard_t1_transmit: IFSD != 254");
+				dbg_log(DBG_CAT_T1, DBG_LEVEL_INFO, "_itecard_t1_transmit: IFSD != 254");
 				r = ITECARD_E_FAILED;
 				break;
 			}
@@ -401,18 +535,20 @@ static itecard_status_t _itecard_t1_transmit(struct itecard_handle *const handle
 				}
 				else {
 					// R-Block from card
-					dbg("_itecard_t1_transmit: R-Block");
+					dbg_log(DBG_CAT_T1, DBG_LEVEL_TRACE, "_itecard_t1_transmit: R-Block");
 					rblock = true;
 				}
 			}
 			else {
-				internal_err("_itecard_t1_transmit: block error");
+				dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transmit: block error");
 			}
 
 			retry_count++;
+			stats_inc(handle->stats, retry);
+			trace_count(handle->trace, retry);
 
 			if (retry_count > 3) {
-				internal_err("_itecard_t1_transmit: retry_count >= 3");
+				dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transmit: retry_count >= 3");
 				r = ITECARD_E_COMM_FAILED;
 				break;
 			}
@@ -423,9 +559,13 @@ static itecard_status_t _itecard_t1_transmit(struct itecard_handle *const handle
 				uint8_t res[254];
 				uint32_t res_len = 254;
 
+				stats_inc(handle->stats, resynch);
+
+				trace_begin(handle->trace, TRACE_STAGE_RESYNCH);
 				ret = _itecard_t1_transmit(handle, 0xC0, NULL, 0, res, &res_len);
+				trace_end(handle->trace, TRACE_STAGE_RESYNCH);
 				if (ret != ITECARD_S_OK) {
-					dbg("_itecard_t1_transmit: RESYNCH request failed");
+					dbg_log(DBG_CAT_T1, DBG_LEVEL_INFO, "_itecard_t1_transmit: RESYNCH request failed");
 					r = ret;
 					break;
 				}
@@ -449,12 +589,12 @@ static itecard_status_t _itecard_t1_transmit(struct itecard_handle *const handle
 			continue;
 		}
 		else if (ret == ITECARD_E_NO_DATA) {
-			internal_err("_itecard_t1_transmit: no data");
+			dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transmit: no data");
 			r = ITECARD_E_COMM_FAILED;
 			break;
 		}
 		else {
-			internal_err("_itecard_t1_transmit: _itecard_t1_transceive failed");
+			dbg_log(DBG_CAT_T1, DBG_LEVEL_ERROR, "_itecard_t1_transmit: _itecard_t1_transceive failed");
 			r = ret;
 			break;
 		}
@@ -473,13 +613,13 @@ static itecard_status_t _itecard_init(struct itecard_handle *const handle, const
 	ret = _itecard_detect(handle, &b);
 	if (ret != ITECARD_S_OK) {
 		internal_err("_itecard_init: _itecard_detect failed");
-		card_clear(card);
+		_itecard_clear(handle);
 		return ret;
 	}
 
 	if (b == false) {
 		internal_err("_itecard_init: card not found");
-		card_clear(card);
+		_itecard_clear(handle);
 		return ITECARD_E_NO_CARD;
 	}
 
@@ -487,16 +627,22 @@ static itecard_status_t _itecard_init(struct itecard_handle *const handle, const
 		return ITECARD_S_FALSE;
 	}
 
-	card_clear(card);
+	_itecard_clear(handle);
+
+	uint64_t start = stats_get_time();
+
+	stats_inc(handle->stats, card_init);
+	trace_begin(handle->trace, TRACE_STAGE_INIT);
 
 	// reset
 	ret = _itecard_reset(handle);
 	if (ret != ITECARD_S_OK) {
 		internal_err("_itecard_init: _itecard_reset failed");
+		trace_end(handle->trace, TRACE_STAGE_INIT);
 		return ret;
 	}
 
-	Sleep(10);
+	_itecard_wait(handle, 10);
 
 	int i = 3;
 
@@ -513,7 +659,7 @@ static itecard_status_t _itecard_init(struct itecard_handle *const handle, const
 
 		if (card->atr_len == 0) {
 			internal_err("_itecard_init: unresponsive card (%d)", i);
-			card_clear(card);
+			_itecard_clear(handle);
 			ret = ITECARD_E_UNRESPONSIVE_CARD;
 			continue;
 		}
@@ -521,7 +667,7 @@ static itecard_status_t _itecard_init(struct itecard_handle *const handle, const
 		// parse atr
 		if (card_parseATR(card) == false) {
 			internal_err("_itecard_init: unsupported card (%d)", i);
-			card_clear(card);
+			_itecard_clear(handle);
 			ret = ITECARD_E_UNSUPPORTED_CARD;
 			continue;
 		}
@@ -529,48 +675,189 @@ static itecard_status_t _itecard_init(struct itecard_handle *const handle, const
 		break;
 	} while (--i);
 
-	if (!i)
+	if (!i) {
+		trace_end(handle->trace, TRACE_STAGE_INIT);
 		return ret;
+	}
 
 	// set baudrate
 	ret = _itecard_set_baudrate(handle, 19200);
 	if (ret != ITECARD_S_OK) {
 		internal_err("_itecard_init: _itecard_set_baudrate failed");
-		card_clear(card);
+		_itecard_clear(handle);
+		trace_end(handle->trace, TRACE_STAGE_INIT);
 		return ret;
 	}
 
+	stats_record(handle->stats, STATS_HIST_CARD_INIT, start);
+	trace_end(handle->trace, TRACE_STAGE_INIT);
+
 	return ITECARD_S_OK;
 }
 
 itecard_status_t itecard_detect(struct itecard_handle *const handle, bool *const b)
 {
-	return _itecard_detect(handle, b);
+	itecard_status_t ret;
+	uint64_t start = _rec_start(handle);
+
+	ret = _itecard_detect(handle, b);
+
+	if (handle->ite.rec != NULL) {
+		uint8_t out = (ret == ITECARD_S_OK && *b == true) ? 1 : 0;
+
+		_rec_call(handle, ITEREC_CALL_DETECT, ret, start, NULL, 0, &out, sizeof(out));
+	}
+
+	return ret;
 }
 
 // init card
 itecard_status_t itecard_init(struct itecard_handle *const handle)
 {
-	return _itecard_init(handle, false);
+	itecard_status_t ret;
+	uint64_t start = _rec_start(handle);
+
+	ret = _itecard_init(handle, false);
+	_rec_call(handle, ITEREC_CALL_INIT, ret, start, NULL, 0, NULL, 0);
+
+	return ret;
+}
+
+// answers the command from the cache, if it was answered less than ttl milliseconds ago
+static bool _itecard_cache_get(struct itecard_handle *const handle, const uint8_t *const sendBuf, const uint32_t sendLen, uint8_t *const recvBuf, uint32_t *const recvLen)
+{
+	uint64_t now = stats_get_time();
+
+	if (handle->ttl == 0)
+		return false;
+
+	for (uint32_t i = 0; i < ITECARD_CACHE_ENTRY_NUM; i++)
+	{
+		struct itecard_shared_cache_entry *entry = &handle->reader->cache[i];
+
+		if (entry->send_len != sendLen || memcmp(entry->send, sendBuf, sendLen) != 0)
+			continue;
+
+		if (stats_get_us(entry->time, now) >= (uint64_t)handle->ttl * 1000 || entry->recv_len > *recvLen)
+			break;
+
+		memcpy(recvBuf, entry->recv, entry->recv_len);
+		*recvLen = entry->recv_len;
+
+		stats_inc64(handle->stats, cache_hit);
+
+		return true;
+	}
+
+	stats_inc64(handle->stats, cache_miss);
+
+	return false;
+}
+
+// keeps the response in the entry of the command, or in the oldest one
+static void _itecard_cache_put(struct itecard_handle *const handle, const uint8_t *const sendBuf, const uint32_t sendLen, const uint8_t *const recvBuf, const uint32_t recvLen)
+{
+	struct itecard_shared_cache_entry *entry = NULL;
+
+	if (handle->ttl == 0 || sendLen == 0 || sendLen > ITECARD_FLIGHT_MAX_SIZE || recvLen > ITECARD_FLIGHT_MAX_SIZE)
+		return;
+
+	// only the normal completions (SW1 SW2: 90 00)
+	if (recvLen < 2 || recvBuf[recvLen - 2] != 0x90 || recvBuf[recvLen - 1] != 0x00)
+		return;
+
+	for (uint32_t i = 0; i < ITECARD_CACHE_ENTRY_NUM; i++)
+	{
+		struct itecard_shared_cache_entry *e = &handle->reader->cache[i];
+
+		if (e->send_len == sendLen && memcmp(e->send, sendBuf, sendLen) == 0) {
+			entry = e;
+			break;
+		}
+
+		if (entry == NULL || e->send_len == 0 || (entry->send_len != 0 && e->time < entry->time))
+			entry = e;
+	}
+
+	memcpy(entry->send, sendBuf, sendLen);
+	memcpy(entry->recv, recvBuf, recvLen);
+	entry->send_len = sendLen;
+	entry->recv_len = recvLen;
+	entry->time = stats_get_time();
+}
+
+// takes the response of the last exchange, if it was the same command and the caller
+// was already waiting for the device when it completed
+static bool _itecard_coalesce(struct itecard_handle *const handle, const uint8_t *const sendBuf, const uint32_t sendLen, uint8_t *const recvBuf, uint32_t *const recvLen)
+{
+	struct itecard_shared_flight *flight = &handle->reader->flight;
+
+	if (handle->since == 0 || flight->valid == 0 || flight->end < handle->since)
+		return false;
+
+	if (flight->send_len != sendLen || flight->recv_len > *recvLen || memcmp(flight->send, sendBuf, sendLen) != 0)
+		return false;
+
+	memcpy(recvBuf, flight->recv, flight->recv_len);
+	*recvLen = flight->recv_len;
+
+	stats_inc64(handle->stats, coalesced);
+	stats_add64(handle->stats, coalesced_us, flight->duration);
+
+	return true;
+}
+
+static void _itecard_flight(struct itecard_handle *const handle, const uint8_t *const sendBuf, const uint32_t sendLen, const uint8_t *const recvBuf, const uint32_t recvLen, const uint64_t start)
+{
+	struct itecard_shared_flight *flight = &handle->reader->flight;
+
+	if (handle->since == 0 || sendLen > ITECARD_FLIGHT_MAX_SIZE || recvLen > ITECARD_FLIGHT_MAX_SIZE) {
+		flight->valid = 0;
+		return;
+	}
+
+	memcpy(flight->send, sendBuf, sendLen);
+	memcpy(flight->recv, recvBuf, recvLen);
+	flight->send_len = sendLen;
+	flight->recv_len = recvLen;
+	flight->end = stats_get_time();
+	flight->duration = (uint32_t)stats_get_us(start, flight->end);
+	flight->valid = 1;
 }
 
 itecard_status_t itecard_transmit(struct itecard_handle *const handle, const itecard_protocol_t protocol, const uint8_t *const sendBuf, const uint32_t sendLen, uint8_t *const recvBuf, uint32_t *const recvLen)
 {
 	itecard_status_t ret;
+	uint64_t start = stats_get_time(), exchange;
+	uint64_t rec_start = _rec_start(handle);
+	uint32_t recv_size = *recvLen;
+
+	stats_inc64(handle->stats, apdu);
+	stats_add64(handle->stats, bytes_sent, sendLen);
 
 	ret = _itecard_init(handle, false);
 	if (ret != ITECARD_S_OK && ret != ITECARD_S_FALSE) {
 		internal_err("itecard_transmit: _itecard_init failed 1");
-		return ret;
+		stats_inc(handle->stats, error);
+		goto end;
 	}
 
+	// a call answered without the card is not recorded, since it makes no request to be replayed
+	if (_itecard_cache_get(handle, sendBuf, sendLen, recvBuf, recvLen) == true || _itecard_coalesce(handle, sendBuf, sendLen, recvBuf, recvLen) == true)
+		return ITECARD_S_OK;
+
+	exchange = stats_get_time();
+
 	switch (protocol)
 	{
 	case ITECARD_PROTOCOL_T1:
 		ret = _itecard_t1_transmit(handle, 0x00, sendBuf, sendLen, recvBuf, recvLen);
 		if (ret == ITECARD_E_COMM_FAILED)
 		{
+			stats_inc(handle->stats, reinit);
+			trace_begin(handle->trace, TRACE_STAGE_REINIT);
 			ret = _itecard_init(handle, true);
+			trace_end(handle->trace, TRACE_STAGE_REINIT);
 			if (ret != ITECARD_S_OK) {
 				internal_err("itecard_transmit: _itecard_init failed 2");
 				break;
@@ -589,7 +876,30 @@ itecard_status_t itecard_transmit(struct itecard_handle *const handle, const ite
 		ret = ITECARD_E_UNSUPPORTED;
 	}
 
-	dbg("itecard_transmit: ret: %d", ret);
+	dbg_trace("itecard_transmit: ret: %d", ret);
+
+	if (ret == ITECARD_S_OK) {
+		stats_add64(handle->stats, bytes_recv, *recvLen);
+		_itecard_flight(handle, sendBuf, sendLen, recvBuf, *recvLen, exchange);
+		_itecard_cache_put(handle, sendBuf, sendLen, recvBuf, *recvLen);
+		stats_update_latency(handle->stats, exchange);
+	}
+	else {
+		stats_inc(handle->stats, error);
+		handle->reader->flight.valid = 0;
+	}
+
+	stats_record(handle->stats, STATS_HIST_TRANSMIT, start);
+
+end:
+	if (handle->ite.rec != NULL && sendLen < ITEREC_MAX_DATA_SIZE / 2) {
+		uint8_t in[5 + (ITEREC_MAX_DATA_SIZE / 2)];
+
+		in[0] = (uint8_t)protocol;
+		memcpy(in + 1, &recv_size, 4);
+		memcpy(in + 5, sendBuf, sendLen);
+		_rec_call(handle, ITEREC_CALL_TRANSMIT, ret, rec_start, in, 5 + sendLen, recvBuf, (ret == ITECARD_S_OK) ? *recvLen : 0);
+	}
 
 	return ret;
 }
\ No newline at end of file
@@ -7,6 +7,9 @@
 
 #include "card.h"
 #include "ite.h"
+#include "iteloop.h"
+#include "stats.h"
+#include "trace.h"
 
 typedef enum _itecard_protocol_t
 {
@@ -15,15 +18,59 @@ typedef enum _itecard_protocol_t
 	ITECARD_PROTOCOL_T1 = 2
 } itecard_protocol_t;
 
+typedef enum _itecard_power_t
+{
+	ITECARD_POWER_UNKNOWN = 0,	// not set since the device appeared, or the request failed
+	ITECARD_POWER_ON,
+	ITECARD_POWER_OFF
+} itecard_power_t;
+
+#define ITECARD_FLIGHT_MAX_SIZE	256
+#define ITECARD_CACHE_ENTRY_NUM	8
+
 // shared data
 
 #pragma pack(4)
 
+// the last exchange with the card. the exchanges of a device are serialized by its
+// lock, so a request which was waiting for the lock while an identical command was
+// being exchanged takes the response of that exchange instead of repeating it.
+struct itecard_shared_flight
+{
+	uint32_t valid;
+	uint32_t send_len;
+	uint32_t recv_len;
+	uint32_t duration;		// microseconds the card took
+	uint64_t end;			// stats_get_time when the response was received
+	uint8_t send[ITECARD_FLIGHT_MAX_SIZE];
+	uint8_t recv[ITECARD_FLIGHT_MAX_SIZE];
+};
+
+// a response kept for the commands which are answered the same while the card is not
+// reset. it is only used for as long as the caller allows, and the entries are
+// cleared together with the card, so that they always belong to its current ATR.
+struct itecard_shared_cache_entry
+{
+	uint32_t send_len;		// 0 if the entry is empty
+	uint32_t recv_len;
+	uint64_t time;			// stats_get_time when the response was received
+	uint8_t send[ITECARD_FLIGHT_MAX_SIZE];
+	uint8_t recv[ITECARD_FLIGHT_MAX_SIZE];
+};
+
+// the power of the card is that which the last process set, and is only set again
+// when it changes. the last close may leave the card powered for a while, so that a
+// handle which comes soon after finds it with its ATR.
 struct itecard_shared_readerinfo
 {
 	uint32_t exclusive;
 	uint32_t reset;
+	uint32_t power;			// itecard_power_t
+	uint32_t power_delay;	// milliseconds the power-off is deferred for
+	uint64_t power_off;		// stats_get_time of the close which deferred the power-off, 0 if none did
 	struct card_info card;
+	struct itecard_shared_flight flight;
+	struct itecard_shared_cache_entry cache[ITECARD_CACHE_ENTRY_NUM];
 };
 
 #pragma pack()
@@ -36,6 +83,12 @@ struct itecard_handle
 	bool exclusive;
 	itecard_protocol_t protocol;
 	struct itecard_shared_readerinfo *reader;
+	struct stats_shared_reader *stats;	// may be NULL
+	struct trace_tx *trace;				// the transaction being traced, may be NULL
+	iteloop *loop;						// the loop running the exchange, NULL on the thread of the caller
+	uint64_t since;						// the command may take the response of an identical exchange completed after this time (stats_get_time), 0 if it may not
+	uint32_t ttl;						// milliseconds the response of the command may be cached for, 0 if it may not
+	uint32_t power_delay;				// milliseconds the power-off by the last close is deferred for, 0 if it is not
 	ite_dev ite;
 };
 
@@ -69,4 +122,8 @@ extern itecard_status_t itecard_open(struct itecard_handle *const handle, const
 extern itecard_status_t itecard_close(struct itecard_handle *const handle, const bool reset, const bool noref, const bool power_off);
 extern itecard_status_t itecard_detect(struct itecard_handle *const handle, bool *const b);
 extern itecard_status_t itecard_init(struct itecard_handle *const handle);
+// whether the power-off deferred by the last close is due, or else the milliseconds
+// until it is, in wait, if one is deferred. it is done by closing a handle with noref,
+// power_off and no power_delay.
+extern bool itecard_power_off_due(const struct itecard_shared_readerinfo *const reader, const uint64_t now, uint32_t *const wait);
 extern itecard_status_t itecard_transmit(struct itecard_handle *const handle, const itecard_protocol_t protocol, const uint8_t *const sendBuf, const uint32_t sendLen, uint8_t *const recvBuf, uint32_t *const recvLen);
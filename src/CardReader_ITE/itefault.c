@@ -0,0 +1,193 @@
+// itefault.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
+
+#include "debug.h"
+#include "itefault.h"
+
+// the faults also build outside of Windows, with the rest of the stack
+
+const char * const itefault_class_name[ITEFAULT_CLASS_NUM] = {
+	"drop",
+	"edc",
+	"short",
+	"ioctl",
+	"removal",
+	"mute",
+};
+
+static uint64_t _itefault_get_time(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER t;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+
+	QueryPerformanceCounter(&t);
+	return (uint64_t)((t.QuadPart / freq.QuadPart) * 1000000 + ((t.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+// xorshift32
+static uint32_t _itefault_rand(itefault *const fault)
+{
+	uint32_t x = fault->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fault->rand = x;
+
+	return x;
+}
+
+// whether to inject a fault of the class into this request
+static bool _itefault_hit(itefault *const fault, const itefault_class_t cls)
+{
+	if (fault->pending == true || fault->config.probability[cls] == 0)
+		return false;
+
+	if ((_itefault_rand(fault) % ITEFAULT_PROBABILITY_SCALE) >= fault->config.probability[cls])
+		return false;
+
+	dbg("_itefault_hit: %s", itefault_class_name[cls]);
+
+	fault->pending = true;
+	fault->cls = cls;
+	fault->time = _itefault_get_time();
+	fault->until = 0;
+	fault->failed = 0;
+	fault->injected[cls]++;
+
+	return true;
+}
+
+void itefault_init(itefault *const fault, const struct itefault_config *const config)
+{
+	memset(fault, 0, sizeof(itefault));
+	memcpy(&fault->config, config, sizeof(struct itefault_config));
+
+	fault->rand = (config->seed != 0) ? config->seed : 1;
+}
+
+// returns true if the request is answered by the fault, with the result in result.
+// the other requests are made to the transport, then passed to itefault_devctl_end.
+bool itefault_devctl_begin(itefault *const fault, const ite_ioctl_type type, struct ite_devctl_data *const data, bool *const result)
+{
+	if (fault->until != 0)
+	{
+		if (_itefault_get_time() < fault->until)
+		{
+			bool removed = (fault->cls == ITEFAULT_REMOVAL) ? true : false;
+
+			*result = true;
+
+			switch (data->code)
+			{
+			case ITE_DEVCTL_CARD_DETECT:
+				if (removed == false)
+					return false;
+				data->card_present = 0;
+				return true;
+
+			case ITE_DEVCTL_UART_SEND_DATA:
+				// a mute card still takes the data
+				return removed;
+
+			case ITE_DEVCTL_UART_CHECK_READY:
+				data->uart_ready = 0;
+				return true;
+
+			case ITE_DEVCTL_UART_RECV_DATA:
+				data->uart_data.length = 0;
+				return true;
+
+			default:
+				return removed;
+			}
+		}
+
+		fault->until = 0;
+	}
+
+	if (_itefault_hit(fault, ITEFAULT_IOCTL) == true) {
+		*result = false;
+		return true;
+	}
+
+	if (data->code == ITE_DEVCTL_UART_SEND_DATA)
+	{
+		if (_itefault_hit(fault, ITEFAULT_REMOVAL) == true) {
+			fault->until = fault->time + ((uint64_t)fault->config.removal_time * 1000);
+			*result = true;
+			return true;
+		}
+
+		if (_itefault_hit(fault, ITEFAULT_MUTE) == true) {
+			fault->until = fault->time + ((uint64_t)fault->config.mute_time * 1000);
+		}
+	}
+
+	return false;
+}
+
+// code is the one of the request, which the result may have overwritten
+bool itefault_devctl_end(itefault *const fault, const ite_ioctl_type type, const uint32_t code, struct ite_devctl_data *const data, const bool result)
+{
+	if (result == false || code != ITE_DEVCTL_UART_RECV_DATA || data->uart_data.length == 0)
+		return result;
+
+	uint8_t len = data->uart_data.length;
+	uint8_t pos = (uint8_t)(_itefault_rand(fault) % len);
+
+	if (_itefault_hit(fault, ITEFAULT_DROP) == true) {
+		memmove(data->uart_data.buffer + pos, data->uart_data.buffer + pos + 1, len - pos - 1);
+		data->uart_data.length--;
+	}
+	else if (_itefault_hit(fault, ITEFAULT_EDC) == true) {
+		data->uart_data.buffer[pos] ^= (uint8_t)(1 << (_itefault_rand(fault) % 8));
+	}
+	else if (_itefault_hit(fault, ITEFAULT_SHORT) == true) {
+		data->uart_data.length = pos;
+	}
+
+	return result;
+}
+
+// called by the caller after every transmit. returns true when the transmit ends the
+// recovery from the pending fault, which is described in recovery.
+bool itefault_tx_end(itefault *const fault, const bool ok, struct itefault_recovery *const recovery)
+{
+	if (fault->pending == false)
+		return false;
+
+	if (ok == false) {
+		fault->failed++;
+		return false;
+	}
+
+	recovery->cls = fault->cls;
+	recovery->failed = fault->failed;
+	recovery->time = _itefault_get_time() - fault->time;
+
+	fault->pending = false;
+
+	return true;
+}
@@ -0,0 +1,61 @@
+// itefault.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ite.h"
+
+// a layer between itecard.c and the transport which injects faults into the device
+// control requests, to measure how the T=1 error paths recover from them.
+//
+// the faults are injected one at a time: no fault is injected until the caller has
+// recovered from the last one, that is, until one of its transmits has succeeded.
+
+#define ITEFAULT_PROBABILITY_SCALE	1000000		// the probabilities are per million
+
+typedef enum _itefault_class_t
+{
+	ITEFAULT_DROP = 0,		// a byte of the received data is lost
+	ITEFAULT_EDC,			// a bit of the received data is flipped
+	ITEFAULT_SHORT,			// the rest of the received data is lost
+	ITEFAULT_IOCTL,			// a device control request fails
+	ITEFAULT_REMOVAL,		// the card is removed, and inserted again after removal_time
+	ITEFAULT_MUTE,			// the card stops answering for mute_time
+	ITEFAULT_CLASS_NUM
+} itefault_class_t;
+
+struct itefault_config
+{
+	uint32_t probability[ITEFAULT_CLASS_NUM];	// for each request the fault can be injected into
+	uint32_t removal_time;	// milliseconds
+	uint32_t mute_time;		// milliseconds
+	uint32_t seed;
+};
+
+typedef struct _itefault
+{
+	struct itefault_config config;
+	uint32_t rand;
+	bool pending;			// injected, and not recovered from yet
+	itefault_class_t cls;	// of the pending fault
+	uint64_t time;			// microseconds, when the pending fault was injected
+	uint64_t until;			// microseconds, when the removal or the mute ends
+	uint32_t failed;		// transmits which failed since the pending fault
+	uint64_t injected[ITEFAULT_CLASS_NUM];
+} itefault;
+
+struct itefault_recovery
+{
+	itefault_class_t cls;
+	uint32_t failed;		// transmits which failed before one succeeded, 0 if the transmit the fault hit succeeded
+	uint64_t time;			// microseconds from the fault to the end of the transmit which succeeded
+};
+
+extern const char * const itefault_class_name[ITEFAULT_CLASS_NUM];
+
+extern void itefault_init(itefault *const fault, const struct itefault_config *const config);
+extern bool itefault_devctl_begin(itefault *const fault, const ite_ioctl_type type, struct ite_devctl_data *const data, bool *const result);
+extern bool itefault_devctl_end(itefault *const fault, const ite_ioctl_type type, const uint32_t code, struct ite_devctl_data *const data, const bool result);
+extern bool itefault_tx_end(itefault *const fault, const bool ok, struct itefault_recovery *const recovery);
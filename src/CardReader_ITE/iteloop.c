@@ -0,0 +1,628 @@
+// iteloop.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
+
+#include "debug.h"
+#include "memory.h"
+#include "iteloop.h"
+
+// everything but the submission stack, the pending count and the wake flag is only
+// touched by the thread of the loop.
+
+#ifdef _WIN32
+
+#define _atomic_load(v)			(*(volatile uint32_t *)&(v))
+#define _atomic_store(v, x)		InterlockedExchange((volatile LONG *)&(v), (LONG)(x))
+#define _atomic_add(v, x)		(InterlockedExchangeAdd((volatile LONG *)&(v), (LONG)(x)) + (LONG)(x))
+#define _atomic_cas_ptr(v, x, c)	(InterlockedCompareExchangePointer((PVOID volatile *)&(v), (x), (c)) == (c))
+#define _atomic_xchg_ptr(v, x)	InterlockedExchangePointer((PVOID volatile *)&(v), (x))
+
+#define _INFINITE	INFINITE
+
+static uint64_t _iteloop_get_tick(iteloop *const loop)
+{
+	LARGE_INTEGER t;
+
+	QueryPerformanceCounter(&t);
+	return (uint64_t)((t.QuadPart / loop->freq) * 1000 + ((t.QuadPart % loop->freq) * 1000) / loop->freq);
+}
+
+static uint32_t _iteloop_wake_token(iteloop *const loop)
+{
+	return 0;
+}
+
+static void _iteloop_wait(iteloop *const loop, const uint32_t token, const uint32_t timeout)
+{
+	WaitForSingleObject(loop->wake, timeout);
+}
+
+static void _iteloop_notify(iteloop *const loop)
+{
+	SetEvent(loop->wake);
+}
+
+static void _iteloop_complete(struct iteloop_request *const req)
+{
+	// the request belongs to the caller again once the event is set
+	SetEvent(req->done);
+}
+
+static void _iteloop_wait_done(struct iteloop_request *const req)
+{
+	WaitForSingleObject(req->done, INFINITE);
+}
+
+static void WINAPI _iteloop_channel_proc(LPVOID param);
+
+static bool _iteloop_channel_init(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	ch->fiber = CreateFiber(ITELOOP_STACK_SIZE, _iteloop_channel_proc, loop);
+	if (ch->fiber == NULL) {
+		internal_err("_iteloop_channel_init: CreateFiber failed");
+		return false;
+	}
+
+	return true;
+}
+
+static void _iteloop_channel_deinit(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	DeleteFiber(ch->fiber);
+	ch->fiber = NULL;
+}
+
+static void _iteloop_switch_to_channel(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	SwitchToFiber(ch->fiber);
+}
+
+static void _iteloop_switch_to_loop(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	SwitchToFiber(loop->fiber);
+}
+
+#else
+
+#define _atomic_load(v)			__atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define _atomic_store(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#define _atomic_add(v, x)		__atomic_add_fetch(&(v), (x), __ATOMIC_SEQ_CST)
+#define _atomic_cas_ptr(v, x, c)	__sync_bool_compare_and_swap(&(v), (c), (x))
+#define _atomic_xchg_ptr(v, x)	__atomic_exchange_n(&(v), (x), __ATOMIC_SEQ_CST)
+
+#define _INFINITE	UINT32_MAX
+
+static uint64_t _iteloop_get_tick(iteloop *const loop)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void _iteloop_futex_wait(volatile uint32_t *const addr, const uint32_t val, const uint32_t timeout)
+{
+	struct timespec ts;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, (timeout == _INFINITE) ? NULL : &ts, NULL, 0);
+}
+
+static void _iteloop_futex_wake(volatile uint32_t *const addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// taken before the submission stack is, so that a later push changes it
+static uint32_t _iteloop_wake_token(iteloop *const loop)
+{
+	return _atomic_load(loop->wake);
+}
+
+static void _iteloop_wait(iteloop *const loop, const uint32_t token, const uint32_t timeout)
+{
+	_iteloop_futex_wait(&loop->wake, token, timeout);
+}
+
+static void _iteloop_notify(iteloop *const loop)
+{
+	(void)_atomic_add(loop->wake, 1);
+	_iteloop_futex_wake(&loop->wake);
+}
+
+static void _iteloop_complete(struct iteloop_request *const req)
+{
+	// the request belongs to the caller again once the flag is set. the wake only
+	// uses the address, which is harmless if the caller has already returned.
+	_atomic_store(req->done, 1);
+	_iteloop_futex_wake(&req->done);
+}
+
+static void _iteloop_wait_done(struct iteloop_request *const req)
+{
+	while (_atomic_load(req->done) == 0)
+		_iteloop_futex_wait(&req->done, 0, _INFINITE);
+}
+
+static void _iteloop_channel_proc(iteloop *const loop);
+
+// makecontext only passes int arguments
+static void _iteloop_channel_entry(const unsigned int hi, const unsigned int lo)
+{
+	_iteloop_channel_proc((iteloop *)(((uintptr_t)hi << 16 << 16) | (uintptr_t)lo));
+}
+
+static bool _iteloop_channel_init(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	uintptr_t p = (uintptr_t)loop;
+
+	ch->stack = memAlloc(ITELOOP_STACK_SIZE);
+	if (ch->stack == NULL) {
+		internal_err("_iteloop_channel_init: memAlloc failed");
+		return false;
+	}
+
+	getcontext(&ch->context);
+	ch->context.uc_stack.ss_sp = ch->stack;
+	ch->context.uc_stack.ss_size = ITELOOP_STACK_SIZE;
+	ch->context.uc_link = NULL;
+	makecontext(&ch->context, (void (*)(void))_iteloop_channel_entry, 2, (unsigned int)(p >> 16 >> 16), (unsigned int)(p & 0xffffffff));
+
+	ch->fiber = true;
+
+	return true;
+}
+
+static void _iteloop_channel_deinit(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	memFree(ch->stack);
+	ch->stack = NULL;
+	ch->fiber = false;
+}
+
+static void _iteloop_switch_to_channel(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	swapcontext(&loop->context, &ch->context);
+}
+
+static void _iteloop_switch_to_loop(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	swapcontext(&ch->context, &loop->context);
+}
+
+#endif
+
+#define _iteloop_index(loop, ch)	((uint32_t)((ch) - (loop)->channel))
+
+// the fiber of a channel runs the requests given to it, and never returns. the
+// channel to run is the current one of the loop.
+#ifdef _WIN32
+static void WINAPI _iteloop_channel_proc(LPVOID param)
+{
+	iteloop *loop = param;
+#else
+static void _iteloop_channel_proc(iteloop *const loop)
+{
+#endif
+	while (1)
+	{
+		struct iteloop_channel *ch = loop->current;
+
+		ch->current->result = loop->ops->execute(loop->ctx, ch->current->prm);
+		ch->done = true;
+
+		_iteloop_switch_to_loop(loop, ch);
+	}
+}
+
+static void _iteloop_timer_add(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	struct iteloop_channel **slot = &loop->wheel[ch->deadline % ITELOOP_WHEEL_SIZE];
+
+	ch->timer_next = *slot;
+	*slot = ch;
+}
+
+// takes the requests pushed by the callers, and queues them in the order they came
+static void _iteloop_take(iteloop *const loop)
+{
+	struct iteloop_request *req, *rev = NULL;
+
+	req = _atomic_xchg_ptr(loop->submitted, NULL);
+
+	while (req != NULL) {
+		struct iteloop_request *next = req->next;
+
+		req->next = rev;
+		rev = req;
+		req = next;
+	}
+
+	while (rev != NULL) {
+		struct iteloop_channel *ch = &loop->channel[rev->channel];
+		struct iteloop_request *next = rev->next;
+
+		rev->next = NULL;
+		if (ch->tail != NULL)
+			ch->tail->next = rev;
+		else
+			ch->head = rev;
+		ch->tail = rev;
+
+		rev = next;
+	}
+}
+
+static struct iteloop_request * _iteloop_dequeue(struct iteloop_channel *const ch)
+{
+	struct iteloop_request *req = ch->head;
+
+	if (req != NULL) {
+		ch->head = req->next;
+		if (ch->head == NULL)
+			ch->tail = NULL;
+	}
+
+	return req;
+}
+
+// runs the channel until its request sleeps or the channel has nothing left to run
+// under the lock
+static void _iteloop_resume(iteloop *const loop, struct iteloop_channel *const ch)
+{
+	while (1)
+	{
+		if (ch->current == NULL)
+			return;
+
+		loop->current = ch;
+
+		if (ch->fiber) {
+			_iteloop_switch_to_channel(loop, ch);
+		}
+		else {
+			// without a fiber the request sleeps on the thread
+			ch->current->result = loop->ops->execute(loop->ctx, ch->current->prm);
+			ch->done = true;
+		}
+
+		loop->current = NULL;
+
+		if (ch->done == false)
+			return;		// on the wheel
+
+		struct iteloop_request *req = ch->current;
+
+		ch->current = NULL;
+		ch->done = false;
+
+		loop->stats.request++;
+		(void)_atomic_add(loop->pending, -1);
+		_iteloop_complete(req);
+
+		if (ch->head != NULL && ch->run < ITELOOP_MAX_BATCH) {
+			ch->current = _iteloop_dequeue(ch);
+			ch->run++;
+			continue;
+		}
+
+		loop->ops->unlock(loop->ctx, _iteloop_index(loop, ch));
+		ch->locked = false;
+		ch->run = 0;
+
+		return;
+	}
+}
+
+// starts the waiting requests of the channels which are not running
+static void _iteloop_start(iteloop *const loop)
+{
+	uint32_t wait = 0;
+
+	for (uint32_t i = 0; i < ITELOOP_MAX_CHANNEL_NUM; i++)
+	{
+		struct iteloop_channel *ch = &loop->channel[i];
+
+		if (ch->head == NULL || ch->locked == true)
+			continue;
+
+		if (loop->ops->try_lock(loop->ctx, i) == false) {
+			wait++;
+			continue;
+		}
+
+		ch->locked = true;
+
+		if (!ch->fiber && loop->fiber) {
+			_iteloop_channel_init(loop, ch);
+		}
+
+		ch->current = _iteloop_dequeue(ch);
+		ch->run = 1;
+
+		_iteloop_resume(loop, ch);
+	}
+
+	loop->lock_wait = wait;
+}
+
+// resumes the channels whose timer has expired
+static void _iteloop_expire(iteloop *const loop, const uint64_t now)
+{
+	uint64_t t = loop->tick;
+
+	if (now - t >= ITELOOP_WHEEL_SIZE)
+		t = now - ITELOOP_WHEEL_SIZE + 1;
+
+	for (; t <= now; t++)
+	{
+		struct iteloop_channel **slot = &loop->wheel[t % ITELOOP_WHEEL_SIZE];
+		struct iteloop_channel *ch = *slot;
+
+		*slot = NULL;
+
+		while (ch != NULL) {
+			struct iteloop_channel *next = ch->timer_next;
+
+			if (ch->deadline <= now) {
+				loop->stats.timer++;
+				_iteloop_resume(loop, ch);
+			}
+			else {
+				// a later turn of the wheel
+				_iteloop_timer_add(loop, ch);
+			}
+
+			ch = next;
+		}
+	}
+
+	// the current slot is processed again, since timers may have been added to it
+	loop->tick = now;
+}
+
+// milliseconds until the earliest timer, from the tick the wheel has been processed up to
+static uint32_t _iteloop_next_timeout(iteloop *const loop, const uint64_t now)
+{
+	bool found = false;
+
+	for (uint32_t d = 0; d < ITELOOP_WHEEL_SIZE; d++)
+	{
+		uint64_t t = loop->tick + d;
+
+		for (struct iteloop_channel *ch = loop->wheel[t % ITELOOP_WHEEL_SIZE]; ch != NULL; ch = ch->timer_next) {
+			if (ch->deadline <= t)
+				return (t > now) ? (uint32_t)(t - now) : 0;
+
+			found = true;
+		}
+	}
+
+	// only timers of later turns
+	return (found == true) ? ITELOOP_WHEEL_SIZE : _INFINITE;
+}
+
+static void _iteloop_main(iteloop *const loop)
+{
+	while (1)
+	{
+		uint32_t token = _iteloop_wake_token(loop);
+		uint32_t timeout;
+
+		_iteloop_take(loop);
+		_iteloop_start(loop);
+		_iteloop_expire(loop, _iteloop_get_tick(loop));
+
+		if (_atomic_load(loop->stop) != 0 && _atomic_load(loop->pending) == 0)
+			break;
+
+		timeout = _iteloop_next_timeout(loop, _iteloop_get_tick(loop));
+		if (timeout == 0)
+			continue;
+
+		if (loop->lock_wait != 0 && timeout > 1) {
+			loop->stats.lock_retry++;
+			timeout = 1;
+		}
+
+		_iteloop_wait(loop, token, timeout);
+		loop->stats.wakeup++;
+	}
+
+	dbg("_iteloop_main: exit, wakeup: %llu, timer: %llu, request: %llu", loop->stats.wakeup, loop->stats.timer, loop->stats.request);
+
+	for (uint32_t i = 0; i < ITELOOP_MAX_CHANNEL_NUM; i++) {
+		if (loop->channel[i].fiber)
+			_iteloop_channel_deinit(loop, &loop->channel[i]);
+	}
+}
+
+#ifdef _WIN32
+
+static DWORD WINAPI _iteloop_thread(LPVOID param)
+{
+	iteloop *loop = param;
+	HMODULE module = loop->module;
+
+	loop->fiber = ConvertThreadToFiber(NULL);
+	if (loop->fiber == NULL) {
+		internal_err("_iteloop_thread: ConvertThreadToFiber failed");
+	}
+
+	_iteloop_main(loop);
+
+	if (loop->fiber != NULL)
+		ConvertFiberToThread();
+
+	CloseHandle(loop->wake);
+	memFree(loop);
+
+	// the thread holds a reference of the module, so that it is not unloaded under it
+	FreeLibraryAndExitThread(module, 0);
+
+	return 0;
+}
+
+#else
+
+static void * _iteloop_thread(void *param)
+{
+	iteloop *loop = param;
+
+	loop->fiber = true;
+
+	_iteloop_main(loop);
+
+	memFree(loop);
+
+	return NULL;
+}
+
+#endif
+
+iteloop * iteloop_create(const struct iteloop_ops *const ops, void *ctx)
+{
+	iteloop *loop;
+
+	loop = memAlloc(sizeof(iteloop));
+	if (loop == NULL)
+		return NULL;
+
+	memset(loop, 0, sizeof(iteloop));
+
+	loop->ops = ops;
+	loop->ctx = ctx;
+
+#ifdef _WIN32
+	HANDLE thread;
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	loop->freq = freq.QuadPart;
+
+	loop->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (loop->wake == NULL)
+		goto end1;
+
+	if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)_iteloop_thread, &loop->module) == FALSE) {
+		internal_err("iteloop_create: GetModuleHandleExW failed");
+		goto end2;
+	}
+
+	loop->tick = _iteloop_get_tick(loop);
+
+	thread = CreateThread(NULL, 0, _iteloop_thread, loop, 0, NULL);
+	if (thread == NULL) {
+		internal_err("iteloop_create: CreateThread failed");
+		goto end3;
+	}
+
+	CloseHandle(thread);
+
+	return loop;
+
+end3:
+	FreeLibrary(loop->module);
+end2:
+	CloseHandle(loop->wake);
+end1:
+	memFree(loop);
+	return NULL;
+#else
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	loop->tick = _iteloop_get_tick(loop);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, _iteloop_thread, loop);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		internal_err("iteloop_create: pthread_create failed");
+		memFree(loop);
+		return NULL;
+	}
+
+	return loop;
+#endif
+}
+
+// the loop ends once the submitted requests have been executed, and frees itself.
+// no request may be submitted after this.
+void iteloop_destroy(iteloop *const loop)
+{
+	_atomic_store(loop->stop, 1);
+	_iteloop_notify(loop);
+}
+
+// executes the request on the loop and waits for it. the result is in req->result.
+void iteloop_submit(iteloop *const loop, struct iteloop_request *const req)
+{
+	struct iteloop_request *head;
+
+#ifndef _WIN32
+	req->done = 0;
+#endif
+
+	// counted before it is pushed, so that the loop does not stop before it is taken
+	(void)_atomic_add(loop->pending, 1);
+
+	do {
+		head = loop->submitted;
+		req->next = head;
+	} while (!_atomic_cas_ptr(loop->submitted, req, head));
+
+	// the loop takes the whole stack at once, so only a push onto an empty one wakes it
+	if (head == NULL)
+		_iteloop_notify(loop);
+
+	_iteloop_wait_done(req);
+}
+
+// called by ops->execute instead of sleeping. the channel is resumed by the loop
+// once the time has passed, and the other channels run meanwhile.
+void iteloop_sleep(iteloop *const loop, const uint32_t milliseconds)
+{
+	struct iteloop_channel *ch = loop->current;
+
+	if (ch == NULL || !ch->fiber) {
+#ifdef _WIN32
+		Sleep(milliseconds);
+#else
+		usleep(milliseconds * 1000);
+#endif
+		return;
+	}
+
+	ch->deadline = _iteloop_get_tick(loop) + milliseconds;
+	_iteloop_timer_add(loop, ch);
+
+	_iteloop_switch_to_loop(loop, ch);
+}
+
+void iteloop_get_stats(iteloop *const loop, struct iteloop_stats *const stats)
+{
+	stats->wakeup = loop->stats.wakeup;
+	stats->timer = loop->stats.timer;
+	stats->request = loop->stats.request;
+	stats->lock_retry = loop->stats.lock_retry;
+}
@@ -0,0 +1,107 @@
+// iteloop.h
+
+#pragma once
+
+// the loop also builds outside of Windows (ucontext, POSIX threads and futexes),
+// where it can be benchmarked without a device.
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ucontext.h>
+#endif
+
+// one thread which runs the exchanges of all the devices. a request runs on the
+// fiber of its channel (a ucontext outside of Windows) and gives the thread back
+// whenever it would sleep, so that the waits for the block guard time, the poll
+// interval and the block waiting time of every device become timers of one wheel,
+// and the thread only wakes up for the earliest of them or for a new request.
+//
+// a channel stands for a lock of the devices: its requests run one after another,
+// and the lock is only tried, so that the loop never blocks on a device which is
+// used by another process.
+
+#define ITELOOP_MAX_CHANNEL_NUM	64
+#define ITELOOP_WHEEL_SIZE		256			// slots of one millisecond
+#define ITELOOP_STACK_SIZE		0x10000		// of the fiber of a channel
+#define ITELOOP_MAX_BATCH		16			// requests run under one acquisition of the lock
+
+struct iteloop_request
+{
+	struct iteloop_request *next;
+	uint32_t channel;
+	void *prm;
+	int32_t result;
+#ifdef _WIN32
+	HANDLE done;	// auto-reset event of the caller, set when the request has been executed
+#else
+	volatile uint32_t done;
+#endif
+};
+
+struct iteloop_ops
+{
+	bool (*try_lock)(void *ctx, const uint32_t channel);	// must not block, tried again on the next tick
+	void (*unlock)(void *ctx, const uint32_t channel);
+	int32_t (*execute)(void *ctx, void *prm);	// on the fiber of the channel, may call iteloop_sleep
+};
+
+struct iteloop_stats
+{
+	uint64_t wakeup;		// returns from the wait of the thread
+	uint64_t timer;			// expired timers
+	uint64_t request;		// executed requests
+	uint64_t lock_retry;	// ticks waited for a lock held elsewhere
+};
+
+struct iteloop_channel
+{
+	struct iteloop_channel *timer_next;		// in the slot of the wheel
+	struct iteloop_request *head;			// waiting requests
+	struct iteloop_request *tail;
+	struct iteloop_request *current;		// being executed
+	uint64_t deadline;		// tick the timer expires on
+	uint32_t run;			// requests run under the current acquisition of the lock
+	bool locked;
+	bool done;				// the current request has returned
+#ifdef _WIN32
+	LPVOID fiber;
+#else
+	bool fiber;
+	void *stack;
+	ucontext_t context;
+#endif
+};
+
+typedef struct _iteloop
+{
+	struct iteloop_request *volatile submitted;	// pushed by the callers, the newest first
+	volatile uint32_t pending;		// submitted and not executed yet
+	volatile uint32_t stop;
+#ifdef _WIN32
+	HANDLE wake;
+	HMODULE module;
+	LPVOID fiber;			// of the thread, NULL if the requests run on it directly
+	uint64_t freq;
+#else
+	volatile uint32_t wake;	// incremented to wake the thread
+	bool fiber;
+	ucontext_t context;
+#endif
+	const struct iteloop_ops *ops;
+	void *ctx;
+	uint64_t tick;			// the wheel has been processed up to this tick
+	uint32_t lock_wait;		// channels waiting for their lock
+	struct iteloop_channel *current;	// running on its fiber
+	struct iteloop_channel *wheel[ITELOOP_WHEEL_SIZE];
+	struct iteloop_channel channel[ITELOOP_MAX_CHANNEL_NUM];
+	struct iteloop_stats stats;
+} iteloop;
+
+extern iteloop * iteloop_create(const struct iteloop_ops *const ops, void *ctx);
+extern void iteloop_destroy(iteloop *const loop);
+extern void iteloop_submit(iteloop *const loop, struct iteloop_request *const req);
+extern void iteloop_sleep(iteloop *const loop, const uint32_t milliseconds);
+extern void iteloop_get_stats(iteloop *const loop, struct iteloop_stats *const stats);
@@ -0,0 +1,671 @@
+// iterec.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
+
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "iterec.h"
+
+// the replay also builds outside of Windows, so that the stack above the transport
+// can be run there
+
+#ifdef _WIN32
+
+typedef SRWLOCK _iterec_lock;
+
+#define _lock_acquire(l)	AcquireSRWLockExclusive((l))
+#define _lock_release(l)	ReleaseSRWLockExclusive((l))
+
+static _iterec_lock _trace_lock = SRWLOCK_INIT;
+
+#define _atomic_inc(v)		((uint32_t)InterlockedIncrement((volatile LONG *)&(v)))
+#define _get_pid()			((uint32_t)GetCurrentProcessId())
+
+#else
+
+typedef pthread_mutex_t _iterec_lock;
+
+#define _lock_acquire(l)	pthread_mutex_lock((l))
+#define _lock_release(l)	pthread_mutex_unlock((l))
+
+static _iterec_lock _trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define _atomic_inc(v)		__atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+#define _get_pid()			((uint32_t)getpid())
+
+#endif
+
+static volatile uint32_t _session = 0;
+static struct iterec_trace *_trace_list = NULL;
+
+uint64_t iterec_get_time(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER t;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+
+	// the counter is shared by the processes, which keeps their records in order
+	QueryPerformanceCounter(&t);
+	return (uint64_t)((t.QuadPart / freq.QuadPart) * 1000000 + ((t.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+static void _iterec_wait(const uint32_t us)
+{
+	if (us == 0)
+		return;
+
+#ifdef _WIN32
+	if (us >= 1000) {
+		Sleep(us / 1000);
+		return;
+	}
+
+	uint64_t end = iterec_get_time() + us;
+
+	while (iterec_get_time() < end) {
+		YieldProcessor();
+	}
+#else
+	struct timespec ts;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+// the part of the structure which a request uses
+static void _iterec_field(const uint32_t code, const ite_ioctl_type type, const bool output, const struct ite_devctl_data *const data, uint32_t *const offset, uint32_t *const len)
+{
+	*offset = 0;
+	*len = 0;
+
+	switch (code)
+	{
+	case ITE_DEVCTL_UART_SEND_DATA:
+		if (output == false) {
+			*offset = offsetof(struct ite_devctl_data, uart_data);
+			*len = 1 + ((data->uart_data.length < sizeof(data->uart_data.buffer)) ? data->uart_data.length : sizeof(data->uart_data.buffer));
+		}
+		break;
+
+	case ITE_DEVCTL_UART_RECV_DATA:
+		*offset = offsetof(struct ite_devctl_data, uart_data);
+		*len = 1;
+		if (output == true) {
+			*len += (data->uart_data.length < sizeof(data->uart_data.buffer)) ? data->uart_data.length : sizeof(data->uart_data.buffer);
+		}
+		break;
+
+	case ITE_DEVCTL_UART_SET_BAUDRATE:
+		if (output == false) {
+			*offset = offsetof(struct ite_devctl_data, uart_baudrate);
+			*len = sizeof(data->uart_baudrate);
+		}
+		break;
+
+	case ITE_DEVCTL_CARD_DETECT:
+		if (output == true) {
+			*offset = offsetof(struct ite_devctl_data, card_present);
+			*len = sizeof(data->card_present);
+		}
+		break;
+
+	case ITE_DEVCTL_UART_CHECK_READY:
+		if (output == true) {
+			*offset = offsetof(struct ite_devctl_data, uart_ready);
+			*len = sizeof(data->uart_ready);
+		}
+		break;
+
+	case ITE_DEVCTL_CARD_GET_ATR:
+		if (output == true) {
+			*offset = offsetof(struct ite_devctl_data, card_atr);
+			*len = sizeof(data->card_atr);
+		}
+		break;
+
+	case ITE_DEVCTL_CARD_RESET:
+		break;
+
+	default:
+		// nothing is read back by a request to the device
+		if (output == false || type == ITE_IOCTL_IN) {
+			*len = sizeof(struct ite_devctl_data);
+		}
+		break;
+	}
+}
+
+// recording
+
+bool iterec_open(iterec *const rec, const wchar_t *const file)
+{
+#ifdef _WIN32
+	// every record is appended by a single write, so that the processes can share the file
+	rec->file = CreateFileW(file, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (rec->file == INVALID_HANDLE_VALUE) {
+		win32_err("iterec_open: CreateFileW");
+		rec->file = NULL;
+		return false;
+	}
+#else
+	char path[1024];
+
+	if (wcstombs(path, file, sizeof(path)) >= sizeof(path)) {
+		internal_err("iterec_open: path is too long");
+		return false;
+	}
+
+	rec->file = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (rec->file == -1) {
+		internal_err("iterec_open: open failed");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+void iterec_close(iterec *const rec)
+{
+#ifdef _WIN32
+	if (rec->file != NULL) {
+		CloseHandle(rec->file);
+		rec->file = NULL;
+	}
+#else
+	if (rec->file != -1) {
+		close(rec->file);
+		rec->file = -1;
+	}
+#endif
+}
+
+uint32_t iterec_new_session(void)
+{
+	return _atomic_inc(_session);
+}
+
+static void _iterec_write(iterec *const rec, const uint32_t session, const iterec_kind_t kind, const uint8_t type, const uint32_t code, const int32_t result, const uint64_t start, const void *const in, const uint32_t in_len, const void *const out, const uint32_t out_len)
+{
+	uint8_t buf[sizeof(struct iterec_record) + ITEREC_MAX_DATA_SIZE];
+	struct iterec_record *r = (struct iterec_record *)buf;
+	uint64_t now = iterec_get_time();
+
+	if (in_len + out_len > ITEREC_MAX_DATA_SIZE) {
+		internal_err("_iterec_write: too large");
+		return;
+	}
+
+	r->signature = ITEREC_SIGNATURE;
+	r->size = (uint16_t)(sizeof(struct iterec_record) + in_len + out_len);
+	r->in_len = (uint16_t)in_len;
+	r->kind = (uint8_t)kind;
+	r->type = type;
+	r->reserved = 0;
+	r->result = result;
+	r->pid = _get_pid();
+	r->session = session;
+	r->code = code;
+	r->duration = (uint32_t)(now - start);
+	r->time = start;
+
+	if (in_len != 0)
+		memcpy(buf + sizeof(struct iterec_record), in, in_len);
+	if (out_len != 0)
+		memcpy(buf + sizeof(struct iterec_record) + in_len, out, out_len);
+
+#ifdef _WIN32
+	DWORD written;
+
+	if (WriteFile(rec->file, buf, r->size, &written, NULL) == FALSE) {
+		win32_err("_iterec_write: WriteFile");
+	}
+#else
+	if (write(rec->file, buf, r->size) != r->size) {
+		internal_err("_iterec_write: write failed");
+	}
+#endif
+}
+
+void iterec_devctl_begin(struct iterec_io *const io, const ite_ioctl_type type, const struct ite_devctl_data *const data)
+{
+	uint32_t offset, len;
+
+	_iterec_field(data->code, type, false, data, &offset, &len);
+
+	io->start = iterec_get_time();
+	io->code = data->code;
+	io->type = (uint8_t)type;
+	io->in_len = (uint16_t)len;
+	memcpy(io->in, (const uint8_t *)data + offset, len);
+}
+
+void iterec_devctl_end(iterec *const rec, const uint32_t session, const struct iterec_io *const io, const struct ite_devctl_data *const data, const bool result)
+{
+	uint32_t offset = 0, len = 0;
+
+	if (result == true && io->type == ITE_IOCTL_IN) {
+		_iterec_field(io->code, io->type, true, data, &offset, &len);
+	}
+
+	_iterec_write(rec, session, ITEREC_KIND_DEVCTL, io->type, io->code, result, io->start, io->in, io->in_len, (const uint8_t *)data + offset, len);
+}
+
+void iterec_private_ioctl(iterec *const rec, const uint32_t session, const ite_ioctl_type type, const uint32_t ioctl_code, const bool result, const uint64_t start)
+{
+	_iterec_write(rec, session, ITEREC_KIND_PRIVATE, (uint8_t)type, ioctl_code, result, start, NULL, 0, NULL, 0);
+}
+
+void iterec_call(iterec *const rec, const uint32_t session, const iterec_call_t call, const int32_t result, const uint64_t start, const void *const in, const uint32_t in_len, const void *const out, const uint32_t out_len)
+{
+	_iterec_write(rec, session, ITEREC_KIND_CALL, 0, call, result, start, in, in_len, out, out_len);
+}
+
+void iterec_call_open(iterec *const rec, const uint32_t session, const int32_t result, const uint64_t start, const uint8_t protocol, const bool exclusive, const bool power_on, const wchar_t *const path)
+{
+	uint8_t in[3 + (ITEREC_MAX_PATH_LEN * 2)];
+	uint32_t len = 0;
+
+	in[0] = protocol;
+	in[1] = (exclusive == true) ? 1 : 0;
+	in[2] = (power_on == true) ? 1 : 0;
+
+	while (path[len] != L'\0' && len < ITEREC_MAX_PATH_LEN) {
+		in[3 + (len * 2)] = (uint8_t)(path[len] & 0xff);
+		in[3 + (len * 2) + 1] = (uint8_t)((path[len] >> 8) & 0xff);
+		len++;
+	}
+
+	_iterec_write(rec, session, ITEREC_KIND_CALL, 0, ITEREC_CALL_OPEN, result, start, in, 3 + (len * 2), NULL, 0);
+}
+
+// replay
+
+static uint8_t * _iterec_read_file(const wchar_t *const file, uint32_t *const size)
+{
+	uint8_t *buf = NULL;
+
+#ifdef _WIN32
+	HANDLE h;
+	LARGE_INTEGER li;
+	DWORD rb;
+
+	h = CreateFileW(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		win32_err("_iterec_read_file: CreateFileW");
+		return NULL;
+	}
+
+	if (GetFileSizeEx(h, &li) != FALSE && li.QuadPart < UINT32_MAX) {
+		buf = memAllocRaw((size_t)li.QuadPart + 1);
+		if (buf != NULL && (ReadFile(h, buf, (DWORD)li.QuadPart, &rb, NULL) == FALSE || rb != (DWORD)li.QuadPart)) {
+			memFree(buf);
+			buf = NULL;
+		}
+		*size = (uint32_t)li.QuadPart;
+	}
+
+	CloseHandle(h);
+#else
+	char path[1024];
+	FILE *fp;
+	long len;
+
+	if (wcstombs(path, file, sizeof(path)) >= sizeof(path))
+		return NULL;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		internal_err("_iterec_read_file: fopen failed");
+		return NULL;
+	}
+
+	if (fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+		buf = memAllocRaw((size_t)len + 1);
+		if (buf != NULL && fread(buf, 1, (size_t)len, fp) != (size_t)len) {
+			memFree(buf);
+			buf = NULL;
+		}
+		*size = (uint32_t)len;
+	}
+
+	fclose(fp);
+#endif
+
+	return buf;
+}
+
+static int _iterec_compare_record(const void *a, const void *b)
+{
+	const struct iterec_record *ra = *(const struct iterec_record *const *)a;
+	const struct iterec_record *rb = *(const struct iterec_record *const *)b;
+
+	if (ra->pid != rb->pid)
+		return (ra->pid < rb->pid) ? -1 : 1;
+	if (ra->session != rb->session)
+		return (ra->session < rb->session) ? -1 : 1;
+
+	// in the order they were written
+	return (ra < rb) ? -1 : ((ra > rb) ? 1 : 0);
+}
+
+static int _iterec_compare_session(const void *a, const void *b)
+{
+	const struct iterec_session *sa = a, *sb = b;
+
+	return (sa->start < sb->start) ? -1 : ((sa->start > sb->start) ? 1 : 0);
+}
+
+// the path of ITEREC_CALL_OPEN, as UTF-16 without a terminator
+static uint32_t _iterec_get_device(struct iterec_trace *const trace, const struct iterec_record *const r, const uint32_t max)
+{
+	const uint8_t *p = (const uint8_t *)r + sizeof(struct iterec_record) + 3;
+	uint32_t len = (r->in_len > 3) ? (r->in_len - 3) / 2 : 0;
+	wchar_t *path;
+
+	path = memAlloc((len + 1) * sizeof(wchar_t));
+	if (path == NULL)
+		return UINT32_MAX;
+
+	for (uint32_t i = 0; i < len; i++)
+		path[i] = (wchar_t)(p[i * 2] | (p[(i * 2) + 1] << 8));
+	path[len] = L'\0';
+
+	for (uint32_t i = 0; i < trace->device_num; i++) {
+		if (wstrCompare(trace->device[i], path) == true) {
+			memFree(path);
+			return i;
+		}
+	}
+
+	if (trace->device_num >= max) {
+		memFree(path);
+		return UINT32_MAX;
+	}
+
+	trace->device[trace->device_num] = path;
+
+	return trace->device_num++;
+}
+
+static struct iterec_trace * _iterec_load(const wchar_t *const file)
+{
+	struct iterec_trace *trace;
+	const struct iterec_record **record = NULL;
+	uint32_t size = 0, pos = 0, num = 0, path_len;
+
+	path_len = wstrLen(file);
+
+	trace = memAlloc(sizeof(struct iterec_trace) + (path_len * sizeof(wchar_t)));
+	if (trace == NULL) {
+		internal_err("_iterec_load: memAlloc failed");
+		return NULL;
+	}
+
+	memcpy(trace->path, file, (path_len + 1) * sizeof(wchar_t));
+
+	trace->buf = _iterec_read_file(file, &size);
+	if (trace->buf == NULL) {
+		internal_err("_iterec_load: _iterec_read_file failed");
+		goto fail;
+	}
+
+	// a record which was being written when the process ended is dropped with the rest
+	while (pos + sizeof(struct iterec_record) <= size) {
+		const struct iterec_record *r = (const struct iterec_record *)(trace->buf + pos);
+
+		if (r->signature != ITEREC_SIGNATURE || r->size < sizeof(struct iterec_record) || r->in_len > r->size - sizeof(struct iterec_record) || pos + r->size > size)
+			break;
+
+		pos += r->size;
+		num++;
+	}
+
+	if (num == 0) {
+		internal_err("_iterec_load: no records");
+		goto fail;
+	}
+
+	record = memAlloc(sizeof(struct iterec_record *) * num);
+	trace->session = memAlloc(sizeof(struct iterec_session) * num);
+	trace->device = memAlloc(sizeof(wchar_t *) * num);
+	if (record == NULL || trace->session == NULL || trace->device == NULL) {
+		internal_err("_iterec_load: memAlloc failed");
+		goto fail;
+	}
+
+	pos = 0;
+	for (uint32_t i = 0; i < num; i++) {
+		record[i] = (const struct iterec_record *)(trace->buf + pos);
+		pos += record[i]->size;
+	}
+
+	qsort((void *)record, num, sizeof(struct iterec_record *), _iterec_compare_record);
+
+	trace->session_num = 0;
+	trace->device_num = 0;
+
+	for (uint32_t i = 0; i < num; i++)
+	{
+		struct iterec_session *s = &trace->session[trace->session_num];
+		const struct iterec_record *r = record[i];
+
+		if (i == 0 || r->pid != record[i - 1]->pid || r->session != record[i - 1]->session) {
+			memset(s, 0, sizeof(struct iterec_session));
+			s->pid = r->pid;
+			s->session = r->session;
+			s->device = UINT32_MAX;
+			s->start = r->time;
+			s->record = &record[i];
+			trace->session_num++;
+		}
+		else {
+			s = &trace->session[trace->session_num - 1];
+		}
+
+		s->record_num++;
+
+		if (s->start > r->time)
+			s->start = r->time;
+
+		if (r->kind == ITEREC_KIND_CALL && r->code == ITEREC_CALL_OPEN) {
+			s->device = _iterec_get_device(trace, r, num);
+		}
+	}
+
+	qsort(trace->session, trace->session_num, sizeof(struct iterec_session), _iterec_compare_session);
+
+	return trace;
+
+fail:
+	memFree(trace->buf);
+	memFree(trace->session);
+	memFree((void *)trace->device);
+	memFree((void *)record);
+	memFree(trace);
+
+	return NULL;
+}
+
+const struct iterec_trace * iterec_trace_load(const wchar_t *const file)
+{
+	struct iterec_trace *trace;
+
+	_lock_acquire(&_trace_lock);
+
+	for (trace = _trace_list; trace != NULL; trace = trace->next) {
+		if (wstrCompare(trace->path, file) == true)
+			break;
+	}
+
+	if (trace == NULL) {
+		trace = _iterec_load(file);
+		if (trace != NULL) {
+			trace->next = _trace_list;
+			_trace_list = trace;
+		}
+	}
+
+	_lock_release(&_trace_lock);
+
+	return trace;
+}
+
+bool iterec_replay_is_path(const wchar_t *const path)
+{
+	return wstrCompareN(path, ITEREC_REPLAY_PATH_PREFIX, ITEREC_REPLAY_PATH_PREFIX_LEN);
+}
+
+iterec_replay * iterec_replay_open(const wchar_t *const path)
+{
+	const struct iterec_trace *trace;
+	const wchar_t *p = path + ITEREC_REPLAY_PATH_PREFIX_LEN;
+	uint32_t index = 0;
+	iterec_replay *replay;
+
+	// the trace follows the index of the session
+	while (*p >= L'0' && *p <= L'9') {
+		index = (index * 10) + (*p++ - L'0');
+	}
+
+	if (*p != L'#' || wstrIsEmpty(p + 1)) {
+		internal_err("iterec_replay_open: no trace");
+		return NULL;
+	}
+
+	trace = iterec_trace_load(p + 1);
+	if (trace == NULL || index >= trace->session_num) {
+		internal_err("iterec_replay_open: no session");
+		return NULL;
+	}
+
+	replay = memAlloc(sizeof(iterec_replay));
+	if (replay == NULL) {
+		internal_err("iterec_replay_open: memAlloc failed");
+		return NULL;
+	}
+
+	replay->session = &trace->session[index];
+	replay->pos = 0;
+	replay->private_ioctl = false;
+
+	for (uint32_t i = 0; i < replay->session->record_num; i++) {
+		if (replay->session->record[i]->kind == ITEREC_KIND_PRIVATE) {
+			replay->private_ioctl = true;
+			break;
+		}
+	}
+
+	return replay;
+}
+
+void iterec_replay_close(iterec_replay *const replay)
+{
+	memFree(replay);
+}
+
+// the next recorded request of the kind and code. the requests of the device which
+// were not made in the replay are skipped, up to ITEREC_REPLAY_WINDOW of them.
+static const struct iterec_record * _iterec_replay_next(iterec_replay *const replay, const iterec_kind_t kind, const ite_ioctl_type type, const uint32_t code)
+{
+	struct iterec_session *s = replay->session;
+	uint32_t skipped = 0;
+
+	for (uint32_t i = replay->pos; i < s->record_num; i++)
+	{
+		const struct iterec_record *r = s->record[i];
+
+		if (r->kind == ITEREC_KIND_CALL)
+			continue;
+
+		if (r->kind == kind && r->type == type && r->code == code) {
+			replay->pos = i + 1;
+			s->skipped += skipped;
+			return r;
+		}
+
+		if (++skipped > ITEREC_REPLAY_WINDOW)
+			break;
+	}
+
+	s->unmatched++;
+
+	return NULL;
+}
+
+bool iterec_replay_devctl(iterec_replay *const replay, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	const struct iterec_record *r;
+	const uint8_t *in;
+	uint32_t offset, len;
+
+	r = _iterec_replay_next(replay, ITEREC_KIND_DEVCTL, type, data->code);
+	if (r == NULL)
+		return false;
+
+	in = (const uint8_t *)r + sizeof(struct iterec_record);
+
+	_iterec_field(data->code, type, false, data, &offset, &len);
+	if (len != r->in_len || memcmp((const uint8_t *)data + offset, in, len) != 0) {
+		replay->session->diverged++;
+	}
+
+	_iterec_wait(r->duration);
+
+	if (r->result == 0)
+		return false;
+
+	if (type == ITE_IOCTL_IN) {
+		_iterec_field(data->code, type, true, data, &offset, &len);
+
+		len = r->size - sizeof(struct iterec_record) - r->in_len;
+		if (offset + len > sizeof(struct ite_devctl_data)) {
+			internal_err("iterec_replay_devctl: incorrect record");
+			return false;
+		}
+
+		memcpy((uint8_t *)data + offset, in + r->in_len, len);
+	}
+
+	return true;
+}
+
+bool iterec_replay_private_ioctl(iterec_replay *const replay, const ite_ioctl_type type, const uint32_t ioctl_code)
+{
+	const struct iterec_record *r;
+
+	r = _iterec_replay_next(replay, ITEREC_KIND_PRIVATE, type, ioctl_code);
+	if (r == NULL)
+		return false;
+
+	_iterec_wait(r->duration);
+
+	return (r->result != 0) ? true : false;
+}
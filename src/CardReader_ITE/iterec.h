@@ -0,0 +1,137 @@
+// iterec.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ite.h"
+
+// a recording of the device control requests of the devices, and of the itecard
+// calls which made them. it is replayed through itecard.c against a transport which
+// answers with the recorded responses after the recorded delays.
+//
+// file: records appended by all the processes, each with its own session numbers
+// replay path: \\?\itecard#replay#<session index>#<file path>
+
+#define ITEREC_SIGNATURE		0x43525449	// "ITRC"
+
+#define ITEREC_REPLAY_PATH_PREFIX		L"\\\\?\\itecard#replay#"
+#define ITEREC_REPLAY_PATH_PREFIX_LEN	19
+
+#define ITEREC_MAX_DATA_SIZE	0x400
+#define ITEREC_MAX_PATH_LEN		260		// characters of a device path which are recorded
+#define ITEREC_REPLAY_WINDOW	8		// requests skipped at most to find the next matching one
+
+typedef enum _iterec_kind_t
+{
+	ITEREC_KIND_DEVCTL = 0,		// ite_devctl
+	ITEREC_KIND_PRIVATE,		// ite_private_ioctl
+	ITEREC_KIND_CALL,			// itecard_*, which drive the replay
+} iterec_kind_t;
+
+typedef enum _iterec_call_t
+{
+	ITEREC_CALL_OPEN = 0,		// in: protocol, exclusive, power_on, path (UTF-16)
+	ITEREC_CALL_CLOSE,			// in: reset, noref, power_off
+	ITEREC_CALL_DETECT,			// out: present
+	ITEREC_CALL_INIT,
+	ITEREC_CALL_TRANSMIT,		// in: protocol, size of the response buffer (uint32_t), command  out: response
+} iterec_call_t;
+
+// the fields of struct ite_devctl_data which a request uses are stored, not the
+// whole structure. for codes which are not known the whole structure is stored.
+
+#pragma pack(1)
+
+struct iterec_record
+{
+	uint32_t signature;
+	uint16_t size;				// of the record and the data after it
+	uint16_t in_len;			// the data is in_len bytes of input, then the output
+	uint8_t kind;
+	uint8_t type;				// ite_ioctl_type
+	uint16_t reserved;
+	int32_t result;				// true/false, or itecard_status_t of a call
+	uint32_t pid;
+	uint32_t session;			// ite_open in the process
+	uint32_t code;				// device control code, private ioctl code or iterec_call_t
+	uint32_t duration;			// microseconds
+	uint64_t time;				// microseconds, when the request was made
+};
+
+#pragma pack()
+
+// recording
+
+typedef struct _iterec
+{
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int file;
+#endif
+} iterec;
+
+// the input of a request is taken before the request, which overwrites it
+struct iterec_io
+{
+	uint64_t start;
+	uint32_t code;
+	uint8_t type;
+	uint16_t in_len;
+	uint8_t in[sizeof(struct ite_devctl_data)];
+};
+
+extern bool iterec_open(iterec *const rec, const wchar_t *const file);
+extern void iterec_close(iterec *const rec);
+extern uint32_t iterec_new_session(void);
+extern uint64_t iterec_get_time(void);
+extern void iterec_devctl_begin(struct iterec_io *const io, const ite_ioctl_type type, const struct ite_devctl_data *const data);
+extern void iterec_devctl_end(iterec *const rec, const uint32_t session, const struct iterec_io *const io, const struct ite_devctl_data *const data, const bool result);
+extern void iterec_private_ioctl(iterec *const rec, const uint32_t session, const ite_ioctl_type type, const uint32_t ioctl_code, const bool result, const uint64_t start);
+extern void iterec_call_open(iterec *const rec, const uint32_t session, const int32_t result, const uint64_t start, const uint8_t protocol, const bool exclusive, const bool power_on, const wchar_t *const path);
+extern void iterec_call(iterec *const rec, const uint32_t session, const iterec_call_t call, const int32_t result, const uint64_t start, const void *const in, const uint32_t in_len, const void *const out, const uint32_t out_len);
+
+// replay
+
+struct iterec_session
+{
+	uint32_t pid;
+	uint32_t session;
+	uint32_t device;			// index of the device path
+	uint64_t start;
+	uint32_t record_num;
+	const struct iterec_record **record;
+	// counted while replaying
+	uint32_t skipped;			// recorded requests which were not made
+	uint32_t unmatched;			// requests which were not recorded
+	uint32_t diverged;			// requests made with other input
+};
+
+struct iterec_trace
+{
+	struct iterec_trace *next;
+	uint8_t *buf;
+	uint32_t session_num;
+	struct iterec_session *session;		// in the order they started
+	uint32_t device_num;
+	const wchar_t **device;				// paths of the devices, as recorded
+	wchar_t path[1];
+};
+
+typedef struct _iterec_replay
+{
+	struct iterec_session *session;
+	uint32_t pos;				// next record
+	bool private_ioctl;			// the private ioctl was recorded
+} iterec_replay;
+
+extern const struct iterec_trace * iterec_trace_load(const wchar_t *const file);
+extern bool iterec_replay_is_path(const wchar_t *const path);
+extern iterec_replay * iterec_replay_open(const wchar_t *const path);
+extern void iterec_replay_close(iterec_replay *const replay);
+extern bool iterec_replay_devctl(iterec_replay *const replay, const ite_ioctl_type type, struct ite_devctl_data *const data);
+extern bool iterec_replay_private_ioctl(iterec_replay *const replay, const ite_ioctl_type type, const uint32_t ioctl_code);
+
+#define iterec_v_supported_private_ioctl(replay) ((replay)->private_ioctl)
@@ -0,0 +1,440 @@
+// itesim.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_TRANSPORT
+
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "profile.h"
+#include "itesim.h"
+
+// the simulated devices also build outside of Windows, where they stand in for the
+// devices of the pcsc-lite compatible library. the time is counted in nanoseconds there.
+
+// the scripts are never released until the heap is destroyed
+static struct itesim_script *volatile _script_list = NULL;
+
+bool itesim_is_path(const wchar_t *const path)
+{
+	return wstrCompareN(path, ITESIM_PATH_PREFIX, ITESIM_PATH_PREFIX_LEN);
+}
+
+static uint64_t _itesim_get_time()
+{
+#ifdef _WIN32
+	LARGE_INTEGER t;
+
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+#endif
+}
+
+static void _itesim_wait(itesim *const sim, const uint32_t us)
+{
+	if (us == 0)
+		return;
+
+	if (us >= 1000) {
+#ifdef _WIN32
+		Sleep(us / 1000);
+#else
+		usleep((us / 1000) * 1000);
+#endif
+		return;
+	}
+
+	uint64_t end = _itesim_get_time() + ((sim->freq * us) / 1000000);
+
+	while (_itesim_get_time() < end) {
+#ifdef _WIN32
+		YieldProcessor();
+#endif
+	}
+}
+
+static int _itesim_hex(const wchar_t ch)
+{
+	if (ch >= L'0' && ch <= L'9')
+		return ch - L'0';
+	else if (ch >= L'A' && ch <= L'F')
+		return ch - L'A' + 10;
+	else if (ch >= L'a' && ch <= L'f')
+		return ch - L'a' + 10;
+
+	return -1;
+}
+
+// "3B F0 12" or 3BF012, up to the terminator. returns the length or -1.
+static int _itesim_parse_hex(const wchar_t *str, const wchar_t term, uint8_t *const buf, const uint32_t size)
+{
+	uint32_t len = 0;
+
+	while (*str != L'\0' && *str != term)
+	{
+		int h, l;
+
+		if (*str == L' ' || *str == L'\t' || *str == L'"') {
+			str++;
+			continue;
+		}
+
+		h = _itesim_hex(str[0]);
+		l = (h != -1) ? _itesim_hex(str[1]) : -1;
+		if (l == -1 || len >= size)
+			return -1;
+
+		buf[len++] = (uint8_t)((h << 4) | l);
+		str += 2;
+	}
+
+	return (int)len;
+}
+
+static struct itesim_script * _itesim_load(const wchar_t *const path)
+{
+	struct itesim_script *script;
+	uint32_t path_len = wstrLen(path);
+	wchar_t str[256];
+	int len;
+
+	script = memAlloc(sizeof(struct itesim_script) + (sizeof(wchar_t) * path_len));
+	if (script == NULL) {
+		internal_err("_itesim_load: memAlloc failed");
+		return NULL;
+	}
+
+	wstrCopy(script->path, path);
+
+	// a B-CAS card by default
+	profile_get_string(L"Card", L"ATR", L"3B F0 12 00 FF 91 81 B1 7C 45 1F 03 99", str, 256, path);
+	len = _itesim_parse_hex(str, L'\0', script->atr, sizeof(script->atr));
+	if (len <= 0) {
+		internal_err("_itesim_load: invalid ATR");
+		memFree(script);
+		return NULL;
+	}
+	script->atr_len = (uint8_t)len;
+
+	script->private_ioctl = (profile_get_int(L"Card", L"PrivateIoctl", 1, path) != 0) ? true : false;
+	script->echo = (profile_get_int(L"Card", L"Echo", 0, path) != 0) ? true : false;
+	script->ioctl_time = profile_get_int(L"Card", L"IoctlTime", 0, path);
+	script->response_time = profile_get_int(L"Card", L"ResponseTime", 0, path);
+
+	profile_get_string(L"Card", L"Default", L"90 00", str, 256, path);
+	len = _itesim_parse_hex(str, L'\0', script->def.data, sizeof(script->def.data));
+	if (len < 0) {
+		internal_err("_itesim_load: invalid default response");
+		memFree(script);
+		return NULL;
+	}
+	script->def.len = (uint8_t)len;
+
+	// <command prefix>=<response>
+	wchar_t *section = memAlloc(sizeof(wchar_t) * 0x4000);
+
+	if (section != NULL)
+	{
+		const wchar_t *p = section;
+
+		profile_get_section(L"Response", section, 0x4000, path);
+
+		while (*p != L'\0' && script->response_num < ITESIM_MAX_RESPONSE_NUM)
+		{
+			struct itesim_response *res = &script->response[script->response_num];
+			const wchar_t *v = wstrGetWCharPtr(p, L'=');
+			int pl, rl = -1;
+
+			if (*p == L';') {
+				p += wstrLen(p) + 1;
+				continue;
+			}
+
+			pl = _itesim_parse_hex(p, L'=', res->prefix, sizeof(res->prefix));
+			if (v != NULL) {
+				rl = _itesim_parse_hex(v + 1, L'\0', res->data, sizeof(res->data));
+			}
+
+			if (pl > 0 && rl >= 0) {
+				res->prefix_len = (uint8_t)pl;
+				res->len = (uint8_t)rl;
+				script->response_num++;
+			}
+			else {
+				dbgW(L"_itesim_load: invalid response: %s", p);
+			}
+
+			p += wstrLen(p) + 1;
+		}
+
+		memFree(section);
+	}
+
+	return script;
+}
+
+static const struct itesim_script * _itesim_get_script(const wchar_t *const path)
+{
+	struct itesim_script *script, *head;
+
+	for (script = _script_list; script != NULL; script = script->next) {
+		if (wstrCompare(script->path, path) == true)
+			return script;
+	}
+
+	script = _itesim_load(path);
+	if (script == NULL)
+		return NULL;
+
+	// another thread may have loaded the same script, which only wastes memory
+	do {
+		head = _script_list;
+		script->next = head;
+#ifdef _WIN32
+	} while (InterlockedCompareExchangePointer((void *volatile *)&_script_list, script, head) != head);
+#else
+	} while (__sync_bool_compare_and_swap(&_script_list, head, script) == false);
+#endif
+
+	return script;
+}
+
+itesim * itesim_open(const wchar_t *const path)
+{
+	const wchar_t *p;
+	itesim *sim;
+
+	// the script follows the id
+	p = wstrGetWCharPtr(path + ITESIM_PATH_PREFIX_LEN, L'#');
+	if (p == NULL || wstrIsEmpty(p + 1)) {
+		internal_err("itesim_open: no script");
+		return NULL;
+	}
+
+	sim = memAlloc(sizeof(itesim));
+	if (sim == NULL) {
+		internal_err("itesim_open: memAlloc failed");
+		return NULL;
+	}
+
+	sim->script = _itesim_get_script(p + 1);
+	if (sim->script == NULL) {
+		internal_err("itesim_open: _itesim_get_script failed");
+		memFree(sim);
+		return NULL;
+	}
+
+#ifdef _WIN32
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	sim->freq = freq.QuadPart;
+#else
+	sim->freq = 1000000000;
+#endif
+
+	return sim;
+}
+
+void itesim_close(itesim *const sim)
+{
+	memFree(sim);
+}
+
+static uint8_t _itesim_lrc(const uint8_t *const p, const uint32_t len)
+{
+	uint8_t lrc = 0;
+
+	for (uint32_t i = 0; i < len; i++)
+		lrc ^= p[i];
+
+	return lrc;
+}
+
+static void _itesim_queue_block(itesim *const sim, const uint8_t nad, const uint8_t pcb, const uint8_t *const inf, const uint8_t inf_len)
+{
+	uint8_t *p = sim->last;
+
+	p[0] = nad;
+	p[1] = pcb;
+	p[2] = inf_len;
+	memcpy(p + 3, inf, inf_len);
+	p[3 + inf_len] = _itesim_lrc(p, 3 + inf_len);
+
+	sim->last_len = 4 + inf_len;
+
+	memcpy(sim->rx, sim->last, sim->last_len);
+	sim->rx_len = sim->last_len;
+	sim->rx_pos = 0;
+	sim->ready = _itesim_get_time() + ((sim->freq * sim->script->response_time) / 1000000);
+}
+
+static void _itesim_command(itesim *const sim, const uint8_t *const cmd, const uint8_t cmd_len, uint8_t *const res, uint8_t *const res_len)
+{
+	const struct itesim_script *script = sim->script;
+	const struct itesim_response *r = &script->def;
+
+	for (uint32_t i = 0; i < script->response_num; i++) {
+		const struct itesim_response *p = &script->response[i];
+
+		if (p->prefix_len <= cmd_len && memcmp(p->prefix, cmd, p->prefix_len) == 0) {
+			r = p;
+			break;
+		}
+	}
+
+	uint32_t len = 0;
+
+	if (r == &script->def && script->echo == true && cmd_len > 5) {
+		// the data after the header (CLA INS P1 P2 Lc)
+		len = cmd_len - 5;
+		if (len > (uint32_t)(254 - r->len)) {
+			len = 254 - r->len;
+		}
+		memcpy(res, cmd + 5, len);
+	}
+
+	memcpy(res + len, r->data, r->len);
+	*res_len = (uint8_t)(len + r->len);
+}
+
+// a block from the terminal is complete
+static void _itesim_block(itesim *const sim)
+{
+	const uint8_t *p = sim->tx;
+	uint8_t nad = (uint8_t)((p[0] << 4) | (p[0] >> 4));
+
+	if (_itesim_lrc(p, sim->tx_len) != 0) {
+		// R-block with an EDC error
+		_itesim_queue_block(sim, nad, 0x81, NULL, 0);
+		return;
+	}
+
+	if ((p[1] & 0x80) == 0)
+	{
+		// I-block, answered with the same sequence number
+		uint8_t res[254];
+		uint8_t res_len;
+
+		_itesim_command(sim, p + 3, p[2], res, &res_len);
+		_itesim_queue_block(sim, nad, p[1] & 0x40, res, res_len);
+	}
+	else if ((p[1] & 0xC0) == 0x80)
+	{
+		// R-block, the last block is sent again
+		if (sim->last_len != 0) {
+			memcpy(sim->rx, sim->last, sim->last_len);
+			sim->rx_len = sim->last_len;
+			sim->rx_pos = 0;
+			sim->ready = _itesim_get_time() + ((sim->freq * sim->script->response_time) / 1000000);
+		}
+	}
+	else if ((p[1] & 0x20) == 0)
+	{
+		// S-block request
+		_itesim_queue_block(sim, nad, p[1] | 0x20, p + 3, p[2]);
+	}
+}
+
+static bool _itesim_send(itesim *const sim, const uint8_t *const data, const uint8_t len)
+{
+	if (sim->tx_len + len > sizeof(sim->tx)) {
+		sim->tx_len = 0;
+		return true;
+	}
+
+	memcpy(sim->tx + sim->tx_len, data, len);
+	sim->tx_len += len;
+
+	// NAD PCB LEN INF EDC
+	if (sim->tx_len >= 3 && sim->tx_len >= (uint32_t)(4 + sim->tx[2])) {
+		sim->tx_len = 4 + sim->tx[2];
+		_itesim_block(sim);
+		sim->tx_len = 0;
+	}
+
+	return true;
+}
+
+bool itesim_devctl(itesim *const sim, const ite_ioctl_type type, struct ite_devctl_data *const data)
+{
+	_itesim_wait(sim, sim->script->ioctl_time);
+
+	switch (data->code)
+	{
+	case ITE_DEVCTL_CARD_DETECT:
+		data->card_present = 1;
+		break;
+
+	case ITE_DEVCTL_CARD_RESET:
+		memcpy(sim->rx, sim->script->atr, sim->script->atr_len);
+		sim->rx_len = sim->script->atr_len;
+		sim->rx_pos = 0;
+		sim->tx_len = 0;
+		sim->last_len = 0;
+		sim->ready = 0;
+		break;
+
+	case ITE_DEVCTL_CARD_GET_ATR:
+		memset(data->card_atr, 0, sizeof(data->card_atr));
+		memcpy(data->card_atr, sim->script->atr, (sim->script->atr_len > sizeof(data->card_atr)) ? sizeof(data->card_atr) : sim->script->atr_len);
+		break;
+
+	case ITE_DEVCTL_UART_SET_BAUDRATE:
+		break;
+
+	case ITE_DEVCTL_UART_SEND_DATA:
+		return _itesim_send(sim, data->uart_data.buffer, data->uart_data.length);
+
+	case ITE_DEVCTL_UART_CHECK_READY:
+		data->uart_ready = (sim->rx_pos < sim->rx_len && _itesim_get_time() >= sim->ready) ? 1 : 0;
+		break;
+
+	case ITE_DEVCTL_UART_RECV_DATA:
+	{
+		uint32_t len = 0;
+
+		if (_itesim_get_time() >= sim->ready) {
+			len = sim->rx_len - sim->rx_pos;
+			if (len > data->uart_data.length) {
+				len = data->uart_data.length;
+			}
+
+			memcpy(data->uart_data.buffer, sim->rx + sim->rx_pos, len);
+			sim->rx_pos += len;
+		}
+
+		data->uart_data.length = (uint8_t)len;
+		break;
+	}
+
+	default:
+		if (type == ITE_IOCTL_IN) {
+			data->ui32_rval = 0;
+		}
+		break;
+	}
+
+	return true;
+}
+
+bool itesim_private_ioctl(itesim *const sim, const ite_ioctl_type type, const uint32_t ioctl_code)
+{
+	_itesim_wait(sim, sim->script->ioctl_time);
+
+	return (type == ITE_IOCTL_OUT && sim->script->private_ioctl == true) ? true : false;
+}
@@ -0,0 +1,64 @@
+// itesim.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ite.h"
+
+// a simulated device with a T=1 card, which answers the device control requests
+// as described by a script. it is used to measure the module without a tuner.
+//
+// path: \\?\itecard#sim#<id>#<script path>
+
+#define ITESIM_PATH_PREFIX		L"\\\\?\\itecard#sim#"
+#define ITESIM_PATH_PREFIX_LEN	16
+
+#define ITESIM_MAX_RESPONSE_NUM	64
+
+struct itesim_response
+{
+	uint8_t prefix_len;
+	uint8_t len;
+	uint8_t prefix[32];		// matched against the beginning of the command
+	uint8_t data[254];
+};
+
+// read from the script once in a process
+struct itesim_script
+{
+	struct itesim_script *next;
+	uint8_t atr[33];
+	uint8_t atr_len;
+	bool private_ioctl;
+	bool echo;				// the command data is sent back before the default response
+	uint32_t ioctl_time;	// microseconds taken by every device control request
+	uint32_t response_time;	// microseconds until the response block is ready
+	uint32_t response_num;
+	struct itesim_response def;
+	struct itesim_response response[ITESIM_MAX_RESPONSE_NUM];
+	wchar_t path[1];
+};
+
+typedef struct _itesim
+{
+	const struct itesim_script *script;
+	uint64_t freq;
+	uint64_t ready;			// time when the received data can be read
+	uint32_t rx_len;		// received from the card
+	uint32_t rx_pos;
+	uint32_t tx_len;		// sent to the card
+	uint32_t last_len;
+	uint8_t rx[259];
+	uint8_t tx[259];
+	uint8_t last[259];		// the last block sent by the card, for R-blocks
+} itesim;
+
+extern bool itesim_is_path(const wchar_t *const path);
+extern itesim * itesim_open(const wchar_t *const path);
+extern void itesim_close(itesim *const sim);
+extern bool itesim_devctl(itesim *const sim, const ite_ioctl_type type, struct ite_devctl_data *const data);
+extern bool itesim_private_ioctl(itesim *const sim, const ite_ioctl_type type, const uint32_t ioctl_code);
+
+#define itesim_v_supported_private_ioctl(sim) ((sim)->script->private_ioctl)
@@ -0,0 +1,594 @@
+// logring.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <wchar.h>
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+
+#include "logring.h"
+
+#ifdef _WIN32
+
+// x86 and x64 keep stores in order and loads in order, so only the compiler has to be stopped
+static __inline uint32_t _load_acquire(const volatile uint32_t *const p)
+{
+	uint32_t v = *p;
+	_ReadWriteBarrier();
+	return v;
+}
+
+static __inline void _store_release(volatile uint32_t *const p, const uint32_t v)
+{
+	_ReadWriteBarrier();
+	*p = v;
+}
+
+#else
+
+#define _load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#endif
+
+#define _RING_MASK			(LOGRING_SIZE - 1)
+#define _RECORD_PADDING		0xff
+#define _HEADER_SIZE		((sizeof(struct logring_record) + 7) & ~(size_t)7)
+#define _record_align(size)	(((size) + (LOGRING_RECORD_ALIGN - 1)) & ~((size_t)LOGRING_RECORD_ALIGN - 1))
+
+// length modifiers
+enum _len {
+	_LEN_NONE = 0,
+	_LEN_SHORT,		// h, hh
+	_LEN_LONG,		// l
+	_LEN_LLONG,		// ll, I64
+	_LEN_SIZE,		// z, I
+	_LEN_INTMAX,	// j
+	_LEN_PTRDIFF,	// t
+	_LEN_WIDE,		// w
+};
+
+struct _spec {
+	uint32_t conv;
+	enum _len len;
+};
+
+static __inline uint32_t _fmt_char(const void *const format, const bool wide, const size_t i)
+{
+	return (wide) ? (uint32_t)((const wchar_t *)format)[i] : (uint32_t)(uint8_t)((const char *)format)[i];
+}
+
+// parses a conversion specification which starts after '%'. '*' is reported
+// through star (if any) so that the caller can take the argument.
+static size_t _parse_spec(const void *const format, const bool wide, size_t i, struct _spec *const spec, void (*star)(void *ctx), void *const ctx)
+{
+	uint32_t c;
+
+	while ((c = _fmt_char(format, wide, i)) == '-' || c == '+' || c == ' ' || c == '#' || c == '0')
+		i++;
+
+	if (c == '*') {
+		if (star != NULL)
+			star(ctx);
+		c = _fmt_char(format, wide, ++i);
+	}
+	else {
+		while (c >= '0' && c <= '9')
+			c = _fmt_char(format, wide, ++i);
+	}
+
+	if (c == '.') {
+		c = _fmt_char(format, wide, ++i);
+
+		if (c == '*') {
+			if (star != NULL)
+				star(ctx);
+			c = _fmt_char(format, wide, ++i);
+		}
+		else {
+			while (c >= '0' && c <= '9')
+				c = _fmt_char(format, wide, ++i);
+		}
+	}
+
+	spec->len = _LEN_NONE;
+
+	switch (c) {
+	case 'h':
+		spec->len = _LEN_SHORT;
+		if ((c = _fmt_char(format, wide, ++i)) == 'h')
+			c = _fmt_char(format, wide, ++i);
+		break;
+
+	case 'l':
+		spec->len = _LEN_LONG;
+		if ((c = _fmt_char(format, wide, ++i)) == 'l') {
+			spec->len = _LEN_LLONG;
+			c = _fmt_char(format, wide, ++i);
+		}
+		break;
+
+	case 'I':
+		spec->len = _LEN_SIZE;
+		c = _fmt_char(format, wide, ++i);
+		if (c == '6' && _fmt_char(format, wide, i + 1) == '4') {
+			spec->len = _LEN_LLONG;
+			i += 2;
+		}
+		else if (c == '3' && _fmt_char(format, wide, i + 1) == '2') {
+			spec->len = _LEN_NONE;
+			i += 2;
+		}
+		c = _fmt_char(format, wide, i);
+		break;
+
+	case 'z':
+		spec->len = _LEN_SIZE;
+		c = _fmt_char(format, wide, ++i);
+		break;
+
+	case 'j':
+		spec->len = _LEN_INTMAX;
+		c = _fmt_char(format, wide, ++i);
+		break;
+
+	case 't':
+		spec->len = _LEN_PTRDIFF;
+		c = _fmt_char(format, wide, ++i);
+		break;
+
+	case 'w':
+		spec->len = _LEN_WIDE;
+		c = _fmt_char(format, wide, ++i);
+		break;
+
+	default:
+		break;
+	}
+
+	spec->conv = c;
+
+	// index of the conversion character
+	return i;
+}
+
+// whether a string argument is wchar_t, following the rules of the C runtime
+static bool _is_wide_string(const bool wide, const struct _spec *const spec)
+{
+#ifdef _WIN32
+	if (spec->len == _LEN_SHORT)
+		return false;
+	if (spec->len == _LEN_LONG || spec->len == _LEN_WIDE)
+		return true;
+
+	return (spec->conv == 's') ? wide : !wide;
+#else
+	return (spec->len == _LEN_LONG || spec->conv == 'S') ? true : false;
+#endif
+}
+
+void logring_init(struct logring *const ring)
+{
+	ring->head = 0;
+	ring->drop = 0;
+	ring->tail = 0;
+	ring->drop_reported = 0;
+	ring->next = NULL;
+	ring->in_use = 0;
+	ring->thread_id = 0;
+}
+
+uint32_t logring_get_used(const struct logring *const ring)
+{
+	return ring->head - _load_acquire(&ring->tail);
+}
+
+// producer
+
+struct _capture {
+	va_list args;
+	uint32_t num;
+	uint64_t arg[LOGRING_MAX_ARG_NUM];
+	const void *str[LOGRING_MAX_ARG_NUM];
+	size_t str_size[LOGRING_MAX_ARG_NUM];	// bytes including the terminator
+	size_t str_total;
+	bool overflow;
+};
+
+static void _capture_star(void *ctx)
+{
+	struct _capture *cap = ctx;
+
+	if (cap->num >= LOGRING_MAX_ARG_NUM) {
+		cap->overflow = true;
+		return;
+	}
+
+	cap->str[cap->num] = NULL;
+	cap->arg[cap->num++] = (uint64_t)(int64_t)va_arg(cap->args, int);
+}
+
+static bool _capture_args(struct _capture *const cap, const bool wide, const void *const format)
+{
+	uint32_t c;
+
+	for (size_t i = 0; (c = _fmt_char(format, wide, i)) != 0; i++)
+	{
+		struct _spec spec;
+
+		if (c != '%') {
+			// skip to the next specification
+			const void *p = (wide) ? (const void *)wcschr((const wchar_t *)format + i, L'%') : (const void *)strchr((const char *)format + i, '%');
+
+			if (p == NULL)
+				break;
+
+			i = ((const uint8_t *)p - (const uint8_t *)format) / ((wide) ? sizeof(wchar_t) : 1);
+		}
+
+		if (_fmt_char(format, wide, i + 1) == '%') {
+			i++;
+			continue;
+		}
+
+		i = _parse_spec(format, wide, i + 1, &spec, _capture_star, cap);
+
+		if (cap->overflow == true || cap->num >= LOGRING_MAX_ARG_NUM)
+			return false;
+
+		uint64_t *v = &cap->arg[cap->num];
+
+		cap->str[cap->num] = NULL;
+
+		switch (spec.conv) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': case 'C':
+			switch (spec.len) {
+			case _LEN_LONG:		*v = (uint64_t)(int64_t)va_arg(cap->args, long); break;
+			case _LEN_LLONG:	*v = (uint64_t)va_arg(cap->args, long long); break;
+			case _LEN_SIZE:		*v = (uint64_t)va_arg(cap->args, size_t); break;
+			case _LEN_INTMAX:	*v = (uint64_t)va_arg(cap->args, intmax_t); break;
+			case _LEN_PTRDIFF:	*v = (uint64_t)va_arg(cap->args, ptrdiff_t); break;
+			default:			*v = (uint64_t)(int64_t)va_arg(cap->args, int); break;
+			}
+			break;
+
+		case 'p':
+			*v = (uint64_t)(uintptr_t)va_arg(cap->args, void *);
+			break;
+
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		{
+			double d = va_arg(cap->args, double);
+			memcpy(v, &d, sizeof(double));
+			break;
+		}
+
+		case 's': case 'S':
+		{
+			const void *s = va_arg(cap->args, const void *);
+			size_t cs = (_is_wide_string(wide, &spec) == true) ? sizeof(wchar_t) : 1;
+			size_t avail = LOGRING_MAX_RECORD_SIZE - _HEADER_SIZE - (sizeof(uint64_t) * LOGRING_MAX_ARG_NUM) - cap->str_total;
+			size_t n;
+
+			*v = cs;
+			if (s == NULL || avail < cs)
+				break;
+
+			// truncated to what is left in the record
+			n = (cs == 1) ? strlen(s) : wcslen(s);
+			if ((n + 1) * cs > avail)
+				n = (avail / cs) - 1;
+
+			cap->str[cap->num] = s;
+			cap->str_size[cap->num] = (n + 1) * cs;
+			cap->str_total += cap->str_size[cap->num];
+			break;
+		}
+
+		default:
+			// %n and unknown conversions
+			return false;
+		}
+
+		cap->num++;
+	}
+
+	return true;
+}
+
+// reserves size bytes and returns the place of the record, or NULL when the ring is full
+static struct logring_record * _reserve(struct logring *const ring, const size_t size, uint32_t *const next)
+{
+	uint32_t head = ring->head;
+	uint32_t off = head & _RING_MASK;
+	uint32_t contiguous = LOGRING_SIZE - off;
+	uint32_t need = (contiguous < size) ? (contiguous + (uint32_t)size) : (uint32_t)size;
+
+	if (LOGRING_SIZE - (head - _load_acquire(&ring->tail)) < need) {
+		ring->drop++;
+		return NULL;
+	}
+
+	if (contiguous < size) {
+		// the rest of the ring is skipped by the consumer
+		((struct logring_record *)(ring->buf + off))->arg_num = _RECORD_PADDING;
+		off = 0;
+	}
+
+	*next = head + need;
+
+	return (struct logring_record *)(ring->buf + off);
+}
+
+bool logring_write(struct logring *const ring, const bool wide, const void *const format, va_list args, const uint32_t thread_id, const uint64_t time)
+{
+	struct _capture cap;
+	struct logring_record *rec;
+	uint32_t next;
+	size_t size;
+
+	cap.num = 0;
+	cap.str_total = 0;
+	cap.overflow = false;
+	va_copy(cap.args, args);
+
+	if (_capture_args(&cap, wide, format) == true)
+	{
+		va_end(cap.args);
+
+		size = _record_align(_HEADER_SIZE + (sizeof(uint64_t) * cap.num) + cap.str_total);
+
+		rec = _reserve(ring, size, &next);
+		if (rec == NULL)
+			return false;
+
+		uint64_t *arg = (uint64_t *)((uint8_t *)rec + _HEADER_SIZE);
+		size_t off = _HEADER_SIZE + (sizeof(uint64_t) * cap.num);
+
+		for (uint32_t i = 0; i < cap.num; i++)
+		{
+			if (cap.str[i] == NULL) {
+				// an integer, a double, or the character size of a NULL string
+				arg[i] = cap.arg[i];
+				continue;
+			}
+
+			// the character size and the offset of the copy
+			arg[i] = cap.arg[i] | ((uint64_t)off << 8);
+			memcpy((uint8_t *)rec + off, cap.str[i], cap.str_size[i] - cap.arg[i]);
+			memset((uint8_t *)rec + off + cap.str_size[i] - cap.arg[i], 0, (size_t)cap.arg[i]);
+			off += cap.str_size[i];
+		}
+
+		rec->format = format;
+		rec->arg_num = (uint8_t)cap.num;
+	}
+	else
+	{
+		// formatted here instead
+		wchar_t text[(LOGRING_MAX_RECORD_SIZE - _HEADER_SIZE) / sizeof(wchar_t)];
+		const size_t cs = (wide) ? sizeof(wchar_t) : 1;
+		const size_t max = sizeof(text) / cs;
+		int c;
+
+		va_end(cap.args);
+
+		if (wide)
+			c = vswprintf(text, max, format, args);
+		else
+			c = vsnprintf((char *)text, max, format, args);
+
+		if (c < 0 || (size_t)c >= max)
+			c = (int)max - 1;
+
+		size = (c + 1) * cs;
+
+		rec = _reserve(ring, _record_align(_HEADER_SIZE + size), &next);
+		if (rec == NULL)
+			return false;
+
+		memcpy((uint8_t *)rec + _HEADER_SIZE, text, size - cs);
+		memset((uint8_t *)rec + _HEADER_SIZE + size - cs, 0, cs);
+
+		size = _record_align(_HEADER_SIZE + size);
+		rec->format = NULL;
+		rec->arg_num = 0;
+	}
+
+	rec->size = (uint16_t)size;
+	rec->wide = (wide) ? 1 : 0;
+	rec->thread_id = thread_id;
+	rec->time = time;
+
+	_store_release(&ring->head, next);
+
+	return true;
+}
+
+// consumer
+
+const struct logring_record * logring_peek(struct logring *const ring)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = _load_acquire(&ring->head);
+	const struct logring_record *rec;
+
+	if (tail == head)
+		return NULL;
+
+	rec = (const struct logring_record *)(ring->buf + (tail & _RING_MASK));
+
+	if (rec->arg_num == _RECORD_PADDING) {
+		tail += LOGRING_SIZE - (tail & _RING_MASK);
+		_store_release(&ring->tail, tail);
+
+		if (tail == head)
+			return NULL;
+
+		rec = (const struct logring_record *)ring->buf;
+	}
+
+	return rec;
+}
+
+void logring_pop(struct logring *const ring, const struct logring_record *const rec)
+{
+	_store_release(&ring->tail, ring->tail + rec->size);
+}
+
+struct _format {
+	const struct logring_record *rec;
+	uint32_t n;				// next argument
+	uint32_t spec_len;
+	char spec_a[48];
+	wchar_t spec_w[48];
+};
+
+static uint64_t _format_next_arg(struct _format *const f)
+{
+	if (f->n >= f->rec->arg_num)
+		return 0;
+
+	return ((const uint64_t *)((const uint8_t *)f->rec + _HEADER_SIZE))[f->n++];
+}
+
+static void _format_spec_put(struct _format *const f, const uint32_t c)
+{
+	if (f->spec_len < 47) {
+		f->spec_a[f->spec_len] = (char)c;
+		f->spec_w[f->spec_len] = (wchar_t)c;
+		f->spec_len++;
+	}
+}
+
+// '*' is replaced with the recorded value
+static void _format_star(void *ctx)
+{
+	struct _format *f = ctx;
+	char num[16];
+	int c = snprintf(num, sizeof(num), "%d", (int)_format_next_arg(f));
+
+	for (int i = 0; i < c; i++)
+		_format_spec_put(f, num[i]);
+}
+
+size_t logring_format(const struct logring_record *const rec, void *const buf, const size_t len)
+{
+	const bool wide = (rec->wide != 0) ? true : false;
+	const void *format = rec->format;
+	size_t n = 0;
+	uint32_t c;
+
+	if (len == 0)
+		return 0;
+
+	if (format == NULL) {
+		// already formatted
+		format = (const uint8_t *)rec + _HEADER_SIZE;
+	}
+
+#define _put(ch) \
+	do { if (wide) ((wchar_t *)buf)[n++] = (wchar_t)(ch); else ((char *)buf)[n++] = (char)(ch); } while (0)
+#define _format_arg(v) \
+	((wide) ? swprintf((wchar_t *)buf + n, len - n, f.spec_w, v) : snprintf((char *)buf + n, len - n, f.spec_a, v))
+
+	struct _format f;
+
+	f.rec = rec;
+	f.n = 0;
+
+	for (size_t i = 0; (c = _fmt_char(format, wide, i)) != 0 && n < len - 1; i++)
+	{
+		struct _spec spec;
+		size_t end;
+		int r;
+
+		if (c != '%' || rec->format == NULL) {
+			_put(c);
+			continue;
+		}
+
+		if (_fmt_char(format, wide, i + 1) == '%') {
+			_put('%');
+			i++;
+			continue;
+		}
+
+		// the specification is copied with '*' resolved
+		f.spec_len = 0;
+		_format_spec_put(&f, '%');
+
+		end = _parse_spec(format, wide, i + 1, &spec, NULL, NULL);
+
+		for (size_t j = i + 1; j <= end; j++) {
+			uint32_t sc = _fmt_char(format, wide, j);
+
+			if (sc == '*')
+				_format_star(&f);
+			else
+				_format_spec_put(&f, sc);
+		}
+
+		f.spec_a[f.spec_len] = '\0';
+		f.spec_w[f.spec_len] = L'\0';
+
+		uint64_t v = _format_next_arg(&f);
+
+		switch (spec.conv) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': case 'C':
+			switch (spec.len) {
+			case _LEN_LONG:		r = _format_arg((long)v); break;
+			case _LEN_LLONG:	r = _format_arg((long long)v); break;
+			case _LEN_SIZE:		r = _format_arg((size_t)v); break;
+			case _LEN_INTMAX:	r = _format_arg((intmax_t)v); break;
+			case _LEN_PTRDIFF:	r = _format_arg((ptrdiff_t)v); break;
+			default:			r = _format_arg((int)v); break;
+			}
+			break;
+
+		case 'p':
+			r = _format_arg((void *)(uintptr_t)v);
+			break;
+
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		{
+			double d;
+			memcpy(&d, &v, sizeof(double));
+			r = _format_arg(d);
+			break;
+		}
+
+		case 's': case 'S':
+			// the character size in the low byte, the offset of the copy above it (0: NULL)
+			r = _format_arg((v >> 8) ? (const void *)((const uint8_t *)rec + (v >> 8)) : NULL);
+			break;
+
+		default:
+			r = 0;
+			break;
+		}
+
+		if (r < 0 || (size_t)r >= len - n) {
+			// truncated
+			n = len - 1;
+			break;
+		}
+
+		n += r;
+		i = end;
+	}
+
+#undef _format_arg
+#undef _put
+
+	if (wide)
+		((wchar_t *)buf)[n] = L'\0';
+	else
+		((char *)buf)[n] = '\0';
+
+	return n;
+}
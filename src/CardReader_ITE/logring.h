@@ -0,0 +1,73 @@
+// logring.h
+
+#pragma once
+
+// single-producer/single-consumer ring of binary log records. the producer only
+// copies the format and its arguments, and the text is made by the consumer.
+// kept free of windows.h so that the producer side can be benchmarked on other
+// platforms too.
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#define LOGRING_CACHE_LINE_SIZE	64
+#define LOGRING_SIZE			0x10000		// bytes, power of two
+#define LOGRING_RECORD_ALIGN	32
+#define LOGRING_MAX_RECORD_SIZE	0x400		// longer strings are truncated
+#define LOGRING_MAX_ARG_NUM		8
+
+struct logring_record
+{
+	uint16_t size;			// including the header, a multiple of LOGRING_RECORD_ALIGN
+	uint8_t wide;			// format is wchar_t
+	uint8_t arg_num;		// 0xff: padding up to the end of the ring
+	uint32_t thread_id;
+	uint64_t time;
+	const void *format;		// NULL: the text follows the header
+};
+
+struct logring
+{
+	// written by the producer
+	union {
+		struct {
+			volatile uint32_t head;
+			volatile uint32_t drop;		// records which did not fit
+		};
+		uint8_t line0[LOGRING_CACHE_LINE_SIZE];
+	};
+	// written by the consumer
+	union {
+		struct {
+			volatile uint32_t tail;
+			uint32_t drop_reported;
+		};
+		uint8_t line1[LOGRING_CACHE_LINE_SIZE];
+	};
+	union {
+		struct {
+			struct logring *next;
+			volatile uint32_t in_use;	// owned by a thread
+			uint32_t thread_id;
+		};
+		uint8_t line2[LOGRING_CACHE_LINE_SIZE];
+	};
+	uint8_t buf[LOGRING_SIZE];
+};
+
+extern void logring_init(struct logring *const ring);
+
+// producer. returns false when the record was dropped.
+extern bool logring_write(struct logring *const ring, const bool wide, const void *const format, va_list args, const uint32_t thread_id, const uint64_t time);
+extern uint32_t logring_get_used(const struct logring *const ring);
+
+// consumer. the record returned by logring_peek stays valid until logring_pop.
+extern const struct logring_record * logring_peek(struct logring *const ring);
+extern void logring_pop(struct logring *const ring, const struct logring_record *const rec);
+
+// formats a record into buf (wchar_t when rec->wide, char otherwise) and
+// returns the number of characters, excluding the terminator.
+extern size_t logring_format(const struct logring_record *const rec, void *const buf, const size_t len);
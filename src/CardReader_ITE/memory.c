@@ -1,29 +1,294 @@
 // memory.c
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <stdlib.h>
+#endif
+
+#include "memory.h"
+
+// the allocator also builds outside of Windows so that it can be benchmarked there
+
+#ifdef _WIN32
 
 static HANDLE _hHeap = NULL;
 
+#define _heap_alloc(size, zero)	HeapAlloc(_hHeap, ((zero) ? HEAP_ZERO_MEMORY : 0), (size))
+#define _heap_free(p)			HeapFree(_hHeap, 0, (LPVOID)(p))
+
+typedef SRWLOCK _mem_lock;
+
+#define _lock_init(l)		InitializeSRWLock((l))
+#define _lock_deinit(l)
+#define _lock_acquire(l)	AcquireSRWLockExclusive((l))
+#define _lock_release(l)	ReleaseSRWLockExclusive((l))
+
+#define _counter_inc(v)		InterlockedIncrement64((volatile LONGLONG *)&(v))
+
+#else
+
+#define _heap_alloc(size, zero)	((zero) ? calloc(1, (size)) : malloc((size)))
+#define _heap_free(p)			free((void *)(p))
+
+typedef pthread_mutex_t _mem_lock;
+
+#define _lock_init(l)		pthread_mutex_init((l), NULL)
+#define _lock_deinit(l)		pthread_mutex_destroy((l))
+#define _lock_acquire(l)	pthread_mutex_lock((l))
+#define _lock_release(l)	pthread_mutex_unlock((l))
+
+#define _counter_inc(v)		__atomic_add_fetch(&(v), 1, __ATOMIC_RELAXED)
+
+#endif
+
+#define _MEM_ALIGN	16
+#define _mem_align(size) (((size) + (_MEM_ALIGN - 1)) & ~((size_t)_MEM_ALIGN - 1))
+
+static struct mem_stats _stats;
+
+struct _mem_slab {
+	struct _mem_slab *next;
+};
+
+struct _mem_pool_info {
+	_mem_lock lock;
+	size_t size;			// object size
+	uint32_t slab_num;		// objects per slab
+	void *free_list;
+	struct _mem_slab *slab;
+};
+
+struct _mem_arena_chunk {
+	struct _mem_arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+struct _mem_arena_info {
+	size_t chunk_size;
+	struct _mem_arena_chunk *chunk;
+};
+
 bool memInit()
 {
+	memset(&_stats, 0, sizeof(_stats));
+
+#ifdef _WIN32
 	_hHeap = HeapCreate(0, 0x1000, 0);
 
 	return (_hHeap != NULL) ? true : false;
+#else
+	return true;
+#endif
 }
 
 void memDeinit()
 {
+#ifdef _WIN32
 	if (_hHeap != NULL)
 		HeapDestroy(_hHeap);
+#endif
 }
 
 void * memAlloc(const size_t size)
 {
-	return HeapAlloc(_hHeap, HEAP_ZERO_MEMORY, size);
+	_counter_inc(_stats.alloc);
+	return _heap_alloc(size, true);
+}
+
+// for memory which is overwritten by the caller anyway
+void * memAllocRaw(const size_t size)
+{
+	_counter_inc(_stats.alloc);
+	return _heap_alloc(size, false);
 }
 
 void memFree(const void *const p)
 {
-	HeapFree(_hHeap, 0, (LPVOID)p);
+	if (p == NULL)
+		return;
+
+	_counter_inc(_stats.free);
+	_heap_free(p);
+}
+
+void memGetStats(struct mem_stats *const stats)
+{
+	memcpy(stats, &_stats, sizeof(struct mem_stats));
+}
+
+// pool
+
+mem_pool memPoolCreate(const size_t size, const uint32_t slab_num)
+{
+	struct _mem_pool_info *pool;
+
+	if (size == 0 || slab_num == 0)
+		return NULL;
+
+	pool = _heap_alloc(sizeof(struct _mem_pool_info), true);
+	if (pool == NULL)
+		return NULL;
+
+	_lock_init(&pool->lock);
+	// a free object holds the link to the next one
+	pool->size = _mem_align((size < sizeof(void *)) ? sizeof(void *) : size);
+	pool->slab_num = slab_num;
+	pool->free_list = NULL;
+	pool->slab = NULL;
+
+	return pool;
+}
+
+void memPoolDestroy(mem_pool pool)
+{
+	struct _mem_pool_info *info = pool;
+	struct _mem_slab *slab;
+
+	if (info == NULL)
+		return;
+
+	slab = info->slab;
+	while (slab != NULL) {
+		struct _mem_slab *next = slab->next;
+
+		_heap_free(slab);
+		slab = next;
+	}
+
+	_lock_deinit(&info->lock);
+	_heap_free(info);
+}
+
+// add a slab to the free list (called with the lock held)
+static bool _mem_pool_grow(struct _mem_pool_info *const info)
+{
+	struct _mem_slab *slab;
+	uint8_t *p;
+
+	slab = _heap_alloc(_mem_align(sizeof(struct _mem_slab)) + (info->size * info->slab_num), false);
+	if (slab == NULL)
+		return false;
+
+	slab->next = info->slab;
+	info->slab = slab;
+
+	p = (uint8_t *)slab + _mem_align(sizeof(struct _mem_slab));
+
+	for (uint32_t i = 0; i < info->slab_num; i++, p += info->size) {
+		*(void **)p = info->free_list;
+		info->free_list = p;
+	}
+
+	_counter_inc(_stats.pool_grow);
+
+	return true;
+}
+
+void * memPoolAlloc(mem_pool pool)
+{
+	struct _mem_pool_info *info = pool;
+	void *p = NULL;
+
+	_lock_acquire(&info->lock);
+
+	if (info->free_list != NULL || _mem_pool_grow(info) == true) {
+		p = info->free_list;
+		info->free_list = *(void **)p;
+	}
+
+	_lock_release(&info->lock);
+
+	if (p != NULL) {
+		_counter_inc(_stats.pool_alloc);
+	}
+
+	return p;
+}
+
+void memPoolFree(mem_pool pool, const void *const p)
+{
+	struct _mem_pool_info *info = pool;
+
+	if (p == NULL)
+		return;
+
+	_lock_acquire(&info->lock);
+
+	*(void **)p = info->free_list;
+	info->free_list = (void *)p;
+
+	_lock_release(&info->lock);
+
+	_counter_inc(_stats.pool_free);
+}
+
+// arena
+
+mem_arena memArenaCreate(const size_t chunk_size)
+{
+	struct _mem_arena_info *arena;
+
+	arena = _heap_alloc(sizeof(struct _mem_arena_info), false);
+	if (arena == NULL)
+		return NULL;
+
+	arena->chunk_size = (chunk_size < 0x1000) ? 0x1000 : chunk_size;
+	arena->chunk = NULL;
+
+	return arena;
+}
+
+void memArenaDestroy(mem_arena arena)
+{
+	struct _mem_arena_info *info = arena;
+	struct _mem_arena_chunk *chunk;
+
+	if (info == NULL)
+		return;
+
+	chunk = info->chunk;
+	while (chunk != NULL) {
+		struct _mem_arena_chunk *next = chunk->next;
+
+		_heap_free(chunk);
+		chunk = next;
+	}
+
+	_heap_free(info);
+}
+
+void * memArenaAlloc(mem_arena arena, const size_t size)
+{
+	struct _mem_arena_info *info = arena;
+	struct _mem_arena_chunk *chunk = info->chunk;
+	size_t sz = _mem_align(size);
+
+	if (chunk == NULL || (chunk->size - chunk->used) < sz)
+	{
+		size_t chunk_size = _mem_align(sizeof(struct _mem_arena_chunk)) + ((sz > info->chunk_size) ? sz : info->chunk_size);
+
+		chunk = _heap_alloc(chunk_size, false);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->next = info->chunk;
+		chunk->size = chunk_size;
+		chunk->used = _mem_align(sizeof(struct _mem_arena_chunk));
+		info->chunk = chunk;
+
+		_counter_inc(_stats.arena_chunk);
+	}
+
+	void *p = (uint8_t *)chunk + chunk->used;
+
+	chunk->used += sz;
+	_counter_inc(_stats.arena_alloc);
+
+	return p;
 }
@@ -3,8 +3,38 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void* mem_pool;
+typedef void* mem_arena;
+
+struct mem_stats
+{
+	uint64_t alloc;			// memAlloc / memAllocRaw
+	uint64_t free;			// memFree
+	uint64_t pool_alloc;	// memPoolAlloc
+	uint64_t pool_free;		// memPoolFree
+	uint64_t pool_grow;		// slabs added to pools
+	uint64_t arena_alloc;	// memArenaAlloc
+	uint64_t arena_chunk;	// chunks taken by arenas
+};
 
 extern bool memInit();
 extern void memDeinit();
 extern void * memAlloc(const size_t size);
+extern void * memAllocRaw(const size_t size);
 extern void memFree(const void *const p);
+extern void memGetStats(struct mem_stats *const stats);
+
+// fixed-size objects. memory returned by memPoolAlloc is not zeroed.
+extern mem_pool memPoolCreate(const size_t size, const uint32_t slab_num);
+extern void memPoolDestroy(mem_pool pool);
+extern void * memPoolAlloc(mem_pool pool);
+extern void memPoolFree(mem_pool pool, const void *const p);
+
+// short-lived allocations which are all released at once. not thread-safe,
+// and memory returned by memArenaAlloc is not zeroed.
+extern mem_arena memArenaCreate(const size_t chunk_size);
+extern void memArenaDestroy(mem_arena arena);
+extern void * memArenaAlloc(mem_arena arena, const size_t size);
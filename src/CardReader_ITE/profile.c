@@ -0,0 +1,372 @@
+// profile.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+#include <stdio.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "profile.h"
+
+// the profile APIs are used on Windows. the file is read again on every call, as the
+// settings are only read when the module is loaded.
+
+#ifndef _WIN32
+
+#define _PROFILE_MAX_SIZE	0x100000	// larger files are not read
+
+struct _profile
+{
+	wchar_t *text;
+	uint32_t len;
+	uint32_t pos;		// of the next line
+};
+
+// the file as one wide string, decoded from UTF-16LE if it starts with its BOM, and from UTF-8 otherwise
+static bool _profile_load(struct _profile *const prof, const wchar_t *const path)
+{
+	char name[1024];
+	FILE *fp;
+	uint8_t *data;
+	long size;
+	uint32_t i = 0, n = 0;
+
+	memset(prof, 0, sizeof(struct _profile));
+
+	if (wstrToUtf8(name, sizeof(name), path) == 0)
+		return false;
+
+	fp = fopen(name, "rb");
+	if (fp == NULL)
+		return false;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 || size > _PROFILE_MAX_SIZE || fseek(fp, 0, SEEK_SET) != 0) {
+		internal_err("_profile_load: couldn't get the size");
+		fclose(fp);
+		return false;
+	}
+
+	data = memAllocRaw((size_t)size + 1);
+	if (data == NULL) {
+		internal_err("_profile_load: memAllocRaw failed");
+		fclose(fp);
+		return false;
+	}
+
+	if (fread(data, 1, (size_t)size, fp) != (size_t)size) {
+		internal_err("_profile_load: fread failed");
+		memFree(data);
+		fclose(fp);
+		return false;
+	}
+
+	fclose(fp);
+
+	// every character takes a byte at least
+	prof->text = memAllocRaw(((size_t)size + 1) * sizeof(wchar_t));
+	if (prof->text == NULL) {
+		internal_err("_profile_load: memAllocRaw failed");
+		memFree(data);
+		return false;
+	}
+
+	if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE)
+	{
+		for (i = 2; i + 1 < (uint32_t)size; i += 2)
+		{
+			uint32_t c = data[i] | (data[i + 1] << 8);
+
+			if (c >= 0xD800 && c < 0xDC00 && i + 3 < (uint32_t)size) {
+				uint32_t c2 = data[i + 2] | (data[i + 3] << 8);
+
+				if (c2 >= 0xDC00 && c2 < 0xE000) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+					i += 2;
+				}
+			}
+
+			prof->text[n++] = (wchar_t)c;
+		}
+	}
+	else
+	{
+		if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+			i = 3;
+
+		while (i < (uint32_t)size)
+		{
+			uint32_t c = data[i++];
+			uint32_t follow = 0;
+
+			if (c >= 0xF0) {
+				c &= 0x07;
+				follow = 3;
+			}
+			else if (c >= 0xE0) {
+				c &= 0x0F;
+				follow = 2;
+			}
+			else if (c >= 0xC0) {
+				c &= 0x1F;
+				follow = 1;
+			}
+
+			while (follow-- > 0 && i < (uint32_t)size && (data[i] & 0xC0) == 0x80)
+				c = (c << 6) | (data[i++] & 0x3F);
+
+			prof->text[n++] = (wchar_t)c;
+		}
+	}
+
+	prof->text[n] = L'\0';
+	prof->len = n;
+
+	memFree(data);
+
+	return true;
+}
+
+static void _profile_free(struct _profile *const prof)
+{
+	if (prof->text != NULL) {
+		memFree(prof->text);
+		prof->text = NULL;
+	}
+}
+
+#define _profile_is_blank(ch) ((ch) == L' ' || (ch) == L'\t')
+
+// the next line without the surrounding blanks. returns false at the end of the file.
+static bool _profile_next_line(struct _profile *const prof, const wchar_t **const line, uint32_t *const len)
+{
+	uint32_t start, end;
+
+	if (prof->pos >= prof->len)
+		return false;
+
+	start = prof->pos;
+	end = start;
+
+	while (end < prof->len && prof->text[end] != L'\n')
+		end++;
+
+	prof->pos = end + 1;
+
+	while (start < end && (_profile_is_blank(prof->text[start]) || prof->text[start] == L'\r'))
+		start++;
+
+	while (end > start && (_profile_is_blank(prof->text[end - 1]) || prof->text[end - 1] == L'\r'))
+		end--;
+
+	*line = prof->text + start;
+	*len = end - start;
+
+	return true;
+}
+
+// the names of sections and keys are compared without regard to the case of ASCII letters
+static bool _profile_name_equal(const wchar_t *const name, const uint32_t len, const wchar_t *const str)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		wchar_t c1 = name[i], c2 = str[i];
+
+		if (c2 == L'\0')
+			return false;
+
+		if (c1 >= L'A' && c1 <= L'Z')
+			c1 += L'a' - L'A';
+		if (c2 >= L'A' && c2 <= L'Z')
+			c2 += L'a' - L'A';
+
+		if (c1 != c2)
+			return false;
+	}
+
+	return (str[i] == L'\0') ? true : false;
+}
+
+// move to the line after the header of the section
+static bool _profile_find_section(struct _profile *const prof, const wchar_t *const section)
+{
+	const wchar_t *line;
+	uint32_t len;
+
+	while (_profile_next_line(prof, &line, &len) == true)
+	{
+		if (len < 2 || line[0] != L'[')
+			continue;
+
+		uint32_t end = 1;
+
+		while (end < len && line[end] != L']')
+			end++;
+
+		if (end < len && _profile_name_equal(line + 1, end - 1, section) == true)
+			return true;
+	}
+
+	return false;
+}
+
+// the value of the key in the section, without the surrounding blanks and quotes
+static bool _profile_find_value(struct _profile *const prof, const wchar_t *const section, const wchar_t *const key, const wchar_t **const value, uint32_t *const value_len)
+{
+	const wchar_t *line;
+	uint32_t len;
+
+	if (_profile_find_section(prof, section) == false)
+		return false;
+
+	while (_profile_next_line(prof, &line, &len) == true)
+	{
+		if (len == 0 || line[0] == L';')
+			continue;
+
+		if (line[0] == L'[')
+			break;
+
+		uint32_t eq = 0, key_len;
+
+		while (eq < len && line[eq] != L'=')
+			eq++;
+
+		if (eq == len)
+			continue;
+
+		key_len = eq;
+		while (key_len > 0 && _profile_is_blank(line[key_len - 1]))
+			key_len--;
+
+		if (_profile_name_equal(line, key_len, key) == false)
+			continue;
+
+		const wchar_t *v = line + eq + 1;
+		uint32_t vl = len - eq - 1;
+
+		while (vl > 0 && _profile_is_blank(*v)) {
+			v++;
+			vl--;
+		}
+
+		if (vl >= 2 && (v[0] == L'"' || v[0] == L'\'') && v[vl - 1] == v[0]) {
+			v++;
+			vl -= 2;
+		}
+
+		*value = v;
+		*value_len = vl;
+
+		return true;
+	}
+
+	return false;
+}
+
+uint32_t profile_get_string(const wchar_t *const section, const wchar_t *const key, const wchar_t *const def, wchar_t *const buf, const uint32_t size, const wchar_t *const path)
+{
+	struct _profile prof;
+	const wchar_t *value = NULL;
+	uint32_t len = 0;
+
+	if (buf == NULL || size == 0)
+		return 0;
+
+	if (_profile_load(&prof, path) == false || _profile_find_value(&prof, section, key, &value, &len) == false) {
+		value = (def != NULL) ? def : L"";
+		len = wstrLen(value);
+	}
+
+	if (len > size - 1)
+		len = size - 1;
+
+	memcpy(buf, value, len * sizeof(wchar_t));
+	buf[len] = L'\0';
+
+	_profile_free(&prof);
+
+	return len;
+}
+
+uint32_t profile_get_int(const wchar_t *const section, const wchar_t *const key, const int32_t def, const wchar_t *const path)
+{
+	wchar_t str[32];
+	const wchar_t *p = str;
+	uint32_t v = 0;
+	bool neg = false;
+
+	if (profile_get_string(section, key, NULL, str, 32, path) == 0)
+		return (uint32_t)def;
+
+	if (*p == L'-') {
+		neg = true;
+		p++;
+	}
+
+	if (p[0] == L'0' && (p[1] == L'x' || p[1] == L'X'))
+	{
+		for (p += 2; ; p++) {
+			if (*p >= L'0' && *p <= L'9')
+				v = (v << 4) | (*p - L'0');
+			else if (*p >= L'a' && *p <= L'f')
+				v = (v << 4) | (*p - L'a' + 10);
+			else if (*p >= L'A' && *p <= L'F')
+				v = (v << 4) | (*p - L'A' + 10);
+			else
+				break;
+		}
+	}
+	else
+	{
+		while (*p >= L'0' && *p <= L'9')
+			v = (v * 10) + (*p++ - L'0');
+	}
+
+	return (neg == true) ? (uint32_t)-(int32_t)v : v;
+}
+
+uint32_t profile_get_section(const wchar_t *const section, wchar_t *const buf, const uint32_t size, const wchar_t *const path)
+{
+	struct _profile prof;
+	const wchar_t *line;
+	uint32_t len, n = 0;
+
+	if (buf == NULL || size < 2)
+		return 0;
+
+	if (_profile_load(&prof, path) == true && _profile_find_section(&prof, section) == true)
+	{
+		while (_profile_next_line(&prof, &line, &len) == true)
+		{
+			if (len == 0)
+				continue;
+
+			if (line[0] == L'[')
+				break;
+
+			// the lines which do not fit are left out, as with the API
+			if (n + len + 2 > size)
+				break;
+
+			memcpy(buf + n, line, len * sizeof(wchar_t));
+			n += len;
+			buf[n++] = L'\0';
+		}
+	}
+
+	buf[n] = L'\0';
+
+	_profile_free(&prof);
+
+	return n;
+}
+
+#endif
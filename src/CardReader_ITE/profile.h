@@ -0,0 +1,30 @@
+// profile.h
+
+#pragma once
+
+// the settings and the scripts of the simulated devices are INI files. they are read
+// with the profile APIs on Windows, and by profile.c elsewhere, which takes the same
+// files (UTF-16LE with a BOM, as the files of the package are) as well as UTF-8 ones.
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#ifdef _WIN32
+
+#define profile_get_string(section, key, def, buf, size, path)	GetPrivateProfileStringW((section), (key), (def), (buf), (size), (path))
+#define profile_get_int(section, key, def, path)				GetPrivateProfileIntW((section), (key), (def), (path))
+#define profile_get_section(section, buf, size, path)			GetPrivateProfileSectionW((section), (buf), (size), (path))
+
+#else
+
+// the value of the key, without the surrounding blanks and quotes, or def (an empty
+// string if NULL). returns the number of characters copied, without the terminator.
+extern uint32_t profile_get_string(const wchar_t *const section, const wchar_t *const key, const wchar_t *const def, wchar_t *const buf, const uint32_t size, const wchar_t *const path);
+extern uint32_t profile_get_int(const wchar_t *const section, const wchar_t *const key, const int32_t def, const wchar_t *const path);
+// the lines of the section, each followed by a terminator, and a terminator after the last one
+extern uint32_t profile_get_section(const wchar_t *const section, wchar_t *const buf, const uint32_t size, const wchar_t *const path);
+
+#endif
@@ -0,0 +1,748 @@
+﻿// reader.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <grp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "memory.h"
+#include "string.h"
+#include "profile.h"
+#include "reader.h"
+
+#define _POWER_CHECK_INTERVAL	100		// milliseconds the thread of the deferred power-offs sleeps for at most
+
+static itecard_status_t devdb_status_to_itecard_status(devdb_status_t status)
+{
+	switch (status)
+	{
+	case DEVDB_S_OK:
+		return ITECARD_S_OK;
+
+	case DEVDB_E_NO_MEMORY:
+		return ITECARD_E_NO_MEMORY;
+
+	case DEVDB_E_API:
+		return ITECARD_E_FATAL;
+
+	case DEVDB_E_NO_DEVICES:
+	case DEVDB_E_DEVICE_NOT_FOUND:
+		return ITECARD_E_NO_DEVICE;
+
+	default:
+		return ITECARD_E_INTERNAL;
+	}
+}
+
+// "34,38": instructions in hexadecimal, whose entries of the table are set to value
+void reader_parse_ins(const wchar_t *str, uint8_t *const table, const uint8_t value)
+{
+	while (*str != L'\0')
+	{
+		uint32_t v = 0, n = 0;
+
+		while (1) {
+			wchar_t ch = *str;
+
+			if (ch >= L'0' && ch <= L'9')
+				v = v * 16 + (ch - L'0');
+			else if (ch >= L'A' && ch <= L'F')
+				v = v * 16 + (ch - L'A' + 10);
+			else if (ch >= L'a' && ch <= L'f')
+				v = v * 16 + (ch - L'a' + 10);
+			else
+				break;
+
+			n++;
+			str++;
+		}
+
+		if (n != 0 && v < 256)
+			table[v] = value;
+
+		if (*str != L'\0')
+			str++;
+	}
+}
+
+// "30:10000,34:1000": instructions in hexadecimal, with milliseconds in decimal
+void reader_parse_ins_ttl(const wchar_t *str, uint32_t *const table)
+{
+	while (*str != L'\0')
+	{
+		uint32_t v = 0, n = 0, ms = 0;
+
+		while (1) {
+			wchar_t ch = *str;
+
+			if (ch >= L'0' && ch <= L'9')
+				v = v * 16 + (ch - L'0');
+			else if (ch >= L'A' && ch <= L'F')
+				v = v * 16 + (ch - L'A' + 10);
+			else if (ch >= L'a' && ch <= L'f')
+				v = v * 16 + (ch - L'a' + 10);
+			else
+				break;
+
+			n++;
+			str++;
+		}
+
+		if (*str == L':') {
+			str++;
+
+			while (*str >= L'0' && *str <= L'9') {
+				ms = ms * 10 + (*str - L'0');
+				str++;
+			}
+		}
+
+		if (n != 0 && v < 256)
+			table[v] = ms;
+
+		while (*str != L'\0' && *str != L',')
+			str++;
+
+		if (*str != L'\0')
+			str++;
+	}
+}
+
+#ifndef _WIN32
+
+// the permissions of the shared memory of the devices, for the whole process, from
+// [CardReader]: SharedMemoryMode in octal ("0660"), and SharedMemoryGroup by its name
+// or its number
+void reader_load_access(const wchar_t *const path)
+{
+	uint32_t mode = DEVDB_DEFAULT_ACCESS_MODE, group = DEVDB_NO_GROUP;
+	wchar_t str[64];
+
+	if (profile_get_string(L"CardReader", L"SharedMemoryMode", L"", str, 64, path) != 0)
+	{
+		const wchar_t *p = str;
+		uint32_t v = 0;
+
+		while (*p >= L'0' && *p <= L'7' && v <= 0777) {
+			v = v * 8 + (*p - L'0');
+			p++;
+		}
+
+		// the owner keeps reading and writing them
+		if (*p == L'\0' && v <= 0777 && (v & 0600) == 0600) {
+			mode = v;
+		}
+		else {
+			internal_err("reader_load_access: SharedMemoryMode is invalid");
+		}
+	}
+
+	if (profile_get_string(L"CardReader", L"SharedMemoryGroup", L"", str, 64, path) != 0)
+	{
+		char name[64 * 4], buf[1024], *end;
+		struct group gr, *res = NULL;
+
+		if (wstrToUtf8(name, sizeof(name), str) != 0) {
+			if (getgrnam_r(name, &gr, buf, sizeof(buf), &res) == 0 && res != NULL) {
+				group = (uint32_t)res->gr_gid;
+			}
+			else {
+				unsigned long v = strtoul(name, &end, 10);
+
+				if (end != name && *end == '\0' && v < DEVDB_NO_GROUP) {
+					group = (uint32_t)v;
+				}
+				else {
+					internal_err("reader_load_access: SharedMemoryGroup is not found");
+				}
+			}
+		}
+	}
+
+	devdb_set_access(mode, group);
+}
+
+#endif
+
+// the settings of the section which every front end takes. capacity is the number of
+// devices of the database unless DeviceNum gives it, and friendly_name (128 characters)
+// receives the name of the database.
+bool reader_device_load(struct reader_device *const rd, const wchar_t *const section, const uint32_t capacity, const wchar_t *const path, wchar_t *const friendly_name)
+{
+	rd->open_status = DEVDB_S_OK;
+
+	if (profile_get_string(section, L"FriendlyName", NULL, friendly_name, 128, path) == 0) {
+		dbg("reader_device_load: profile_get_string(FriendlyName): empty");
+		return false;
+	}
+
+	wchar_t uniqueID[DEVDB_MAX_ID_SIZE];
+
+	profile_get_string(section, L"UniqueID", L"", uniqueID, DEVDB_MAX_ID_SIZE, path);
+
+	uint32_t num;
+
+	num = profile_get_int(section, L"DeviceNum", capacity, path);
+	if (num == 0) {
+		num = capacity;
+	}
+
+	rd->open_status = devdb_open(&rd->db, friendly_name, uniqueID, sizeof(struct itecard_shared_readerinfo), num);
+	if (rd->open_status != DEVDB_S_OK) {
+		if (rd->open_status == DEVDB_E_ACCESS_DENIED) {
+			internal_err("reader_device_load: devdb_open() failed: access denied, see SharedMemoryMode and SharedMemoryGroup");
+		}
+		else {
+			dbg("reader_device_load: devdb_open() failed");
+		}
+		return false;
+	}
+
+#ifndef _WIN32
+	{
+		// Device1 から Device8 までをデバイスのパスとする
+
+		wchar_t device[READER_MAX_DEVICE_PATH_NUM * DEVDB_MAX_PATH_SIZE + 1];
+		uint32_t len = 0;
+
+		for (uint32_t i = 0; i < READER_MAX_DEVICE_PATH_NUM; i++)
+		{
+			wchar_t key[16];
+			uint32_t n;
+
+			memcpy(key, L"Device", 6 * sizeof(wchar_t));
+			wstrFromUInt32(key + 6, 10, i + 1, 10);
+
+			n = profile_get_string(section, key, L"", device + len, DEVDB_MAX_PATH_SIZE, path);
+			if (n != 0) {
+				len += n + 1;
+			}
+		}
+
+		device[len] = L'\0';
+
+		if (len != 0 && devdb_set_devices(&rd->db, device) != DEVDB_S_OK) {
+			dbg("reader_device_load: devdb_set_devices() failed");
+		}
+	}
+#endif
+
+	wchar_t simScript[DEVDB_MAX_SCRIPT_SIZE + 1];
+
+	// devices simulated by a script, for the benchmarks and the tests
+	profile_get_string(section, L"SimulatedDevice", L"", simScript, DEVDB_MAX_SCRIPT_SIZE + 1, path);
+	if (!wstrIsEmpty(simScript)) {
+		devdb_set_simulated(&rd->db, simScript, profile_get_int(section, L"SimulatedDeviceNum", 1, path));
+	}
+
+	wchar_t coalesceIns[256];
+
+	// identical commands of the handles waiting for a device are exchanged once
+	profile_get_string(section, L"CoalesceIns", L"", coalesceIns, 256, path);
+	reader_parse_ins(coalesceIns, rd->coalesce_ins, 1);
+
+	wchar_t cacheTtl[256];
+
+	// the responses to the commands are kept in the shared memory of the device for a while
+	profile_get_string(section, L"CacheTtl", L"", cacheTtl, 256, path);
+	reader_parse_ins_ttl(cacheTtl, rd->cache_ttl);
+
+	wchar_t recFile[DEVDB_MAX_PATH_SIZE];
+
+	// the device control requests are recorded to be replayed elsewhere
+	profile_get_string(section, L"DevctlRecordFile", L"", recFile, DEVDB_MAX_PATH_SIZE, path);
+	if (!wstrIsEmpty(recFile)) {
+		rd->rec = memAlloc(sizeof(iterec));
+		if (rd->rec != NULL && iterec_open(rd->rec, recFile) == false) {
+			dbg("reader_device_load: iterec_open() failed");
+			memFree(rd->rec);
+			rd->rec = NULL;
+		}
+	}
+
+	uint32_t power_mode;
+
+	power_mode = profile_get_int(section, L"PowerControlMode", 3, path);
+	if ((power_mode & (UINT32_MAX - 3))) {
+		power_mode = 3;
+	}
+
+	rd->power_mode = (uint8_t)power_mode;
+
+	// milliseconds the card is left powered after the last disconnect, for a connect which
+	// comes soon after to find it with its ATR
+	rd->power_delay = profile_get_int(section, L"PowerOffDelay", 0, path);
+
+	wchar_t statsFile[DEVDB_MAX_PATH_SIZE];
+
+	// the statistics are optional
+	profile_get_string(section, L"StatsFile", L"", statsFile, DEVDB_MAX_PATH_SIZE, path);
+	if (stats_open(&rd->stats, friendly_name, statsFile) == false) {
+		dbg("reader_device_load: stats_open() failed");
+	}
+
+	uint32_t sampling;
+
+	// so is the tracing of the transmits
+	sampling = profile_get_int(section, L"TraceSampling", 0, path);
+	if (sampling != 0) {
+		wchar_t traceFile[DEVDB_MAX_PATH_SIZE];
+
+		profile_get_string(section, L"TraceFile", L"", traceFile, DEVDB_MAX_PATH_SIZE, path);
+		if (trace_open(&rd->trace, friendly_name, traceFile, sampling) == false) {
+			dbg("reader_device_load: trace_open() failed");
+		}
+	}
+
+	return true;
+}
+
+void reader_device_unload(struct reader_device *const rd)
+{
+#ifndef _WIN32
+	if (rd->power_join == true) {
+		rd->power_stop = true;
+		pthread_join(rd->power_tid, NULL);
+	}
+#endif
+
+	if (rd->rec != NULL) {
+		iterec_close(rd->rec);
+		memFree(rd->rec);
+		rd->rec = NULL;
+	}
+
+	trace_close(&rd->trace);
+	stats_close(&rd->stats);
+	devdb_close(&rd->db);
+}
+
+const wchar_t * reader_get_path_nolock(struct reader_device *const rd, const uint32_t id)
+{
+	const wchar_t *path = NULL;
+
+	devdb_get_path_nolock(&rd->db, id, &path);
+
+	return path;
+}
+
+// opens the device to probe the card, without a protocol and without a reference
+itecard_status_t reader_open_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const bool power_on)
+{
+	struct devdb_shared_devinfo *devinfo;
+	const wchar_t *path = NULL;
+
+	memset(h, 0, sizeof(struct itecard_handle));
+	h->ite.rec = rd->rec;
+
+	if (devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo) != DEVDB_S_OK || devdb_get_path_nolock(&rd->db, id, &path) != DEVDB_S_OK)
+		return ITECARD_E_NO_DEVICE;
+
+	return itecard_open(h, path, (struct itecard_shared_readerinfo *)devinfo->user, ITECARD_PROTOCOL_UNDEFINED, false, power_on);
+}
+
+// the device table may have moved to a new generation while the lock was released
+void reader_sync_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h)
+{
+	void *user;
+
+	if (h->reader != NULL && devdb_get_userdata_nolock(&rd->db, id, &user) == DEVDB_S_OK) {
+		h->reader = (struct itecard_shared_readerinfo *)user;
+	}
+}
+
+void reader_reclaim_nolock(struct reader_device *const rd, const uint32_t id, struct devdb_shared_devinfo *const devinfo)
+{
+	uint32_t reclaimed = 0;
+
+	if (devdb_reclaim_nolock(&rd->db, id, &reclaimed) != DEVDB_S_OK || reclaimed == 0)
+		return;
+
+	dbg("reader_reclaim_nolock: reclaimed: %u, ref: %u", reclaimed, devinfo->ref);
+
+	struct stats_shared_reader *st = stats_get_reader(&rd->stats, id);
+
+	// the handles of the processes which have gone are no longer open
+	stats_add(st, handle_num, -(int32_t)reclaimed);
+	stats_set(st, ref, devinfo->ref);
+
+	if (devinfo->ref != 0)
+		return;
+
+	// nobody uses the card anymore: release it the way the last disconnect would have
+
+	struct itecard_shared_readerinfo *reader;
+	struct itecard_handle h;
+
+	reader = (struct itecard_shared_readerinfo *)devinfo->user;
+	reader->exclusive = 0;
+
+	if (reader_open_nolock(rd, id, &h, false) == ITECARD_S_OK) {
+		h.stats = st;
+		itecard_close(&h, true, true, ((rd->power_mode & 2) ? true : false));
+	}
+	else {
+		card_clear(&reader->card);
+		reader->reset = 0;
+	}
+}
+
+// powers off the card if the power-off which the last disconnect deferred is due, or
+// returns the milliseconds until it is, 0 if none is deferred.
+uint32_t reader_power_off_nolock(struct reader_device *const rd, const uint32_t id, struct devdb_shared_devinfo *const devinfo)
+{
+	struct itecard_shared_readerinfo *reader;
+	struct itecard_handle h;
+	uint32_t wait = 0;
+
+	reader = (struct itecard_shared_readerinfo *)devinfo->user;
+
+	if (devinfo->ref != 0 || reader->power_off == 0)
+		return 0;
+
+	if (itecard_power_off_due(reader, stats_get_time(), &wait) == false)
+		return wait;
+
+	if (reader_open_nolock(rd, id, &h, false) == ITECARD_S_OK) {
+		h.stats = stats_get_reader(&rd->stats, id);
+		itecard_close(&h, false, true, true);
+	}
+	else {
+		reader->power_off = 0;
+	}
+
+	return 0;
+}
+
+// the deferred power-offs of the cards of the reader which are due. returns the
+// milliseconds until the next one, 0 if none is left, and then the thread ends.
+static uint32_t _power_off_cards(struct reader_device *const rd)
+{
+	uint32_t count = 0, wait = 0;
+
+	devdb_lock(&rd->db);
+	devdb_get_count_nolock(&rd->db, &count);
+
+	for (uint32_t id = 0; id < count; id++)
+	{
+		struct devdb_shared_devinfo *devinfo;
+		uint32_t w;
+
+		if (devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo) != DEVDB_S_OK)
+			continue;
+
+		w = reader_power_off_nolock(rd, id, devinfo);
+		if (w != 0 && (wait == 0 || w < wait)) {
+			wait = w;
+		}
+	}
+
+	if (wait == 0) {
+		rd->power_thread = false;
+	}
+
+	devdb_unlock(&rd->db);
+
+	return wait;
+}
+
+#ifdef _WIN32
+
+// the power-offs which are left by a process which has gone are done by the next probe
+// of the card.
+static DWORD WINAPI _power_thread(LPVOID param)
+{
+	struct reader_device *rd = param;
+	HMODULE module = rd->power_module;
+	uint32_t wait;
+
+	while ((wait = _power_off_cards(rd)) != 0) {
+		Sleep(wait);
+	}
+
+	// the thread holds a reference of the module, so that it is not unloaded under it
+	FreeLibraryAndExitThread(module, 0);
+
+	return 0;
+}
+
+static void _power_thread_start_nolock(struct reader_device *const rd, const struct itecard_shared_readerinfo *const reader)
+{
+	HANDLE thread;
+
+	if (reader->power_off == 0 || rd->power_thread == true)
+		return;
+
+	if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)_power_thread, &rd->power_module) == FALSE) {
+		internal_err("_power_thread_start_nolock: GetModuleHandleExW failed");
+		return;
+	}
+
+	thread = CreateThread(NULL, 0, _power_thread, rd, 0, NULL);
+	if (thread == NULL) {
+		internal_err("_power_thread_start_nolock: CreateThread failed");
+		FreeLibrary(rd->power_module);
+		return;
+	}
+
+	CloseHandle(thread);
+
+	rd->power_thread = true;
+}
+
+#else
+
+// the power-offs which are left when the device is unloaded are done by the next probe
+// of the card.
+static void * _power_thread(void *param)
+{
+	struct reader_device *rd = param;
+
+	while (rd->power_stop == false)
+	{
+		uint32_t wait = _power_off_cards(rd);
+
+		if (wait == 0)
+			break;
+
+		// in slices, so that the unload does not wait for the whole delay
+		while (wait != 0 && rd->power_stop == false) {
+			uint32_t ms = (wait < _POWER_CHECK_INTERVAL) ? wait : _POWER_CHECK_INTERVAL;
+			struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+
+			nanosleep(&ts, NULL);
+			wait -= ms;
+		}
+	}
+
+	return NULL;
+}
+
+static void _power_thread_start_nolock(struct reader_device *const rd, const struct itecard_shared_readerinfo *const reader)
+{
+	if (reader->power_off == 0 || rd->power_thread == true || rd->power_stop == true)
+		return;
+
+	// the thread which ended before does not take the lock anymore
+	if (rd->power_join == true) {
+		pthread_join(rd->power_tid, NULL);
+		rd->power_join = false;
+	}
+
+	if (pthread_create(&rd->power_tid, NULL, _power_thread, rd) != 0) {
+		internal_err("_power_thread_start_nolock: pthread_create failed");
+		return;
+	}
+
+	rd->power_thread = true;
+	rd->power_join = true;
+}
+
+#endif
+
+// whether the card is there. a card which is not is forgotten, so that the one
+// inserted next is initialized again.
+itecard_status_t reader_detect_nolock(struct itecard_handle *const h, bool *const present)
+{
+	struct itecard_shared_readerinfo *reader = h->reader;
+	itecard_status_t r;
+
+	*present = false;
+
+	r = itecard_detect(h, present);
+	if (r != ITECARD_S_OK) {
+		*present = false;
+	}
+
+	if (*present == false) {
+		card_clear(&reader->card);
+	}
+
+	return r;
+}
+
+// the card is reset by the next itecard_init
+void reader_reinit_card(struct itecard_handle *const h)
+{
+	card_clear(&h->reader->card);
+}
+
+// connects h to the card in T=1, and counts it as a reference of the device. ITECARD_E_SHARED
+// if exclusive and the card is in use, ITECARD_E_PROTO_MISMATCH if the card has no T=1.
+itecard_status_t reader_connect_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const itecard_protocol_t protocol, const bool exclusive)
+{
+	devdb_status_t dbr;
+	struct devdb_shared_devinfo *devinfo;
+	struct itecard_shared_readerinfo *reader;
+	itecard_status_t r;
+	uint32_t ref;
+
+	dbr = devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo);
+	if (dbr != DEVDB_S_OK) {
+		internal_err("reader_connect_nolock: devdb_get_shared_devinfo_nolock failed");
+		return devdb_status_to_itecard_status(dbr);
+	}
+
+	reader_reclaim_nolock(rd, id, devinfo);
+
+	reader = (struct itecard_shared_readerinfo *)devinfo->user;
+
+	if (exclusive == true && (devinfo->ref > 0)) {
+		internal_err("reader_connect_nolock: device was opened in share mode by another application");
+		return ITECARD_E_SHARED;
+	}
+
+	h->ite.rec = rd->rec;
+	r = itecard_open(h, reader_get_path_nolock(rd, id), reader, protocol, exclusive, ((rd->power_mode & 1) ? true : false));
+	if (r != ITECARD_S_OK) {
+		internal_err("reader_connect_nolock: itecard_open failed");
+		return r;
+	}
+
+	h->stats = stats_get_reader(&rd->stats, id);
+
+	r = itecard_init(h);
+	if (r != ITECARD_S_OK && r != ITECARD_S_FALSE) {
+		internal_err("reader_connect_nolock: itecard_init failed");
+		goto end;
+	}
+
+	if ((protocol & ITECARD_PROTOCOL_T1) == 0 || reader->card.T1.b == false) {
+		internal_err("reader_connect_nolock: no active protocol");
+		r = ITECARD_E_PROTO_MISMATCH;
+		goto end;
+	}
+
+	if (devdb_ref_nolock(&rd->db, id, &ref) != DEVDB_S_OK) {
+		internal_err("reader_connect_nolock: devdb_ref_nolock failed");
+		r = ITECARD_E_INTERNAL;
+		goto end;
+	}
+
+	// a full owner table has moved the device table to a new generation
+	reader_sync_nolock(rd, id, h);
+
+	stats_inc(h->stats, handle_num);
+	stats_set(h->stats, ref, ref);
+
+	return ITECARD_S_OK;
+
+end:
+	itecard_close(h, true, ((devinfo->ref == 0) ? true : false), ((rd->power_mode & 2) ? true : false));
+	return r;
+}
+
+// drops the reference of h. the last one powers off the card, or leaves it to the
+// thread of the deferred power-offs.
+itecard_status_t reader_disconnect_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const bool reset)
+{
+	struct itecard_shared_readerinfo *reader = h->reader;
+	itecard_status_t r;
+	uint32_t ref;
+
+	if (devdb_unref_nolock(&rd->db, id, &ref) != DEVDB_S_OK)
+		return ITECARD_E_INTERNAL;
+
+	stats_add(h->stats, handle_num, -1);
+	stats_set(h->stats, ref, ref);
+	h->power_delay = rd->power_delay;
+	r = itecard_close(h, reset, ((ref == 0) ? true : false), ((rd->power_mode & 2) ? true : false));
+
+	if (ref == 0 && reader != NULL) {
+		_power_thread_start_nolock(rd, reader);
+	}
+
+	return r;
+}
+
+static void _copy_atr(const struct itecard_shared_readerinfo *const reader, uint8_t *const atr, uint32_t *const atr_len)
+{
+	*atr_len = (reader->card.atr_len > READER_MAX_ATR_SIZE) ? READER_MAX_ATR_SIZE : reader->card.atr_len;
+	memcpy(atr, reader->card.atr, *atr_len);
+}
+
+// READER_STATE_*, probing the card if nobody uses it. the ATR (READER_MAX_ATR_SIZE bytes
+// at most) is given for a card which is present and not mute, and atr_len is 0 otherwise.
+uint32_t reader_get_state_nolock(struct reader_device *const rd, const uint32_t id, uint8_t *const atr, uint32_t *const atr_len)
+{
+	struct devdb_shared_devinfo *devinfo;
+	struct itecard_shared_readerinfo *reader;
+	struct itecard_handle h;
+	uint32_t state;
+	bool unpowered;
+
+	*atr_len = 0;
+
+	if (devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo) != DEVDB_S_OK)
+		return READER_STATE_UNAVAILABLE;
+
+	reader_reclaim_nolock(rd, id, devinfo);
+	reader_power_off_nolock(rd, id, devinfo);
+
+	reader = (struct itecard_shared_readerinfo *)devinfo->user;
+
+	// a card which the last disconnect powered off is left so until the next connect
+	unpowered = (devinfo->ref == 0 && (rd->power_mode & 1) && reader->power == ITECARD_POWER_OFF) ? true : false;
+
+	if (reader_open_nolock(rd, id, &h, ((devinfo->ref == 0 && unpowered == false) ? true : false)) != ITECARD_S_OK)
+		return READER_STATE_UNAVAILABLE;
+
+	if (unpowered == true) {
+		bool b;
+
+		reader_detect_nolock(&h, &b);
+
+		if (b == true) {
+			state = READER_STATE_PRESENT | READER_STATE_UNPOWERED;
+			_copy_atr(reader, atr, atr_len);
+		}
+		else {
+			state = READER_STATE_EMPTY;
+		}
+
+		itecard_close(&h, false, false, false);
+	}
+	else {
+		h.stats = stats_get_reader(&rd->stats, id);
+
+		switch (itecard_init(&h))
+		{
+		case ITECARD_S_OK:
+		case ITECARD_S_FALSE:
+			state = READER_STATE_PRESENT;
+			break;
+
+		case ITECARD_E_NO_CARD:
+		case ITECARD_E_FAILED:
+			state = READER_STATE_EMPTY;
+			break;
+
+		default:
+			state = READER_STATE_PRESENT | READER_STATE_MUTE;
+			break;
+		}
+
+		if (state == READER_STATE_PRESENT)
+		{
+			if (devinfo->ref > 0) {
+				state |= (reader->exclusive == true) ? READER_STATE_EXCLUSIVE : READER_STATE_INUSE;
+			}
+
+			_copy_atr(reader, atr, atr_len);
+		}
+
+		itecard_close(&h, false, false, ((devinfo->ref == 0) ? true : false));
+	}
+
+	return state;
+}
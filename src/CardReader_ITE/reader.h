@@ -0,0 +1,75 @@
+// reader.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "devdb.h"
+#include "itecard.h"
+#include "iterec.h"
+#include "stats.h"
+#include "trace.h"
+
+// the engine of the readers, shared by the front ends: winscard.c, the pcsc-lite
+// compatible library and the IFD handler of pcscd. a reader device is a section of the
+// INI file ([ReaderDeviceN]), whose cards are the slots of a device database. the front
+// ends keep their own names of the readers and map the results to their interfaces.
+//
+// the functions named _nolock are called with the lock of the database held.
+
+#define READER_MAX_DEVICE_PATH_NUM	8	// Device1 to Device8, outside of Windows
+#define READER_MAX_ATR_SIZE			36
+
+// the state of the card of a reader
+#define READER_STATE_UNAVAILABLE	0x0001	// the device cannot be opened
+#define READER_STATE_EMPTY			0x0002
+#define READER_STATE_PRESENT		0x0004
+#define READER_STATE_MUTE			0x0008	// with READER_STATE_PRESENT: the card does not answer the reset
+#define READER_STATE_UNPOWERED		0x0010	// with READER_STATE_PRESENT: left powered off by the last disconnect
+#define READER_STATE_INUSE			0x0020
+#define READER_STATE_EXCLUSIVE		0x0040
+
+struct reader_device
+{
+	devdb db;
+	devdb_status_t open_status;	// of devdb_open, when the load has failed there
+	stats stats;			// StatsFile, or the shared memory named after the device
+	trace trace;			// TraceSampling and TraceFile
+	iterec *rec;			// NULL unless the device control requests are recorded
+	uint8_t coalesce_ins[256];	// non-zero for the commands which may take the response of an identical exchange
+	uint32_t cache_ttl[256];	// milliseconds the responses of the commands are cached for, by instruction
+	uint8_t power_mode;		// bit 0: powered on by the first connect, bit 1: powered off by the last disconnect
+	uint32_t power_delay;	// milliseconds the power-off by the last disconnect is deferred for
+	bool power_thread;		// the thread of the deferred power-offs is running
+#ifdef _WIN32
+	HMODULE power_module;	// referenced by it
+#else
+	bool power_join;		// it was started, and is not joined yet
+	volatile bool power_stop;	// it is to end, when the device is unloaded
+	pthread_t power_tid;
+#endif
+};
+
+extern void reader_parse_ins(const wchar_t *str, uint8_t *const table, const uint8_t value);
+extern void reader_parse_ins_ttl(const wchar_t *str, uint32_t *const table);
+#ifndef _WIN32
+extern void reader_load_access(const wchar_t *const path);
+#endif
+extern bool reader_device_load(struct reader_device *const rd, const wchar_t *const section, const uint32_t capacity, const wchar_t *const path, wchar_t *const friendly_name);
+extern void reader_device_unload(struct reader_device *const rd);
+extern const wchar_t * reader_get_path_nolock(struct reader_device *const rd, const uint32_t id);
+extern itecard_status_t reader_open_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const bool power_on);
+extern void reader_sync_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h);
+extern void reader_reclaim_nolock(struct reader_device *const rd, const uint32_t id, struct devdb_shared_devinfo *const devinfo);
+extern uint32_t reader_power_off_nolock(struct reader_device *const rd, const uint32_t id, struct devdb_shared_devinfo *const devinfo);
+extern itecard_status_t reader_detect_nolock(struct itecard_handle *const h, bool *const present);
+extern void reader_reinit_card(struct itecard_handle *const h);
+extern itecard_status_t reader_connect_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const itecard_protocol_t protocol, const bool exclusive);
+extern itecard_status_t reader_disconnect_nolock(struct reader_device *const rd, const uint32_t id, struct itecard_handle *const h, const bool reset);
+extern uint32_t reader_get_state_nolock(struct reader_device *const rd, const uint32_t id, uint8_t *const atr, uint32_t *const atr_len);
@@ -0,0 +1,125 @@
+// scheduler.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "scheduler.h"
+
+void scheduler_init(scheduler *const s, const uint32_t depth, const uint32_t quantum)
+{
+	InitializeSRWLock(&s->lock);
+	s->busy = false;
+	s->depth = depth;
+	s->quantum = (quantum != 0) ? quantum : 1;
+
+	for (uint32_t i = 0; i < SCHEDULER_CLASS_NUM; i++) {
+		s->waiting[i] = 0;
+		s->head[i] = NULL;
+		s->tail[i] = NULL;
+	}
+}
+
+static void _scheduler_push_nolock(scheduler *const s, const scheduler_class_t cls, struct scheduler_flow *const flow)
+{
+	flow->next = NULL;
+
+	if (s->tail[cls] != NULL)
+		s->tail[cls]->next = flow;
+	else
+		s->head[cls] = flow;
+
+	s->tail[cls] = flow;
+}
+
+static struct scheduler_flow * _scheduler_pop_nolock(scheduler *const s, const scheduler_class_t cls)
+{
+	struct scheduler_flow *flow = s->head[cls];
+
+	s->head[cls] = flow->next;
+	if (s->head[cls] == NULL)
+		s->tail[cls] = NULL;
+
+	return flow;
+}
+
+// the highest class first. in a class, every turn adds a quantum to the deficit of
+// the handle, and the request goes once the deficit covers its length.
+static struct scheduler_flow * _scheduler_next_nolock(scheduler *const s)
+{
+	for (uint32_t cls = 0; cls < SCHEDULER_CLASS_NUM; cls++)
+	{
+		while (s->head[cls] != NULL)
+		{
+			struct scheduler_flow *flow = _scheduler_pop_nolock(s, cls);
+
+			flow->deficit += s->quantum;
+
+			if (flow->cost <= flow->deficit) {
+				// the handle has nothing else waiting, so nothing is carried over
+				flow->deficit = 0;
+				s->waiting[cls]--;
+				return flow;
+			}
+
+			_scheduler_push_nolock(s, cls, flow);
+		}
+	}
+
+	return NULL;
+}
+
+// waits until the request may use the device. false if its class is full, in which
+// case the request has to be refused.
+bool scheduler_enter(scheduler *const s, struct scheduler_flow *const flow, const scheduler_class_t cls, const uint32_t cost, HANDLE event)
+{
+	AcquireSRWLockExclusive(&s->lock);
+
+	// nothing waits while the device is not in use
+	if (s->busy == false) {
+		s->busy = true;
+		ReleaseSRWLockExclusive(&s->lock);
+		return true;
+	}
+
+	if (s->waiting[cls] >= s->depth) {
+		ReleaseSRWLockExclusive(&s->lock);
+		dbg("scheduler_enter: class %u is full", cls);
+		return false;
+	}
+
+	flow->cost = cost;
+	flow->event = event;
+	_scheduler_push_nolock(s, cls, flow);
+	s->waiting[cls]++;
+
+	ReleaseSRWLockExclusive(&s->lock);
+
+	// the device is handed over with the event
+	WaitForSingleObject(event, INFINITE);
+
+	return true;
+}
+
+// hands the device over to the next request, if any
+void scheduler_leave(scheduler *const s)
+{
+	struct scheduler_flow *next;
+	HANDLE event = NULL;
+
+	AcquireSRWLockExclusive(&s->lock);
+
+	next = _scheduler_next_nolock(s);
+	if (next != NULL)
+		event = next->event;
+	else
+		s->busy = false;
+
+	ReleaseSRWLockExclusive(&s->lock);
+
+	if (event != NULL)
+		SetEvent(event);
+}
@@ -0,0 +1,50 @@
+// scheduler.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+// orders the transmits of the handles of this process to a device. the classes are
+// served in strict priority, and the handles of a class by deficit round-robin on
+// the length of their commands, so that a burst of large commands from one handle
+// does not hold back the others. a class holds a bounded number of waiting requests,
+// and the next ones are refused at once instead of waiting without a bound.
+//
+// the requests of other processes still take their turn in the order of the lock.
+
+#define SCHEDULER_DEFAULT_DEPTH		8
+#define SCHEDULER_DEFAULT_QUANTUM	256		// bytes of commands a handle may send in its turn
+
+typedef enum _scheduler_class_t
+{
+	SCHEDULER_CLASS_HIGH = 0,		// ECM
+	SCHEDULER_CLASS_NORMAL,
+	SCHEDULER_CLASS_LOW,			// EMM, management
+	SCHEDULER_CLASS_NUM
+} scheduler_class_t;
+
+// one per handle, which has at most one request at a time
+struct scheduler_flow
+{
+	struct scheduler_flow *next;	// in the queue of its class while its request waits
+	uint32_t deficit;
+	uint32_t cost;			// of the waiting request
+	HANDLE event;			// set when the request may use the device
+};
+
+typedef struct _scheduler
+{
+	SRWLOCK lock;
+	bool busy;				// a request is using the device
+	uint32_t depth;			// of each class
+	uint32_t quantum;
+	uint32_t waiting[SCHEDULER_CLASS_NUM];
+	struct scheduler_flow *head[SCHEDULER_CLASS_NUM];
+	struct scheduler_flow *tail[SCHEDULER_CLASS_NUM];
+} scheduler;
+
+extern void scheduler_init(scheduler *const s, const uint32_t depth, const uint32_t quantum);
+extern bool scheduler_enter(scheduler *const s, struct scheduler_flow *const flow, const scheduler_class_t cls, const uint32_t cost, HANDLE event);
+extern void scheduler_leave(scheduler *const s);
@@ -0,0 +1,354 @@
+// stats.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "string.h"
+#include "stats.h"
+#ifndef _WIN32
+#include "devdb.h"
+#endif
+
+// outside of Windows the region is POSIX shared memory or a file of the same layout,
+// and the time is counted in nanoseconds.
+
+#ifndef _WIN32
+#define C_ASSERT(e)		_Static_assert((e), #e)
+#endif
+
+C_ASSERT((sizeof(struct stats_shared_reader) % STATS_CACHE_LINE_SIZE) == 0);
+C_ASSERT(offsetof(struct stats_shared_info, reader) == STATS_CACHE_LINE_SIZE);
+
+#ifdef _WIN32
+
+#define _counter_inc(v)		InterlockedIncrement((volatile LONG *)&(v))
+
+#define STATS_OPEN_TIMEOUT	100		// ms the creator has to initialize the region
+
+static const wchar_t stats_name[] = L"itecard_stats_";
+static const wchar_t stats_guid[] = L"_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}";
+
+static uint64_t _qpc_freq = 0;
+
+// the region is backed by the paging file, or by the given file so that it can
+// be read from outside of Windows (e.g. by the monitor running on the host of Wine)
+bool stats_open(stats *const st, const wchar_t *const name, const wchar_t *const file)
+{
+	wchar_t obj_name[256];
+	uint32_t name_len;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE shmem;
+	struct stats_shared_info *info;
+
+	st->shmem = NULL;
+	st->info = NULL;
+
+	if (_qpc_freq == 0) {
+		LARGE_INTEGER freq;
+
+		QueryPerformanceFrequency(&freq);
+		_qpc_freq = freq.QuadPart;
+	}
+
+	name_len = wstrLen(name);
+	if (name_len >= 128) {
+		internal_err("stats_open: name is too long");
+		return false;
+	}
+
+	memcpy(obj_name, stats_name, sizeof(stats_name) - sizeof(wchar_t));
+	memcpy(obj_name + (sizeof(stats_name) / sizeof(wchar_t)) - 1, name, name_len * sizeof(wchar_t));
+	memcpy(obj_name + (sizeof(stats_name) / sizeof(wchar_t)) - 1 + name_len, stats_guid, sizeof(stats_guid));
+
+	if (file != NULL && !wstrIsEmpty(file)) {
+		hFile = CreateFileW(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			win32_err("stats_open: CreateFileW");
+		}
+	}
+
+	DWORD le;
+
+	shmem = CreateFileMappingW(hFile, NULL, PAGE_READWRITE, 0, sizeof(struct stats_shared_info), obj_name);
+	le = GetLastError();
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	if (shmem == NULL) {
+		win32_err("stats_open: CreateFileMappingW");
+		return false;
+	}
+
+	info = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+	if (info == NULL) {
+		win32_err("stats_open: MapViewOfFile");
+		CloseHandle(shmem);
+		return false;
+	}
+
+	if (le != ERROR_ALREADY_EXISTS)
+	{
+		// a file written with another layout is started over
+		if (info->signature != STATS_SHARED_INFO_SIGNATURE || info->version != STATS_SHARED_INFO_VERSION || info->count != STATS_MAX_READER_NUM || info->bucket_num != STATS_HIST_BUCKET_NUM) {
+			memset(info, 0, sizeof(struct stats_shared_info));
+			info->version = STATS_SHARED_INFO_VERSION;
+			info->count = STATS_MAX_READER_NUM;
+			info->bucket_num = STATS_HIST_BUCKET_NUM;
+			InterlockedExchange((volatile LONG *)&info->signature, STATS_SHARED_INFO_SIGNATURE);
+		}
+	}
+	else
+	{
+		// the creator may not have initialized it yet
+		for (DWORD tick = GetTickCount(); info->signature == 0 && (GetTickCount() - tick) < STATS_OPEN_TIMEOUT; ) {
+			Sleep(1);
+		}
+		if (info->signature != STATS_SHARED_INFO_SIGNATURE || info->version != STATS_SHARED_INFO_VERSION || info->count != STATS_MAX_READER_NUM) {
+			internal_err("stats_open: incorrect signature or version");
+			UnmapViewOfFile(info);
+			CloseHandle(shmem);
+			return false;
+		}
+	}
+
+	st->shmem = shmem;
+	st->info = info;
+
+	return true;
+}
+
+void stats_close(stats *const st)
+{
+	if (st->info != NULL) {
+		UnmapViewOfFile(st->info);
+		st->info = NULL;
+	}
+
+	if (st->shmem != NULL) {
+		CloseHandle(st->shmem);
+		st->shmem = NULL;
+	}
+}
+
+#else
+
+#define _counter_inc(v)		__atomic_add_fetch(&(v), 1, __ATOMIC_SEQ_CST)
+
+static const char stats_name[] = "/itecard_stats_";
+
+static uint64_t _qpc_freq = 1000000000;
+
+// the region is /dev/shm/itecard_stats_<name>, or the given file so that it is kept
+// across the runs. it is created with the permissions of the device database
+// (SharedMemoryMode and SharedMemoryGroup), and left there when the last process
+// closes it, as the one of the broker is. the openers take turns with flock, so the
+// one which finds it unsized or unwritten sets it up without the others waiting on it.
+bool stats_open(stats *const st, const wchar_t *const name, const wchar_t *const file)
+{
+	char obj_name[512];
+	struct stats_shared_info *info;
+	struct stat sb;
+	bool shm, created = true;
+	int fd;
+
+	st->shmem = NULL;
+	st->info = NULL;
+
+	shm = (file == NULL || wstrIsEmpty(file)) ? true : false;
+
+	if (shm == true) {
+		uint32_t len;
+
+		memcpy(obj_name, stats_name, sizeof(stats_name) - 1);
+		len = wstrToUtf8(obj_name + sizeof(stats_name) - 1, sizeof(obj_name) - (sizeof(stats_name) - 1), name);
+		if (len == 0) {
+			internal_err("stats_open: name is too long");
+			return false;
+		}
+
+		for (uint32_t i = sizeof(stats_name) - 1; i < sizeof(stats_name) - 1 + len; i++) {
+			if (obj_name[i] == '/')
+				obj_name[i] = '_';
+		}
+
+		fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, (mode_t)devdb_get_access_mode());
+		if (fd == -1 && errno == EEXIST) {
+			created = false;
+			fd = shm_open(obj_name, O_RDWR, 0);
+		}
+	}
+	else {
+		if (wstrToUtf8(obj_name, sizeof(obj_name), file) == 0) {
+			internal_err("stats_open: file is too long");
+			return false;
+		}
+
+		fd = open(obj_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, (mode_t)devdb_get_access_mode());
+		if (fd == -1 && errno == EEXIST) {
+			created = false;
+			fd = open(obj_name, O_RDWR | O_CLOEXEC);
+		}
+	}
+
+	if (fd == -1) {
+		if (errno == EACCES) {
+			internal_err("stats_open: access denied, see SharedMemoryMode and SharedMemoryGroup");
+		}
+		else {
+			internal_err("stats_open: open failed (%d)", errno);
+		}
+		return false;
+	}
+
+	if (created == true) {
+		devdb_set_obj_access(fd);
+	}
+
+	flock(fd, LOCK_EX);
+
+	if (fstat(fd, &sb) != 0 || (sb.st_size < (off_t)sizeof(struct stats_shared_info) && ftruncate(fd, sizeof(struct stats_shared_info)) != 0)) {
+		internal_err("stats_open: ftruncate failed");
+		flock(fd, LOCK_UN);
+		close(fd);
+		return false;
+	}
+
+	info = mmap(NULL, sizeof(struct stats_shared_info), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (info == MAP_FAILED) {
+		internal_err("stats_open: mmap failed");
+		flock(fd, LOCK_UN);
+		close(fd);
+		return false;
+	}
+
+	if (info->signature != STATS_SHARED_INFO_SIGNATURE || info->version != STATS_SHARED_INFO_VERSION || info->count != STATS_MAX_READER_NUM || info->bucket_num != STATS_HIST_BUCKET_NUM)
+	{
+		// a file written with another layout is started over, as on Windows. shared memory
+		// is only set up once: a signature there is that of modules of another version.
+		if (shm == true && info->signature != 0) {
+			internal_err("stats_open: incorrect signature or version");
+			munmap(info, sizeof(struct stats_shared_info));
+			flock(fd, LOCK_UN);
+			close(fd);
+			return false;
+		}
+
+		memset(info, 0, sizeof(struct stats_shared_info));
+		info->version = STATS_SHARED_INFO_VERSION;
+		info->count = STATS_MAX_READER_NUM;
+		info->bucket_num = STATS_HIST_BUCKET_NUM;
+		__atomic_store_n(&info->signature, STATS_SHARED_INFO_SIGNATURE, __ATOMIC_SEQ_CST);
+	}
+
+	flock(fd, LOCK_UN);
+
+	// the mapping stays without the descriptor
+	close(fd);
+
+	st->info = info;
+
+	return true;
+}
+
+void stats_close(stats *const st)
+{
+	if (st->info != NULL) {
+		munmap(st->info, sizeof(struct stats_shared_info));
+		st->info = NULL;
+	}
+}
+
+#endif
+
+struct stats_shared_reader * stats_get_reader(stats *const st, const uint32_t id)
+{
+	struct stats_shared_reader *reader;
+
+	if (st->info == NULL || id >= STATS_MAX_READER_NUM)
+		return NULL;
+
+	reader = &st->info->reader[id];
+	if (reader->active == 0) {
+		reader->active = 1;
+	}
+
+	return reader;
+}
+
+uint64_t stats_get_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER t;
+
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+#endif
+}
+
+// microseconds between two values of stats_get_time
+uint64_t stats_get_us(const uint64_t start, const uint64_t end)
+{
+#ifdef _WIN32
+	// the region may not have been opened
+	if (_qpc_freq == 0) {
+		LARGE_INTEGER freq;
+
+		QueryPerformanceFrequency(&freq);
+		_qpc_freq = freq.QuadPart;
+	}
+#endif
+
+	return ((end - start) * 1000000) / _qpc_freq;
+}
+
+// add the time elapsed since start to a latency histogram
+void stats_record(struct stats_shared_reader *const reader, const stats_hist_t hist, const uint64_t start)
+{
+	if (reader == NULL)
+		return;
+
+	uint64_t us = stats_get_us(start, stats_get_time());
+	uint32_t bucket = 0;
+
+	while (us > 1 && bucket < STATS_HIST_BUCKET_NUM - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	_counter_inc(reader->hist[hist][bucket]);
+}
+
+// moves the average latency of the device by 1/8 of the difference to the time
+// elapsed since start. concurrent updates may be lost, which only delays it.
+void stats_update_latency(struct stats_shared_reader *const reader, const uint64_t start)
+{
+	if (reader == NULL)
+		return;
+
+	int64_t us = (int64_t)stats_get_us(start, stats_get_time());
+	int64_t avg = reader->latency_us;
+
+	avg += (us - avg) / 8;
+
+	stats_set(reader, latency_us, (avg > 0xffffffff) ? 0xffffffff : avg);
+}
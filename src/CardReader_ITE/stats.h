@@ -0,0 +1,119 @@
+// stats.h
+
+#pragma once
+
+// the layout of the shared region is also used by the monitor tool, which is
+// built on other platforms too. keep this header free of windows.h.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_SHARED_INFO_SIGNATURE	0x54534349	// "ICST"
+#define STATS_SHARED_INFO_VERSION	3
+
+#define STATS_CACHE_LINE_SIZE	64
+#define STATS_MAX_READER_NUM	64		// devices with a larger id are not counted
+#define STATS_HIST_BUCKET_NUM	32		// bucket n: [2^n, 2^(n+1)) microseconds, bucket 0 also holds 0
+
+typedef enum _stats_hist_t
+{
+	STATS_HIST_TRANSMIT = 0,	// itecard_transmit
+	STATS_HIST_LOCK_WAIT,		// devdb_lock in SCardTransmit
+	STATS_HIST_CARD_INIT,		// card reset and ATR
+	STATS_HIST_QUEUE_HIGH,		// wait in the scheduler of SCardTransmit, by class
+	STATS_HIST_QUEUE_NORMAL,
+	STATS_HIST_QUEUE_LOW,
+	STATS_HIST_NUM
+} stats_hist_t;
+
+// shared data
+
+struct stats_shared_reader
+{
+	union {
+		struct {
+			uint32_t active;		// non-zero once the device has been opened
+			uint32_t error;			// failed transmissions
+			uint64_t apdu;			// transmitted commands
+			uint64_t bytes_sent;
+			uint64_t bytes_recv;
+			uint32_t retry;			// T=1 block retransmissions
+			uint32_t resynch;		// T=1 RESYNCH requests
+			uint32_t card_init;		// card resets
+			uint32_t detect;		// card detection ioctls
+			uint32_t reinit;		// card re-initializations after a failed transmission
+			uint32_t handle_num;	// open card handles of all processes (gauge)
+			uint32_t ref;			// references of the device in the device table (gauge)
+			uint32_t rejected;		// transmissions refused since the queue of their class was full
+		};
+		uint8_t line0[STATS_CACHE_LINE_SIZE];
+	};
+	union {
+		struct {
+			uint64_t coalesced;		// commands answered with the response of an identical exchange they waited for
+			uint64_t coalesced_us;	// time of the card saved by them, in microseconds
+			uint64_t cache_hit;		// commands answered from the response cache
+			uint64_t cache_miss;	// cacheable commands sent to the card
+			uint32_t pending;		// transmits of all processes waiting for or using the device (gauge)
+			uint32_t latency_us;	// moving average of the exchanges with the card, in microseconds (gauge)
+		};
+		uint8_t line1[STATS_CACHE_LINE_SIZE];
+	};
+	uint32_t hist[STATS_HIST_NUM][STATS_HIST_BUCKET_NUM];
+};
+
+struct stats_shared_info
+{
+	union {
+		struct {
+			uint32_t signature;
+			uint32_t version;
+			uint32_t count;			// number of reader slots
+			uint32_t bucket_num;	// number of histogram buckets
+		};
+		uint8_t line0[STATS_CACHE_LINE_SIZE];
+	};
+	struct stats_shared_reader reader[STATS_MAX_READER_NUM];
+};
+
+// local
+
+typedef struct _stats
+{
+	void *shmem;
+	struct stats_shared_info *info;
+} stats;
+
+extern bool stats_open(stats *const st, const wchar_t *const name, const wchar_t *const file);
+extern void stats_close(stats *const st);
+extern struct stats_shared_reader * stats_get_reader(stats *const st, const uint32_t id);
+extern uint64_t stats_get_time(void);
+extern uint64_t stats_get_us(const uint64_t start, const uint64_t end);
+extern void stats_record(struct stats_shared_reader *const reader, const stats_hist_t hist, const uint64_t start);
+extern void stats_update_latency(struct stats_shared_reader *const reader, const uint64_t start);
+
+// counters are updated without any lock. every update is a single interlocked
+// instruction on a line which belongs to the device, and nothing is done when
+// the statistics are not available.
+
+#ifdef _WIN32
+#define stats_inc(reader, field) \
+	do { if ((reader) != NULL) InterlockedIncrement((volatile LONG *)&(reader)->field); } while (0)
+#define stats_add(reader, field, n) \
+	do { if ((reader) != NULL) InterlockedExchangeAdd((volatile LONG *)&(reader)->field, (LONG)(n)); } while (0)
+#define stats_set(reader, field, v) \
+	do { if ((reader) != NULL) InterlockedExchange((volatile LONG *)&(reader)->field, (LONG)(v)); } while (0)
+#define stats_add64(reader, field, n) \
+	do { if ((reader) != NULL) InterlockedExchangeAdd64((volatile LONGLONG *)&(reader)->field, (LONGLONG)(n)); } while (0)
+#else
+#define stats_inc(reader, field) \
+	do { if ((reader) != NULL) __atomic_add_fetch(&(reader)->field, 1, __ATOMIC_SEQ_CST); } while (0)
+#define stats_add(reader, field, n) \
+	do { if ((reader) != NULL) __atomic_add_fetch(&(reader)->field, (uint32_t)(n), __ATOMIC_SEQ_CST); } while (0)
+#define stats_set(reader, field, v) \
+	do { if ((reader) != NULL) __atomic_store_n(&(reader)->field, (uint32_t)(v), __ATOMIC_SEQ_CST); } while (0)
+#define stats_add64(reader, field, n) \
+	do { if ((reader) != NULL) __atomic_add_fetch(&(reader)->field, (uint64_t)(n), __ATOMIC_SEQ_CST); } while (0)
+#endif
+#define stats_inc64(reader, field) stats_add64(reader, field, 1)
@@ -269,3 +269,108 @@ wchar_t * wstrGetWCharPtr(const wchar_t *const str, const wchar_t ch)
 
 	return (*p - ch) ? NULL : p;
 }
+
+// UTF-8 of a wide string (UTF-16 on Windows), for the names used outside of Windows.
+// returns the length without the terminator, or 0 if it does not fit.
+uint32_t wstrToUtf8(char *const dst, const size_t size, const wchar_t *const src)
+{
+	const wchar_t *s = src;
+	size_t n = 0;
+
+	while (*s)
+	{
+		uint32_t c = (uint32_t)*s++;
+		uint8_t b[4];
+		uint32_t len;
+
+		if (sizeof(wchar_t) == 2 && c >= 0xD800 && c < 0xDC00 && *s >= 0xDC00 && *s < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)*s++ - 0xDC00);
+
+		if (c < 0x80) {
+			b[0] = (uint8_t)c;
+			len = 1;
+		}
+		else if (c < 0x800) {
+			b[0] = (uint8_t)(0xC0 | (c >> 6));
+			b[1] = (uint8_t)(0x80 | (c & 0x3F));
+			len = 2;
+		}
+		else if (c < 0x10000) {
+			b[0] = (uint8_t)(0xE0 | (c >> 12));
+			b[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			b[2] = (uint8_t)(0x80 | (c & 0x3F));
+			len = 3;
+		}
+		else {
+			b[0] = (uint8_t)(0xF0 | (c >> 18));
+			b[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+			b[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			b[3] = (uint8_t)(0x80 | (c & 0x3F));
+			len = 4;
+		}
+
+		if (n + len >= size)
+			return 0;
+
+		for (uint32_t i = 0; i < len; i++)
+			dst[n++] = (char)b[i];
+	}
+
+	if (n >= size)
+		return 0;
+
+	dst[n] = '\0';
+
+	return (uint32_t)n;
+}
+
+// the reverse of wstrToUtf8. invalid sequences are taken byte by byte.
+// returns the length without the terminator, or 0 if it does not fit.
+uint32_t wstrFromUtf8(wchar_t *const dst, const size_t size, const char *const src)
+{
+	const uint8_t *s = (const uint8_t *)src;
+	size_t n = 0;
+
+	while (*s)
+	{
+		uint32_t c = *s++;
+		uint32_t follow = 0;
+
+		if (c >= 0xF0) {
+			c &= 0x07;
+			follow = 3;
+		}
+		else if (c >= 0xE0) {
+			c &= 0x0F;
+			follow = 2;
+		}
+		else if (c >= 0xC0) {
+			c &= 0x1F;
+			follow = 1;
+		}
+
+		while (follow-- > 0 && (*s & 0xC0) == 0x80)
+			c = (c << 6) | (*s++ & 0x3F);
+
+		if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+			if (n + 2 >= size)
+				return 0;
+
+			dst[n++] = (wchar_t)(0xD800 + ((c - 0x10000) >> 10));
+			dst[n++] = (wchar_t)(0xDC00 + ((c - 0x10000) & 0x3FF));
+			continue;
+		}
+
+		if (n + 1 >= size)
+			return 0;
+
+		dst[n++] = (wchar_t)c;
+	}
+
+	if (n >= size)
+		return 0;
+
+	dst[n] = L'\0';
+
+	return (uint32_t)n;
+}
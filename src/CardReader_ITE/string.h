@@ -21,5 +21,7 @@ extern bool strToUInt32(const char *const str, uint32_t *const ui32);
 extern uint32_t wstrFromUInt32(wchar_t *const str, const size_t size, const uint32_t ui32, const int radix);
 extern uint32_t strFromUInt32(char *const str, const size_t size, const uint32_t ui32, const int radix);
 extern wchar_t * wstrGetWCharPtr(const wchar_t *const str, const wchar_t ch);
+extern uint32_t wstrToUtf8(char *const dst, const size_t size, const wchar_t *const src);
+extern uint32_t wstrFromUtf8(wchar_t *const dst, const size_t size, const char *const src);
 
 #define wstrIsEmpty(str) (((str)[0]) == L'\0')
@@ -0,0 +1,365 @@
+// trace.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "string.h"
+#include "trace.h"
+#ifndef _WIN32
+#include "devdb.h"
+#endif
+
+// outside of Windows the region is POSIX shared memory or a file of the same layout,
+// and the ticks are nanoseconds of CLOCK_MONOTONIC, as stats_get_time counts them.
+
+#ifdef _WIN32
+
+#define _trace_get_pid()		GetCurrentProcessId()
+#define _trace_get_tid()		GetCurrentThreadId()
+#define _trace_inc(v)			((uint32_t)InterlockedIncrement((volatile LONG *)&(v)))
+#define _trace_store(v, x)		InterlockedExchange((volatile LONG *)&(v), (LONG)(x))
+
+#define TRACE_OPEN_TIMEOUT	100		// ms the creator has to initialize the region
+
+static const wchar_t trace_name[] = L"itecard_trace_";
+static const wchar_t trace_guid[] = L"_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}";
+
+#else
+
+#define C_ASSERT(e)				_Static_assert((e), #e)
+
+#define _trace_get_pid()		((uint32_t)getpid())
+#define _trace_get_tid()		((uint32_t)syscall(SYS_gettid))
+#define _trace_inc(v)			__atomic_add_fetch(&(v), 1, __ATOMIC_SEQ_CST)
+#define _trace_store(v, x)		__atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+
+static const char trace_name[] = "/itecard_trace_";
+
+#endif
+
+C_ASSERT(sizeof(struct trace_shared_record) == 256);
+C_ASSERT(offsetof(struct trace_shared_info, record) == 64);
+
+static uint64_t _trace_get_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER t;
+
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t)t.tv_sec * 1000000000) + t.tv_nsec;
+#endif
+}
+
+#ifdef _WIN32
+
+// the region is backed by the paging file, or by the given file so that it can
+// be read from outside of Windows, as the statistics are
+bool trace_open(trace *const tr, const wchar_t *const name, const wchar_t *const file, const uint32_t sampling)
+{
+	wchar_t obj_name[256];
+	uint32_t name_len;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	HANDLE shmem;
+	struct trace_shared_info *info;
+
+	tr->shmem = NULL;
+	tr->info = NULL;
+	tr->sampling = sampling;
+	tr->counter = 0;
+
+	name_len = wstrLen(name);
+	if (name_len >= 128) {
+		internal_err("trace_open: name is too long");
+		return false;
+	}
+
+	memcpy(obj_name, trace_name, sizeof(trace_name) - sizeof(wchar_t));
+	memcpy(obj_name + (sizeof(trace_name) / sizeof(wchar_t)) - 1, name, name_len * sizeof(wchar_t));
+	memcpy(obj_name + (sizeof(trace_name) / sizeof(wchar_t)) - 1 + name_len, trace_guid, sizeof(trace_guid));
+
+	if (file != NULL && !wstrIsEmpty(file)) {
+		hFile = CreateFileW(file, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			win32_err("trace_open: CreateFileW");
+		}
+	}
+
+	DWORD le;
+
+	shmem = CreateFileMappingW(hFile, NULL, PAGE_READWRITE, 0, sizeof(struct trace_shared_info), obj_name);
+	le = GetLastError();
+	if (hFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(hFile);
+	}
+	if (shmem == NULL) {
+		win32_err("trace_open: CreateFileMappingW");
+		return false;
+	}
+
+	info = MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+	if (info == NULL) {
+		win32_err("trace_open: MapViewOfFile");
+		CloseHandle(shmem);
+		return false;
+	}
+
+	if (le != ERROR_ALREADY_EXISTS)
+	{
+		// the records of an earlier run are kept unless the layout differs
+		if (info->signature != TRACE_SHARED_INFO_SIGNATURE || info->version != TRACE_SHARED_INFO_VERSION || info->count != TRACE_RECORD_NUM) {
+			LARGE_INTEGER freq;
+
+			QueryPerformanceFrequency(&freq);
+
+			memset(info, 0, sizeof(struct trace_shared_info));
+			info->version = TRACE_SHARED_INFO_VERSION;
+			info->count = TRACE_RECORD_NUM;
+			info->freq = freq.QuadPart;
+			InterlockedExchange((volatile LONG *)&info->signature, TRACE_SHARED_INFO_SIGNATURE);
+		}
+	}
+	else
+	{
+		// the creator may not have initialized it yet
+		for (DWORD tick = GetTickCount(); info->signature == 0 && (GetTickCount() - tick) < TRACE_OPEN_TIMEOUT; ) {
+			Sleep(1);
+		}
+		if (info->signature != TRACE_SHARED_INFO_SIGNATURE || info->version != TRACE_SHARED_INFO_VERSION || info->count != TRACE_RECORD_NUM) {
+			internal_err("trace_open: incorrect signature or version");
+			UnmapViewOfFile(info);
+			CloseHandle(shmem);
+			return false;
+		}
+	}
+
+	tr->shmem = shmem;
+	tr->info = info;
+
+	return true;
+}
+
+void trace_close(trace *const tr)
+{
+	if (tr->info != NULL) {
+		UnmapViewOfFile(tr->info);
+		tr->info = NULL;
+	}
+
+	if (tr->shmem != NULL) {
+		CloseHandle(tr->shmem);
+		tr->shmem = NULL;
+	}
+}
+
+#else
+
+// the region is /dev/shm/itecard_trace_<name>, or the given file, set up as the one of
+// the statistics is
+bool trace_open(trace *const tr, const wchar_t *const name, const wchar_t *const file, const uint32_t sampling)
+{
+	char obj_name[512];
+	struct trace_shared_info *info;
+	struct stat sb;
+	bool shm, created = true;
+	int fd;
+
+	tr->shmem = NULL;
+	tr->info = NULL;
+	tr->sampling = sampling;
+	tr->counter = 0;
+
+	shm = (file == NULL || wstrIsEmpty(file)) ? true : false;
+
+	if (shm == true) {
+		uint32_t len;
+
+		memcpy(obj_name, trace_name, sizeof(trace_name) - 1);
+		len = wstrToUtf8(obj_name + sizeof(trace_name) - 1, sizeof(obj_name) - (sizeof(trace_name) - 1), name);
+		if (len == 0) {
+			internal_err("trace_open: name is too long");
+			return false;
+		}
+
+		for (uint32_t i = sizeof(trace_name) - 1; i < sizeof(trace_name) - 1 + len; i++) {
+			if (obj_name[i] == '/')
+				obj_name[i] = '_';
+		}
+
+		fd = shm_open(obj_name, O_RDWR | O_CREAT | O_EXCL, (mode_t)devdb_get_access_mode());
+		if (fd == -1 && errno == EEXIST) {
+			created = false;
+			fd = shm_open(obj_name, O_RDWR, 0);
+		}
+	}
+	else {
+		if (wstrToUtf8(obj_name, sizeof(obj_name), file) == 0) {
+			internal_err("trace_open: file is too long");
+			return false;
+		}
+
+		fd = open(obj_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, (mode_t)devdb_get_access_mode());
+		if (fd == -1 && errno == EEXIST) {
+			created = false;
+			fd = open(obj_name, O_RDWR | O_CLOEXEC);
+		}
+	}
+
+	if (fd == -1) {
+		if (errno == EACCES) {
+			internal_err("trace_open: access denied, see SharedMemoryMode and SharedMemoryGroup");
+		}
+		else {
+			internal_err("trace_open: open failed (%d)", errno);
+		}
+		return false;
+	}
+
+	if (created == true) {
+		devdb_set_obj_access(fd);
+	}
+
+	flock(fd, LOCK_EX);
+
+	if (fstat(fd, &sb) != 0 || (sb.st_size < (off_t)sizeof(struct trace_shared_info) && ftruncate(fd, sizeof(struct trace_shared_info)) != 0)) {
+		internal_err("trace_open: ftruncate failed");
+		flock(fd, LOCK_UN);
+		close(fd);
+		return false;
+	}
+
+	info = mmap(NULL, sizeof(struct trace_shared_info), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (info == MAP_FAILED) {
+		internal_err("trace_open: mmap failed");
+		flock(fd, LOCK_UN);
+		close(fd);
+		return false;
+	}
+
+	if (info->signature != TRACE_SHARED_INFO_SIGNATURE || info->version != TRACE_SHARED_INFO_VERSION || info->count != TRACE_RECORD_NUM)
+	{
+		// the records of an earlier run are kept unless the layout differs
+		if (shm == true && info->signature != 0) {
+			internal_err("trace_open: incorrect signature or version");
+			munmap(info, sizeof(struct trace_shared_info));
+			flock(fd, LOCK_UN);
+			close(fd);
+			return false;
+		}
+
+		memset(info, 0, sizeof(struct trace_shared_info));
+		info->version = TRACE_SHARED_INFO_VERSION;
+		info->count = TRACE_RECORD_NUM;
+		info->freq = 1000000000;
+		_trace_store(info->signature, TRACE_SHARED_INFO_SIGNATURE);
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	tr->info = info;
+
+	return true;
+}
+
+void trace_close(trace *const tr)
+{
+	if (tr->info != NULL) {
+		munmap(tr->info, sizeof(struct trace_shared_info));
+		tr->info = NULL;
+	}
+}
+
+#endif
+
+// returns whether the transaction is recorded. start is the time it was entered.
+bool trace_tx_begin(trace *const tr, struct trace_tx *const tx, const uint32_t reader_id, const uint64_t start)
+{
+	if (tr->info == NULL)
+		return false;
+
+	// the counter is shared by the threads without a lock, which only makes the sampling less exact
+	if (++tr->counter < tr->sampling)
+		return false;
+
+	tr->counter = 0;
+
+	memset(&tx->rec, 0, offsetof(struct trace_shared_record, event));
+	tx->rec.pid = _trace_get_pid();
+	tx->rec.tid = _trace_get_tid();
+	tx->rec.reader_id = reader_id;
+	tx->rec.start = start;
+
+	return true;
+}
+
+// puts in the beginning of the transaction and the lookup of its handle, which ended at
+// end, afterwards: the device, and so whether it is traced, is not known before it.
+void trace_tx_lookup(struct trace_tx *const tx, const uint64_t end, const uint32_t send_len)
+{
+	tx->rec.event[0].offset = 0;
+	tx->rec.event[0].stage = TRACE_STAGE_TRANSMIT;
+	tx->rec.event[0].phase = TRACE_PHASE_BEGIN;
+	tx->rec.event[1].offset = 0;
+	tx->rec.event[1].stage = TRACE_STAGE_HANDLE;
+	tx->rec.event[1].phase = TRACE_PHASE_BEGIN;
+	tx->rec.event[2].offset = (uint32_t)(end - tx->rec.start);
+	tx->rec.event[2].stage = TRACE_STAGE_HANDLE;
+	tx->rec.event[2].phase = TRACE_PHASE_END;
+	tx->rec.event_num = 3;
+	tx->rec.send_len = (uint16_t)send_len;
+}
+
+void trace_tx_event(struct trace_tx *const tx, const trace_stage_t stage, const uint8_t phase)
+{
+	struct trace_shared_event *ev;
+
+	if (tx->rec.event_num >= TRACE_MAX_EVENT_NUM)
+		return;
+
+	ev = &tx->rec.event[tx->rec.event_num++];
+	ev->offset = (uint32_t)(_trace_get_time() - tx->rec.start);
+	ev->stage = (uint8_t)stage;
+	ev->phase = phase;
+	ev->reserved = 0;
+}
+
+// copies the transaction into the next slot of the ring. a reader sees the same
+// non-zero seq before and after copying a complete record.
+void trace_tx_end(trace *const tr, struct trace_tx *const tx, const int32_t result)
+{
+	struct trace_shared_record *rec;
+	uint32_t seq;
+
+	tx->rec.result = result;
+
+	do {
+		seq = _trace_inc(tr->info->next);
+	} while (seq == 0);
+
+	rec = &tr->info->record[(seq - 1) & (TRACE_RECORD_NUM - 1)];
+
+	_trace_store(rec->seq, 0);
+	memcpy((uint8_t *)rec + sizeof(uint32_t), (const uint8_t *)&tx->rec + sizeof(uint32_t), offsetof(struct trace_shared_record, event) - sizeof(uint32_t) + (sizeof(struct trace_shared_event) * tx->rec.event_num));
+	_trace_store(rec->seq, seq);
+}
@@ -0,0 +1,107 @@
+// trace.h
+
+#pragma once
+
+// the layout of the shared region is also used by the monitor tool, which is
+// built on other platforms too. keep this header free of windows.h.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_SHARED_INFO_SIGNATURE	0x52544349	// "ICTR"
+#define TRACE_SHARED_INFO_VERSION	1
+
+#define TRACE_RECORD_NUM		2048	// power of two
+#define TRACE_MAX_EVENT_NUM		27		// later events of a transaction are not recorded
+
+typedef enum _trace_stage_t
+{
+	TRACE_STAGE_TRANSMIT = 0,	// the whole SCardTransmit
+	TRACE_STAGE_HANDLE,			// handle lookup
+	TRACE_STAGE_LOCK_WAIT,		// devdb_lock
+	TRACE_STAGE_DETECT,			// card detection
+	TRACE_STAGE_INIT,			// card reset, ATR and baudrate
+	TRACE_STAGE_REINIT,			// init after a communication error
+	TRACE_STAGE_IFSD,			// IFSD negotiation
+	TRACE_STAGE_RESYNCH,		// RESYNCH request
+	TRACE_STAGE_SEND,
+	TRACE_STAGE_BGT,			// block guard time
+	TRACE_STAGE_RECV,			// polling for the response
+	TRACE_STAGE_NUM
+} trace_stage_t;
+
+#define TRACE_PHASE_BEGIN	0
+#define TRACE_PHASE_END		1
+
+// shared data
+
+struct trace_shared_event
+{
+	uint32_t offset;		// ticks from the start of the transaction
+	uint8_t stage;
+	uint8_t phase;
+	uint16_t reserved;
+};
+
+struct trace_shared_record
+{
+	volatile uint32_t seq;	// 0 while being written
+	uint32_t pid;
+	uint32_t tid;
+	uint32_t reader_id;
+	uint64_t start;			// ticks
+	int32_t result;
+	uint16_t send_len;
+	uint16_t recv_len;
+	uint16_t ioctl;			// device control requests
+	uint16_t poll;			// polls for the response
+	uint8_t retry;			// T=1 block retransmissions
+	uint8_t event_num;
+	uint16_t reserved;
+	struct trace_shared_event event[TRACE_MAX_EVENT_NUM];
+};
+
+struct trace_shared_info
+{
+	uint32_t signature;
+	uint32_t version;
+	uint32_t count;			// number of records
+	uint32_t reserved;
+	uint64_t freq;			// ticks per second
+	volatile uint32_t next;	// sequence number of the next record
+	uint8_t reserved2[36];
+	struct trace_shared_record record[TRACE_RECORD_NUM];
+};
+
+// local
+
+typedef struct _trace
+{
+	void *shmem;
+	struct trace_shared_info *info;
+	uint32_t sampling;		// one of this many transactions is recorded
+	uint32_t counter;
+} trace;
+
+// a transaction being recorded, on the stack of the caller
+struct trace_tx
+{
+	struct trace_shared_record rec;
+};
+
+extern bool trace_open(trace *const tr, const wchar_t *const name, const wchar_t *const file, const uint32_t sampling);
+extern void trace_close(trace *const tr);
+extern bool trace_tx_begin(trace *const tr, struct trace_tx *const tx, const uint32_t reader_id, const uint64_t start);
+extern void trace_tx_event(struct trace_tx *const tx, const trace_stage_t stage, const uint8_t phase);
+extern void trace_tx_lookup(struct trace_tx *const tx, const uint64_t end, const uint32_t send_len);
+extern void trace_tx_end(trace *const tr, struct trace_tx *const tx, const int32_t result);
+
+// nothing is done unless the transaction is sampled
+
+#define trace_begin(tx, stage) \
+	do { if ((tx) != NULL) trace_tx_event((tx), (stage), TRACE_PHASE_BEGIN); } while (0)
+#define trace_end(tx, stage) \
+	do { if ((tx) != NULL) trace_tx_event((tx), (stage), TRACE_PHASE_END); } while (0)
+#define trace_count(tx, field) \
+	do { if ((tx) != NULL) (tx)->rec.field++; } while (0)
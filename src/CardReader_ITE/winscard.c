@@ -4,12 +4,22 @@
 #include <stdint.h>
 #include <windows.h>
 
+#define DBG_CATEGORY	DBG_CAT_API
+
 #include "debug.h"
 #include "memory.h"
 #include "string.h"
 #include "handle.h"
 #include "devdb.h"
 #include "itecard.h"
+#include "stats.h"
+#include "trace.h"
+#include "iterec.h"
+#include "worker.h"
+#include "broker.h"
+#include "iteloop.h"
+#include "scheduler.h"
+#include "reader.h"
 
 /* macros */
 
@@ -25,6 +35,21 @@
 #define _handle_check_signature(handle) ((handle)->signature == _HANDLE_SIGNATURE)
 #define _handle_check(handle) ((handle) != NULL && _handle_check_signature((handle)))
 
+#define _POOL_SLAB_NUM	8
+
+#define _WORKER_MAX_DEV_NUM	64		// devices with a larger id are accessed by the callers
+#define _BROKER_MAX_DEV_NUM	64		// devices with a larger id are not served to other processes
+
+// SCardControl: sets the scheduling class of the transmits of the handle.
+// in: DWORD, scheduler_class_t or _SCHED_CLASS_BY_INS
+#define _IOCTL_ITECARD_SET_PRIORITY	SCARD_CTL_CODE(3400)
+#define _SCHED_CLASS_BY_INS		0xffffffff	// the class is looked up by the instruction of the command
+
+#define _READER_POOL_MAX_NUM			16
+#define _READER_POOL_MAX_MEMBER_NUM		8
+#define _READER_POOL_NO_MEMBER			0xffffffff
+#define _READER_POOL_RETRY_INTERVAL		5000	// milliseconds a member which failed is left out
+
 #define _READER_NAME_SIZE_A(dev) ((dev)->reader_len_A + 1 + 10 + 1 + 1)
 #define _READER_NAME_SIZE_W(dev) ((dev)->reader_len_W + 1 + 10 + 1 + 1)
 
@@ -41,15 +66,62 @@ struct _handle {
 	uint32_t id;
 	struct _reader_device *dev;
 	struct itecard_handle itecard;
+	worker *worker;		// NULL if the device is accessed by the caller
+	iteloop *loop;		// NULL unless the transmits run on the event loop
+	HANDLE done;		// event of the worker, loop and scheduler requests, created on the first one
+	uint32_t sched_class;
+	struct scheduler_flow flow;
+	struct _reader_pool *pool;	// NULL unless the handle was connected to a pooled reader
+	struct _handle *member[_READER_POOL_MAX_MEMBER_NUM];	// of the members of the pool which are connected, this handle first
+	uint32_t affinity;			// member the transmits stick to
+};
+
+struct _reader_worker {
+	worker *w;
+	uint32_t ref;		// handles of this process
+};
+
+// the owner of the broker serves the other processes from a thread, with handles
+// of its own. it is freed by the thread.
+struct _broker_server {
+	struct _reader_device *dev;
+	volatile LONG stop;
+	HMODULE module;
+	struct itecard_handle itecard[_BROKER_MAX_DEV_NUM];
 };
 
 struct _reader_device {
-	devdb db;
+	struct reader_device core;	// the engine, shared with the other front ends
+	bool worker_mode;
+	bool loop_mode;
+	scheduler *sched;		// NULL unless the transmits of the handles of this process are scheduled
+	uint8_t ins_class[256];	// scheduler_class_t of the commands, by instruction
+	struct _reader_worker *worker;	// _WORKER_MAX_DEV_NUM entries, allocated on the first connection
+	broker *broker;			// NULL unless the devices are shared through the broker
+	struct _broker_server *server;	// not NULL while this process is the owner
+	uint32_t broker_ref;	// handles of this process
 	wchar_t reader_W[128];
 	uint32_t reader_len_W;
 	char reader_A[128];
 	uint32_t reader_len_A;
-	uint8_t power_mode;
+};
+
+// a reader made of the cards of other readers, possibly of different types. the
+// handle connected to it is connected to its first member which is available, and
+// has handles of its own for the others.
+struct _reader_pool_member {
+	wchar_t reader_W[160];		// name of the reader of the card
+	volatile DWORD fail_tick;	// GetTickCount when the card last failed, 0 if it did not
+};
+
+struct _reader_pool {
+	wchar_t reader_W[128];
+	uint32_t reader_len_W;
+	char reader_A[128];
+	uint32_t reader_len_A;
+	bool affinity;				// the transmits of a handle stay on one card until it fails
+	uint32_t member_num;
+	struct _reader_pool_member member[_READER_POOL_MAX_MEMBER_NUM];
 };
 
 struct _reader_list_A
@@ -78,12 +150,22 @@ static uintptr_t _event_ref = 0;
 static handle_list _hlist_ctx;
 static handle_list _hlist_card;
 
-static uint32_t _reader_all_len_W = 0;
-static uint32_t _reader_all_len_A = 0;
+static mem_pool _pool_ctx = NULL;
+static mem_pool _pool_card = NULL;
+
+static uint32_t _device_capacity = DEVDB_DEFAULT_DEV_NUM;
 
 static struct _reader_device *_device = NULL;
 static uintptr_t _device_num = 0;
 
+static struct _reader_pool *_reader_pool = NULL;
+static uintptr_t _reader_pool_num = 0;
+
+// the event loop is shared by the readers in loop mode, with a channel for each
+static iteloop *_loop = NULL;
+static uint32_t _loop_ref = 0;
+static SRWLOCK _loop_lock = SRWLOCK_INIT;
+
 /* functions */
 
 static LONG itecard_status_to_scard_status(itecard_status_t status)
@@ -169,6 +251,9 @@ static LONG devdb_status_to_scard_status(devdb_status_t status)
 	case DEVDB_E_DEVICE_NOT_FOUND:
 		return SCARD_E_READER_UNAVAILABLE;
 
+	case DEVDB_E_ACCESS_DENIED:
+		return SCARD_E_NO_ACCESS;
+
 	default:
 		return SCARD_F_INTERNAL_ERROR;
 	}
@@ -230,6 +315,144 @@ static int _enum_readers_callback_W(devdb *const db, const uint32_t id, const st
 	return 1;
 }
 
+static LONG _list_readers_A(struct _reader_list_A *const rl)
+{
+	LONG r = SCARD_E_NO_READERS_AVAILABLE;
+	devdb_status_t ret = DEVDB_E_INTERNAL;
+	uintptr_t i;
+
+	for (i = 0; i < _device_num; i++)
+	{
+		struct _reader_device *dev = &_device[i];
+
+		devdb_lock(&dev->core.db);
+
+		ret = devdb_update_nolock(&dev->core.db);
+		if (ret != DEVDB_S_OK && ret != DEVDB_E_NO_DEVICES) {
+			r = devdb_status_to_scard_status(ret);
+			devdb_unlock(&dev->core.db);
+			break;
+		}
+
+		rl->dev = dev;
+
+		ret = devdb_enum_nolock(&dev->core.db, _enum_readers_callback_A, rl);
+		if (ret != DEVDB_E_NO_DEVICES) {
+			if (ret != DEVDB_S_OK) {
+				r = SCARD_F_INTERNAL_ERROR;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else if (rl->len == 0) {
+				r = SCARD_E_INSUFFICIENT_BUFFER;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else {
+				r = SCARD_S_SUCCESS;
+			}
+		}
+		else if (r != SCARD_S_SUCCESS) {
+			r = SCARD_E_NO_READERS_AVAILABLE;
+		}
+
+		devdb_unlock(&dev->core.db);
+	}
+
+	// the pooled readers follow the devices they are made of
+	if (r == SCARD_S_SUCCESS)
+	{
+		for (i = 0; i < _reader_pool_num; i++)
+		{
+			struct _reader_pool *pool = &_reader_pool[i];
+			uint32_t name_len = pool->reader_len_A + 1;
+
+			if (rl->list != NULL)
+			{
+				if (rl->len + name_len > rl->size) {
+					rl->len = 0;
+					r = SCARD_E_INSUFFICIENT_BUFFER;
+					break;
+				}
+				memcpy(rl->list + rl->len, pool->reader_A, name_len * sizeof(char));
+			}
+
+			rl->len += name_len;
+		}
+	}
+
+	return r;
+}
+
+static LONG _list_readers_W(struct _reader_list_W *const rl)
+{
+	LONG r = SCARD_E_NO_READERS_AVAILABLE;
+	devdb_status_t ret = DEVDB_E_INTERNAL;
+	uintptr_t i;
+
+	for (i = 0; i < _device_num; i++)
+	{
+		struct _reader_device *dev = &_device[i];
+
+		devdb_lock(&dev->core.db);
+
+		ret = devdb_update_nolock(&dev->core.db);
+		if (ret != DEVDB_S_OK && ret != DEVDB_E_NO_DEVICES) {
+			r = devdb_status_to_scard_status(ret);
+			devdb_unlock(&dev->core.db);
+			break;
+		}
+
+		rl->dev = dev;
+
+		ret = devdb_enum_nolock(&dev->core.db, _enum_readers_callback_W, rl);
+		if (ret != DEVDB_E_NO_DEVICES) {
+			if (ret != DEVDB_S_OK) {
+				r = SCARD_F_INTERNAL_ERROR;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else if (rl->len == 0) {
+				r = SCARD_E_INSUFFICIENT_BUFFER;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else {
+				r = SCARD_S_SUCCESS;
+			}
+		}
+		else if (r != SCARD_S_SUCCESS) {
+			r = SCARD_E_NO_READERS_AVAILABLE;
+		}
+
+		devdb_unlock(&dev->core.db);
+	}
+
+	// the pooled readers follow the devices they are made of
+	if (r == SCARD_S_SUCCESS)
+	{
+		for (i = 0; i < _reader_pool_num; i++)
+		{
+			struct _reader_pool *pool = &_reader_pool[i];
+			uint32_t name_len = pool->reader_len_W + 1;
+
+			if (rl->list != NULL)
+			{
+				if (rl->len + name_len > rl->size) {
+					rl->len = 0;
+					r = SCARD_E_INSUFFICIENT_BUFFER;
+					break;
+				}
+				memcpy(rl->list + rl->len, pool->reader_W, name_len * sizeof(wchar_t));
+			}
+
+			rl->len += name_len;
+		}
+	}
+
+	return r;
+}
+
 static bool _get_reader_id_A(const char *const name, uintptr_t *const pos, struct _reader_device **const rd, uint32_t *const id)
 {
 	struct _reader_device *d = _device;
@@ -278,110 +501,345 @@ static bool _get_reader_id_W(const wchar_t *const name, uintptr_t *const pos, st
 	return false;
 }
 
-static LONG _connect_card(struct _handle *const handle, struct _reader_device *const rd, const uint32_t id, DWORD dwShareMode, DWORD dwPreferredProtocols, LPDWORD pdwActiveProtocol)
+static bool _get_reader_pool_A(const char *const name, struct _reader_pool **const pool)
 {
-	bool exclusive;
+	for (uintptr_t i = 0; i < _reader_pool_num; i++) {
+		if (strCompare(_reader_pool[i].reader_A, name) == true) {
+			*pool = &_reader_pool[i];
+			return true;
+		}
+	}
 
-	if (dwShareMode == SCARD_SHARE_DIRECT)
-		return SCARD_E_READER_UNSUPPORTED;
+	return false;
+}
 
-	exclusive = (dwShareMode == SCARD_SHARE_EXCLUSIVE) ? true : false;
+static bool _get_reader_pool_W(const wchar_t *const name, struct _reader_pool **const pool)
+{
+	for (uintptr_t i = 0; i < _reader_pool_num; i++) {
+		if (wstrCompare(_reader_pool[i].reader_W, name) == true) {
+			*pool = &_reader_pool[i];
+			return true;
+		}
+	}
 
-	itecard_protocol_t protocol = ITECARD_PROTOCOL_UNDEFINED;
+	return false;
+}
 
-	if (dwPreferredProtocols & SCARD_PROTOCOL_T1)
-		protocol |= ITECARD_PROTOCOL_T1;
+static void _worker_lock(void *ctx)
+{
+	devdb_lock(&((struct _reader_device *)ctx)->core.db);
+}
 
-	if (protocol == ITECARD_PROTOCOL_UNDEFINED)
-		return SCARD_E_READER_UNSUPPORTED;
+static void _worker_unlock(void *ctx)
+{
+	devdb_unlock(&((struct _reader_device *)ctx)->core.db);
+}
 
-	LONG r = SCARD_F_INTERNAL_ERROR;
-	devdb_status_t dbr;
-	struct devdb_shared_devinfo *devinfo;
-	struct itecard_shared_readerinfo *reader;
-
-	dbr = devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo);
-	if (dbr != DEVDB_S_OK) {
-		internal_err("_connect_card: devdb_get_shared_devinfo_nolock failed");
-		r = devdb_status_to_scard_status(dbr);
-		goto end1;
+static LONG _worker_execute(void *ctx, void *prm);
+
+static const struct worker_ops _worker_ops = { _worker_lock, _worker_unlock, _worker_execute };
+
+// called with the lock held. the worker of the device is shared by the handles of
+// this process, and is started by the first one.
+static worker * _worker_ref_nolock(struct _reader_device *const rd, const uint32_t id)
+{
+	struct _reader_worker *rw;
+
+	if (rd->worker_mode == false || id >= _WORKER_MAX_DEV_NUM)
+		return NULL;
+
+	if (rd->worker == NULL) {
+		rd->worker = memAlloc(_WORKER_MAX_DEV_NUM * sizeof(struct _reader_worker));
+		if (rd->worker == NULL)
+			return NULL;
+
+		memset(rd->worker, 0, _WORKER_MAX_DEV_NUM * sizeof(struct _reader_worker));
 	}
 
-	reader = (struct itecard_shared_readerinfo *)devinfo->user;
+	rw = &rd->worker[id];
 
-	if (exclusive == true && (devinfo->ref > 0)) {
-		internal_err("_connect_card: device was opened in share mode by another application");
-		r = SCARD_E_SHARING_VIOLATION;
-		goto end1;
+	if (rw->w == NULL) {
+		rw->w = worker_create(&_worker_ops, rd);
+		if (rw->w == NULL) {
+			dbg("_worker_ref_nolock: worker_create failed");
+			return NULL;
+		}
 	}
 
-	itecard_status_t cr;
+	rw->ref++;
 
-	cr = itecard_open(&handle->itecard, devinfo->path, reader, protocol, exclusive, ((rd->power_mode & 1) ? true : false));
-	if (cr != ITECARD_S_OK) {
-		internal_err("_connect_card: itecard_open failed");
-		r = itecard_status_to_scard_status(cr);
-		goto end1;
+	return rw->w;
+}
+
+static void _worker_unref_nolock(struct _handle *const handle)
+{
+	struct _reader_worker *rw;
+
+	if (handle->worker == NULL)
+		return;
+
+	rw = &handle->dev->worker[handle->id];
+	handle->worker = NULL;
+
+	if (--rw->ref == 0) {
+		worker_destroy(rw->w);
+		rw->w = NULL;
 	}
+}
 
-	cr = itecard_init(&handle->itecard);
-	if (cr != ITECARD_S_OK && cr != ITECARD_S_FALSE) {
-		internal_err("_connect_card: itecard_init failed");
-		r = itecard_status_to_scard_status(cr);
-		goto end2;
+static bool _loop_try_lock(void *ctx, const uint32_t channel)
+{
+	return devdb_trylock(&_device[channel].core.db);
+}
+
+static void _loop_unlock(void *ctx, const uint32_t channel)
+{
+	devdb_unlock(&_device[channel].core.db);
+}
+
+static int32_t _loop_execute(void *ctx, void *prm);
+
+static const struct iteloop_ops _loop_ops = { _loop_try_lock, _loop_unlock, _loop_execute };
+
+// called with the lock of the device held. the loop is started by the first handle
+// of a reader in loop mode, and ends with the last one.
+static iteloop * _loop_ref_nolock(struct _reader_device *const rd)
+{
+	iteloop *loop;
+
+	if (rd->loop_mode == false || (uintptr_t)(rd - _device) >= ITELOOP_MAX_CHANNEL_NUM)
+		return NULL;
+
+	AcquireSRWLockExclusive(&_loop_lock);
+
+	if (_loop == NULL) {
+		_loop = iteloop_create(&_loop_ops, NULL);
+		if (_loop == NULL) {
+			dbg("_loop_ref_nolock: iteloop_create failed");
+		}
 	}
 
-	if ((dwPreferredProtocols & SCARD_PROTOCOL_T1) && (reader->card.T1.b == true))
-		*pdwActiveProtocol |= SCARD_PROTOCOL_T1;
+	if (_loop != NULL) {
+		_loop_ref++;
+	}
 
-	if (*pdwActiveProtocol == SCARD_PROTOCOL_UNDEFINED) {
-		internal_err("_connect_card: no active protocol");
-		r = SCARD_E_PROTO_MISMATCH;
-		goto end2;
+	loop = _loop;
+
+	ReleaseSRWLockExclusive(&_loop_lock);
+
+	return loop;
+}
+
+static void _loop_unref_nolock(struct _handle *const handle)
+{
+	if (handle->loop == NULL)
+		return;
+
+	handle->loop = NULL;
+
+	AcquireSRWLockExclusive(&_loop_lock);
+
+	if (--_loop_ref == 0) {
+		iteloop_destroy(_loop);
+		_loop = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&_loop_lock);
+}
+
+static void _broker_lock(void *ctx)
+{
+	devdb_lock(&((struct _broker_server *)ctx)->dev->core.db);
+}
+
+static void _broker_unlock(void *ctx)
+{
+	devdb_unlock(&((struct _broker_server *)ctx)->dev->core.db);
+}
+
+// called with the lock held, on the thread of the owner
+static int32_t _broker_execute(void *ctx, const struct broker_request *const req)
+{
+	struct _broker_server *srv = ctx;
+	struct _reader_device *rd = srv->dev;
+	struct itecard_handle *itecard;
+	void *user;
+
+	if (req->id >= _BROKER_MAX_DEV_NUM || devdb_get_userdata_nolock(&rd->core.db, req->id, &user) != DEVDB_S_OK)
+		return SCARD_E_READER_UNAVAILABLE;
+
+	itecard = &srv->itecard[req->id];
+
+	if (itecard->reader == NULL)
+	{
+		itecard->ite.rec = rd->core.rec;
+		if (itecard_open(itecard, reader_get_path_nolock(&rd->core, req->id), user, ITECARD_PROTOCOL_T1, false, false) != ITECARD_S_OK) {
+			internal_err("_broker_execute: itecard_open failed");
+			memset(itecard, 0, sizeof(struct itecard_handle));
+			return SCARD_E_READER_UNAVAILABLE;
+		}
+
+		itecard->stats = stats_get_reader(&rd->core.stats, req->id);
+	}
+
+	// the device table may have moved to a new generation
+	itecard->reader = (struct itecard_shared_readerinfo *)user;
+
+	if (req->protocol != SCARD_PROTOCOL_T1)
+		return SCARD_E_READER_UNSUPPORTED;
+
+	if (itecard->reader->card.T1.b == false)
+		return SCARD_E_UNSUPPORTED_FEATURE;
+
+	return itecard_status_to_scard_status(itecard_transmit(itecard, ITECARD_PROTOCOL_T1, req->send, req->send_len, req->recv, req->recv_len));
+}
+
+static const struct broker_ops _broker_ops = { _broker_lock, _broker_unlock, _broker_execute };
+
+static DWORD WINAPI _broker_thread(LPVOID param)
+{
+	struct _broker_server *srv = param;
+	struct _reader_device *rd = srv->dev;
+	HMODULE module = srv->module;
+
+	while (srv->stop == 0) {
+		broker_serve(rd->broker, &_broker_ops, srv, BROKER_CHECK_INTERVAL);
+	}
+
+	devdb_lock(&rd->core.db);
+
+	for (uint32_t i = 0; i < _BROKER_MAX_DEV_NUM; i++) {
+		if (srv->itecard[i].reader != NULL) {
+			itecard_close(&srv->itecard[i], false, false, false);
+		}
 	}
 
-	if (devdb_ref_nolock(&rd->db, id, NULL) != DEVDB_S_OK) {
-		internal_err("_connect_card: devdb_ref_nolock failed");
-		r = SCARD_F_INTERNAL_ERROR;
+	devdb_unlock(&rd->core.db);
+
+	memFree(srv);
+
+	// the thread holds a reference of the module, so that it is not unloaded under it
+	FreeLibraryAndExitThread(module, 0);
+
+	return 0;
+}
+
+// called with the lock held. the first process to connect to a device of the reader
+// becomes the owner, and serves the others until its last handle is disconnected.
+static void _broker_ref_nolock(struct _reader_device *const rd)
+{
+	struct _broker_server *srv;
+	HANDLE thread;
+
+	if (rd->broker == NULL)
+		return;
+
+	rd->broker_ref++;
+
+	if (rd->server != NULL || broker_claim(rd->broker) == false)
+		return;
+
+	srv = memAlloc(sizeof(struct _broker_server));
+	if (srv == NULL)
+		goto end1;
+
+	memset(srv, 0, sizeof(struct _broker_server));
+	srv->dev = rd;
+	srv->stop = 0;
+
+	if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)_broker_thread, &srv->module) == FALSE) {
+		internal_err("_broker_ref_nolock: GetModuleHandleExW failed");
 		goto end2;
 	}
 
-	handle->id = id;
-	handle->dev = rd;
+	thread = CreateThread(NULL, 0, _broker_thread, srv, 0, NULL);
+	if (thread == NULL) {
+		internal_err("_broker_ref_nolock: CreateThread failed");
+		goto end3;
+	}
 
-	return SCARD_S_SUCCESS;
+	CloseHandle(thread);
+
+	rd->server = srv;
+
+	return;
 
+end3:
+	FreeLibrary(srv->module);
 end2:
-	itecard_close(&handle->itecard, true, ((devinfo->ref == 0) ? true : false), ((rd->power_mode & 2) ? true : false));
+	memFree(srv);
 end1:
-	return r;
+	broker_release(rd->broker);
+	return;
 }
 
-static LONG _disconnect_card(struct _handle *const handle, const bool reset)
+static void _broker_unref_nolock(struct _reader_device *const rd)
 {
-	uint32_t ref;
-	LONG r;
+	if (rd->broker == NULL || rd->broker_ref == 0)
+		return;
 
-	if (devdb_unref_nolock(&handle->dev->db, handle->id, &ref) == DEVDB_S_OK) {
-		r = itecard_status_to_scard_status(itecard_close(&handle->itecard, reset, ((ref == 0) ? true : false), ((handle->dev->power_mode & 2) ? true : false)));
-	}
-	else {
-		r = SCARD_F_INTERNAL_ERROR;
+	if (--rd->broker_ref == 0 && rd->server != NULL) {
+		// the requests which are not taken yet are given back to their clients
+		broker_release(rd->broker);
+		InterlockedExchange(&rd->server->stop, 1);
+		rd->server = NULL;
 	}
+}
 
-	return r;
+static LONG _connect_card(struct _handle *const handle, struct _reader_device *const rd, const uint32_t id, DWORD dwShareMode, DWORD dwPreferredProtocols, LPDWORD pdwActiveProtocol)
+{
+	if (dwShareMode == SCARD_SHARE_DIRECT)
+		return SCARD_E_READER_UNSUPPORTED;
+
+	itecard_protocol_t protocol = ITECARD_PROTOCOL_UNDEFINED;
+
+	if (dwPreferredProtocols & SCARD_PROTOCOL_T1)
+		protocol |= ITECARD_PROTOCOL_T1;
+
+	if (protocol == ITECARD_PROTOCOL_UNDEFINED)
+		return SCARD_E_READER_UNSUPPORTED;
+
+	itecard_status_t cr;
+
+	cr = reader_connect_nolock(&rd->core, id, &handle->itecard, protocol, ((dwShareMode == SCARD_SHARE_EXCLUSIVE) ? true : false));
+	if (cr != ITECARD_S_OK)
+		return itecard_status_to_scard_status(cr);
+
+	*pdwActiveProtocol |= SCARD_PROTOCOL_T1;
+
+	handle->id = id;
+	handle->dev = rd;
+	handle->loop = _loop_ref_nolock(rd);
+	handle->worker = (handle->loop == NULL) ? _worker_ref_nolock(rd, id) : NULL;
+	_broker_ref_nolock(rd);
+
+	return SCARD_S_SUCCESS;
 }
 
-static LONG _get_card_atr(struct itecard_handle *const itecard, LPBYTE pbAtr, LPDWORD pcbAtrLen, uint32_t max_atr_len)
+static void _handle_sync_nolock(struct _handle *const handle)
+{
+	reader_sync_nolock(&handle->dev->core, handle->id, &handle->itecard);
+}
+
+static LONG _disconnect_card(struct _handle *const handle, const bool reset)
+{
+	_handle_sync_nolock(handle);
+	_loop_unref_nolock(handle);
+	_worker_unref_nolock(handle);
+	_broker_unref_nolock(handle->dev);
+
+	return itecard_status_to_scard_status(reader_disconnect_nolock(&handle->dev->core, handle->id, &handle->itecard, reset));
+}
+
+static LONG _copy_atr(const uint8_t *const card_atr, const uint32_t card_atr_len, LPBYTE pbAtr, LPDWORD pcbAtrLen, uint32_t max_atr_len)
 {
 	LONG r = SCARD_S_SUCCESS;
 
 	if (pcbAtrLen != NULL)
 	{
-		struct card_info *card = &itecard->reader->card;
 		uint8_t atr_len;
 
-		atr_len = (card->atr_len > max_atr_len) ? max_atr_len : card->atr_len;
+		atr_len = (card_atr_len > max_atr_len) ? max_atr_len : card_atr_len;
 
 		if (pbAtr != NULL)
 		{
@@ -389,7 +847,7 @@ static LONG _get_card_atr(struct itecard_handle *const itecard, LPBYTE pbAtr, LP
 
 			if (*pcbAtrLen == SCARD_AUTOALLOCATE)
 			{
-				atr = memAlloc(atr_len);
+				atr = memAllocRaw(atr_len);
 				if (atr == NULL) {
 					r = SCARD_E_NO_MEMORY;
 					goto end;
@@ -407,7 +865,7 @@ static LONG _get_card_atr(struct itecard_handle *const itecard, LPBYTE pbAtr, LP
 			}
 
 			if (atr != NULL) {
-				memcpy(atr, card->atr, atr_len);
+				memcpy(atr, card_atr, atr_len);
 			}
 		}
 
@@ -418,53 +876,73 @@ end:
 	return r;
 }
 
+static LONG _get_card_atr(struct itecard_handle *const itecard, LPBYTE pbAtr, LPDWORD pcbAtrLen, uint32_t max_atr_len)
+{
+	return _copy_atr(itecard->reader->card.atr, itecard->reader->card.atr_len, pbAtr, pcbAtrLen, max_atr_len);
+}
+
+// a mute card is reported as such only
 static DWORD _get_reader_state(struct _reader_device *const rd, const uint32_t id, LPDWORD pcbAtr, LPBYTE rgbAtr)
 {
+	static const DWORD map[][2] = {
+		{ READER_STATE_UNAVAILABLE, SCARD_STATE_UNAVAILABLE },
+		{ READER_STATE_EMPTY, SCARD_STATE_EMPTY },
+		{ READER_STATE_PRESENT, SCARD_STATE_PRESENT },
+		{ READER_STATE_UNPOWERED, SCARD_STATE_UNPOWERED },
+		{ READER_STATE_INUSE, SCARD_STATE_INUSE },
+		{ READER_STATE_EXCLUSIVE, SCARD_STATE_EXCLUSIVE },
+	};
+
+	uint8_t atr[READER_MAX_ATR_SIZE];
+	uint32_t atr_len, st;
 	DWORD state = 0;
-	struct devdb_shared_devinfo *devinfo;
 
-	if (devdb_get_shared_devinfo_nolock(&rd->db, id, &devinfo) != DEVDB_S_OK) {
-		state = SCARD_STATE_UNAVAILABLE;
-	}
-	else
-	{
-		struct itecard_shared_readerinfo *reader;
-		struct itecard_handle h;
+	st = reader_get_state_nolock(&rd->core, id, atr, &atr_len);
 
-		reader = (struct itecard_shared_readerinfo *)devinfo->user;
-		memset(&h, 0, sizeof(struct itecard_handle));
+	if (st & READER_STATE_MUTE)
+		return SCARD_STATE_MUTE;
 
-		if (itecard_open(&h, devinfo->path, reader, ITECARD_PROTOCOL_UNDEFINED, false, ((devinfo->ref == 0) ? true : false)) != ITECARD_S_OK) {
-			state = SCARD_STATE_UNAVAILABLE;
+	for (uint32_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		if (st & map[i][0]) {
+			state |= map[i][1];
 		}
-		else {
-			switch (itecard_init(&h))
-			{
-			case ITECARD_S_OK:
-			case ITECARD_S_FALSE:
-				state = SCARD_STATE_PRESENT;
-				break;
+	}
 
-			case ITECARD_E_NO_CARD:
-			case ITECARD_E_FAILED:
-				state = SCARD_STATE_EMPTY;
-				break;
+	if (st & READER_STATE_PRESENT) {
+		_copy_atr(atr, atr_len, rgbAtr, pcbAtr, 36);
+	}
 
-			default:
-				state = SCARD_STATE_MUTE;
-				break;
-			}
+	return state;
+}
 
-			if (state == SCARD_STATE_PRESENT)
-			{
-				if (devinfo->ref > 0) {
-					state |= (reader->exclusive == true) ? SCARD_STATE_EXCLUSIVE : SCARD_STATE_INUSE;
-				}
+// the state of the first member with a card, or of the last one
+static DWORD _get_reader_pool_state(struct _reader_pool *const pool, LPDWORD pcbAtr, LPBYTE rgbAtr)
+{
+	DWORD state = SCARD_STATE_UNAVAILABLE;
+
+	for (uint32_t i = 0; i < pool->member_num; i++)
+	{
+		uintptr_t pos = 0;
+		struct _reader_device *dev;
+		uint32_t id;
+
+		while (_get_reader_id_W(pool->member[i].reader_W, &pos, &dev, &id) == true)
+		{
+			*pcbAtr = 0;
+
+			devdb_lock(&dev->core.db);
+			state = _get_reader_state(dev, id, pcbAtr, rgbAtr);
+			devdb_unlock(&dev->core.db);
+
+			pos++;
 
-				_get_card_atr(&h, rgbAtr, pcbAtr, 36);
+			if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
+				break;
 			}
+		}
 
-			itecard_close(&h, false, false, ((devinfo->ref == 0) ? true : false));
+		if (state & SCARD_STATE_PRESENT) {
+			break;
 		}
 	}
 
@@ -516,7 +994,7 @@ static bool _context_alloc(struct _context **const ctx)
 {
 	struct _context *c;
 
-	c = memAlloc(sizeof(struct _context));
+	c = memPoolAlloc(_pool_ctx);
 	if (c == NULL)
 		return false;
 
@@ -531,7 +1009,7 @@ static bool _context_alloc(struct _context **const ctx)
 static bool _context_free(struct _context *const ctx)
 {
 	DeleteCriticalSection(&ctx->sct);
-	memFree(ctx);
+	memPoolFree(_pool_ctx, ctx);
 
 	return true;
 }
@@ -562,12 +1040,23 @@ static bool _handle_alloc(struct _handle **const handle)
 {
 	struct _handle *h;
 
-	h = memAlloc(sizeof(struct _handle));
+	h = memPoolAlloc(_pool_card);
 	if (h == NULL)
 		return false;
 
 	h->signature = _HANDLE_SIGNATURE;
 	InitializeCriticalSection(&h->sct);
+	h->id = 0;
+	h->dev = NULL;
+	memset(&h->itecard, 0, sizeof(struct itecard_handle));
+	h->worker = NULL;
+	h->loop = NULL;
+	h->done = NULL;
+	h->sched_class = _SCHED_CLASS_BY_INS;
+	h->flow.deficit = 0;
+	h->pool = NULL;
+	memset(h->member, 0, sizeof(h->member));
+	h->affinity = _READER_POOL_NO_MEMBER;
 
 	*handle = h;
 
@@ -576,8 +1065,12 @@ static bool _handle_alloc(struct _handle **const handle)
 
 static bool _handle_free(struct _handle *const handle)
 {
+	if (handle->done != NULL) {
+		CloseHandle(handle->done);
+	}
+
 	DeleteCriticalSection(&handle->sct);
-	memFree(handle);
+	memPoolFree(_pool_card, handle);
 
 	return true;
 }
@@ -594,16 +1087,97 @@ static void _handle_unlock(struct _handle *const handle)
 	return;
 }
 
+// the handles of the other members of the pool. they are only used with the handle
+// of the pool locked.
+static void _disconnect_reader_pool(struct _handle *const handle, const bool reset)
+{
+	if (handle->pool == NULL)
+		return;
+
+	for (uint32_t i = 0; i < handle->pool->member_num; i++)
+	{
+		struct _handle *m = handle->member[i];
+
+		if (m == NULL || m == handle)
+			continue;
+
+		devdb_lock(&m->dev->core.db);
+		_disconnect_card(m, reset);
+		devdb_unlock(&m->dev->core.db);
+
+		_handle_free(m);
+		handle->member[i] = NULL;
+	}
+}
+
+// connects the handle to the first member which can be connected, and a handle of
+// its own to each of the others
+static LONG _connect_reader_pool(struct _handle *const handle, struct _reader_pool *const pool, DWORD dwShareMode, DWORD dwPreferredProtocols, LPDWORD pdwActiveProtocol)
+{
+	LONG r = SCARD_E_UNKNOWN_READER;
+
+	handle->pool = pool;
+
+	for (uint32_t i = 0; i < pool->member_num; i++)
+	{
+		struct _handle *m = handle;
+		DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+		uintptr_t pos = 0;
+		struct _reader_device *dev;
+		uint32_t id;
+
+		if (handle->dev != NULL && _handle_alloc(&m) == false) {
+			r = SCARD_E_NO_MEMORY;
+			continue;
+		}
+
+		while (_get_reader_id_W(pool->member[i].reader_W, &pos, &dev, &id) == true)
+		{
+			memset(&m->itecard, 0, sizeof(struct itecard_handle));
+
+			devdb_lock(&dev->core.db);
+			r = _connect_card(m, dev, id, dwShareMode, dwPreferredProtocols, (m == handle) ? pdwActiveProtocol : &protocol);
+			devdb_unlock(&dev->core.db);
+
+			pos++;
+
+			if (r == SCARD_S_SUCCESS || pos >= _device_num) {
+				break;
+			}
+		}
+
+		if (m->dev == NULL) {
+			if (m != handle) {
+				_handle_free(m);
+			}
+			continue;
+		}
+
+		m->sched_class = handle->sched_class;
+		handle->member[i] = m;
+	}
+
+	if (handle->dev == NULL) {
+		handle->pool = NULL;
+		return r;
+	}
+
+	return SCARD_S_SUCCESS;
+}
+
 static uintptr_t _handle_release_callback(void *h, void *prm)
 {
 	LONG r;
 	struct _handle *handle = (struct _handle *)h;
+	bool reset = (prm != NULL) ? *((bool *)prm) : false;
 
 	_handle_lock(handle);
 
-	devdb_lock(&handle->dev->db);
-	r = _disconnect_card(handle, *((bool *)prm));
-	devdb_unlock(&handle->dev->db);
+	devdb_lock(&handle->dev->core.db);
+	r = _disconnect_card(handle, reset);
+	devdb_unlock(&handle->dev->core.db);
+
+	_disconnect_reader_pool(handle, reset);
 
 	_handle_unlock(handle);
 
@@ -630,13 +1204,6 @@ static bool _reader_device_load(const uint8_t dev_id, const wchar_t *const name,
 		wstrFromUInt32(def + 15, 11, dev_id, 10);
 	}
 
-	wchar_t friendlyName[128];
-
-	if (GetPrivateProfileStringW(nm, L"FriendlyName", NULL, friendlyName, 128, path) == 0) {
-		dbg("_reader_device_load: GetPrivateProfileStringW(FriendlyName): empty");
-		return false;
-	}
-
 	rd->reader_len_W = GetPrivateProfileStringW(nm, L"ReaderName", def, rd->reader_W, 128, path);
 	rd->reader_len_A = WideCharToMultiByte(CP_ACP, 0, rd->reader_W, -1, rd->reader_A, 128, NULL, NULL);
 	if (rd->reader_len_A == 0) {
@@ -645,26 +1212,89 @@ static bool _reader_device_load(const uint8_t dev_id, const wchar_t *const name,
 	}
 	rd->reader_len_A--;
 
-	wchar_t uniqueID[DEVDB_MAX_ID_SIZE];
+	wchar_t friendlyName[128];
+
+	if (reader_device_load(&rd->core, nm, _device_capacity, path, friendlyName) == false)
+		return false;
 
-	GetPrivateProfileStringW(nm, L"UniqueID", L"", uniqueID, DEVDB_MAX_ID_SIZE, path);
+	// the device is accessed by a thread of this process on behalf of the callers
+	rd->worker_mode = (GetPrivateProfileIntW(nm, L"WorkerThread", 0, path) != 0) ? true : false;
+
+	// the exchanges of every device are run by one thread, which waits for all of them
+	rd->loop_mode = (GetPrivateProfileIntW(nm, L"EventLoop", 0, path) != 0) ? true : false;
+
+	// the transmits of the handles are ordered by class
+	if (GetPrivateProfileIntW(nm, L"Scheduler", 0, path) != 0) {
+		rd->sched = memAlloc(sizeof(scheduler));
+		if (rd->sched != NULL)
+		{
+			wchar_t ins[256];
 
-	if (devdb_open(&rd->db, friendlyName, uniqueID, sizeof(struct itecard_shared_readerinfo)) != DEVDB_S_OK) {
-		dbg("_reader_device_load: devdb_open() failed");
+			scheduler_init(rd->sched, GetPrivateProfileIntW(nm, L"SchedulerQueueDepth", SCHEDULER_DEFAULT_DEPTH, path), GetPrivateProfileIntW(nm, L"SchedulerQuantum", SCHEDULER_DEFAULT_QUANTUM, path));
+
+			memset(rd->ins_class, SCHEDULER_CLASS_NORMAL, sizeof(rd->ins_class));
+
+			GetPrivateProfileStringW(nm, L"SchedulerHighIns", L"", ins, 256, path);
+			reader_parse_ins(ins, rd->ins_class, SCHEDULER_CLASS_HIGH);
+			GetPrivateProfileStringW(nm, L"SchedulerLowIns", L"", ins, 256, path);
+			reader_parse_ins(ins, rd->ins_class, SCHEDULER_CLASS_LOW);
+		}
+	}
+
+	// the devices are shared with the other processes through the owner of the broker
+	if (GetPrivateProfileIntW(nm, L"BrokerMode", 0, path) != 0) {
+		rd->broker = memAlloc(sizeof(broker));
+		if (rd->broker != NULL && broker_open(rd->broker, friendlyName) == false) {
+			dbg("_reader_device_load: broker_open() failed");
+			memFree(rd->broker);
+			rd->broker = NULL;
+		}
+	}
+
+	return true;
+}
+
+static bool _reader_pool_load(const uint8_t pool_id, struct _reader_pool *const pool, const wchar_t *const path)
+{
+	wchar_t nm[32];
+
+	memcpy(nm, L"ReaderPool", 10 * sizeof(wchar_t));
+	wstrFromUInt32(nm + 10, 11, pool_id, 10);
+
+	pool->reader_len_W = GetPrivateProfileStringW(nm, L"ReaderName", L"", pool->reader_W, 128, path);
+	if (pool->reader_len_W == 0) {
+		dbg("_reader_pool_load: GetPrivateProfileStringW(ReaderName): empty");
 		return false;
 	}
 
-	_reader_all_len_W += (rd->reader_len_W + 1 + 10 + 1) * DEVDB_MAX_DEV_NUM;
-	_reader_all_len_A += (rd->reader_len_A + 1 + 10 + 1) * DEVDB_MAX_DEV_NUM;
+	pool->reader_len_A = WideCharToMultiByte(CP_ACP, 0, pool->reader_W, -1, pool->reader_A, 128, NULL, NULL);
+	if (pool->reader_len_A == 0) {
+		dbg("_reader_pool_load: pool->reader_len_A == 0");
+		return false;
+	}
+	pool->reader_len_A--;
 
-	UINT power_mode;
+	pool->member_num = 0;
 
-	power_mode = GetPrivateProfileIntW(nm, L"PowerControlMode", 3, path);
-	if ((power_mode & (UINT_MAX - 3))) {
-		power_mode = 3;
+	for (uint32_t i = 0; i < _READER_POOL_MAX_MEMBER_NUM; i++)
+	{
+		wchar_t key[16];
+
+		memcpy(key, L"Member", 6 * sizeof(wchar_t));
+		wstrFromUInt32(key + 6, 10, i + 1, 10);
+
+		if (GetPrivateProfileStringW(nm, key, L"", pool->member[pool->member_num].reader_W, 160, path) != 0) {
+			pool->member[pool->member_num].fail_tick = 0;
+			pool->member_num++;
+		}
 	}
 
-	rd->power_mode = (uint8_t)power_mode;
+	if (pool->member_num == 0) {
+		dbg("_reader_pool_load: no members");
+		return false;
+	}
+
+	pool->affinity = (GetPrivateProfileIntW(nm, L"Affinity", 0, path) != 0) ? true : false;
 
 	return true;
 }
@@ -691,16 +1321,24 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 
 		if (GetPrivateProfileIntW(L"Debug", L"Enable", 0, path) != 0)
 		{
+			static const wchar_t *const cat_key[DBG_CAT_NUM] = { L"LevelAPI", L"LevelTransport", L"LevelT1", L"LevelDevDB" };
+			uint32_t level;
+
 			dbg_enable(true);
 
+			level = GetPrivateProfileIntW(L"Debug", L"Level", DBG_LEVEL_INFO, path);
+			for (uint32_t i = 0; i < DBG_CAT_NUM; i++) {
+				dbg_set_level(i, GetPrivateProfileIntW(L"Debug", cat_key[i], level, path));
+			}
+
 			if (GetPrivateProfileIntW(L"Debug", L"OutputToFile", 0, path) != 0)
 			{
 				wchar_t path2[MAX_PATH + 1];
 
-				memcpy(path2, path, ret);
-				memcpy(path + ret - 3, L"log", 3 * sizeof(wchar_t));
+				memcpy(path2, path, ret * sizeof(wchar_t));
+				memcpy(path2 + ret - 3, L"log", 3 * sizeof(wchar_t));
 				path2[ret] = L'\0';
-				dbg_open(path);
+				dbg_open(path2);
 			}
 		}
 
@@ -714,6 +1352,10 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 
 		max_ctx = GetPrivateProfileIntW(L"ResourceManager", L"MaxContextNum", 32, path);
 		max_card = GetPrivateProfileIntW(L"CardReader", L"MaxHandleNum", 32, path);
+		_device_capacity = GetPrivateProfileIntW(L"CardReader", L"DeviceNum", DEVDB_DEFAULT_DEV_NUM, path);
+		if (_device_capacity == 0) {
+			_device_capacity = DEVDB_DEFAULT_DEV_NUM;
+		}
 		use_dev_len = GetPrivateProfileStringW(L"CardReader", L"UseDevice", NULL, use_dev, 1024, path);
 
 		_device_num = 0;
@@ -746,9 +1388,6 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 			goto attach_err1;
 		}
 
-		_reader_all_len_W = 0;
-		_reader_all_len_A = 0;
-
 		if (_device_num != 0)
 		{
 			// 設定ファイルから該当する番号のデバイス情報を読み込む
@@ -777,33 +1416,79 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 			_device_num++;
 		}
 
-		_reader_all_len_W++;
-		_reader_all_len_A++;
+		{
+			// UsePool から番号を取り出し、該当するプールの情報を読み込む
+
+			wchar_t use_pool[256];
+			uint32_t use_pool_len, i;
+
+			use_pool_len = GetPrivateProfileStringW(L"CardReader", L"UsePool", NULL, use_pool, 256, path);
 
-		if (handle_list_init(&_hlist_ctx, _CONTEXT_BASE, max_ctx, _context_release_callback) != false) {
+			_reader_pool_num = 0;
+			_reader_pool = memAlloc(_READER_POOL_MAX_NUM * sizeof(struct _reader_pool));
+
+			for (i = 0; _reader_pool != NULL && i < use_pool_len && _reader_pool_num < _READER_POOL_MAX_NUM; i++)
+			{
+				uint8_t num = 0;
+
+				while (use_pool[i] >= L'0' && use_pool[i] <= L'9') {
+					num *= 10;
+					num += use_pool[i] - L'0';
+					i++;
+				}
+
+				if (num != 0 && _reader_pool_load(num, &_reader_pool[_reader_pool_num], path) != false) {
+					_reader_pool_num++;
+				}
+			}
+		}
+
+		_pool_ctx = memPoolCreate(sizeof(struct _context), _POOL_SLAB_NUM);
+		_pool_card = memPoolCreate(sizeof(struct _handle), _POOL_SLAB_NUM);
+
+		if (_pool_ctx != NULL && _pool_card != NULL && handle_list_init(&_hlist_ctx, _CONTEXT_BASE, max_ctx, _context_release_callback) != false) {
 			if (handle_list_init(&_hlist_card, _HANDLE_BASE, max_card, _handle_release_callback) != false) {
 				// 初期化完了
 #if defined(_RELEASE_LITE) && defined(_MSC_VER)
 				extern int __isa_available_init();
 				__isa_available_init();
 #endif
+				dbg_start();
 				break;
 			}
 			handle_list_deinit(_hlist_ctx);
 		}
 
+		memPoolDestroy(_pool_card);
+		memPoolDestroy(_pool_ctx);
+
 		{
 			uintptr_t i;
 
 			for (i = 0; i < _device_num; i++) {
-				devdb_close(&_device[i].db);
+				if (_device[i].worker != NULL) {
+					memFree(_device[i].worker);
+				}
+				if (_device[i].sched != NULL) {
+					memFree(_device[i].sched);
+				}
+				if (_device[i].broker != NULL) {
+					broker_close(_device[i].broker);
+					memFree(_device[i].broker);
+				}
+				reader_device_unload(&_device[i].core);
 			}
 
 			memFree(_device);
 		}
 
+		if (_reader_pool != NULL) {
+			memFree(_reader_pool);
+			_reader_pool = NULL;
+		}
+
 	attach_err1:
-		dbg_close();
+		dbg_close(false);
 		memDeinit();
 
 		return FALSE;
@@ -816,26 +1501,52 @@ BOOL WINAPI DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved)
 		}
 		_event_ref = 0;
 
-		handle_list_deinit(_hlist_card);
-		handle_list_deinit(_hlist_ctx);
+		if (lpvReserved == NULL) {
+			handle_list_deinit(_hlist_card);
+			handle_list_deinit(_hlist_ctx);
+			memPoolDestroy(_pool_card);
+			memPoolDestroy(_pool_ctx);
+		}
+		// else: the process is terminating and the other threads are already gone,
+		// so the devdb lock may be held by one of them. leave the references to be
+		// reclaimed by other processes.
 
 		if (_device != NULL)
 		{
 			uintptr_t i;
 
 			for (i = 0; i < _device_num; i++) {
-				devdb_close(&_device[i].db);
+				if (_device[i].worker != NULL) {
+					memFree(_device[i].worker);
+				}
+				if (_device[i].sched != NULL) {
+					memFree(_device[i].sched);
+				}
+				if (_device[i].broker != NULL) {
+					broker_close(_device[i].broker);
+					memFree(_device[i].broker);
+				}
+				reader_device_unload(&_device[i].core);
 			}
 
 			memFree(_device);
 		}
 
-		dbg_close();
+		if (_reader_pool != NULL) {
+			memFree(_reader_pool);
+			_reader_pool = NULL;
+		}
+
+		dbg_close((lpvReserved != NULL) ? true : false);
 		memDeinit();
 
 		break;
 	}
 
+	case DLL_THREAD_DETACH:
+		dbg_thread_detach();
+		break;
+
 	default:
 		break;
 	}
@@ -969,64 +1680,49 @@ LONG WINAPI SCardListReadersA(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR msz
 		{
 			auto_alloc = true;
 
-			rl.list = memAlloc(_reader_all_len_A * sizeof(char));
-			if (rl.list == NULL) {
-				internal_err("SCardListReadersA(ITE): memAlloc failed");
-				r = SCARD_E_NO_MEMORY;
-				goto end;
-			}
-
-			rl.size = _reader_all_len_A - 1;
-
-			*((LPSTR *)mszReaders) = rl.list;
-		}
-		else {
-			rl.list = mszReaders;
-			rl.size = *pcchReaders - 1;
-		}
-	}
+			while (1)
+			{
+				// measure the list, then fill a buffer of exactly that size
 
-	devdb_status_t ret = DEVDB_E_INTERNAL;
-	uintptr_t i;
+				rl.size = 0;
+				rl.len = 0;
+				rl.list = NULL;
 
-	for (i = 0; i < _device_num; i++)
-	{
-		struct _reader_device *dev = &_device[i];
+				r = _list_readers_A(&rl);
+				if (r != SCARD_S_SUCCESS) {
+					goto end;
+				}
 
-		devdb_lock(&dev->db);
+				rl.list = memAlloc((rl.len + 1) * sizeof(char));
+				if (rl.list == NULL) {
+					internal_err("SCardListReadersA(ITE): memAlloc failed");
+					r = SCARD_E_NO_MEMORY;
+					goto end;
+				}
 
-		ret = devdb_update_nolock(&dev->db);
-		if (ret != DEVDB_S_OK && ret != DEVDB_E_NO_DEVICES) {
-			r = devdb_status_to_scard_status(ret);
-			devdb_unlock(&dev->db);
-			break;
-		}
+				rl.size = rl.len;
+				rl.len = 0;
 
-		rl.dev = dev;
+				r = _list_readers_A(&rl);
+				if (r != SCARD_E_INSUFFICIENT_BUFFER) {
+					break;
+				}
 
-		ret = devdb_enum_nolock(&dev->db, _enum_readers_callback_A, &rl);
-		if (ret != DEVDB_E_NO_DEVICES) {
-			if (ret != DEVDB_S_OK) {
-				r = SCARD_F_INTERNAL_ERROR;
-				devdb_unlock(&dev->db);
-				break;
-			}
-			else if (rl.len == 0) {
-				r = SCARD_E_INSUFFICIENT_BUFFER;
-				devdb_unlock(&dev->db);
-				break;
-			}
-			else {
-				r = SCARD_S_SUCCESS;
+				// a reader has been added in the meantime
+				memFree(rl.list);
 			}
+
+			*((LPSTR *)mszReaders) = rl.list;
+			goto end;
 		}
-		else if (r != SCARD_S_SUCCESS) {
-			r = SCARD_E_NO_READERS_AVAILABLE;
+		else {
+			rl.list = mszReaders;
+			rl.size = *pcchReaders - 1;
 		}
-
-		devdb_unlock(&dev->db);
 	}
 
+	r = _list_readers_A(&rl);
+
 end:
 	if (r == SCARD_S_SUCCESS)
 	{
@@ -1044,6 +1740,7 @@ end:
 
 			if (rl.list != NULL) {
 				memFree(rl.list);
+				rl.list = NULL;
 			}
 		}
 		*pcchReaders = 0;
@@ -1088,22 +1785,46 @@ LONG WINAPI SCardListReadersW(SCARDCONTEXT hContext, LPCWSTR mszGroups, LPWSTR m
 	rl.len = 0;
 	rl.list = NULL;
 
-	if (mszReaders != NULL)
-	{
-		if (*pcchReaders == SCARD_AUTOALLOCATE)
-		{
-			auto_alloc = true;
+	if (mszReaders != NULL)
+	{
+		if (*pcchReaders == SCARD_AUTOALLOCATE)
+		{
+			auto_alloc = true;
+
+			while (1)
+			{
+				// measure the list, then fill a buffer of exactly that size
+
+				rl.size = 0;
+				rl.len = 0;
+				rl.list = NULL;
+
+				r = _list_readers_W(&rl);
+				if (r != SCARD_S_SUCCESS) {
+					goto end;
+				}
+
+				rl.list = memAlloc((rl.len + 1) * sizeof(wchar_t));
+				if (rl.list == NULL) {
+					internal_err("SCardListReadersW(ITE): memAlloc failed");
+					r = SCARD_E_NO_MEMORY;
+					goto end;
+				}
+
+				rl.size = rl.len;
+				rl.len = 0;
 
-			rl.list = memAlloc(_reader_all_len_W * sizeof(wchar_t));
-			if (rl.list == NULL) {
-				internal_err("SCardListReadersW(ITE): memAlloc failed");
-				r = SCARD_E_NO_MEMORY;
-				goto end;
-			}
+				r = _list_readers_W(&rl);
+				if (r != SCARD_E_INSUFFICIENT_BUFFER) {
+					break;
+				}
 
-			rl.size = _reader_all_len_W - 1;
+				// a reader has been added in the meantime
+				memFree(rl.list);
+			}
 
 			*((LPWSTR *)mszReaders) = rl.list;
+			goto end;
 		}
 		else {
 			rl.list = mszReaders;
@@ -1111,46 +1832,7 @@ LONG WINAPI SCardListReadersW(SCARDCONTEXT hContext, LPCWSTR mszGroups, LPWSTR m
 		}
 	}
 
-	devdb_status_t ret = DEVDB_E_INTERNAL;
-	uintptr_t i;
-
-	for (i = 0; i < _device_num; i++)
-	{
-		struct _reader_device *dev = &_device[i];
-
-		devdb_lock(&dev->db);
-
-		ret = devdb_update_nolock(&dev->db);
-		if (ret != DEVDB_S_OK && ret != DEVDB_E_NO_DEVICES) {
-			r = devdb_status_to_scard_status(ret);
-			devdb_unlock(&dev->db);
-			break;
-		}
-
-		rl.dev = dev;
-
-		ret = devdb_enum_nolock(&dev->db, _enum_readers_callback_W, &rl);
-		if (ret != DEVDB_E_NO_DEVICES) {
-			if (ret != DEVDB_S_OK) {
-				r = SCARD_F_INTERNAL_ERROR;
-				devdb_unlock(&dev->db);
-				break;
-			}
-			else if (rl.len == 0) {
-				r = SCARD_E_INSUFFICIENT_BUFFER;
-				devdb_unlock(&dev->db);
-				break;
-			}
-			else {
-				r = SCARD_S_SUCCESS;
-			}
-		}
-		else if (r != SCARD_S_SUCCESS) {
-			r = SCARD_E_NO_READERS_AVAILABLE;
-		}
-
-		devdb_unlock(&dev->db);
-	}
+	r = _list_readers_W(&rl);
 
 end:
 	if (r == SCARD_S_SUCCESS)
@@ -1169,6 +1851,7 @@ end:
 
 			if (rl.list != NULL) {
 				memFree(rl.list);
+				rl.list = NULL;
 			}
 		}
 		*pcchReaders = 0;
@@ -1185,7 +1868,7 @@ end:
 
 LONG WINAPI SCardGetStatusChangeA(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATEA rgReaderStates, DWORD cReaders)
 {
-	dbg("SCardGetStatusChangeA(ITE)");
+	dbg_trace("SCardGetStatusChangeA(ITE)");
 
 	if (cReaders != 0 && rgReaderStates == NULL)
 		return SCARD_E_INVALID_PARAMETER;
@@ -1227,22 +1910,28 @@ LONG WINAPI SCardGetStatusChangeA(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCAR
 		uintptr_t pos = 0;
 		struct _reader_device *dev;
 		uint32_t id;
+		struct _reader_pool *pool;
 
-		while (1) {
-			if (_get_reader_id_A(rgReaderStates[i].szReader, &pos, &dev, &id) == false) {
-				state = SCARD_STATE_IGNORE | SCARD_STATE_UNKNOWN;
-				break;
-			}
+		if (_get_reader_pool_A(rgReaderStates[i].szReader, &pool) == true) {
+			state = _get_reader_pool_state(pool, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
+		}
+		else {
+			while (1) {
+				if (_get_reader_id_A(rgReaderStates[i].szReader, &pos, &dev, &id) == false) {
+					state = SCARD_STATE_IGNORE | SCARD_STATE_UNKNOWN;
+					break;
+				}
 
-			devdb_lock(&dev->db);
-			state = _get_reader_state(dev, id, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
-			devdb_unlock(&dev->db);
+				devdb_lock(&dev->core.db);
+				state = _get_reader_state(dev, id, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
+				devdb_unlock(&dev->core.db);
 
-			if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
-				break;
-			}
+				if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
+					break;
+				}
 
-			pos++;
+				pos++;
+			}
 		}
 
 		rgReaderStates[i].dwEventState = state | ((state != rgReaderStates[i].dwCurrentState) ? SCARD_STATE_CHANGED : 0);
@@ -1255,7 +1944,7 @@ LONG WINAPI SCardGetStatusChangeA(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCAR
 
 LONG WINAPI SCardGetStatusChangeW(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATEW rgReaderStates, DWORD cReaders)
 {
-	dbg("SCardGetStatusChangeW(ITE)");
+	dbg_trace("SCardGetStatusChangeW(ITE)");
 
 	if (cReaders != 0 && rgReaderStates == NULL)
 		return SCARD_E_INVALID_PARAMETER;
@@ -1297,21 +1986,27 @@ LONG WINAPI SCardGetStatusChangeW(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCAR
 		uintptr_t pos = 0;
 		struct _reader_device *dev;
 		uint32_t id;
+		struct _reader_pool *pool;
 
-		while (1) {
-			if (_get_reader_id_W(rgReaderStates[i].szReader, &pos, &dev, &id) == false) {
-				state = SCARD_STATE_IGNORE | SCARD_STATE_UNKNOWN;
-				break;
-			}
+		if (_get_reader_pool_W(rgReaderStates[i].szReader, &pool) == true) {
+			state = _get_reader_pool_state(pool, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
+		}
+		else {
+			while (1) {
+				if (_get_reader_id_W(rgReaderStates[i].szReader, &pos, &dev, &id) == false) {
+					state = SCARD_STATE_IGNORE | SCARD_STATE_UNKNOWN;
+					break;
+				}
 
-			devdb_lock(&dev->db);
-			state = _get_reader_state(dev, id, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
-			devdb_unlock(&dev->db);
+				devdb_lock(&dev->core.db);
+				state = _get_reader_state(dev, id, &rgReaderStates[i].cbAtr, rgReaderStates[i].rgbAtr);
+				devdb_unlock(&dev->core.db);
 
-			pos++;
+				pos++;
 
-			if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
-				break;
+				if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
+					break;
+				}
 			}
 		}
 
@@ -1346,6 +2041,36 @@ LONG WINAPI SCardCancel(SCARDCONTEXT hContext)
 
 /* Smart Card and Reader Access Functions */
 
+static LONG _connect_reader_pool_handle(struct _reader_pool *const pool, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol)
+{
+	struct _handle *handle;
+	LONG r;
+
+	*phCard = 0;
+	*pdwActiveProtocol = SCARD_PROTOCOL_UNDEFINED;
+
+	if (_handle_alloc(&handle) == false)
+		return SCARD_E_NO_MEMORY;
+
+	r = _connect_reader_pool(handle, pool, dwShareMode, dwPreferredProtocols, pdwActiveProtocol);
+	if (r == SCARD_S_SUCCESS)
+	{
+		if (handle_list_put(_hlist_card, handle, phCard) == true)
+			return SCARD_S_SUCCESS;
+
+		devdb_lock(&handle->dev->core.db);
+		_disconnect_card(handle, false);
+		devdb_unlock(&handle->dev->core.db);
+
+		_disconnect_reader_pool(handle, false);
+		r = SCARD_E_NO_MEMORY;
+	}
+
+	_handle_free(handle);
+
+	return r;
+}
+
 LONG WINAPI SCardConnectA(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol)
 {
 	dbg("SCardConnectA(ITE)");
@@ -1368,6 +2093,13 @@ LONG WINAPI SCardConnectA(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareM
 
 	LONG r = SCARD_F_INTERNAL_ERROR;
 	uintptr_t pos = 0;
+	struct _reader_pool *pool;
+
+	if (_get_reader_pool_A(szReader, &pool) == true) {
+		r = _connect_reader_pool_handle(pool, dwShareMode, dwPreferredProtocols, phCard, pdwActiveProtocol);
+		_context_unlock(ctx);
+		return r;
+	}
 
 	while (1)
 	{
@@ -1389,13 +2121,13 @@ LONG WINAPI SCardConnectA(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareM
 			break;
 		}
 
-		devdb_lock(&dev->db);
+		devdb_lock(&dev->core.db);
 
 		r = _connect_card(handle, dev, id, dwShareMode, dwPreferredProtocols, pdwActiveProtocol);
 		if (r == SCARD_S_SUCCESS)
 		{
 			if (handle_list_put(_hlist_card, handle, phCard) == true) {
-				devdb_unlock(&dev->db);
+				devdb_unlock(&dev->core.db);
 				break;
 			}
 			else {
@@ -1404,7 +2136,7 @@ LONG WINAPI SCardConnectA(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareM
 			}
 		}
 
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		_handle_free(handle);
 
 		pos++;
@@ -1441,6 +2173,13 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext, LPCWSTR szReader, DWORD dwShare
 
 	LONG r = SCARD_F_INTERNAL_ERROR;
 	uintptr_t pos = 0;
+	struct _reader_pool *pool;
+
+	if (_get_reader_pool_W(szReader, &pool) == true) {
+		r = _connect_reader_pool_handle(pool, dwShareMode, dwPreferredProtocols, phCard, pdwActiveProtocol);
+		_context_unlock(ctx);
+		return r;
+	}
 
 	while (1)
 	{
@@ -1462,13 +2201,13 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext, LPCWSTR szReader, DWORD dwShare
 			break;
 		}
 
-		devdb_lock(&dev->db);
+		devdb_lock(&dev->core.db);
 
 		r = _connect_card(handle, dev, id, dwShareMode, dwPreferredProtocols, pdwActiveProtocol);
 		if (r == SCARD_S_SUCCESS)
 		{
 			if (handle_list_put(_hlist_card, handle, phCard) == true) {
-				devdb_unlock(&dev->db);
+				devdb_unlock(&dev->core.db);
 				break;
 			}
 			else {
@@ -1477,7 +2216,7 @@ LONG WINAPI SCardConnectW(SCARDCONTEXT hContext, LPCWSTR szReader, DWORD dwShare
 			}
 		}
 
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		_handle_free(handle);
 
 		pos++;
@@ -1521,7 +2260,7 @@ end:
 
 LONG WINAPI SCardStatusA(SCARDHANDLE hCard, LPSTR szReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen)
 {
-	dbg("SCardStatusA(ITE)");
+	dbg_trace("SCardStatusA(ITE)");
 
 	struct _handle *handle;
 	struct _reader_device *dev;
@@ -1582,21 +2321,22 @@ LONG WINAPI SCardStatusA(SCARDHANDLE hCard, LPSTR szReaderName, LPDWORD pcchRead
 		name[*pcchReaderLen - 1] = '\0';
 	}
 
-	devdb_lock(&dev->db);
+	devdb_lock(&dev->core.db);
+	_handle_sync_nolock(handle);
 
 	r = _get_card_status(handle, pdwState, pdwProtocol);
 	if (r != SCARD_S_SUCCESS) {
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		goto end2;
 	}
 
 	r = _get_card_atr(&handle->itecard, pbAtr, pcbAtrLen, 32);
 	if (r != SCARD_S_SUCCESS) {
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		goto end2;
 	}
 
-	devdb_unlock(&dev->db);
+	devdb_unlock(&dev->core.db);
 	goto end1;
 
 end2:
@@ -1644,7 +2384,7 @@ end1:
 
 LONG WINAPI SCardStatusW(SCARDHANDLE hCard, LPWSTR szReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen)
 {
-	dbg("SCardStatusW(ITE)");
+	dbg_trace("SCardStatusW(ITE)");
 
 	struct _handle *handle;
 	struct _reader_device *dev;
@@ -1705,21 +2445,22 @@ LONG WINAPI SCardStatusW(SCARDHANDLE hCard, LPWSTR szReaderName, LPDWORD pcchRea
 		name[*pcchReaderLen - 1] = L'\0';
 	}
 
-	devdb_lock(&dev->db);
+	devdb_lock(&dev->core.db);
+	_handle_sync_nolock(handle);
 
 	r = _get_card_status(handle, pdwState, pdwProtocol);
 	if (r != SCARD_S_SUCCESS) {
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		goto end2;
 	}
 
 	r = _get_card_atr(&handle->itecard, pbAtr, pcbAtrLen, 32);
 	if (r != SCARD_S_SUCCESS) {
-		devdb_unlock(&dev->db);
+		devdb_unlock(&dev->core.db);
 		goto end2;
 	}
 
-	devdb_unlock(&dev->db);
+	devdb_unlock(&dev->core.db);
 	goto end1;
 
 end2:
@@ -1765,15 +2506,300 @@ end1:
 	return r;
 }
 
+struct _transmit_param
+{
+	struct _handle *handle;
+	DWORD protocol;
+	LPCBYTE send;
+	DWORD send_len;
+	LPBYTE recv;
+	LPDWORD recv_len;
+	uint64_t start;		// when the handle was locked, or when the scheduler let it go
+	bool scheduled;		// scheduler_leave has to be called
+};
+
+// called with the lock held, by the caller, by the worker of the device or by the loop
+static LONG _transmit_nolock(struct _transmit_param *const prm)
+{
+	struct _handle *handle = prm->handle;
+	LONG r;
+
+	_handle_sync_nolock(handle);
+
+	stats_record(handle->itecard.stats, STATS_HIST_LOCK_WAIT, prm->start);
+	trace_end(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	// an identical exchange which completed while the handle was waiting answers the command too
+	handle->itecard.since = (prm->send_len >= 2 && handle->dev->core.coalesce_ins[prm->send[1]] != 0) ? prm->start : 0;
+	handle->itecard.ttl = (prm->send_len >= 2) ? handle->dev->core.cache_ttl[prm->send[1]] : 0;
+
+	switch (prm->protocol)
+	{
+	case SCARD_PROTOCOL_T1:
+		if (handle->itecard.reader->card.T1.b == false) {
+			r = SCARD_E_UNSUPPORTED_FEATURE;
+		}
+		else {
+			r = itecard_status_to_scard_status(itecard_transmit(&handle->itecard, ITECARD_PROTOCOL_T1, prm->send, prm->send_len, prm->recv, prm->recv_len));
+		}
+		break;
+
+	default:
+		r = SCARD_E_READER_UNSUPPORTED;
+		break;
+	}
+
+	return r;
+}
+
+static LONG _worker_execute(void *ctx, void *prm)
+{
+	return _transmit_nolock(prm);
+}
+
+// on the fiber of the channel of the device
+static int32_t _loop_execute(void *ctx, void *prm)
+{
+	struct _handle *handle = ((struct _transmit_param *)prm)->handle;
+	LONG r;
+
+	handle->itecard.loop = handle->loop;
+	r = _transmit_nolock(prm);
+	handle->itecard.loop = NULL;
+
+	return r;
+}
+
+// waits for the turn of the handle. false if the request is refused, since too many
+// requests of its class are waiting.
+static bool _schedule(struct _transmit_param *const prm)
+{
+	struct _handle *handle = prm->handle;
+	struct _reader_device *dev = handle->dev;
+	scheduler_class_t cls;
+
+	prm->scheduled = false;
+
+	if (dev->sched == NULL || handle->done == NULL)
+		return true;
+
+	if (handle->sched_class < SCHEDULER_CLASS_NUM)
+		cls = (scheduler_class_t)handle->sched_class;
+	else
+		cls = (scheduler_class_t)dev->ins_class[(prm->send_len >= 2) ? prm->send[1] : 0];
+
+	if (scheduler_enter(dev->sched, &handle->flow, cls, prm->send_len, handle->done) == false) {
+		stats_inc(handle->itecard.stats, rejected);
+		return false;
+	}
+
+	stats_record(handle->itecard.stats, STATS_HIST_QUEUE_HIGH + cls, prm->start);
+
+	prm->start = stats_get_time();
+	prm->scheduled = true;
+
+	return true;
+}
+
+// has the owner of the broker transmit, without the lock. false if the command has
+// to be transmitted by this process (it is the owner, or there is none).
+static bool _transmit_broker(struct _transmit_param *const prm, LONG *const r)
+{
+	struct _handle *handle = prm->handle;
+	int32_t result = SCARD_F_INTERNAL_ERROR;
+	uint32_t len = *prm->recv_len;
+
+	if (handle->dev->broker == NULL)
+		return false;
+
+	if (broker_call(handle->dev->broker, handle->id, prm->protocol, prm->send, prm->send_len, prm->recv, &len, &result) != BROKER_S_OK)
+		return false;
+
+	*prm->recv_len = len;
+	*r = result;
+
+	return true;
+}
+
+// with the handle locked
+static LONG _transmit(struct _handle *const handle, const uint64_t enter, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
+{
+	struct _reader_device *dev = handle->dev;
+	LONG r;
+	uint64_t start = stats_get_time();
+	struct trace_tx tx;
+
+	stats_inc(handle->itecard.stats, pending);
+
+	if (trace_tx_begin(&dev->core.trace, &tx, handle->id, enter) == true) {
+		trace_tx_lookup(&tx, start, cbSendLength);
+		handle->itecard.trace = &tx;
+	}
+
+	struct _transmit_param prm;
+
+	prm.handle = handle;
+	prm.protocol = pioSendPci->dwProtocol;
+	prm.send = pbSendBuffer;
+	prm.send_len = cbSendLength;
+	prm.recv = pbRecvBuffer;
+	prm.recv_len = pcbRecvLength;
+	prm.start = start;
+
+	trace_begin(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	if ((handle->worker != NULL || handle->loop != NULL || dev->sched != NULL) && handle->done == NULL) {
+		handle->done = CreateEventW(NULL, FALSE, FALSE, NULL);
+	}
+
+	if (_schedule(&prm) == false) {
+		trace_end(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+		r = SCARD_E_TIMEOUT;
+	}
+	else if (_transmit_broker(&prm, &r) == true) {
+		trace_end(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+	}
+	else if (handle->loop != NULL && handle->done != NULL) {
+		struct iteloop_request req;
+
+		req.channel = (uint32_t)(dev - _device);
+		req.prm = &prm;
+		req.done = handle->done;
+
+		// the handle is locked, so the loop stays until the request has been executed
+		iteloop_submit(handle->loop, &req);
+		r = req.result;
+	}
+	else if (handle->worker != NULL && handle->done != NULL) {
+		struct worker_request req;
+
+		req.prm = &prm;
+		req.done = handle->done;
+
+		// the handle is locked, so the worker stays until the request has been executed
+		worker_submit(handle->worker, &req);
+		r = req.result;
+	}
+	else {
+		devdb_lock(&dev->core.db);
+		r = _transmit_nolock(&prm);
+		devdb_unlock(&dev->core.db);
+	}
+
+	if (prm.scheduled == true) {
+		scheduler_leave(dev->sched);
+	}
+
+	if (handle->itecard.trace != NULL) {
+		trace_end(handle->itecard.trace, TRACE_STAGE_TRANSMIT);
+		tx.rec.recv_len = (r == SCARD_S_SUCCESS) ? (uint16_t)*pcbRecvLength : 0;
+		trace_tx_end(&dev->core.trace, &tx, r);
+
+		handle->itecard.trace = NULL;
+	}
+
+	stats_add(handle->itecard.stats, pending, -1);
+
+	return r;
+}
+
+static bool _reader_pool_member_failed(const LONG r)
+{
+	switch (r)
+	{
+	case SCARD_S_SUCCESS:
+	case SCARD_E_INSUFFICIENT_BUFFER:
+	case SCARD_E_INVALID_PARAMETER:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
+// the member the transmit of the handle goes to: the one it sticks to, or the healthy
+// one with the lowest load, estimated from the transmits of all processes waiting
+// for the card and its recent latency. the members which failed recently are only
+// used when no other one is left.
+static uint32_t _reader_pool_select(struct _handle *const handle, const uint32_t tried)
+{
+	struct _reader_pool *pool = handle->pool;
+	uint32_t best = _READER_POOL_NO_MEMBER, resting = _READER_POOL_NO_MEMBER;
+	uint64_t best_load = 0;
+	DWORD now = GetTickCount();
+
+	for (uint32_t i = 0; i < pool->member_num; i++)
+	{
+		struct _handle *m = handle->member[i];
+		DWORD fail_tick = pool->member[i].fail_tick;
+
+		if (m == NULL || (tried & (1 << i)))
+			continue;
+
+		if (fail_tick != 0 && (DWORD)(now - fail_tick) < _READER_POOL_RETRY_INTERVAL) {
+			if (resting == _READER_POOL_NO_MEMBER)
+				resting = i;
+			continue;
+		}
+
+		if (pool->affinity == true && handle->affinity == i)
+			return i;
+
+		struct stats_shared_reader *st = m->itecard.stats;
+		uint64_t load = (st != NULL) ? ((uint64_t)st->pending + 1) * ((uint64_t)st->latency_us + 1) : 0;
+
+		if (best == _READER_POOL_NO_MEMBER || load < best_load) {
+			best = i;
+			best_load = load;
+		}
+	}
+
+	return (best != _READER_POOL_NO_MEMBER) ? best : resting;
+}
+
+// the command goes to the next member as long as the card fails
+static LONG _transmit_reader_pool(struct _handle *const handle, const uint64_t enter, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
+{
+	struct _reader_pool *pool = handle->pool;
+	DWORD recv_size = *pcbRecvLength;
+	uint32_t tried = 0, i;
+	LONG r = SCARD_E_NO_SMARTCARD;
+
+	while ((i = _reader_pool_select(handle, tried)) != _READER_POOL_NO_MEMBER)
+	{
+		*pcbRecvLength = recv_size;
+
+		r = _transmit(handle->member[i], enter, pioSendPci, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength);
+		if (_reader_pool_member_failed(r) == false) {
+			if (pool->member[i].fail_tick != 0)
+				pool->member[i].fail_tick = 0;
+
+			handle->affinity = i;
+			break;
+		}
+
+		dbg("_transmit_reader_pool: member %u failed (%08X)", i, r);
+
+		// a member whose queue is full is only busy
+		if (r != SCARD_E_TIMEOUT)
+			pool->member[i].fail_tick = GetTickCount() | 1;
+
+		tried |= 1 << i;
+	}
+
+	return r;
+}
+
 LONG WINAPI SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPSCARD_IO_REQUEST pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
 {
-	dbg("SCardTransmit(ITE)");
+	dbg_trace("SCardTransmit(ITE)");
 
 	if (pioSendPci == NULL || pbSendBuffer == NULL || pbRecvBuffer == NULL || pcbRecvLength == NULL || *pcbRecvLength == SCARD_AUTOALLOCATE)
 		return SCARD_E_INVALID_PARAMETER;
 
 	struct _handle *handle;
-	struct _reader_device *dev;
+	uint64_t enter = stats_get_time();
+	LONG r;
 
 	handle_list_lock(_hlist_card);
 
@@ -1786,30 +2812,73 @@ LONG WINAPI SCardTransmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci, LPC
 	_handle_lock(handle);
 	handle_list_unlock(_hlist_card);
 
-	dev = handle->dev;
+	if (handle->pool != NULL)
+		r = _transmit_reader_pool(handle, enter, pioSendPci, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength);
+	else
+		r = _transmit(handle, enter, pioSendPci, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength);
+
+	_handle_unlock(handle);
+
+	return r;
+}
+
+LONG WINAPI SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID lpInBuffer, DWORD cbInBufferSize, LPVOID lpOutBuffer, DWORD cbOutBufferSize, LPDWORD lpBytesReturned)
+{
+	dbg_trace("SCardControl(ITE)");
 
+	struct _handle *handle;
 	LONG r;
 
-	devdb_lock(&dev->db);
+	handle_list_lock(_hlist_card);
+
+	handle_list_get_nolock(_hlist_card, hCard, &handle);
+	if (!_handle_check(handle)) {
+		handle_list_unlock(_hlist_card);
+		return SCARD_E_INVALID_HANDLE;
+	}
+
+	_handle_lock(handle);
+	handle_list_unlock(_hlist_card);
+
+	if (lpBytesReturned != NULL) {
+		*lpBytesReturned = 0;
+	}
 
-	switch (pioSendPci->dwProtocol)
+	switch (dwControlCode)
 	{
-	case SCARD_PROTOCOL_T1:
-		if (handle->itecard.reader->card.T1.b == false) {
-			r = SCARD_E_UNSUPPORTED_FEATURE;
+	case _IOCTL_ITECARD_SET_PRIORITY:
+	{
+		DWORD cls;
+
+		if (lpInBuffer == NULL || cbInBufferSize < sizeof(DWORD)) {
+			r = SCARD_E_INVALID_PARAMETER;
+			break;
 		}
-		else {
-			r = itecard_status_to_scard_status(itecard_transmit(&handle->itecard, ITECARD_PROTOCOL_T1, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength));
+
+		cls = *(const DWORD *)lpInBuffer;
+		if (cls >= SCHEDULER_CLASS_NUM && cls != _SCHED_CLASS_BY_INS) {
+			r = SCARD_E_INVALID_VALUE;
+			break;
 		}
+
+		handle->sched_class = cls;
+
+		if (handle->pool != NULL) {
+			for (uint32_t i = 0; i < handle->pool->member_num; i++) {
+				if (handle->member[i] != NULL)
+					handle->member[i]->sched_class = cls;
+			}
+		}
+
+		r = SCARD_S_SUCCESS;
 		break;
+	}
 
 	default:
-		r = SCARD_E_READER_UNSUPPORTED;
+		r = SCARD_E_UNSUPPORTED_FEATURE;
 		break;
 	}
 
-	devdb_unlock(&dev->db);
-
 	_handle_unlock(handle);
 
 	return r;
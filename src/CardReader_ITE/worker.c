@@ -0,0 +1,193 @@
+// worker.c
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "debug.h"
+#include "memory.h"
+#include "worker.h"
+
+// the queue is an intrusive MPSC queue (D. Vyukov): a push is one exchange of the
+// head, and only the worker follows the links from the tail. the stub is pushed
+// again when the queue would otherwise become empty, so that the last request is
+// never referenced once it has been popped.
+
+static void _worker_push(worker *const w, struct worker_request *const req)
+{
+	struct worker_request *prev;
+
+	req->next = NULL;
+	prev = InterlockedExchangePointer((PVOID volatile *)&w->head, req);
+	// the request is not reachable from the tail until the link is stored
+	prev->next = req;
+}
+
+static struct worker_request * _worker_pop(worker *const w)
+{
+	struct worker_request *tail = w->tail;
+	struct worker_request *next = tail->next;
+
+	if (tail == &w->stub)
+	{
+		if (next == NULL)
+			return NULL;
+
+		w->tail = next;
+		tail = next;
+		next = next->next;
+	}
+
+	if (next != NULL) {
+		w->tail = next;
+		return tail;
+	}
+
+	// a producer is between the exchange and the link
+	if (tail != w->head)
+		return NULL;
+
+	_worker_push(w, &w->stub);
+
+	next = tail->next;
+	if (next != NULL) {
+		w->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static DWORD WINAPI _worker_thread(LPVOID param)
+{
+	worker *w = param;
+	HMODULE module = w->module;
+
+	while (1)
+	{
+		WaitForSingleObject(w->wake, INFINITE);
+
+		while (w->pending > 0)
+		{
+			struct worker_request *req = _worker_pop(w);
+			LONG n = 0;
+
+			if (req == NULL) {
+				// counted, but not linked yet
+				SwitchToThread();
+				continue;
+			}
+
+			w->ops->lock(w->ctx);
+
+			do {
+				HANDLE done = req->done;
+
+				req->result = w->ops->execute(w->ctx, req->prm);
+
+				// the request belongs to the caller again once the event is set
+				SetEvent(done);
+				n++;
+			} while (n < WORKER_MAX_BATCH && (req = _worker_pop(w)) != NULL);
+
+			w->ops->unlock(w->ctx);
+
+			w->stats.batch++;
+			w->stats.request += n;
+
+			InterlockedExchangeAdd(&w->pending, -n);
+		}
+
+		if (w->stop != 0)
+			break;
+	}
+
+	dbg("_worker_thread: exit, batch: %llu, request: %llu", w->stats.batch, w->stats.request);
+
+	CloseHandle(w->wake);
+	memFree(w);
+
+	// the thread holds a reference of the module, so that it is not unloaded under it
+	FreeLibraryAndExitThread(module, 0);
+
+	return 0;
+}
+
+worker * worker_create(const struct worker_ops *const ops, void *ctx)
+{
+	worker *w;
+	HANDLE thread;
+
+	w = memAlloc(sizeof(worker));
+	if (w == NULL)
+		return NULL;
+
+	memset(w, 0, sizeof(worker));
+
+	w->stub.next = NULL;
+	w->head = &w->stub;
+	w->tail = &w->stub;
+	w->pending = 0;
+	w->stop = 0;
+	w->ops = ops;
+	w->ctx = ctx;
+
+	w->wake = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (w->wake == NULL)
+		goto end1;
+
+	if (GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)_worker_thread, &w->module) == FALSE) {
+		internal_err("worker_create: GetModuleHandleExW failed");
+		goto end2;
+	}
+
+	thread = CreateThread(NULL, 0, _worker_thread, w, 0, NULL);
+	if (thread == NULL) {
+		internal_err("worker_create: CreateThread failed");
+		goto end3;
+	}
+
+	CloseHandle(thread);
+
+	return w;
+
+end3:
+	FreeLibrary(w->module);
+end2:
+	CloseHandle(w->wake);
+end1:
+	memFree(w);
+	return NULL;
+}
+
+// the worker ends once the requests in the queue have been executed, and frees
+// itself. no request may be submitted after this.
+void worker_destroy(worker *const w)
+{
+	InterlockedExchange(&w->stop, 1);
+	SetEvent(w->wake);
+}
+
+// executes the request on the worker and waits for it. the result is in req->result.
+void worker_submit(worker *const w, struct worker_request *const req)
+{
+	LONG pending;
+
+	// counted before it is pushed, so that the worker does not stop before it is popped
+	pending = InterlockedIncrement(&w->pending);
+	_worker_push(w, req);
+
+	// the worker runs until the count drops to 0, so only the first one wakes it
+	if (pending == 1)
+		SetEvent(w->wake);
+
+	WaitForSingleObject(req->done, INFINITE);
+}
+
+void worker_get_stats(worker *const w, struct worker_stats *const stats)
+{
+	stats->batch = w->stats.batch;
+	stats->request = w->stats.request;
+}
@@ -0,0 +1,54 @@
+// worker.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <windows.h>
+
+// a thread which owns the I/O of a device. callers push their requests onto a
+// lock-free queue (any number of producers, the worker is the only consumer) and
+// wait for their own event, so that they never poll the device and the requests of
+// different handles run back to back under a single acquisition of the lock.
+
+#define WORKER_MAX_BATCH	16		// requests executed under one acquisition of the lock
+
+struct worker_request
+{
+	struct worker_request *volatile next;
+	void *prm;
+	LONG result;
+	HANDLE done;	// auto-reset event of the caller, set when the request has been executed
+};
+
+struct worker_ops
+{
+	void (*lock)(void *ctx);		// before a batch of requests
+	void (*unlock)(void *ctx);		// after it
+	LONG (*execute)(void *ctx, void *prm);
+};
+
+struct worker_stats
+{
+	uint64_t batch;			// acquisitions of the lock
+	uint64_t request;		// executed requests
+};
+
+typedef struct _worker
+{
+	struct worker_request *volatile head;	// last pushed request (producers)
+	struct worker_request *tail;			// next request to execute (worker)
+	struct worker_request stub;
+	volatile LONG pending;		// pushed or being pushed, not executed yet
+	volatile LONG stop;
+	HANDLE wake;
+	HMODULE module;
+	const struct worker_ops *ops;
+	void *ctx;
+	struct worker_stats stats;
+} worker;
+
+extern worker * worker_create(const struct worker_ops *const ops, void *ctx);
+extern void worker_destroy(worker *const w);
+extern void worker_submit(worker *const w, struct worker_request *const req);
+extern void worker_get_stats(worker *const w, struct worker_stats *const stats);
@@ -0,0 +1,275 @@
+// bench.c
+//
+// benchmarks for CardReader_ITE.
+//
+//   Windows: CardReader_ITE_Bench.exe <command> [--option value ...]
+//   other:   cc -O2 -o itecard_bench *.c ../CardReader_ITE/memory.c ../CardReader_ITE/logring.c ../CardReader_ITE/card.c ../CardReader_ITE/handle.c ../CardReader_ITE/string.c
+//                ../CardReader_ITE/itecard.c ../CardReader_ITE/ite.c ../CardReader_ITE/iterec.c ../CardReader_ITE/itefault.c ../CardReader_ITE/itesim.c ../CardReader_ITE/profile.c
+//                ../CardReader_ITE/devdb.c ../CardReader_ITE/broker.c ../CardReader_ITE/iteloop.c ../CardReader_ITE/stats.c ../CardReader_ITE/trace.c ../CardReader_ITE_Server/client.c -lpthread -ldl
+//
+// only the commands which do not need a device or Win32 APIs are built outside of Windows.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <wchar.h>
+#include <sys/mman.h>
+#endif
+
+#include "bench.h"
+
+static const struct bench_command _commands[] = {
+	{ "memory", "[--iterations n] [--objects n]", bench_memory_main },
+	{ "log", "[--iterations n] [--threads n] [--output path]", bench_log_main },
+	{ "micro", "[--filter name] [--min-time ms] [--repetitions n] [--handles n] [--history path] [--threshold percent]", bench_micro_main },
+	{ "e2e", "[--module path] [--ops transmit,status,statuschange,connect] [--processes 1,2] [--threads 1,4] [--devices 1,2] [--sizes 5,64] [--duration ms] [--baseline path] [--threshold percent]", bench_e2e_main },
+	{ "soak", "[--module path] [--cycles n] [--duration s] [--processes n] [--threads n] [--devices n] [--transmits n] [--reset n] [--interval s] [--warmup s] [--stats FriendlyName] [--drift percent]", bench_soak_main },
+	{ "replay", "--trace path [--session n]", bench_replay_main },
+	{ "fault", "--device path [--transmits n] [--size n] [--drop ppm] [--edc ppm] [--short ppm] [--ioctl ppm] [--removal ppm] [--mute ppm] [--removal-time ms] [--mute-time ms] [--seed n]", bench_fault_main },
+	{ "worker", "--device path [--threads n] [--duration ms] [--size n]", bench_worker_main },
+	{ "broker", "[--clients n] [--duration ms] [--service us] [--size n]", bench_broker_main },
+	{ "lock", "[--processes 1,2,4,8] [--duration ms] [--hold us] [--work us]", bench_lock_main },
+	{ "recover", "[--iterations n] [--refs n] [--waiters n] [--stop ms]", bench_recover_main },
+	{ "ref", "[--processes 1,2,4] [--threads 1,4] [--slots n] [--duration ms] [--cpus n] [--packed]", bench_ref_main },
+	{ "loop", "[--readers n] [--duration ms] [--bgt ms] [--poll ms] [--response ms]", bench_loop_main },
+	{ "pcsc", "[--direct path] [--pcscd path] [--ifd path] [--reader name] [--device ReaderDeviceN:id] [--size n] [--transmits n] [--warmup n]", bench_pcsc_main },
+	{ "cardsrv", "[--direct path] [--socket path] [--reader name] [--size n] [--batch n] [--depth n] [--transmits n] [--warmup n]", bench_cardsrv_main },
+};
+
+uint64_t bench_get_time_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER t;
+
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+
+	QueryPerformanceCounter(&t);
+	return (uint64_t)((t.QuadPart / freq.QuadPart) * 1000000000 + ((t.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+}
+
+const char * bench_get_arg_str(int argc, char *argv[], const char *const name, const char *const def)
+{
+	for (int i = 0; i < argc - 1; i++) {
+		if (argv[i][0] == '-' && argv[i][1] == '-' && strcmp(argv[i] + 2, name) == 0) {
+			return argv[i + 1];
+		}
+	}
+
+	return def;
+}
+
+// an option without a value
+bool bench_get_arg_flag(int argc, char *argv[], const char *const name)
+{
+	for (int i = 0; i < argc; i++) {
+		if (argv[i][0] == '-' && argv[i][1] == '-' && strcmp(argv[i] + 2, name) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint64_t bench_get_arg_uint(int argc, char *argv[], const char *const name, const uint64_t def)
+{
+	const char *v = bench_get_arg_str(argc, argv, name, NULL);
+
+	return (v != NULL) ? strtoull(v, NULL, 10) : def;
+}
+
+void bench_print_result(const char *const name, const uint64_t ops, const uint64_t ns)
+{
+	printf("%-32s %12llu ops %10.1f ns/op\n", name, (unsigned long long)ops, (ops != 0) ? (double)ns / ops : 0.0);
+}
+
+void bench_hist_init(struct bench_hist *const h)
+{
+	memset(h, 0, sizeof(struct bench_hist));
+}
+
+uint32_t bench_hist_index(const uint64_t v)
+{
+	uint32_t e = 0;
+
+	if (v < 16)
+		return (uint32_t)v;
+
+	while ((v >> e) >= 32)
+		e++;
+
+	// 16..31 for e = 0, 32..63 for e = 1, ...
+	return ((e + 1) * 16) + (uint32_t)((v >> e) & 15);
+}
+
+static uint64_t _bench_hist_value(const uint32_t i)
+{
+	uint32_t e;
+
+	if (i < 16)
+		return i;
+
+	e = (i / 16) - 1;
+
+	// the middle of the bucket
+	return ((uint64_t)(16 + (i & 15)) << e) + ((1ULL << e) >> 1);
+}
+
+void bench_hist_add(struct bench_hist *const h, const uint64_t ns)
+{
+	h->count[bench_hist_index(ns)]++;
+	h->total++;
+
+	if (h->max < ns)
+		h->max = ns;
+}
+
+void bench_hist_merge(struct bench_hist *const dst, const struct bench_hist *const src)
+{
+	for (uint32_t i = 0; i < BENCH_HIST_SIZE; i++)
+		dst->count[i] += src->count[i];
+
+	dst->total += src->total;
+
+	if (dst->max < src->max)
+		dst->max = src->max;
+}
+
+// p: 0.0 to 1.0
+uint64_t bench_hist_percentile(const struct bench_hist *const h, const double p)
+{
+	uint64_t n, c = 0;
+
+	if (h->total == 0)
+		return 0;
+
+	n = (uint64_t)(p * h->total);
+	if (n >= h->total)
+		return h->max;
+
+	for (uint32_t i = 0; i < BENCH_HIST_SIZE; i++) {
+		c += h->count[i];
+		if (c > n) {
+			uint64_t v = _bench_hist_value(i);
+
+			return (v > h->max) ? h->max : v;
+		}
+	}
+
+	return h->max;
+}
+
+struct _bench_thread {
+	void (*fn)(void *arg);
+	void *arg;
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t thread;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI _bench_thread_proc(LPVOID param)
+#else
+static void * _bench_thread_proc(void *param)
+#endif
+{
+	struct _bench_thread *t = param;
+
+	t->fn(t->arg);
+
+	return 0;
+}
+
+bench_thread bench_thread_create(void (*fn)(void *arg), void *const arg)
+{
+	struct _bench_thread *t = malloc(sizeof(struct _bench_thread));
+
+	if (t == NULL)
+		return NULL;
+
+	t->fn = fn;
+	t->arg = arg;
+
+#ifdef _WIN32
+	t->handle = CreateThread(NULL, 0, _bench_thread_proc, t, 0, NULL);
+	if (t->handle == NULL) {
+#else
+	if (pthread_create(&t->thread, NULL, _bench_thread_proc, t) != 0) {
+#endif
+		free(t);
+		return NULL;
+	}
+
+	return t;
+}
+
+void bench_thread_join(bench_thread thread)
+{
+	struct _bench_thread *t = thread;
+
+#ifdef _WIN32
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+#else
+	pthread_join(t->thread, NULL);
+#endif
+	free(t);
+}
+
+#if !defined(_WIN32) && defined(__linux__)
+
+// the objects of a device database are left in /dev/shm when the last process closes them
+void bench_devdb_remove(const wchar_t *const name, const uint32_t generation)
+{
+	char db_name[256], path[320];
+
+	if (wcstombs(db_name, name, sizeof(db_name)) == (size_t)-1)
+		return;
+
+	snprintf(path, sizeof(path), "/devdb_itedev_shmem_%s", db_name);
+	shm_unlink(path);
+
+	for (uint32_t g = 1; g <= generation; g++) {
+		snprintf(path, sizeof(path), "/devdb_itedev_table_%s_%u", db_name, g);
+		shm_unlink(path);
+	}
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 2) {
+		for (size_t i = 0; i < sizeof(_commands) / sizeof(_commands[0]); i++) {
+			if (strcmp(argv[1], _commands[i].name) == 0) {
+				return _commands[i].main(argc - 2, argv + 2);
+			}
+		}
+	}
+
+	fprintf(stderr, "usage: %s <command> [options]\n", argv[0]);
+
+	for (size_t i = 0; i < sizeof(_commands) / sizeof(_commands[0]); i++) {
+		fprintf(stderr, "  %s %s\n", _commands[i].name, _commands[i].usage);
+	}
+
+	return 1;
+}
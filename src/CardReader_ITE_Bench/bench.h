@@ -0,0 +1,115 @@
+// bench.h
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winscard.h>
+#endif
+
+struct bench_command
+{
+	const char *name;
+	const char *usage;
+	int (*main)(int argc, char *argv[]);
+};
+
+extern uint64_t bench_get_time_ns(void);
+extern uint64_t bench_get_arg_uint(int argc, char *argv[], const char *const name, const uint64_t def);
+extern const char * bench_get_arg_str(int argc, char *argv[], const char *const name, const char *const def);
+extern bool bench_get_arg_flag(int argc, char *argv[], const char *const name);
+extern void bench_print_result(const char *const name, const uint64_t ops, const uint64_t ns);
+
+// latency histogram: 16 linear buckets for each power of two (about 6% error)
+
+#define BENCH_HIST_SIZE	1024
+
+struct bench_hist
+{
+	uint64_t count[BENCH_HIST_SIZE];
+	uint64_t total;
+	uint64_t max;
+};
+
+extern void bench_hist_init(struct bench_hist *const h);
+extern uint32_t bench_hist_index(const uint64_t v);
+extern void bench_hist_add(struct bench_hist *const h, const uint64_t ns);
+extern void bench_hist_merge(struct bench_hist *const dst, const struct bench_hist *const src);
+extern uint64_t bench_hist_percentile(const struct bench_hist *const h, const double p);
+
+typedef void* bench_thread;
+
+extern bench_thread bench_thread_create(void (*fn)(void *arg), void *const arg);
+extern void bench_thread_join(bench_thread thread);
+
+#if !defined(_WIN32) && defined(__linux__)
+#include <wchar.h>
+
+extern void bench_devdb_remove(const wchar_t *const name, const uint32_t generation);
+#endif
+
+#ifdef _WIN32
+
+// the SCard API of the module, which is loaded instead of winscard.dll
+
+struct bench_scard_api
+{
+	HMODULE module;
+	LONG (WINAPI *EstablishContext)(DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT);
+	LONG (WINAPI *ReleaseContext)(SCARDCONTEXT);
+	LONG (WINAPI *ListReadersA)(SCARDCONTEXT, LPCSTR, LPSTR, LPDWORD);
+	LONG (WINAPI *ConnectA)(SCARDCONTEXT, LPCSTR, DWORD, DWORD, LPSCARDHANDLE, LPDWORD);
+	LONG (WINAPI *Disconnect)(SCARDHANDLE, DWORD);
+	LONG (WINAPI *Transmit)(SCARDHANDLE, LPCSCARD_IO_REQUEST, LPCBYTE, DWORD, LPSCARD_IO_REQUEST, LPBYTE, LPDWORD);
+	LONG (WINAPI *StatusA)(SCARDHANDLE, LPSTR, LPDWORD, LPDWORD, LPDWORD, LPBYTE, LPDWORD);
+	LONG (WINAPI *GetStatusChangeA)(SCARDCONTEXT, DWORD, LPSCARD_READERSTATEA, DWORD);
+};
+
+#elif defined(__linux__)
+
+#include "../CardReader_ITE_PCSC/pcsclite.h"
+
+// the SCard API of libpcsclite.so.1 of CardReader_ITE_PCSC, under the names of the
+// functions of the module
+
+struct bench_scard_api
+{
+	void *module;
+	LONG (*EstablishContext)(DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT);
+	LONG (*ReleaseContext)(SCARDCONTEXT);
+	LONG (*ListReadersA)(SCARDCONTEXT, LPCSTR, LPSTR, LPDWORD);
+	LONG (*ConnectA)(SCARDCONTEXT, LPCSTR, DWORD, DWORD, LPSCARDHANDLE, LPDWORD);
+	LONG (*Disconnect)(SCARDHANDLE, DWORD);
+	LONG (*Transmit)(SCARDHANDLE, LPCSCARD_IO_REQUEST, LPCBYTE, DWORD, LPSCARD_IO_REQUEST, LPBYTE, LPDWORD);
+	LONG (*StatusA)(SCARDHANDLE, LPSTR, LPDWORD, LPDWORD, LPDWORD, LPBYTE, LPDWORD);
+	LONG (*GetStatusChangeA)(SCARDCONTEXT, DWORD, LPSCARD_READERSTATE, DWORD);
+	LPCSCARD_IO_REQUEST t1;		// g_rgSCardT1Pci of the library
+};
+
+#endif
+
+#if defined(_WIN32) || defined(__linux__)
+
+extern bool bench_scard_load(struct bench_scard_api *const api, const char *const path);
+extern uint32_t bench_scard_list_readers(const struct bench_scard_api *const api, char *const buf, DWORD len, const char **const readers, const uint32_t max);
+
+#endif
+
+extern int bench_memory_main(int argc, char *argv[]);
+extern int bench_log_main(int argc, char *argv[]);
+extern int bench_e2e_main(int argc, char *argv[]);
+extern int bench_micro_main(int argc, char *argv[]);
+extern int bench_soak_main(int argc, char *argv[]);
+extern int bench_replay_main(int argc, char *argv[]);
+extern int bench_fault_main(int argc, char *argv[]);
+extern int bench_worker_main(int argc, char *argv[]);
+extern int bench_broker_main(int argc, char *argv[]);
+extern int bench_lock_main(int argc, char *argv[]);
+extern int bench_recover_main(int argc, char *argv[]);
+extern int bench_ref_main(int argc, char *argv[]);
+extern int bench_loop_main(int argc, char *argv[]);
+extern int bench_pcsc_main(int argc, char *argv[]);
+extern int bench_cardsrv_main(int argc, char *argv[]);
@@ -0,0 +1,334 @@
+// bench_broker.c
+//
+// compares two ways for several processes to share a device, with a busy loop of
+// --service microseconds standing in for the exchange with the card:
+//
+//   direct: every process takes a lock shared between the processes and does the
+//           exchange itself, as the module does by default
+//   broker: this process owns the device, and the others submit their commands
+//           through the request ring of broker.c (BrokerMode in the INI file)
+//
+// a futex of a shared mapping stands in for the devdb lock. it runs on Linux, over
+// POSIX shared memory and futexes.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../CardReader_ITE/broker.h"
+
+#define _MAX_CLIENT_NUM	64
+
+typedef enum {
+	_MODEL_DIRECT,
+	_MODEL_BROKER,
+	_MODEL_NUM
+} _model_t;
+
+static const char *const _model_name[_MODEL_NUM] = { "direct", "broker" };
+
+struct _client_result
+{
+	uint64_t ops;
+	uint64_t errors;
+	struct bench_hist hist;
+};
+
+// shared with the child processes
+struct _shared
+{
+	uint32_t lock;			// 0: unlocked, 1: locked, 2: locked with waiters
+	uint32_t start;
+	uint64_t end;			// bench_get_time_ns
+	struct _client_result result[_MAX_CLIENT_NUM];
+};
+
+struct _config
+{
+	_model_t model;
+	uint32_t clients;
+	uint64_t duration;		// nanoseconds
+	uint64_t service;		// nanoseconds
+	uint32_t size;
+	wchar_t name[64];
+};
+
+static void _futex_wait(uint32_t *const addr, const uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t *const addr, const int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+static void _lock(void *ctx)
+{
+	uint32_t *m = &((struct _shared *)ctx)->lock;
+	uint32_t c = 0;
+
+	if (__atomic_compare_exchange_n(m, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	if (c != 2)
+		c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+
+	while (c != 0) {
+		_futex_wait(m, 2);
+		c = __atomic_exchange_n(m, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void _unlock(void *ctx)
+{
+	uint32_t *m = &((struct _shared *)ctx)->lock;
+
+	if (__atomic_fetch_sub(m, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(m, 0, __ATOMIC_RELEASE);
+		_futex_wake(m, 1);
+	}
+}
+
+static uint64_t _service_ns = 0;
+
+// the exchange: the response is the command
+static int32_t _execute(void *ctx, const struct broker_request *const req)
+{
+	uint64_t end = bench_get_time_ns() + _service_ns;
+
+	while (bench_get_time_ns() < end);
+
+	if (req->send_len > *req->recv_len)
+		return 1;
+
+	memcpy(req->recv, req->send, req->send_len);
+	*req->recv_len = req->send_len;
+
+	return 0;
+}
+
+static const struct broker_ops _ops = { _lock, _unlock, _execute };
+
+static void _client_main(struct _shared *const s, const struct _config *const c, const uint32_t index)
+{
+	struct _client_result *res = &s->result[index];
+	broker b;
+	uint8_t cmd[BROKER_MAX_DATA_SIZE], recv[BROKER_MAX_DATA_SIZE];
+
+	if (c->model == _MODEL_BROKER && broker_open(&b, c->name) == false) {
+		fprintf(stderr, "broker_open failed\n");
+		_exit(1);
+	}
+
+	for (uint32_t i = 0; i < c->size; i++)
+		cmd[i] = (uint8_t)i;
+
+	while (__atomic_load_n(&s->start, __ATOMIC_ACQUIRE) == 0)
+		_futex_wait(&s->start, 0);
+
+	while (1)
+	{
+		struct broker_request req;
+		uint32_t recv_len = sizeof(recv);
+		int32_t result = 0;
+		uint64_t t0 = bench_get_time_ns();
+
+		if (t0 >= s->end)
+			break;
+
+		if (c->model == _MODEL_BROKER) {
+			if (broker_call(&b, 0, 0, cmd, c->size, recv, &recv_len, &result) != BROKER_S_OK)
+				result = 1;
+		}
+		else {
+			req.send = cmd;
+			req.send_len = c->size;
+			req.recv = recv;
+			req.recv_len = &recv_len;
+
+			_lock(s);
+			result = _execute(s, &req);
+			_unlock(s);
+		}
+
+		bench_hist_add(&res->hist, bench_get_time_ns() - t0);
+
+		res->ops++;
+		if (result != 0 || recv_len != c->size)
+			res->errors++;
+	}
+
+	if (c->model == _MODEL_BROKER)
+		broker_close(&b);
+
+	_exit(0);
+}
+
+static bool _run(struct _shared *const s, const struct _config *const c)
+{
+	pid_t pid[_MAX_CLIENT_NUM];
+	struct rusage ru_self0, ru_self1, ru_child;
+	struct bench_hist *all;
+	struct broker_stats bs;
+	uint64_t ops = 0, errors = 0;
+	uint32_t running;
+	broker b;
+
+	memset(s, 0, sizeof(struct _shared));
+	memset(&bs, 0, sizeof(bs));
+
+	all = malloc(sizeof(struct bench_hist));
+	if (all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return false;
+	}
+
+	bench_hist_init(all);
+
+	if (c->model == _MODEL_BROKER) {
+		if (broker_open(&b, c->name) == false || broker_claim(&b) == false) {
+			fprintf(stderr, "failed to own the broker\n");
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < c->clients; i++)
+		bench_hist_init(&s->result[i].hist);
+
+	for (uint32_t i = 0; i < c->clients; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0)
+			_client_main(s, c, i);
+		if (pid[i] < 0) {
+			fprintf(stderr, "fork failed\n");
+			return false;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &ru_self0);
+
+	s->end = bench_get_time_ns() + c->duration;
+	__atomic_store_n(&s->start, 1, __ATOMIC_RELEASE);
+	_futex_wake(&s->start, INT_MAX);
+
+	running = c->clients;
+
+	while (running > 0)
+	{
+		pid_t p;
+
+		if (c->model == _MODEL_BROKER)
+			broker_serve(&b, &_ops, s, 10);
+		else
+			usleep(10000);
+
+		while (running > 0 && (p = waitpid(-1, NULL, WNOHANG)) > 0)
+			running--;
+	}
+
+	getrusage(RUSAGE_SELF, &ru_self1);
+	getrusage(RUSAGE_CHILDREN, &ru_child);
+
+	if (c->model == _MODEL_BROKER) {
+		memcpy(&bs, &b.info->stats, sizeof(bs));
+		broker_release(&b);
+		broker_close(&b);
+	}
+
+	for (uint32_t i = 0; i < c->clients; i++) {
+		ops += s->result[i].ops;
+		errors += s->result[i].errors;
+		bench_hist_merge(all, &s->result[i].hist);
+	}
+
+	// the children of the earlier runs are counted too, which is why the direct model is run first
+	static uint64_t child_csw = 0;
+	uint64_t csw = (uint64_t)(ru_child.ru_nvcsw + ru_child.ru_nivcsw) - child_csw;
+
+	child_csw += csw;
+	csw += (uint64_t)(ru_self1.ru_nvcsw + ru_self1.ru_nivcsw) - (uint64_t)(ru_self0.ru_nvcsw + ru_self0.ru_nivcsw);
+
+	printf("{\"model\":\"%s\",\"clients\":%u,\"service_us\":%.1f,\"size\":%u,\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"csw_per_op\":%.2f,\"batch_avg\":%.2f}\n",
+		_model_name[c->model], c->clients, c->service / 1000.0, c->size, (unsigned long long)ops, (unsigned long long)errors,
+		(double)ops * 1000000000.0 / c->duration,
+		bench_hist_percentile(all, 0.5) / 1000.0, bench_hist_percentile(all, 0.99) / 1000.0, all->max / 1000.0,
+		(ops != 0) ? (double)csw / ops : 0.0, (bs.batch != 0) ? (double)bs.request / bs.batch : 0.0);
+
+	free(all);
+
+	return true;
+}
+
+int bench_broker_main(int argc, char *argv[])
+{
+	struct _config c;
+	struct _shared *s;
+	char shm_name[96];
+	int r = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.clients = (uint32_t)bench_get_arg_uint(argc, argv, "clients", 4);
+	c.duration = bench_get_arg_uint(argc, argv, "duration", 3000) * 1000000;
+	c.service = bench_get_arg_uint(argc, argv, "service", 50) * 1000;
+	c.size = (uint32_t)bench_get_arg_uint(argc, argv, "size", 5);
+
+	if (c.clients == 0 || c.clients > _MAX_CLIENT_NUM) {
+		fprintf(stderr, "--clients must be 1..%u\n", _MAX_CLIENT_NUM);
+		return 1;
+	}
+
+	if (c.size == 0 || c.size > BROKER_MAX_DATA_SIZE) {
+		fprintf(stderr, "--size must be 1..%u\n", BROKER_MAX_DATA_SIZE);
+		return 1;
+	}
+
+	_service_ns = c.service;
+	swprintf(c.name, sizeof(c.name) / sizeof(wchar_t), L"bench_%u", (uint32_t)getpid());
+	snprintf(shm_name, sizeof(shm_name), "/itecard_broker_bench_%u", (uint32_t)getpid());
+
+	s = mmap(NULL, sizeof(struct _shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		return 1;
+	}
+
+	for (uint32_t m = 0; m < _MODEL_NUM; m++) {
+		c.model = (_model_t)m;
+		if (_run(s, &c) == false) {
+			r = 1;
+			break;
+		}
+	}
+
+	shm_unlink(shm_name);
+	munmap(s, sizeof(struct _shared));
+
+	return r;
+}
+
+#else
+
+int bench_broker_main(int argc, char *argv[])
+{
+	fprintf(stderr, "broker runs on Linux, over POSIX shared memory and futexes\n");
+	return 1;
+}
+
+#endif
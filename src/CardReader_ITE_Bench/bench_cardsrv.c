@@ -0,0 +1,347 @@
+// bench_cardsrv.c
+//
+// the cost of the card server: per-APDU latency of the exchanges with a card from the
+// process itself, through libpcsclite.so.1 of CardReader_ITE_PCSC (--direct), and
+// through the card server of CardReader_ITE_Server on --socket, which must be running:
+//
+//   direct:   SCardTransmit of the library, from the calling thread
+//   single:   cardsrv_transmit, an APDU for each request
+//   batch:    cardsrv_transmit_batch, --batch APDUs for each request
+//   pipeline: cardsrv_submit and cardsrv_complete, --depth requests of an APDU on the way
+//
+// mean_us is the time of all the exchanges divided by the number of the APDUs, and the
+// percentiles are those of the requests. overhead_us is the difference of the means of
+// single and direct: what a round trip to the server adds to an APDU.
+//
+//   ITECARD_PCSC_CONFIG=<ini> itecard_cardsrv --socket /tmp/cardsrv.sock &
+//   ITECARD_PCSC_CONFIG=<ini> itecard_bench cardsrv --socket /tmp/cardsrv.sock
+//
+// it runs on Linux.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <dlfcn.h>
+
+#include "../CardReader_ITE_Server/client.h"
+
+#define _MAX_SIZE	255		// of the data of the command
+#define _RES_SIZE	258
+
+typedef enum {
+	_MODE_DIRECT,
+	_MODE_SINGLE,
+	_MODE_BATCH,
+	_MODE_PIPELINE,
+	_MODE_NUM
+} _mode_t;
+
+static const char *const _mode_name[_MODE_NUM] = { "direct", "single", "batch", "pipeline" };
+
+struct _config
+{
+	const char *direct;
+	const char *socket;
+	const char *reader;
+	uint32_t size;
+	uint32_t batch;
+	uint32_t depth;
+	uint64_t transmits;
+	uint64_t warmup;
+	uint8_t cmd[5 + _MAX_SIZE];
+	uint32_t cmd_len;
+};
+
+struct _result
+{
+	bool ok;
+	uint64_t apdus;
+	uint64_t total;		// ns
+	struct bench_hist hist;
+};
+
+static void _print_result(const struct _config *const c, const _mode_t mode, const char *const reader, const uint32_t per_request, const struct _result *const res)
+{
+	printf("{\"mode\":\"%s\",\"reader\":\"%s\",\"size\":%u,\"apdus\":%llu,\"apdus_per_request\":%u,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		_mode_name[mode], reader, c->size, (unsigned long long)res->apdus, per_request,
+		(res->apdus != 0) ? (double)res->total / res->apdus / 1000.0 : 0.0,
+		bench_hist_percentile(&res->hist, 0.5) / 1000.0, bench_hist_percentile(&res->hist, 0.99) / 1000.0, res->hist.max / 1000.0);
+}
+
+static void _print_error(const _mode_t mode, const char *const func, const LONG r)
+{
+	printf("{\"mode\":\"%s\",\"error\":\"%s\",\"code\":\"0x%08lX\"}\n", _mode_name[mode], func, (unsigned long)r & 0xffffffff);
+}
+
+// the first reader of the list whose name starts with --reader
+static const char * _find_reader(const struct _config *const c, const char *readers)
+{
+	for (; *readers != '\0'; readers += strlen(readers) + 1) {
+		if (strncmp(readers, c->reader, strlen(c->reader)) == 0)
+			return readers;
+	}
+
+	return NULL;
+}
+
+static void _run_direct(const struct _config *const c, struct _result *const res)
+{
+	void *lib;
+	const SCARD_IO_REQUEST *t1;
+	LONG (*EstablishContext)(DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT);
+	LONG (*ReleaseContext)(SCARDCONTEXT);
+	LONG (*ListReaders)(SCARDCONTEXT, LPCSTR, LPSTR, LPDWORD);
+	LONG (*Connect)(SCARDCONTEXT, LPCSTR, DWORD, DWORD, LPSCARDHANDLE, LPDWORD);
+	LONG (*Disconnect)(SCARDHANDLE, DWORD);
+	LONG (*Transmit)(SCARDHANDLE, const SCARD_IO_REQUEST *, LPCBYTE, DWORD, SCARD_IO_REQUEST *, LPBYTE, LPDWORD);
+	SCARDCONTEXT ctx;
+	SCARDHANDLE card;
+	DWORD len, protocol;
+	char readers[CARDSRV_MAX_READERS_SIZE];
+	const char *reader;
+	uint8_t buf[_RES_SIZE];
+	LONG r;
+
+	lib = dlopen(c->direct, RTLD_NOW | RTLD_LOCAL);
+	if (lib == NULL) {
+		_print_error(_MODE_DIRECT, "dlopen", 0);
+		return;
+	}
+
+	t1 = dlsym(lib, "g_rgSCardT1Pci");
+	EstablishContext = dlsym(lib, "SCardEstablishContext");
+	ReleaseContext = dlsym(lib, "SCardReleaseContext");
+	ListReaders = dlsym(lib, "SCardListReaders");
+	Connect = dlsym(lib, "SCardConnect");
+	Disconnect = dlsym(lib, "SCardDisconnect");
+	Transmit = dlsym(lib, "SCardTransmit");
+
+	if (t1 == NULL || EstablishContext == NULL || ReleaseContext == NULL || ListReaders == NULL || Connect == NULL || Disconnect == NULL || Transmit == NULL) {
+		_print_error(_MODE_DIRECT, "dlsym", 0);
+		goto end1;
+	}
+
+	r = EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(_MODE_DIRECT, "SCardEstablishContext", r);
+		goto end1;
+	}
+
+	len = sizeof(readers);
+	r = ListReaders(ctx, NULL, readers, &len);
+	if (r != SCARD_S_SUCCESS || (reader = _find_reader(c, readers)) == NULL) {
+		_print_error(_MODE_DIRECT, "SCardListReaders", (r != SCARD_S_SUCCESS) ? r : SCARD_E_UNKNOWN_READER);
+		goto end2;
+	}
+
+	r = Connect(ctx, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card, &protocol);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(_MODE_DIRECT, "SCardConnect", r);
+		goto end2;
+	}
+
+	for (uint64_t i = 0; i < c->warmup + c->transmits; i++)
+	{
+		uint64_t t0;
+
+		len = sizeof(buf);
+
+		t0 = bench_get_time_ns();
+		r = Transmit(card, t1, c->cmd, c->cmd_len, NULL, buf, &len);
+		t0 = bench_get_time_ns() - t0;
+
+		if (r != SCARD_S_SUCCESS) {
+			_print_error(_MODE_DIRECT, "SCardTransmit", r);
+			goto end3;
+		}
+
+		if (i >= c->warmup) {
+			bench_hist_add(&res->hist, t0);
+			res->total += t0;
+			res->apdus++;
+		}
+	}
+
+	res->ok = true;
+	_print_result(c, _MODE_DIRECT, reader, 1, res);
+
+end3:
+	Disconnect(card, SCARD_LEAVE_CARD);
+end2:
+	ReleaseContext(ctx);
+end1:
+	// the cards are released to the server
+	dlclose(lib);
+}
+
+static void _run_server(const struct _config *const c, const _mode_t mode, struct _result *const res)
+{
+	cardsrv_client cl;
+	char readers[CARDSRV_MAX_READERS_SIZE];
+	const char *reader;
+	uint32_t len = sizeof(readers);
+	uint32_t per_request = (mode == _MODE_BATCH) ? c->batch : 1;
+	uint32_t depth = (mode == _MODE_PIPELINE) ? c->depth : 1;
+	uint16_t session;
+	DWORD protocol;
+	struct cardsrv_apdu *apdu;
+	uint8_t *buf;
+	uint64_t *start;
+	uint64_t requests = (c->warmup + c->transmits + per_request - 1) / per_request;
+	uint64_t warmup = c->warmup / per_request, sent = 0, done = 0, t_begin = 0;
+	LONG r;
+
+	r = cardsrv_open(&cl, c->socket);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(mode, "cardsrv_open", r);
+		return;
+	}
+
+	r = cardsrv_list_readers(&cl, readers, &len);
+	if (r != SCARD_S_SUCCESS || (reader = _find_reader(c, readers)) == NULL) {
+		_print_error(mode, "cardsrv_list_readers", (r != SCARD_S_SUCCESS) ? r : SCARD_E_UNKNOWN_READER);
+		goto end1;
+	}
+
+	r = cardsrv_connect(&cl, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &session, &protocol);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(mode, "cardsrv_connect", r);
+		goto end1;
+	}
+
+	// a batch of APDUs for each request on the way
+	apdu = malloc(depth * per_request * sizeof(struct cardsrv_apdu));
+	buf = malloc(depth * per_request * _RES_SIZE);
+	start = malloc(depth * sizeof(uint64_t));
+	if (apdu == NULL || buf == NULL || start == NULL) {
+		_print_error(mode, "malloc", SCARD_E_NO_MEMORY);
+		goto end2;
+	}
+
+	for (uint32_t i = 0; i < depth * per_request; i++) {
+		apdu[i].send = c->cmd;
+		apdu[i].send_len = c->cmd_len;
+		apdu[i].recv = buf + i * _RES_SIZE;
+		apdu[i].recv_size = _RES_SIZE;
+	}
+
+	while (done < requests)
+	{
+		// the pipeline is kept full, the others wait for each response
+		while (sent < requests && sent - done < depth) {
+			uint32_t slot = sent % depth;
+
+			start[slot] = bench_get_time_ns();
+			if (sent == warmup)
+				t_begin = start[slot];
+
+			r = cardsrv_submit(&cl, session, &apdu[slot * per_request], (uint16_t)per_request, CARDSRV_TRANSMIT_STOP_ON_ERROR);
+			if (r != SCARD_S_SUCCESS) {
+				_print_error(mode, "cardsrv_submit", r);
+				goto end2;
+			}
+
+			sent++;
+		}
+
+		r = cardsrv_complete(&cl);
+		if (r != SCARD_S_SUCCESS) {
+			_print_error(mode, "cardsrv_complete", r);
+			goto end2;
+		}
+
+		if (done >= warmup) {
+			bench_hist_add(&res->hist, bench_get_time_ns() - start[done % depth]);
+			res->apdus += per_request;
+		}
+
+		done++;
+	}
+
+	res->total = bench_get_time_ns() - t_begin;
+	res->ok = true;
+	_print_result(c, mode, reader, per_request, res);
+
+end2:
+	free(start);
+	free(buf);
+	free(apdu);
+	cardsrv_disconnect(&cl, session, SCARD_LEAVE_CARD);
+end1:
+	cardsrv_close(&cl);
+}
+
+int bench_cardsrv_main(int argc, char *argv[])
+{
+	struct _config c;
+	struct _result *res;
+	uint32_t ok = 0;
+
+	c.direct = bench_get_arg_str(argc, argv, "direct", "./libpcsclite.so.1");
+	c.socket = bench_get_arg_str(argc, argv, "socket", NULL);
+	c.reader = bench_get_arg_str(argc, argv, "reader", "");
+	c.size = (uint32_t)bench_get_arg_uint(argc, argv, "size", 0);
+	c.batch = (uint32_t)bench_get_arg_uint(argc, argv, "batch", 8);
+	c.depth = (uint32_t)bench_get_arg_uint(argc, argv, "depth", 4);
+	c.transmits = bench_get_arg_uint(argc, argv, "transmits", 1000);
+	c.warmup = bench_get_arg_uint(argc, argv, "warmup", 100);
+
+	if (c.size > _MAX_SIZE || c.batch == 0 || c.batch > CARDSRV_MAX_BATCH_NUM || c.depth == 0 || c.depth > CARDSRV_CLIENT_MAX_PENDING_NUM) {
+		fprintf(stderr, "--size must be 0..%u, --batch 1..%u and --depth 1..%u\n", _MAX_SIZE, CARDSRV_MAX_BATCH_NUM, CARDSRV_CLIENT_MAX_PENDING_NUM);
+		return 1;
+	}
+
+	// the command of e2e, with --size bytes of data
+	c.cmd[0] = 0x90;
+	c.cmd[1] = 0x30;
+	c.cmd[2] = 0x00;
+	c.cmd[3] = 0x02;
+	c.cmd[4] = (uint8_t)c.size;
+	for (uint32_t i = 0; i < c.size; i++)
+		c.cmd[5 + i] = (uint8_t)i;
+	c.cmd_len = 5 + c.size;
+
+	res = calloc(_MODE_NUM, sizeof(struct _result));
+	if (res == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < _MODE_NUM; i++) {
+		bench_hist_init(&res[i].hist);
+
+		if (i == _MODE_DIRECT)
+			_run_direct(&c, &res[i]);
+		else
+			_run_server(&c, (_mode_t)i, &res[i]);
+
+		if (res[i].ok == true)
+			ok++;
+	}
+
+	if (res[_MODE_DIRECT].ok == true && res[_MODE_SINGLE].ok == true) {
+		printf("{\"overhead_us\":%.1f}\n",
+			((double)res[_MODE_SINGLE].total / res[_MODE_SINGLE].apdus - (double)res[_MODE_DIRECT].total / res[_MODE_DIRECT].apdus) / 1000.0);
+	}
+
+	free(res);
+
+	return (ok != 0) ? 0 : 1;
+}
+
+#else
+
+int bench_cardsrv_main(int argc, char *argv[])
+{
+	fprintf(stderr, "cardsrv runs on Linux, with the card server of CardReader_ITE_Server\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,886 @@
+// bench_e2e.c
+//
+// end-to-end latency of the SCard API of the module against simulated devices.
+//
+// the module reads the INI file next to it, where the devices are simulated with
+// SimulatedDevice and SimulatedDeviceNum in a [ReaderDeviceN] section (sim_bcas.ini
+// is an example of the script). on Linux, the module is libpcsclite.so.1 of
+// CardReader_ITE_PCSC (./libpcsclite.so.1 by default, given as a path so that the
+// one of the system is not taken), which reads the INI file of ITECARD_PCSC_CONFIG.
+//
+// every combination of the lists is measured and printed as one JSON line. the
+// output of an earlier run can be given as --baseline, and the exit code is 2 if
+// the throughput or p99 of a combination got worse by more than --threshold percent.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winscard.h>
+#elif defined(__linux__)
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "bench.h"
+
+#if defined(_WIN32) || defined(__linux__)
+
+#ifdef _WIN32
+#define _DEFAULT_MODULE		"CardReader_ITE.dll"
+#define _atomic_inc(p)		InterlockedIncrement(p)
+#define _atomic_set(p, v)	InterlockedExchange((p), (v))
+#define _yield()			Sleep(0)
+#define _sleep(ms)			Sleep(ms)
+#else
+#define _DEFAULT_MODULE		"./libpcsclite.so.1"
+#define _atomic_inc(p)		__atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define _atomic_set(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define _yield()			sched_yield()
+#define _sleep(ms)			usleep((ms) * 1000)
+#define SCARD_READERSTATEA	SCARD_READERSTATE
+#endif
+
+#define _MAX_LIST_NUM		16
+#define _MAX_THREAD_NUM		64
+#define _MAX_PROCESS_NUM	16
+#define _MAX_READER_NUM		16
+
+typedef enum {
+	_OP_TRANSMIT,
+	_OP_STATUS,
+	_OP_STATUS_CHANGE,
+	_OP_CONNECT,			// SCardConnect and SCardDisconnect
+	_OP_NUM
+} _op_t;
+
+static const char *const _op_name[_OP_NUM] = { "transmit", "status", "statuschange", "connect" };
+
+struct _config
+{
+	_op_t op;
+	uint32_t processes;
+	uint32_t threads;
+	uint32_t devices;
+	uint32_t size;			// APDU length
+	uint64_t duration;		// milliseconds
+};
+
+// written by a child process to its result file
+struct _result
+{
+	struct bench_hist hist;
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t ns;			// the longest run of the threads
+};
+
+// a child process, and what it shares with its parent
+struct _child
+{
+#ifdef _WIN32
+	HANDLE ready_sem;
+	HANDLE start_event;
+#else
+	int ready_fd;		// a byte is written to it when the threads have connected
+	int start_fd;		// reaches its end when the parent closes the other one
+#endif
+};
+
+struct _worker
+{
+	const struct bench_scard_api *api;
+	const struct _config *config;
+	const char *reader;
+	volatile LONG *ready;
+	volatile LONG *start;
+	struct _result result;
+};
+
+#ifdef _WIN32
+
+bool bench_scard_load(struct bench_scard_api *const api, const char *const path)
+{
+	api->module = LoadLibraryA(path);
+	if (api->module == NULL) {
+		fprintf(stderr, "LoadLibrary(%s) failed: %lu\n", path, GetLastError());
+		return false;
+	}
+
+#define _get_proc(name, proc) \
+	if ((*(FARPROC *)&api->name = GetProcAddress(api->module, proc)) == NULL) { \
+		fprintf(stderr, "GetProcAddress(%s) failed\n", proc); \
+		FreeLibrary(api->module); \
+		return false; \
+	}
+
+	_get_proc(EstablishContext, "SCardEstablishContext");
+	_get_proc(ReleaseContext, "SCardReleaseContext");
+	_get_proc(ListReadersA, "SCardListReadersA");
+	_get_proc(ConnectA, "SCardConnectA");
+	_get_proc(Disconnect, "SCardDisconnect");
+	_get_proc(Transmit, "SCardTransmit");
+	_get_proc(StatusA, "SCardStatusA");
+	_get_proc(GetStatusChangeA, "SCardGetStatusChangeA");
+
+#undef _get_proc
+
+	return true;
+}
+
+#else
+
+bool bench_scard_load(struct bench_scard_api *const api, const char *const path)
+{
+	api->module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (api->module == NULL) {
+		fprintf(stderr, "dlopen(%s) failed: %s\n", path, dlerror());
+		return false;
+	}
+
+#define _get_proc(name, proc) \
+	if ((*(void **)&api->name = dlsym(api->module, proc)) == NULL) { \
+		fprintf(stderr, "dlsym(%s) failed\n", proc); \
+		dlclose(api->module); \
+		return false; \
+	}
+
+	_get_proc(EstablishContext, "SCardEstablishContext");
+	_get_proc(ReleaseContext, "SCardReleaseContext");
+	_get_proc(ListReadersA, "SCardListReaders");
+	_get_proc(ConnectA, "SCardConnect");
+	_get_proc(Disconnect, "SCardDisconnect");
+	_get_proc(Transmit, "SCardTransmit");
+	_get_proc(StatusA, "SCardStatus");
+	_get_proc(GetStatusChangeA, "SCardGetStatusChange");
+	_get_proc(t1, "g_rgSCardT1Pci");
+
+#undef _get_proc
+
+	return true;
+}
+
+#endif
+
+// "1,2,4"
+static uint32_t _parse_list(const char *str, uint32_t *const list, const uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (*str != '\0' && n < max) {
+		char *end;
+
+		list[n++] = (uint32_t)strtoul(str, &end, 10);
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+
+	return n;
+}
+
+static uint32_t _parse_op_list(const char *str, uint32_t *const list, const uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (*str != '\0' && n < max) {
+		size_t len = strcspn(str, ",");
+		uint32_t i;
+
+		for (i = 0; i < _OP_NUM; i++) {
+			if (strlen(_op_name[i]) == len && strncmp(str, _op_name[i], len) == 0) {
+				list[n++] = i;
+				break;
+			}
+		}
+
+		if (i == _OP_NUM) {
+			fprintf(stderr, "unknown operation: %.*s\n", (int)len, str);
+			return 0;
+		}
+
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+
+	return n;
+}
+
+// the multi-string of the readers is split in place
+uint32_t bench_scard_list_readers(const struct bench_scard_api *const api, char *const buf, DWORD len, const char **const readers, const uint32_t max)
+{
+	SCARDCONTEXT ctx;
+	uint32_t n = 0;
+
+	if (api->EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx) != SCARD_S_SUCCESS)
+		return 0;
+
+	if (api->ListReadersA(ctx, NULL, buf, &len) == SCARD_S_SUCCESS) {
+		for (char *p = buf; *p != '\0' && n < max; p += strlen(p) + 1) {
+			readers[n++] = p;
+		}
+	}
+
+	api->ReleaseContext(ctx);
+
+	return n;
+}
+
+static void _worker_proc(void *arg)
+{
+	struct _worker *w = arg;
+	const struct bench_scard_api *api = w->api;
+	const struct _config *config = w->config;
+	SCARDCONTEXT ctx = 0;
+	SCARDHANDLE card = 0;
+	DWORD protocol;
+	uint8_t cmd[260], res[260];
+	uint32_t cmd_len;
+	bool ok = false;
+
+	bench_hist_init(&w->result.hist);
+	w->result.ops = 0;
+	w->result.errors = 0;
+	w->result.ns = 0;
+
+	// CLA INS P1 P2 (Lc data | Le)
+	cmd[0] = 0x90;
+	cmd[1] = 0x30;
+	cmd[2] = 0x00;
+	cmd[3] = 0x02;
+	if (config->size <= 5) {
+		cmd[4] = 0x00;
+		cmd_len = 5;
+	}
+	else {
+		cmd_len = (config->size > sizeof(cmd)) ? sizeof(cmd) : config->size;
+		cmd[4] = (uint8_t)(cmd_len - 5);
+		for (uint32_t i = 5; i < cmd_len; i++)
+			cmd[i] = (uint8_t)i;
+	}
+
+	// connected before the clock starts, so that the first card reset is not measured
+	if (api->EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx) != SCARD_S_SUCCESS) {
+		w->result.errors++;
+	}
+	else if (api->ConnectA(ctx, w->reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card, &protocol) != SCARD_S_SUCCESS) {
+		w->result.errors++;
+	}
+	else {
+		ok = true;
+	}
+
+	_atomic_inc(w->ready);
+
+	while (*w->start == 0)
+		_yield();
+
+	uint64_t begin = bench_get_time_ns(), end = begin + (config->duration * 1000000), t = begin;
+
+	while (ok == true && t < end)
+	{
+		LONG r = SCARD_S_SUCCESS;
+		uint64_t t0 = t;
+
+		switch (config->op)
+		{
+		case _OP_TRANSMIT:
+		{
+			DWORD res_len = sizeof(res);
+
+#ifdef _WIN32
+			r = api->Transmit(card, SCARD_PCI_T1, cmd, cmd_len, NULL, res, &res_len);
+#else
+			r = api->Transmit(card, api->t1, cmd, cmd_len, NULL, res, &res_len);
+#endif
+			break;
+		}
+
+		case _OP_STATUS:
+		{
+			char name[256];
+			DWORD name_len = sizeof(name), state, proto, atr_len = 33;
+			BYTE atr[33];
+
+			r = api->StatusA(card, name, &name_len, &state, &proto, atr, &atr_len);
+			break;
+		}
+
+		case _OP_STATUS_CHANGE:
+		{
+			SCARD_READERSTATEA rs;
+
+			memset(&rs, 0, sizeof(rs));
+			rs.szReader = w->reader;
+			rs.dwCurrentState = SCARD_STATE_UNAWARE;
+
+			r = api->GetStatusChangeA(ctx, 0, &rs, 1);
+			break;
+		}
+
+		case _OP_CONNECT:
+		{
+			SCARDHANDLE h;
+
+			r = api->ConnectA(ctx, w->reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &h, &protocol);
+			if (r == SCARD_S_SUCCESS) {
+				r = api->Disconnect(h, SCARD_LEAVE_CARD);
+			}
+			break;
+		}
+
+		default:
+			break;
+		}
+
+		t = bench_get_time_ns();
+
+		if (r == SCARD_S_SUCCESS) {
+			bench_hist_add(&w->result.hist, t - t0);
+			w->result.ops++;
+		}
+		else {
+			w->result.errors++;
+		}
+	}
+
+	w->result.ns = t - begin;
+
+	if (card != 0)
+		api->Disconnect(card, SCARD_LEAVE_CARD);
+	if (ctx != 0)
+		api->ReleaseContext(ctx);
+}
+
+// tells the parent that the threads have connected, and waits for it to start them
+static void _child_wait_start(const struct _child *const child)
+{
+#ifdef _WIN32
+	ReleaseSemaphore(child->ready_sem, 1, NULL);
+	WaitForSingleObject(child->start_event, INFINITE);
+#else
+	char b = 0;
+	ssize_t n;
+
+	if (write(child->ready_fd, &b, 1) != 1)
+		return;
+
+	while ((n = read(child->start_fd, &b, 1)) > 0 || (n == -1 && errno == EINTR));
+#endif
+}
+
+// runs the threads of one process. child is NULL unless it is started by a parent.
+static bool _run_threads(const struct bench_scard_api *const api, const struct _config *const config, const char *const *const readers, const struct _child *const child, struct _result *const result)
+{
+	struct _worker *w;
+	bench_thread th[_MAX_THREAD_NUM];
+	volatile LONG ready = 0, start = 0;
+
+	w = malloc(sizeof(struct _worker) * config->threads);
+	if (w == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return false;
+	}
+
+	for (uint32_t i = 0; i < config->threads; i++) {
+		w[i].api = api;
+		w[i].config = config;
+		w[i].reader = readers[i % config->devices];
+		w[i].ready = &ready;
+		w[i].start = &start;
+		th[i] = bench_thread_create(_worker_proc, &w[i]);
+	}
+
+	while ((uint32_t)ready < config->threads)
+		_sleep(1);
+
+	if (child != NULL) {
+		_child_wait_start(child);
+	}
+
+	_atomic_set(&start, 1);
+
+	for (uint32_t i = 0; i < config->threads; i++)
+		bench_thread_join(th[i]);
+
+	bench_hist_init(&result->hist);
+	result->ops = 0;
+	result->errors = 0;
+	result->ns = 0;
+
+	for (uint32_t i = 0; i < config->threads; i++) {
+		bench_hist_merge(&result->hist, &w[i].result.hist);
+		result->ops += w[i].result.ops;
+		result->errors += w[i].result.errors;
+		if (result->ns < w[i].result.ns)
+			result->ns = w[i].result.ns;
+	}
+
+	free(w);
+
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool _run_processes(const struct _config *const config, const char *const module, struct _result *const result)
+{
+	char exe[MAX_PATH + 1], tmp[MAX_PATH + 1], file[_MAX_PROCESS_NUM][MAX_PATH + 1], name[64];
+	PROCESS_INFORMATION pi[_MAX_PROCESS_NUM];
+	HANDLE ready_sem, start_event;
+	uint32_t n = 0;
+	bool r = true;
+
+	GetModuleFileNameA(NULL, exe, MAX_PATH);
+	GetTempPathA(MAX_PATH, tmp);
+
+	snprintf(name, sizeof(name), "itecard_bench_e2e_ready_%lu", GetCurrentProcessId());
+	ready_sem = CreateSemaphoreA(NULL, 0, _MAX_PROCESS_NUM, name);
+	snprintf(name, sizeof(name), "itecard_bench_e2e_start_%lu", GetCurrentProcessId());
+	start_event = CreateEventA(NULL, TRUE, FALSE, name);
+
+	if (ready_sem == NULL || start_event == NULL) {
+		fprintf(stderr, "CreateSemaphore/CreateEvent failed: %lu\n", GetLastError());
+		r = false;
+		goto end;
+	}
+
+	for (n = 0; n < config->processes; n++)
+	{
+		char cmdline[MAX_PATH * 3];
+		STARTUPINFOA si;
+
+		snprintf(file[n], MAX_PATH + 1, "%sitecard_bench_e2e_%lu_%u.bin", tmp, GetCurrentProcessId(), n);
+		snprintf(cmdline, sizeof(cmdline), "\"%s\" e2e --child \"%s\" --parent %lu --module \"%s\" --ops %s --threads %u --devices %u --sizes %u --duration %llu",
+			exe, file[n], GetCurrentProcessId(), module, _op_name[config->op], config->threads, config->devices, config->size, (unsigned long long)config->duration);
+
+		memset(&si, 0, sizeof(si));
+		si.cb = sizeof(si);
+
+		if (CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi[n]) == FALSE) {
+			fprintf(stderr, "CreateProcess failed: %lu\n", GetLastError());
+			r = false;
+			break;
+		}
+	}
+
+	// every child has connected
+	for (uint32_t i = 0; i < n && r == true; i++) {
+		HANDLE h[2] = { ready_sem, pi[i].hProcess };
+
+		if (WaitForMultipleObjects(2, h, FALSE, INFINITE) != WAIT_OBJECT_0) {
+			fprintf(stderr, "a child process exited before starting\n");
+			r = false;
+		}
+	}
+
+	SetEvent(start_event);
+
+	bench_hist_init(&result->hist);
+	result->ops = 0;
+	result->errors = 0;
+	result->ns = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct _result *cr = malloc(sizeof(struct _result));
+		FILE *fp;
+
+		WaitForSingleObject(pi[i].hProcess, INFINITE);
+		CloseHandle(pi[i].hThread);
+		CloseHandle(pi[i].hProcess);
+
+		fp = fopen(file[i], "rb");
+		if (cr != NULL && fp != NULL && fread(cr, sizeof(struct _result), 1, fp) == 1) {
+			bench_hist_merge(&result->hist, &cr->hist);
+			result->ops += cr->ops;
+			result->errors += cr->errors;
+			if (result->ns < cr->ns)
+				result->ns = cr->ns;
+		}
+		else {
+			fprintf(stderr, "no result from the child process %u\n", i);
+			r = false;
+		}
+
+		if (fp != NULL)
+			fclose(fp);
+		DeleteFileA(file[i]);
+		free(cr);
+	}
+
+end:
+	if (start_event != NULL)
+		CloseHandle(start_event);
+	if (ready_sem != NULL)
+		CloseHandle(ready_sem);
+
+	return r;
+}
+
+static bool _child_open(struct _child *const child, int argc, char *argv[])
+{
+	uint64_t parent = bench_get_arg_uint(argc, argv, "parent", 0);
+	char name[64];
+
+	snprintf(name, sizeof(name), "itecard_bench_e2e_ready_%llu", (unsigned long long)parent);
+	child->ready_sem = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE, FALSE, name);
+	snprintf(name, sizeof(name), "itecard_bench_e2e_start_%llu", (unsigned long long)parent);
+	child->start_event = OpenEventA(SYNCHRONIZE, FALSE, name);
+
+	if (child->ready_sem == NULL || child->start_event == NULL) {
+		if (child->start_event != NULL)
+			CloseHandle(child->start_event);
+		if (child->ready_sem != NULL)
+			CloseHandle(child->ready_sem);
+		return false;
+	}
+
+	return true;
+}
+
+static void _child_close(struct _child *const child)
+{
+	CloseHandle(child->start_event);
+	CloseHandle(child->ready_sem);
+}
+
+#else
+
+// the children are the bench tool itself, run again with --child, so that each one
+// loads the library on its own, as the processes of the applications do
+static bool _run_processes(const struct _config *const config, const char *const module, struct _result *const result)
+{
+	char file[_MAX_PROCESS_NUM][64];
+	pid_t pid[_MAX_PROCESS_NUM];
+	int ready[2] = { -1, -1 }, start[2] = { -1, -1 };
+	uint32_t n = 0, connected = 0;
+	bool r = true;
+
+	if (pipe(ready) != 0 || pipe(start) != 0) {
+		fprintf(stderr, "pipe failed: %d\n", errno);
+		r = false;
+		goto end;
+	}
+
+	for (n = 0; n < config->processes; n++)
+	{
+		char ready_fd[16], start_fd[16], threads[16], devices[16], size[16], duration[24];
+
+		snprintf(file[n], sizeof(file[n]), "/tmp/itecard_bench_e2e_%u_%u.bin", (uint32_t)getpid(), n);
+		snprintf(ready_fd, sizeof(ready_fd), "%d", ready[1]);
+		snprintf(start_fd, sizeof(start_fd), "%d", start[0]);
+		snprintf(threads, sizeof(threads), "%u", config->threads);
+		snprintf(devices, sizeof(devices), "%u", config->devices);
+		snprintf(size, sizeof(size), "%u", config->size);
+		snprintf(duration, sizeof(duration), "%llu", (unsigned long long)config->duration);
+
+		pid[n] = fork();
+		if (pid[n] == 0) {
+			close(ready[0]);
+			close(start[1]);
+			execl("/proc/self/exe", "itecard_bench", "e2e", "--child", file[n], "--ready", ready_fd, "--start", start_fd, "--module", module,
+				"--ops", _op_name[config->op], "--threads", threads, "--devices", devices, "--sizes", size, "--duration", duration, (char *)NULL);
+			_exit(127);
+		}
+		if (pid[n] < 0) {
+			fprintf(stderr, "fork failed: %d\n", errno);
+			r = false;
+			break;
+		}
+	}
+
+	// every child has connected. one which exits before that fails the run.
+	while (connected < n && r == true)
+	{
+		struct pollfd pfd = { ready[0], POLLIN, 0 };
+		char b;
+
+		if (poll(&pfd, 1, 100) == 1 && read(ready[0], &b, 1) == 1) {
+			connected++;
+			continue;
+		}
+
+		for (uint32_t i = 0; i < n; i++) {
+			if (waitpid(pid[i], NULL, WNOHANG) == pid[i]) {
+				fprintf(stderr, "a child process exited before starting\n");
+				pid[i] = -1;
+				r = false;
+			}
+		}
+	}
+
+	bench_hist_init(&result->hist);
+	result->ops = 0;
+	result->errors = 0;
+	result->ns = 0;
+
+end:
+	// the children read the end of the pipe, and start
+	if (start[1] != -1)
+		close(start[1]);
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct _result *cr = malloc(sizeof(struct _result));
+		FILE *fp;
+
+		if (pid[i] > 0)
+			waitpid(pid[i], NULL, 0);
+
+		fp = fopen(file[i], "rb");
+		if (cr != NULL && fp != NULL && fread(cr, sizeof(struct _result), 1, fp) == 1) {
+			bench_hist_merge(&result->hist, &cr->hist);
+			result->ops += cr->ops;
+			result->errors += cr->errors;
+			if (result->ns < cr->ns)
+				result->ns = cr->ns;
+		}
+		else {
+			fprintf(stderr, "no result from the child process %u\n", i);
+			r = false;
+		}
+
+		if (fp != NULL)
+			fclose(fp);
+		unlink(file[i]);
+		free(cr);
+	}
+
+	if (start[0] != -1)
+		close(start[0]);
+	if (ready[1] != -1)
+		close(ready[1]);
+	if (ready[0] != -1)
+		close(ready[0]);
+
+	return r;
+}
+
+static bool _child_open(struct _child *const child, int argc, char *argv[])
+{
+	child->ready_fd = (int)bench_get_arg_uint(argc, argv, "ready", 0);
+	child->start_fd = (int)bench_get_arg_uint(argc, argv, "start", 0);
+
+	if (child->ready_fd <= STDERR_FILENO || child->start_fd <= STDERR_FILENO || fcntl(child->ready_fd, F_GETFD) == -1 || fcntl(child->start_fd, F_GETFD) == -1)
+		return false;
+
+	return true;
+}
+
+static void _child_close(struct _child *const child)
+{
+	close(child->start_fd);
+	close(child->ready_fd);
+}
+
+#endif
+
+static int _child_main(const struct bench_scard_api *const api, const struct _config *const config, const char *const *const readers, const char *const file, int argc, char *argv[])
+{
+	struct _child child;
+	struct _result *result;
+	FILE *fp;
+	int r = 1;
+
+	if (_child_open(&child, argc, argv) == false) {
+		fprintf(stderr, "no parent\n");
+		return 1;
+	}
+
+	result = malloc(sizeof(struct _result));
+
+	if (result != NULL && _run_threads(api, config, readers, &child, result) == true) {
+		fp = fopen(file, "wb");
+		if (fp != NULL) {
+			r = (fwrite(result, sizeof(struct _result), 1, fp) == 1) ? 0 : 1;
+			fclose(fp);
+		}
+	}
+
+	free(result);
+	_child_close(&child);
+
+	return r;
+}
+
+static void _print_json(const struct _config *const c, const struct _result *const r)
+{
+	double sec = (double)r->ns / 1000000000;
+
+	printf("{\"op\":\"%s\",\"processes\":%u,\"threads\":%u,\"devices\":%u,\"size\":%u,\"ops\":%llu,\"errors\":%llu,\"throughput\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+		_op_name[c->op], c->processes, c->threads, c->devices, c->size,
+		(unsigned long long)r->ops, (unsigned long long)r->errors, (sec > 0) ? r->ops / sec : 0.0,
+		bench_hist_percentile(&r->hist, 0.5) / 1000.0, bench_hist_percentile(&r->hist, 0.99) / 1000.0,
+		bench_hist_percentile(&r->hist, 0.999) / 1000.0, r->hist.max / 1000.0);
+	fflush(stdout);
+}
+
+// returns true if the combination regressed against the line of the baseline
+static bool _compare_baseline(const char *const baseline, const struct _config *const c, const struct _result *const r, const double threshold)
+{
+	FILE *fp = fopen(baseline, "r");
+	char line[512];
+	bool regressed = false;
+
+	if (fp == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char op[16];
+		unsigned int processes, threads, devices, size;
+		unsigned long long ops, errors;
+		double throughput, p50, p99;
+
+		if (sscanf(line, "{\"op\":\"%15[^\"]\",\"processes\":%u,\"threads\":%u,\"devices\":%u,\"size\":%u,\"ops\":%llu,\"errors\":%llu,\"throughput\":%lf,\"p50_us\":%lf,\"p99_us\":%lf",
+			op, &processes, &threads, &devices, &size, &ops, &errors, &throughput, &p50, &p99) != 10)
+			continue;
+
+		if (strcmp(op, _op_name[c->op]) != 0 || processes != c->processes || threads != c->threads || devices != c->devices || size != c->size)
+			continue;
+
+		double sec = (double)r->ns / 1000000000;
+		double tp = (sec > 0) ? r->ops / sec : 0.0;
+		double p99_now = bench_hist_percentile(&r->hist, 0.99) / 1000.0;
+
+		if (tp < throughput * (1.0 - (threshold / 100))) {
+			fprintf(stderr, "regression: %s p%u t%u d%u s%u: throughput %.1f -> %.1f\n", op, processes, threads, devices, size, throughput, tp);
+			regressed = true;
+		}
+		if (p99_now > p99 * (1.0 + (threshold / 100))) {
+			fprintf(stderr, "regression: %s p%u t%u d%u s%u: p99 %.1fus -> %.1fus\n", op, processes, threads, devices, size, p99, p99_now);
+			regressed = true;
+		}
+		break;
+	}
+
+	fclose(fp);
+
+	return regressed;
+}
+
+int bench_e2e_main(int argc, char *argv[])
+{
+	const char *module = bench_get_arg_str(argc, argv, "module", _DEFAULT_MODULE);
+	const char *baseline = bench_get_arg_str(argc, argv, "baseline", NULL);
+	const char *child = bench_get_arg_str(argc, argv, "child", NULL);
+	double threshold = (double)bench_get_arg_uint(argc, argv, "threshold", 10);
+	uint32_t ops[_MAX_LIST_NUM], processes[_MAX_LIST_NUM], threads[_MAX_LIST_NUM], devices[_MAX_LIST_NUM], sizes[_MAX_LIST_NUM];
+	uint32_t ops_num, processes_num, threads_num, devices_num, sizes_num;
+	struct _config config;
+	struct bench_scard_api api;
+	char buf[0x1000];
+	const char *readers[_MAX_READER_NUM];
+	uint32_t reader_num;
+	bool regressed = false;
+
+	ops_num = _parse_op_list(bench_get_arg_str(argc, argv, "ops", "transmit"), ops, _MAX_LIST_NUM);
+	processes_num = _parse_list(bench_get_arg_str(argc, argv, "processes", "1"), processes, _MAX_LIST_NUM);
+	threads_num = _parse_list(bench_get_arg_str(argc, argv, "threads", "1"), threads, _MAX_LIST_NUM);
+	devices_num = _parse_list(bench_get_arg_str(argc, argv, "devices", "1"), devices, _MAX_LIST_NUM);
+	sizes_num = _parse_list(bench_get_arg_str(argc, argv, "sizes", "5"), sizes, _MAX_LIST_NUM);
+	config.duration = bench_get_arg_uint(argc, argv, "duration", 3000);
+
+	if (ops_num == 0 || processes_num == 0 || threads_num == 0 || devices_num == 0 || sizes_num == 0) {
+		fprintf(stderr, "empty list\n");
+		return 1;
+	}
+
+	if (bench_scard_load(&api, module) == false)
+		return 1;
+
+	reader_num = bench_scard_list_readers(&api, buf, sizeof(buf), readers, _MAX_READER_NUM);
+	if (reader_num == 0) {
+		fprintf(stderr, "no readers\n");
+		return 1;
+	}
+
+	if (child != NULL) {
+		config.op = ops[0];
+		config.processes = 1;
+		config.threads = threads[0];
+		config.devices = (devices[0] > reader_num) ? reader_num : devices[0];
+		config.size = sizes[0];
+
+		return _child_main(&api, &config, readers, child, argc, argv);
+	}
+
+	for (uint32_t o = 0; o < ops_num; o++)
+	for (uint32_t p = 0; p < processes_num; p++)
+	for (uint32_t t = 0; t < threads_num; t++)
+	for (uint32_t d = 0; d < devices_num; d++)
+	for (uint32_t s = 0; s < sizes_num; s++)
+	{
+		struct _result *result;
+		bool r;
+
+		config.op = ops[o];
+		config.processes = processes[p];
+		config.threads = threads[t];
+		config.devices = devices[d];
+		config.size = sizes[s];
+
+		if (config.processes == 0 || config.processes > _MAX_PROCESS_NUM || config.threads == 0 || config.threads > _MAX_THREAD_NUM) {
+			fprintf(stderr, "--processes must be 1..%u and --threads 1..%u\n", _MAX_PROCESS_NUM, _MAX_THREAD_NUM);
+			return 1;
+		}
+
+		if (config.devices == 0 || config.devices > reader_num) {
+			fprintf(stderr, "skipped: %u devices (%u available)\n", config.devices, reader_num);
+			continue;
+		}
+
+		// sizes only matter for SCardTransmit
+		if (config.op != _OP_TRANSMIT && s != 0)
+			continue;
+
+		result = malloc(sizeof(struct _result));
+		if (result == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		if (config.processes == 1) {
+			r = _run_threads(&api, &config, readers, NULL, result);
+		}
+		else {
+			r = _run_processes(&config, module, result);
+		}
+
+		if (r == true) {
+			_print_json(&config, result);
+
+			if (baseline != NULL && _compare_baseline(baseline, &config, result, threshold) == true)
+				regressed = true;
+		}
+
+		free(result);
+	}
+
+#ifdef _WIN32
+	FreeLibrary(api.module);
+#else
+	dlclose(api.module);
+#endif
+
+	return (regressed == true) ? 2 : 0;
+}
+
+#else
+
+int bench_e2e_main(int argc, char *argv[])
+{
+	fprintf(stderr, "e2e runs on Windows and Linux\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,160 @@
+// bench_fault.c
+//
+// injects faults into the device control requests made by itecard.c, and measures
+// how often and how fast the T=1 error paths (R-block, RESYNCH, init) recover from
+// each class of them. the device is usually a simulated one:
+//
+//   --device "\\?\itecard#sim#1#C:\CardReader_ITE\sim_bcas.ini"
+//
+// a fault is recovered from when a transmit succeeds after it. it is recovered from
+// in the call when the transmit it was injected into succeeded.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/itecard.h"
+#include "../CardReader_ITE/itefault.h"
+#include "bench.h"
+
+struct _class_result
+{
+	uint64_t recovered;
+	uint64_t in_call;
+	uint64_t failed;		// transmits which failed before the recovery
+	struct bench_hist time;
+};
+
+int bench_fault_main(int argc, char *argv[])
+{
+	const char *device = bench_get_arg_str(argc, argv, "device", NULL);
+	uint64_t transmits = bench_get_arg_uint(argc, argv, "transmits", 2000);
+	uint32_t size = (uint32_t)bench_get_arg_uint(argc, argv, "size", 5);
+	struct itefault_config config;
+	wchar_t path[1024];
+	itefault fault;
+	struct itecard_shared_readerinfo reader;
+	struct itecard_handle h;
+	struct _class_result *res;
+	struct bench_hist *all;
+	uint64_t errors = 0;
+	uint8_t cmd[260], recv[260];
+	uint32_t cmd_len;
+
+	if (device == NULL) {
+		fprintf(stderr, "--device is required\n");
+		return 1;
+	}
+
+	if (mbstowcs(path, device, sizeof(path) / sizeof(wchar_t)) >= sizeof(path) / sizeof(wchar_t)) {
+		fprintf(stderr, "--device is too long\n");
+		return 1;
+	}
+
+	if (size < 5 || size > sizeof(cmd)) {
+		fprintf(stderr, "--size must be 5..%u\n", (uint32_t)sizeof(cmd));
+		return 1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	for (uint32_t i = 0; i < ITEFAULT_CLASS_NUM; i++)
+		config.probability[i] = (uint32_t)bench_get_arg_uint(argc, argv, itefault_class_name[i], 1000);
+	config.removal_time = (uint32_t)bench_get_arg_uint(argc, argv, "removal-time", 500);
+	config.mute_time = (uint32_t)bench_get_arg_uint(argc, argv, "mute-time", 200);
+	config.seed = (uint32_t)bench_get_arg_uint(argc, argv, "seed", 1);
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	res = calloc(ITEFAULT_CLASS_NUM, sizeof(struct _class_result));
+	all = malloc(sizeof(struct bench_hist));
+	if (res == NULL || all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	bench_hist_init(all);
+
+	// the same APDU as the e2e benchmark
+	cmd[0] = 0x90;
+	cmd[1] = 0x30;
+	cmd[2] = 0x00;
+	cmd[3] = 0x02;
+	if (size == 5) {
+		cmd[4] = 0x00;
+		cmd_len = 5;
+	}
+	else {
+		cmd_len = size;
+		cmd[4] = (uint8_t)(cmd_len - 5);
+		for (uint32_t i = 5; i < cmd_len; i++)
+			cmd[i] = (uint8_t)i;
+	}
+
+	memset(&reader, 0, sizeof(reader));
+	card_clear(&reader.card);
+	memset(&h, 0, sizeof(h));
+
+	itefault_init(&fault, &config);
+	h.ite.fault = &fault;
+
+	if (itecard_open(&h, path, &reader, ITECARD_PROTOCOL_T1, false, true) != ITECARD_S_OK) {
+		fprintf(stderr, "failed to open %s\n", device);
+		return 1;
+	}
+
+	for (uint64_t n = 0; n < transmits; n++)
+	{
+		struct itefault_recovery recovery;
+		uint32_t recv_len = sizeof(recv);
+		itecard_status_t ret;
+		uint64_t t;
+
+		t = bench_get_time_ns();
+		ret = itecard_transmit(&h, ITECARD_PROTOCOL_T1, cmd, cmd_len, recv, &recv_len);
+		bench_hist_add(all, bench_get_time_ns() - t);
+
+		if (ret != ITECARD_S_OK)
+			errors++;
+
+		if (itefault_tx_end(&fault, (ret == ITECARD_S_OK) ? true : false, &recovery) == true) {
+			struct _class_result *r = &res[recovery.cls];
+
+			r->recovered++;
+			if (recovery.failed == 0)
+				r->in_call++;
+			r->failed += recovery.failed;
+			bench_hist_add(&r->time, recovery.time * 1000);
+		}
+	}
+
+	itecard_close(&h, false, true, true);
+
+	printf("{\"transmits\":%llu,\"errors\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		(unsigned long long)transmits, (unsigned long long)errors,
+		bench_hist_percentile(all, 0.5) / 1000.0, bench_hist_percentile(all, 0.99) / 1000.0, all->max / 1000.0);
+
+	for (uint32_t i = 0; i < ITEFAULT_CLASS_NUM; i++)
+	{
+		const struct _class_result *r = &res[i];
+		uint64_t injected = fault.injected[i];
+
+		printf("{\"fault\":\"%s\",\"probability\":%u,\"injected\":%llu,\"recovered\":%llu,\"unrecovered\":%llu,\"in_call\":%llu,\"success_rate\":%.4f,\"failed_transmits\":%llu,"
+			"\"recovery_p50_us\":%.1f,\"recovery_p99_us\":%.1f,\"recovery_max_us\":%.1f}\n",
+			itefault_class_name[i], config.probability[i], (unsigned long long)injected,
+			(unsigned long long)r->recovered, (unsigned long long)(injected - r->recovered), (unsigned long long)r->in_call,
+			(injected != 0) ? (double)r->in_call / injected : 0.0, (unsigned long long)r->failed,
+			bench_hist_percentile(&r->time, 0.5) / 1000.0, bench_hist_percentile(&r->time, 0.99) / 1000.0, r->time.max / 1000.0);
+	}
+
+	free(all);
+	free(res);
+
+	return 0;
+}
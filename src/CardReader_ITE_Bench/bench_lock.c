@@ -0,0 +1,265 @@
+// bench_lock.c
+//
+// several processes contending on the lock of a device database (devdb_lock). each
+// holds it for --hold microseconds, and then works outside of it for --work
+// microseconds, with a busy loop. the throughput, the wait for the lock and the
+// context switches are measured, along with the statistics devdb keeps of its lock.
+//
+// a database of its own is created for each run. it runs on Linux, where devdb is
+// POSIX shared memory and futexes.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../CardReader_ITE/devdb.h"
+
+#define _MAX_PROCESS_NUM	64
+
+struct _process_result
+{
+	uint64_t ops;
+	struct bench_hist hist;		// of the waits for the lock
+};
+
+// shared with the child processes
+struct _shared
+{
+	uint32_t start;
+	uint32_t ready;
+	uint64_t end;			// bench_get_time_ns
+	struct _process_result result[_MAX_PROCESS_NUM];
+};
+
+struct _config
+{
+	uint32_t processes;
+	uint64_t duration;		// nanoseconds
+	uint64_t hold;			// nanoseconds
+	uint64_t work;			// nanoseconds
+	wchar_t name[64];
+};
+
+static void _futex_wait(uint32_t *const addr, const uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t *const addr, const int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+static void _spin(const uint64_t ns)
+{
+	uint64_t end = bench_get_time_ns() + ns;
+
+	while (bench_get_time_ns() < end);
+}
+
+static void _process_main(struct _shared *const s, const struct _config *const c, const uint32_t index)
+{
+	struct _process_result *res = &s->result[index];
+	devdb db;
+
+	if (devdb_open(&db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+		fprintf(stderr, "devdb_open failed\n");
+		_exit(1);
+	}
+
+	__atomic_add_fetch(&s->ready, 1, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&s->start, __ATOMIC_ACQUIRE) == 0)
+		_futex_wait(&s->start, 0);
+
+	while (1)
+	{
+		uint64_t t0 = bench_get_time_ns();
+
+		if (t0 >= s->end)
+			break;
+
+		devdb_lock(&db);
+		bench_hist_add(&res->hist, bench_get_time_ns() - t0);
+		_spin(c->hold);
+		devdb_unlock(&db);
+
+		res->ops++;
+
+		_spin(c->work);
+	}
+
+	devdb_close(&db);
+
+	_exit(0);
+}
+
+static bool _run(struct _shared *const s, const struct _config *const c)
+{
+	pid_t pid[_MAX_PROCESS_NUM];
+	struct rusage ru_child;
+	struct bench_hist *all;
+	struct devdb_lock_stats ls;
+	uint64_t ops = 0, start, elapsed;
+	uint32_t generation, forked = 0;
+	devdb db;
+	bool r = false;
+
+	memset(s, 0, sizeof(struct _shared));
+
+	all = malloc(sizeof(struct bench_hist));
+	if (all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return false;
+	}
+
+	bench_hist_init(all);
+
+	// created by this process, and kept open for the statistics
+	if (devdb_open(&db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+		fprintf(stderr, "devdb_open failed\n");
+		free(all);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < c->processes; i++)
+		bench_hist_init(&s->result[i].hist);
+
+	for (uint32_t i = 0; i < c->processes; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0)
+			_process_main(s, c, i);
+		if (pid[i] < 0) {
+			fprintf(stderr, "fork failed\n");
+			goto end;
+		}
+		forked++;
+	}
+
+	while (__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE) < c->processes)
+		usleep(1000);
+
+	// the statistics of the opens are left out
+	devdb_lock(&db);
+	memset(&db.info->stats, 0, sizeof(db.info->stats));
+	devdb_unlock(&db);
+
+	start = bench_get_time_ns();
+	s->end = start + c->duration;
+	__atomic_store_n(&s->start, 1, __ATOMIC_RELEASE);
+	_futex_wake(&s->start, INT_MAX);
+
+	for (uint32_t i = 0; i < c->processes; i++)
+		waitpid(pid[i], NULL, 0);
+
+	elapsed = bench_get_time_ns() - start;
+
+	getrusage(RUSAGE_CHILDREN, &ru_child);
+	devdb_get_lock_stats(&db, &ls);
+
+	for (uint32_t i = 0; i < c->processes; i++) {
+		ops += s->result[i].ops;
+		bench_hist_merge(all, &s->result[i].hist);
+	}
+
+	// the children of the earlier runs are counted too
+	static uint64_t child_csw = 0;
+	uint64_t csw = (uint64_t)(ru_child.ru_nvcsw + ru_child.ru_nivcsw) - child_csw;
+
+	child_csw += csw;
+
+	printf("{\"processes\":%u,\"hold_us\":%.1f,\"work_us\":%.1f,\"ops\":%llu,\"ops_per_sec\":%.1f,\"wait_p50_us\":%.1f,\"wait_p99_us\":%.1f,\"wait_max_us\":%.1f,\"csw_per_op\":%.2f,"
+		"\"acquire\":%u,\"contended\":%u,\"sleep\":%u,\"recover\":%u,\"lock_wait_avg_us\":%.1f,\"lock_wait_max_us\":%u}\n",
+		c->processes, c->hold / 1000.0, c->work / 1000.0, (unsigned long long)ops, (double)ops * 1000000000.0 / elapsed,
+		bench_hist_percentile(all, 0.5) / 1000.0, bench_hist_percentile(all, 0.99) / 1000.0, all->max / 1000.0,
+		(ops != 0) ? (double)csw / ops : 0.0,
+		ls.acquire, ls.contended, ls.sleep, ls.recover, (ls.contended != 0) ? (double)ls.wait_total / ls.contended : 0.0, ls.wait_max);
+
+	r = true;
+
+end:
+	// the children forked before a failure see the run as already over
+	if (r == false) {
+		__atomic_store_n(&s->start, 1, __ATOMIC_RELEASE);
+		_futex_wake(&s->start, INT_MAX);
+
+		for (uint32_t i = 0; i < forked; i++)
+			waitpid(pid[i], NULL, 0);
+	}
+
+	generation = db.info->generation;
+	devdb_close(&db);
+	bench_devdb_remove(c->name, generation);
+	free(all);
+
+	return r;
+}
+
+int bench_lock_main(int argc, char *argv[])
+{
+	const char *list = bench_get_arg_str(argc, argv, "processes", "1,2,4,8");
+	struct _config c;
+	struct _shared *s;
+	int r = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.duration = bench_get_arg_uint(argc, argv, "duration", 2000) * 1000000;
+	c.hold = bench_get_arg_uint(argc, argv, "hold", 5) * 1000;
+	c.work = bench_get_arg_uint(argc, argv, "work", 20) * 1000;
+
+	s = mmap(NULL, sizeof(struct _shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		return 1;
+	}
+
+	while (*list != '\0')
+	{
+		char *next;
+
+		c.processes = (uint32_t)strtoul(list, &next, 10);
+		if (next == list || c.processes == 0 || c.processes > _MAX_PROCESS_NUM) {
+			fprintf(stderr, "--processes must be a list of 1..%u\n", _MAX_PROCESS_NUM);
+			r = 1;
+			break;
+		}
+
+		swprintf(c.name, sizeof(c.name) / sizeof(wchar_t), L"bench_lock_%u_%u", (uint32_t)getpid(), c.processes);
+
+		if (_run(s, &c) == false) {
+			r = 1;
+			break;
+		}
+
+		list = (*next == ',') ? next + 1 : next;
+	}
+
+	munmap(s, sizeof(struct _shared));
+
+	return r;
+}
+
+#else
+
+int bench_lock_main(int argc, char *argv[])
+{
+	fprintf(stderr, "lock runs on Linux, over POSIX shared memory and futexes\n");
+	return 1;
+}
+
+#endif
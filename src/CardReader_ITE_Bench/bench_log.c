@@ -0,0 +1,212 @@
+// bench_log.c
+//
+// cost of a debug message on the calling thread: formatted and written there
+// (the old dbg_printf) against a record put into the ring of the thread.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../CardReader_ITE/logring.h"
+#include "bench.h"
+
+#ifdef _WIN32
+#define _DEFAULT_OUTPUT	"NUL"
+#else
+#define _DEFAULT_OUTPUT	"/dev/null"
+#endif
+
+#define _MAX_THREAD_NUM	64
+
+struct _producer {
+	uint64_t iterations;
+	uint64_t ns;
+	uint32_t id;
+	FILE *out;
+	struct logring *ring;
+};
+
+static volatile int _consumer_stop;
+
+// about what the T=1 transport logs for every block
+static void _log_sync(FILE *const out, const char *const format, ...)
+{
+	va_list args;
+	char buf[0x400];
+	int c;
+
+	va_start(args, format);
+	c = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if (c > 0) {
+		fwrite(buf, 1, (size_t)c, out);
+	}
+}
+
+static void _log_ring(struct _producer *const p, const char *const format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	logring_write(p->ring, false, format, args, p->id, bench_get_time_ns());
+	va_end(args);
+}
+
+static void _producer_sync(void *arg)
+{
+	struct _producer *p = arg;
+	uint64_t t = bench_get_time_ns();
+
+	for (uint64_t i = 0; i < p->iterations; i++) {
+		_log_sync(p->out, "_itecard_t1_transmit: %s: NAD %02X PCB %02X LEN %u (%u)\n", "I-block", 0, (uint32_t)(i & 0x40), (uint32_t)(i & 0xff), p->id);
+	}
+
+	p->ns = bench_get_time_ns() - t;
+}
+
+static void _producer_ring(void *arg)
+{
+	struct _producer *p = arg;
+	uint64_t t = bench_get_time_ns();
+
+	for (uint64_t i = 0; i < p->iterations; i++) {
+		_log_ring(p, "_itecard_t1_transmit: %s: NAD %02X PCB %02X LEN %u (%u)\n", "I-block", 0, (uint32_t)(i & 0x40), (uint32_t)(i & 0xff), p->id);
+	}
+
+	p->ns = bench_get_time_ns() - t;
+}
+
+struct _consumer {
+	struct _producer *producer;
+	uint32_t num;
+	FILE *out;
+	uint64_t records;
+};
+
+static void _consumer(void *arg)
+{
+	struct _consumer *c = arg;
+	bool stop = false;
+
+	while (1)
+	{
+		for (uint32_t i = 0; i < c->num; i++)
+		{
+			struct logring *ring = c->producer[i].ring;
+			const struct logring_record *rec;
+			char buf[0x400];
+
+			while ((rec = logring_peek(ring)) != NULL) {
+				size_t n = logring_format(rec, buf, sizeof(buf));
+
+				fwrite(buf, 1, n, c->out);
+				logring_pop(ring, rec);
+
+				c->records++;
+			}
+		}
+
+		if (stop == true)
+			break;
+
+		// one more pass after the producers have finished
+		stop = (_consumer_stop != 0) ? true : false;
+	}
+}
+
+static void _print(const char *const name, const struct _producer *const p, const uint32_t num)
+{
+	uint64_t ops = 0, ns = 0, drop = 0;
+
+	for (uint32_t i = 0; i < num; i++) {
+		ops += p[i].iterations;
+		ns += p[i].ns;
+		drop += (p[i].ring != NULL) ? p[i].ring->drop : 0;
+	}
+
+	bench_print_result(name, ops, ns);
+
+	if (p[0].ring != NULL) {
+		printf("%-32s %12llu dropped\n", "", (unsigned long long)drop);
+	}
+}
+
+int bench_log_main(int argc, char *argv[])
+{
+	uint64_t iterations = bench_get_arg_uint(argc, argv, "iterations", 1000000);
+	uint32_t threads = (uint32_t)bench_get_arg_uint(argc, argv, "threads", 1);
+	const char *output = bench_get_arg_str(argc, argv, "output", _DEFAULT_OUTPUT);
+	struct _producer p[_MAX_THREAD_NUM];
+	bench_thread th[_MAX_THREAD_NUM];
+	FILE *out;
+
+	if (threads == 0 || threads > _MAX_THREAD_NUM) {
+		fprintf(stderr, "--threads must be 1..%u\n", _MAX_THREAD_NUM);
+		return 1;
+	}
+
+	out = fopen(output, "wb");
+	if (out == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	// every message is written by itself, as WriteFile does
+	setvbuf(out, NULL, _IONBF, 0);
+
+	// formatted and written on the calling thread
+
+	for (uint32_t i = 0; i < threads; i++) {
+		p[i].iterations = iterations;
+		p[i].id = i;
+		p[i].out = out;
+		p[i].ring = NULL;
+	}
+
+	for (uint32_t i = 0; i < threads; i++)
+		th[i] = bench_thread_create(_producer_sync, &p[i]);
+	for (uint32_t i = 0; i < threads; i++)
+		bench_thread_join(th[i]);
+
+	_print("log: synchronous", p, threads);
+
+	// put into the ring, formatted and written by the consumer
+
+	for (uint32_t i = 0; i < threads; i++) {
+		p[i].ring = malloc(sizeof(struct logring));
+		if (p[i].ring == NULL) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		logring_init(p[i].ring);
+	}
+
+	struct _consumer c = { p, threads, out, 0 };
+	bench_thread consumer;
+
+	_consumer_stop = 0;
+	consumer = bench_thread_create(_consumer, &c);
+
+	for (uint32_t i = 0; i < threads; i++)
+		th[i] = bench_thread_create(_producer_ring, &p[i]);
+	for (uint32_t i = 0; i < threads; i++)
+		bench_thread_join(th[i]);
+
+	_consumer_stop = 1;
+	bench_thread_join(consumer);
+
+	_print("log: ring", p, threads);
+	printf("%-32s %12llu written\n", "", (unsigned long long)c.records);
+
+	for (uint32_t i = 0; i < threads; i++)
+		free(p[i].ring);
+
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,296 @@
+// bench_loop.c
+//
+// compares two ways of waiting for the cards of many readers, with an exchange which
+// sleeps for the block guard time and then polls every --poll milliseconds until the
+// response is ready, --response milliseconds after the command:
+//
+//   direct: the thread of every reader sleeps between its polls, as itecard.c does
+//   loop:   the threads of the readers submit their exchanges to the event loop of
+//           iteloop.c (EventLoop in the INI file), which waits for all of them
+//
+// wakeups_per_op counts the returns from a sleep or a wait, of the threads of the
+// readers and of the loop. csw_per_op counts the context switches of the process,
+// and is only measured outside of Windows.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#include "bench.h"
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/iteloop.h"
+
+typedef enum {
+	_MODEL_DIRECT,
+	_MODEL_LOOP,
+	_MODEL_NUM
+} _model_t;
+
+static const char *const _model_name[_MODEL_NUM] = { "direct", "loop" };
+
+struct _shared
+{
+	_model_t model;
+	iteloop *loop;
+	uint64_t duration;		// nanoseconds
+	uint32_t bgt;			// milliseconds
+	uint32_t poll;
+	uint64_t response;		// nanoseconds
+};
+
+struct _reader
+{
+	struct _shared *shared;
+	uint32_t index;
+	uint64_t ops;
+	uint64_t polls;
+	uint64_t wakeups;
+	struct bench_hist hist;
+#ifdef _WIN32
+	HANDLE done;
+#endif
+};
+
+static void _sleep(const uint32_t milliseconds)
+{
+#ifdef _WIN32
+	Sleep(milliseconds);
+#else
+	usleep(milliseconds * 1000);
+#endif
+}
+
+static bool _get_csw(uint64_t *const csw)
+{
+#ifdef _WIN32
+	return false;
+#else
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	*csw = (uint64_t)(ru.ru_nvcsw + ru.ru_nivcsw);
+
+	return true;
+#endif
+}
+
+static void _wait(struct _reader *const r, const uint32_t milliseconds)
+{
+	if (r->shared->model == _MODEL_LOOP) {
+		iteloop_sleep(r->shared->loop, milliseconds);
+	}
+	else {
+		_sleep(milliseconds);
+		r->wakeups++;
+	}
+}
+
+// the exchange, on the thread of the reader or on the fiber of its channel
+static int32_t _exchange(struct _reader *const r)
+{
+	uint64_t ready = bench_get_time_ns() + r->shared->response;
+
+	_wait(r, r->shared->bgt);
+
+	while (bench_get_time_ns() < ready) {
+		r->polls++;
+		_wait(r, r->shared->poll);
+	}
+
+	return 0;
+}
+
+static bool _try_lock(void *ctx, const uint32_t channel)
+{
+	return true;
+}
+
+static void _unlock(void *ctx, const uint32_t channel)
+{
+}
+
+static int32_t _execute(void *ctx, void *prm)
+{
+	return _exchange(prm);
+}
+
+static const struct iteloop_ops _ops = { _try_lock, _unlock, _execute };
+
+static void _reader_proc(void *arg)
+{
+	struct _reader *r = arg;
+	struct _shared *s = r->shared;
+	uint64_t end = bench_get_time_ns() + s->duration;
+
+	while (1)
+	{
+		uint64_t t0 = bench_get_time_ns();
+
+		if (t0 >= end)
+			break;
+
+		if (s->model == _MODEL_LOOP) {
+			struct iteloop_request req;
+
+			req.channel = r->index;
+			req.prm = r;
+#ifdef _WIN32
+			req.done = r->done;
+#endif
+			iteloop_submit(s->loop, &req);
+
+			// woken up once by the loop
+			r->wakeups++;
+		}
+		else {
+			_exchange(r);
+		}
+
+		bench_hist_add(&r->hist, bench_get_time_ns() - t0);
+		r->ops++;
+	}
+}
+
+static bool _run(struct _shared *const s, struct _reader *const readers, const uint32_t reader_num)
+{
+	bench_thread th[ITELOOP_MAX_CHANNEL_NUM];
+	struct iteloop_stats ls;
+	struct bench_hist *all;
+	uint64_t ops = 0, polls = 0, wakeups = 0, csw0 = 0, csw1 = 0;
+	bool csw;
+
+	all = malloc(sizeof(struct bench_hist));
+	if (all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return false;
+	}
+
+	bench_hist_init(all);
+	memset(&ls, 0, sizeof(ls));
+
+	for (uint32_t i = 0; i < reader_num; i++) {
+		readers[i].ops = 0;
+		readers[i].polls = 0;
+		readers[i].wakeups = 0;
+		bench_hist_init(&readers[i].hist);
+	}
+
+	if (s->model == _MODEL_LOOP) {
+		s->loop = iteloop_create(&_ops, s);
+		if (s->loop == NULL) {
+			fprintf(stderr, "iteloop_create failed\n");
+			free(all);
+			return false;
+		}
+	}
+
+	csw = _get_csw(&csw0);
+
+	for (uint32_t i = 0; i < reader_num; i++)
+		th[i] = bench_thread_create(_reader_proc, &readers[i]);
+
+	for (uint32_t i = 0; i < reader_num; i++)
+	{
+		bench_thread_join(th[i]);
+
+		ops += readers[i].ops;
+		polls += readers[i].polls;
+		wakeups += readers[i].wakeups;
+		bench_hist_merge(all, &readers[i].hist);
+	}
+
+	if (csw == true)
+		_get_csw(&csw1);
+
+	if (s->loop != NULL) {
+		// every request has been executed, so the loop is waiting
+		iteloop_get_stats(s->loop, &ls);
+		iteloop_destroy(s->loop);
+		s->loop = NULL;
+
+		wakeups += ls.wakeup;
+	}
+
+	printf("{\"model\":\"%s\",\"readers\":%u,\"bgt_ms\":%u,\"poll_ms\":%u,\"response_ms\":%.1f,\"ops\":%llu,\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"polls_per_op\":%.2f,\"wakeups_per_op\":%.2f,",
+		_model_name[s->model], reader_num, s->bgt, s->poll, s->response / 1000000.0, (unsigned long long)ops,
+		(double)ops * 1000000000.0 / s->duration,
+		bench_hist_percentile(all, 0.5) / 1000.0, bench_hist_percentile(all, 0.99) / 1000.0, all->max / 1000.0,
+		(ops != 0) ? (double)polls / ops : 0.0, (ops != 0) ? (double)wakeups / ops : 0.0);
+
+	if (csw == true)
+		printf("\"csw_per_op\":%.2f}\n", (ops != 0) ? (double)(csw1 - csw0) / ops : 0.0);
+	else
+		printf("\"csw_per_op\":null}\n");
+
+	free(all);
+
+	return true;
+}
+
+int bench_loop_main(int argc, char *argv[])
+{
+	uint32_t reader_num = (uint32_t)bench_get_arg_uint(argc, argv, "readers", 16);
+	struct _shared s;
+	struct _reader *readers;
+	int r = 0;
+
+	if (reader_num == 0 || reader_num > ITELOOP_MAX_CHANNEL_NUM) {
+		fprintf(stderr, "--readers must be 1..%u\n", ITELOOP_MAX_CHANNEL_NUM);
+		return 1;
+	}
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.duration = bench_get_arg_uint(argc, argv, "duration", 3000) * 1000000;
+	s.bgt = (uint32_t)bench_get_arg_uint(argc, argv, "bgt", 1);
+	s.poll = (uint32_t)bench_get_arg_uint(argc, argv, "poll", 1);
+	s.response = bench_get_arg_uint(argc, argv, "response", 5) * 1000000;
+
+	readers = calloc(reader_num, sizeof(struct _reader));
+	if (readers == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < reader_num; i++) {
+		readers[i].shared = &s;
+		readers[i].index = i;
+#ifdef _WIN32
+		readers[i].done = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (readers[i].done == NULL) {
+			fprintf(stderr, "CreateEventW failed\n");
+			return 1;
+		}
+#endif
+	}
+
+	for (uint32_t m = 0; m < _MODEL_NUM; m++) {
+		s.model = (_model_t)m;
+		if (_run(&s, readers, reader_num) == false) {
+			r = 1;
+			break;
+		}
+	}
+
+#ifdef _WIN32
+	for (uint32_t i = 0; i < reader_num; i++)
+		CloseHandle(readers[i].done);
+#endif
+
+	free(readers);
+
+	return r;
+}
@@ -0,0 +1,94 @@
+// bench_memory.c
+//
+// compares the allocation patterns of the module on the heap, a pool and an arena.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../CardReader_ITE/memory.h"
+#include "bench.h"
+
+#define _HANDLE_SIZE	160		// about the size of struct _handle
+#define _DETAIL_SIZE	1048	// SP_DEVICE_INTERFACE_DETAIL_DATA_W with 512 characters
+
+static void _print_stats(void)
+{
+	struct mem_stats st;
+
+	memGetStats(&st);
+	printf("alloc: %llu, free: %llu, pool alloc: %llu, pool free: %llu, pool grow: %llu, arena alloc: %llu, arena chunk: %llu\n",
+		(unsigned long long)st.alloc, (unsigned long long)st.free,
+		(unsigned long long)st.pool_alloc, (unsigned long long)st.pool_free, (unsigned long long)st.pool_grow,
+		(unsigned long long)st.arena_alloc, (unsigned long long)st.arena_chunk);
+}
+
+int bench_memory_main(int argc, char *argv[])
+{
+	uint64_t iterations = bench_get_arg_uint(argc, argv, "iterations", 1000000);
+	uint32_t objects = (uint32_t)bench_get_arg_uint(argc, argv, "objects", 16);
+	void *p[256];
+	uint64_t t;
+
+	if (objects == 0 || objects > 256) {
+		fprintf(stderr, "--objects must be 1..256\n");
+		return 1;
+	}
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	// connect/disconnect: handles are allocated and freed in batches
+
+	t = bench_get_time_ns();
+	for (uint64_t i = 0; i < iterations; i += objects) {
+		for (uint32_t j = 0; j < objects; j++)
+			p[j] = memAlloc(_HANDLE_SIZE);
+		for (uint32_t j = 0; j < objects; j++)
+			memFree(p[j]);
+	}
+	bench_print_result("handle: memAlloc/memFree", iterations, bench_get_time_ns() - t);
+
+	mem_pool pool = memPoolCreate(_HANDLE_SIZE, 8);
+
+	t = bench_get_time_ns();
+	for (uint64_t i = 0; i < iterations; i += objects) {
+		for (uint32_t j = 0; j < objects; j++)
+			p[j] = memPoolAlloc(pool);
+		for (uint32_t j = 0; j < objects; j++)
+			memPoolFree(pool, p[j]);
+	}
+	bench_print_result("handle: memPoolAlloc/memPoolFree", iterations, bench_get_time_ns() - t);
+
+	memPoolDestroy(pool);
+
+	// device enumeration: one buffer per interface, all released at the end
+
+	t = bench_get_time_ns();
+	for (uint64_t i = 0; i < iterations; i += objects) {
+		for (uint32_t j = 0; j < objects; j++)
+			p[j] = memAlloc(_DETAIL_SIZE);
+		for (uint32_t j = 0; j < objects; j++)
+			memFree(p[j]);
+	}
+	bench_print_result("enum: memAlloc/memFree", iterations, bench_get_time_ns() - t);
+
+	t = bench_get_time_ns();
+	for (uint64_t i = 0; i < iterations; i += objects) {
+		mem_arena arena = memArenaCreate(0x4000);
+
+		for (uint32_t j = 0; j < objects; j++)
+			p[j] = memArenaAlloc(arena, _DETAIL_SIZE);
+		memArenaDestroy(arena);
+	}
+	bench_print_result("enum: memArenaAlloc", iterations, bench_get_time_ns() - t);
+
+	_print_stats();
+
+	memDeinit();
+
+	return 0;
+}
@@ -0,0 +1,416 @@
+// bench_micro.c
+//
+// the routines which run on every call or connect: ATR parsing, T=1 blocks, the
+// handle list, the string functions and the formatting of the reader names.
+//
+// each case is run with more iterations until it takes --min-time milliseconds,
+// --repetitions times, and the median is reported. with --history, the results
+// are compared with the last ones in the file and appended to it as JSON lines;
+// the exit code is 2 if a case got slower by more than --threshold percent.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../CardReader_ITE/card.h"
+#include "../CardReader_ITE/handle.h"
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/string.h"
+#include "bench.h"
+
+#define _MAX_REPETITION_NUM	32
+#define _MAX_HANDLE_NUM		1024
+
+struct _case
+{
+	const char *name;
+	void (*fn)(const uint64_t iterations);
+};
+
+static volatile uint32_t _sink;
+
+// ATR of a B-CAS card
+static const uint8_t _bcas_atr[] = { 0x3B, 0xF0, 0x12, 0x00, 0xFF, 0x91, 0x81, 0xB1, 0x7C, 0x45, 0x1F, 0x03, 0x99 };
+
+static const wchar_t _reader_name_W[] = L"PLEX PX-W3U4 Card Reader for the benchmark of a long reader name";
+static const char _reader_name_A[] = "PLEX PX-W3U4 Card Reader for the benchmark of a long reader name";
+static const wchar_t _interface_path[] = L"\\\\?\\usb#vid_0511&pid_083f#000000000000001#{fbf6f530-07b9-11d2-a71e-0000f8004788}\\{a1b2c3d4-e5f6-4789-abcd-ef0123456789}";
+
+static void _card_parse_atr(const uint64_t iterations)
+{
+	struct card_info card;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		card_init(&card);
+		memcpy(card.atr, _bcas_atr, sizeof(_bcas_atr));
+		card.atr_len = sizeof(_bcas_atr);
+		_sink += card_parseATR(&card);
+	}
+}
+
+static void _card_make_iblock(const uint64_t iterations)
+{
+	struct card_info card;
+	uint8_t inf[254], block[259];
+
+	card_init(&card);
+	for (uint32_t i = 0; i < sizeof(inf); i++)
+		inf[i] = (uint8_t)i;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		card.T1.seq = (uint8_t)i;
+		_sink += card_T1MakeBlock(&card, block, 0x00, inf, sizeof(inf));
+	}
+}
+
+static void _card_make_sblock(const uint64_t iterations)
+{
+	struct card_info card;
+	uint8_t ifsd = 254, block[259];
+
+	card_init(&card);
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += card_T1MakeBlock(&card, block, 0xC1, &ifsd, 1);
+	}
+}
+
+static void _card_check_edc(const uint64_t iterations)
+{
+	struct card_info card;
+	uint8_t inf[254], block[259];
+
+	card_init(&card);
+	for (uint32_t i = 0; i < sizeof(inf); i++)
+		inf[i] = (uint8_t)i;
+	card_T1MakeBlock(&card, block, 0x00, inf, sizeof(inf));
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += card_T1CheckBlockEDC(&card, block, 4 + sizeof(inf));
+	}
+}
+
+static uintptr_t _handle_release(void *handle, void *prm)
+{
+	return 0;
+}
+
+struct _handle_arg
+{
+	handle_list list;
+	uint32_t num;
+	uintptr_t last;		// the only free slot
+};
+
+static uint32_t _handle_num = 32;
+
+static bool _handle_fill(struct _handle_arg *const h)
+{
+	h->num = _handle_num;
+
+	if (handle_list_init(&h->list, 0x100, h->num, _handle_release) == false)
+		return false;
+
+	// every slot but the last one is taken, which is the slowest case for put
+	for (uint32_t i = 0; i < h->num; i++) {
+		uintptr_t v;
+
+		handle_list_put(h->list, (void *)(uintptr_t)(i + 1), &v);
+		h->last = v;
+	}
+
+	handle_list_release(h->list, h->last, false, NULL, NULL);
+
+	return true;
+}
+
+static void _handle_put_release(const uint64_t iterations)
+{
+	struct _handle_arg h;
+
+	if (_handle_fill(&h) == false)
+		return;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		uintptr_t v;
+
+		handle_list_put(h.list, &h, &v);
+		handle_list_release(h.list, v, true, NULL, NULL);
+	}
+
+	handle_list_deinit(h.list);
+}
+
+static void _handle_get(const uint64_t iterations)
+{
+	struct _handle_arg h;
+
+	if (_handle_fill(&h) == false)
+		return;
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		void *p;
+
+		_sink += handle_list_get(h.list, 0x100 + (uintptr_t)(i % (h.num - 1)), &p);
+	}
+
+	handle_list_deinit(h.list);
+}
+
+static void _wstr_compare(const uint64_t iterations)
+{
+	wchar_t name[128];
+
+	wstrCopy(name, _reader_name_W);
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += wstrCompare(name, _reader_name_W);
+	}
+}
+
+static void _wstr_compare_ex(const uint64_t iterations)
+{
+	// UniqueID
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += wstrCompareEx(L"000000000000001", L"**************1", L'*');
+	}
+}
+
+static void _wstr_match(const uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += wstrMatch(_reader_name_W, L"PLEX*Card Reader*long*", L'*');
+	}
+}
+
+static void _wstr_len(const uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += wstrLen(_interface_path);
+	}
+}
+
+static void _wstr_get_wchar_ptr(const uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += (uint32_t)(uintptr_t)wstrGetWCharPtr(_interface_path, L'{');
+	}
+}
+
+static void _wstr_to_uint32(const uint64_t iterations)
+{
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint32_t v = 0;
+
+		wstrToUInt32(L"4294967295", &v);
+		_sink += v;
+	}
+}
+
+static void _wstr_from_uint32(const uint64_t iterations)
+{
+	wchar_t buf[12];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		_sink += wstrFromUInt32(buf, 11, (uint32_t)i, 10);
+	}
+}
+
+// as _enum_readers_callback_A/W in winscard.c, for 8 devices
+static void _reader_names_A(const uint64_t iterations)
+{
+	const uint32_t len = sizeof(_reader_name_A) - 1;
+	char list[2048];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint32_t list_len = 0;
+
+		for (uint32_t id = 0; id < 8; id++) {
+			char name[256];
+			uint32_t id_len, name_len;
+
+			memcpy(name, _reader_name_A, len * sizeof(char));
+			name[len] = ' ';
+			id_len = strFromUInt32(name + len + 1, 11, id, 10);
+			name_len = len + 1 + id_len + 1;
+
+			memcpy(list + list_len, name, name_len * sizeof(char));
+			list_len += name_len;
+		}
+
+		_sink += list_len;
+	}
+}
+
+static void _reader_names_W(const uint64_t iterations)
+{
+	const uint32_t len = (sizeof(_reader_name_W) / sizeof(wchar_t)) - 1;
+	wchar_t list[2048];
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint32_t list_len = 0;
+
+		for (uint32_t id = 0; id < 8; id++) {
+			wchar_t name[256];
+			uint32_t id_len, name_len;
+
+			memcpy(name, _reader_name_W, len * sizeof(wchar_t));
+			name[len] = L' ';
+			id_len = wstrFromUInt32(name + len + 1, 11, id, 10);
+			name_len = len + 1 + id_len + 1;
+
+			memcpy(list + list_len, name, name_len * sizeof(wchar_t));
+			list_len += name_len;
+		}
+
+		_sink += list_len;
+	}
+}
+
+static const struct _case _cases[] = {
+	{ "card_parseATR/bcas", _card_parse_atr },
+	{ "card_T1MakeBlock/I254", _card_make_iblock },
+	{ "card_T1MakeBlock/S1", _card_make_sblock },
+	{ "card_T1CheckBlockEDC/258", _card_check_edc },
+	{ "handle_list/put_release_full", _handle_put_release },
+	{ "handle_list/get_full", _handle_get },
+	{ "wstrCompare/reader_name", _wstr_compare },
+	{ "wstrCompareEx/unique_id", _wstr_compare_ex },
+	{ "wstrMatch/reader_name", _wstr_match },
+	{ "wstrLen/interface_path", _wstr_len },
+	{ "wstrGetWCharPtr/interface_path", _wstr_get_wchar_ptr },
+	{ "wstrToUInt32", _wstr_to_uint32 },
+	{ "wstrFromUInt32", _wstr_from_uint32 },
+	{ "enum_readers/A8", _reader_names_A },
+	{ "enum_readers/W8", _reader_names_W },
+};
+
+static int _compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+// the iterations are increased until a run takes min_ns
+static double _run_case(const struct _case *const c, const uint64_t min_ns, uint64_t *const iterations)
+{
+	uint64_t n = 1, ns;
+
+	while (1) {
+		uint64_t t = bench_get_time_ns();
+
+		c->fn(n);
+		ns = bench_get_time_ns() - t;
+
+		if (ns >= min_ns || n >= (1ULL << 40))
+			break;
+
+		n *= (ns < (min_ns / 10)) ? 10 : 2;
+	}
+
+	*iterations = n;
+
+	return (double)ns / n;
+}
+
+// the last result of the case in the history, or a negative value
+static double _find_history(const char *const history, const char *const name)
+{
+	FILE *fp = fopen(history, "r");
+	char line[512];
+	double r = -1.0;
+
+	if (fp == NULL)
+		return r;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char n[64];
+		double v;
+
+		if (sscanf(line, "{\"name\":\"%63[^\"]\",\"time\":%*[^,],\"iterations\":%*[^,],\"ns_per_op\":%lf", n, &v) == 2 && strcmp(n, name) == 0) {
+			r = v;
+		}
+	}
+
+	fclose(fp);
+
+	return r;
+}
+
+int bench_micro_main(int argc, char *argv[])
+{
+	const char *filter = bench_get_arg_str(argc, argv, "filter", NULL);
+	const char *history = bench_get_arg_str(argc, argv, "history", NULL);
+	uint64_t min_ns = bench_get_arg_uint(argc, argv, "min-time", 200) * 1000000;
+	uint32_t repetitions = (uint32_t)bench_get_arg_uint(argc, argv, "repetitions", 5);
+	double threshold = (double)bench_get_arg_uint(argc, argv, "threshold", 10);
+	unsigned long long now = (unsigned long long)time(NULL);
+	FILE *out = NULL;
+	bool regressed = false;
+
+	_handle_num = (uint32_t)bench_get_arg_uint(argc, argv, "handles", 32);
+
+	if (repetitions == 0 || repetitions > _MAX_REPETITION_NUM) {
+		fprintf(stderr, "--repetitions must be 1..%u\n", _MAX_REPETITION_NUM);
+		return 1;
+	}
+
+	if (_handle_num < 2 || _handle_num > _MAX_HANDLE_NUM) {
+		fprintf(stderr, "--handles must be 2..%u\n", _MAX_HANDLE_NUM);
+		return 1;
+	}
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(_cases) / sizeof(_cases[0]); i++)
+	{
+		const struct _case *c = &_cases[i];
+		double v[_MAX_REPETITION_NUM], median, last = -1.0;
+		uint64_t iterations = 0;
+
+		if (filter != NULL && strstr(c->name, filter) == NULL)
+			continue;
+
+		for (uint32_t j = 0; j < repetitions; j++)
+			v[j] = _run_case(c, min_ns, &iterations);
+
+		qsort(v, repetitions, sizeof(double), _compare_double);
+		median = v[repetitions / 2];
+
+		printf("%-32s %12llu ops %10.2f ns/op (min %.2f, max %.2f)\n", c->name, (unsigned long long)iterations, median, v[0], v[repetitions - 1]);
+
+		if (history == NULL)
+			continue;
+
+		last = _find_history(history, c->name);
+		if (last > 0 && median > last * (1.0 + (threshold / 100))) {
+			fprintf(stderr, "regression: %s: %.2f -> %.2f ns/op\n", c->name, last, median);
+			regressed = true;
+		}
+
+		if (out == NULL) {
+			out = fopen(history, "a");
+			if (out == NULL) {
+				perror("fopen");
+				return 1;
+			}
+		}
+
+		fprintf(out, "{\"name\":\"%s\",\"time\":%llu,\"iterations\":%llu,\"ns_per_op\":%.3f,\"min\":%.3f,\"max\":%.3f}\n",
+			c->name, now, (unsigned long long)iterations, median, v[0], v[repetitions - 1]);
+	}
+
+	if (out != NULL)
+		fclose(out);
+
+	memDeinit();
+
+	return (regressed == true) ? 2 : 0;
+}
@@ -0,0 +1,351 @@
+// bench_pcsc.c
+//
+// per-APDU latency of an exchange with the card through the libraries for PC/SC Lite,
+// which are loaded one after the other:
+//
+//   pcscd:  libpcsclite of the system (--pcscd), which passes every call to pcscd
+//   ifd:    the driver of pcscd of CardReader_ITE_IFD (--ifd), called directly with
+//           the device --device, which is what pcscd adds to it
+//   direct: libpcsclite.so.1 of CardReader_ITE_PCSC (--direct), which reaches the
+//           devices from the calling thread
+//
+// CardReader_ITE_IFD and CardReader_ITE_PCSC read the INI file given by
+// ITECARD_PCSC_CONFIG, where the devices may be simulated as for e2e. pcscd reaches
+// them through CardReader_ITE_IFD when it is listed in its reader.conf. the first
+// reader whose name starts with --reader is used, and a library which fails is
+// reported and skipped. it runs on Linux.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <dlfcn.h>
+
+#include "../CardReader_ITE_IFD/ifdhandler.h"
+
+#define _MAX_SIZE	255		// of the data of the command
+
+#define _IFD_LUN	0
+
+typedef enum {
+	_LIB_PCSCD,
+	_LIB_IFD,
+	_LIB_DIRECT,
+	_LIB_NUM
+} _lib_t;
+
+static const char *const _lib_name[_LIB_NUM] = { "pcscd", "ifd", "direct" };
+
+struct _api
+{
+	void *lib;
+	const SCARD_IO_REQUEST *t1;
+	LONG (*EstablishContext)(DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT);
+	LONG (*ReleaseContext)(SCARDCONTEXT);
+	LONG (*ListReaders)(SCARDCONTEXT, LPCSTR, LPSTR, LPDWORD);
+	LONG (*Connect)(SCARDCONTEXT, LPCSTR, DWORD, DWORD, LPSCARDHANDLE, LPDWORD);
+	LONG (*Disconnect)(SCARDHANDLE, DWORD);
+	LONG (*Transmit)(SCARDHANDLE, const SCARD_IO_REQUEST *, LPCBYTE, DWORD, SCARD_IO_REQUEST *, LPBYTE, LPDWORD);
+};
+
+struct _ifd_api
+{
+	void *lib;
+	RESPONSECODE (*CreateChannelByName)(DWORD, LPSTR);
+	RESPONSECODE (*CloseChannel)(DWORD);
+	RESPONSECODE (*PowerICC)(DWORD, DWORD, PUCHAR, PDWORD);
+	RESPONSECODE (*TransmitToICC)(DWORD, SCARD_IO_HEADER, PUCHAR, DWORD, PUCHAR, PDWORD, PSCARD_IO_HEADER);
+};
+
+struct _config
+{
+	const char *path[_LIB_NUM];
+	const char *reader;
+	const char *device;
+	uint32_t size;
+	uint64_t transmits;
+	uint64_t warmup;
+};
+
+static bool _load(struct _api *const api, const char *const path)
+{
+	memset(api, 0, sizeof(struct _api));
+
+	// both are named libpcsclite.so.1, and only one of them is loaded at a time
+	api->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (api->lib == NULL)
+		return false;
+
+	api->t1 = dlsym(api->lib, "g_rgSCardT1Pci");
+	api->EstablishContext = dlsym(api->lib, "SCardEstablishContext");
+	api->ReleaseContext = dlsym(api->lib, "SCardReleaseContext");
+	api->ListReaders = dlsym(api->lib, "SCardListReaders");
+	api->Connect = dlsym(api->lib, "SCardConnect");
+	api->Disconnect = dlsym(api->lib, "SCardDisconnect");
+	api->Transmit = dlsym(api->lib, "SCardTransmit");
+
+	if (api->t1 == NULL || api->EstablishContext == NULL || api->ReleaseContext == NULL || api->ListReaders == NULL ||
+		api->Connect == NULL || api->Disconnect == NULL || api->Transmit == NULL)
+	{
+		dlclose(api->lib);
+		api->lib = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static bool _ifd_load(struct _ifd_api *const api, const char *const path)
+{
+	memset(api, 0, sizeof(struct _ifd_api));
+
+	api->lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (api->lib == NULL)
+		return false;
+
+	api->CreateChannelByName = dlsym(api->lib, "IFDHCreateChannelByName");
+	api->CloseChannel = dlsym(api->lib, "IFDHCloseChannel");
+	api->PowerICC = dlsym(api->lib, "IFDHPowerICC");
+	api->TransmitToICC = dlsym(api->lib, "IFDHTransmitToICC");
+
+	if (api->CreateChannelByName == NULL || api->CloseChannel == NULL || api->PowerICC == NULL || api->TransmitToICC == NULL) {
+		dlclose(api->lib);
+		api->lib = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+// the command of e2e, with --size bytes of data
+static uint32_t _make_command(const struct _config *const c, uint8_t *const cmd)
+{
+	cmd[0] = 0x90;
+	cmd[1] = 0x30;
+	cmd[2] = 0x00;
+	cmd[3] = 0x02;
+	cmd[4] = (uint8_t)c->size;
+	for (uint32_t i = 0; i < c->size; i++)
+		cmd[5 + i] = (uint8_t)i;
+
+	return 5 + c->size;
+}
+
+static void _print_result(const struct _config *const c, const _lib_t lib, const char *const reader, const uint64_t connect_ns, const uint64_t total, const struct bench_hist *const hist)
+{
+	printf("{\"library\":\"%s\",\"path\":\"%s\",\"reader\":\"%s\",\"size\":%u,\"transmits\":%llu,\"connect_us\":%.1f,\"mean_us\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+		_lib_name[lib], c->path[lib], reader, c->size, (unsigned long long)c->transmits, connect_ns / 1000.0,
+		(c->transmits != 0) ? (double)total / c->transmits / 1000.0 : 0.0,
+		bench_hist_percentile(hist, 0.5) / 1000.0, bench_hist_percentile(hist, 0.99) / 1000.0, hist->max / 1000.0);
+}
+
+static void _print_error(const _lib_t lib, const char *const path, const char *const func, const LONG r)
+{
+	printf("{\"library\":\"%s\",\"path\":\"%s\",\"error\":\"%s\",\"code\":\"0x%08lX\"}\n", _lib_name[lib], path, func, (unsigned long)r & 0xffffffff);
+}
+
+static bool _run(const struct _config *const c, const _lib_t lib, struct bench_hist *const hist)
+{
+	const char *path = c->path[lib];
+	struct _api api;
+	SCARDCONTEXT ctx;
+	SCARDHANDLE card;
+	DWORD len, protocol;
+	char readers[4096], *reader;
+	uint8_t cmd[5 + _MAX_SIZE], res[258];
+	uint32_t cmd_len;
+	uint64_t t0, connect_ns, total = 0;
+	LONG r;
+
+	if (_load(&api, path) == false) {
+		_print_error(lib, path, "dlopen", 0);
+		return false;
+	}
+
+	r = api.EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(lib, path, "SCardEstablishContext", r);
+		dlclose(api.lib);
+		return false;
+	}
+
+	len = sizeof(readers);
+	r = api.ListReaders(ctx, NULL, readers, &len);
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(lib, path, "SCardListReaders", r);
+		goto end1;
+	}
+
+	for (reader = readers; *reader != '\0'; reader += strlen(reader) + 1) {
+		if (strncmp(reader, c->reader, strlen(c->reader)) == 0)
+			break;
+	}
+
+	if (*reader == '\0') {
+		_print_error(lib, path, "no reader", SCARD_E_UNKNOWN_READER);
+		r = SCARD_E_UNKNOWN_READER;
+		goto end1;
+	}
+
+	t0 = bench_get_time_ns();
+	r = api.Connect(ctx, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card, &protocol);
+	connect_ns = bench_get_time_ns() - t0;
+	if (r != SCARD_S_SUCCESS) {
+		_print_error(lib, path, "SCardConnect", r);
+		goto end1;
+	}
+
+	cmd_len = _make_command(c, cmd);
+
+	bench_hist_init(hist);
+
+	for (uint64_t i = 0; i < c->warmup + c->transmits; i++)
+	{
+		DWORD res_len = sizeof(res);
+
+		t0 = bench_get_time_ns();
+		r = api.Transmit(card, api.t1, cmd, cmd_len, NULL, res, &res_len);
+		t0 = bench_get_time_ns() - t0;
+
+		if (r != SCARD_S_SUCCESS) {
+			_print_error(lib, path, "SCardTransmit", r);
+			goto end2;
+		}
+
+		if (i >= c->warmup) {
+			bench_hist_add(hist, t0);
+			total += t0;
+		}
+	}
+
+	_print_result(c, lib, reader, connect_ns, total, hist);
+
+end2:
+	api.Disconnect(card, SCARD_LEAVE_CARD);
+end1:
+	api.ReleaseContext(ctx);
+	dlclose(api.lib);
+
+	return (r == SCARD_S_SUCCESS) ? true : false;
+}
+
+// the driver as pcscd calls it, with the card powered up as by SCardConnect
+static bool _run_ifd(const struct _config *const c, struct bench_hist *const hist)
+{
+	const char *path = c->path[_LIB_IFD];
+	struct _ifd_api api;
+	SCARD_IO_HEADER pci = { 1, 0 };
+	UCHAR atr[MAX_ATR_SIZE];
+	DWORD atr_len = sizeof(atr);
+	uint8_t cmd[5 + _MAX_SIZE], res[258];
+	uint32_t cmd_len;
+	uint64_t t0, connect_ns, total = 0;
+	RESPONSECODE r;
+
+	if (_ifd_load(&api, path) == false) {
+		_print_error(_LIB_IFD, path, "dlopen", 0);
+		return false;
+	}
+
+	r = api.CreateChannelByName(_IFD_LUN, (LPSTR)c->device);
+	if (r != IFD_SUCCESS) {
+		_print_error(_LIB_IFD, path, "IFDHCreateChannelByName", r);
+		dlclose(api.lib);
+		return false;
+	}
+
+	t0 = bench_get_time_ns();
+	r = api.PowerICC(_IFD_LUN, IFD_POWER_UP, atr, &atr_len);
+	connect_ns = bench_get_time_ns() - t0;
+	if (r != IFD_SUCCESS) {
+		_print_error(_LIB_IFD, path, "IFDHPowerICC", r);
+		goto end;
+	}
+
+	cmd_len = _make_command(c, cmd);
+
+	bench_hist_init(hist);
+
+	for (uint64_t i = 0; i < c->warmup + c->transmits; i++)
+	{
+		DWORD res_len = sizeof(res);
+
+		t0 = bench_get_time_ns();
+		r = api.TransmitToICC(_IFD_LUN, pci, cmd, cmd_len, res, &res_len, NULL);
+		t0 = bench_get_time_ns() - t0;
+
+		if (r != IFD_SUCCESS) {
+			_print_error(_LIB_IFD, path, "IFDHTransmitToICC", r);
+			break;
+		}
+
+		if (i >= c->warmup) {
+			bench_hist_add(hist, t0);
+			total += t0;
+		}
+	}
+
+	if (r == IFD_SUCCESS)
+		_print_result(c, _LIB_IFD, c->device, connect_ns, total, hist);
+
+	api.PowerICC(_IFD_LUN, IFD_POWER_DOWN, NULL, NULL);
+end:
+	api.CloseChannel(_IFD_LUN);
+	dlclose(api.lib);
+
+	return (r == IFD_SUCCESS) ? true : false;
+}
+
+int bench_pcsc_main(int argc, char *argv[])
+{
+	struct _config c;
+	struct bench_hist *hist;
+	uint32_t ok = 0;
+
+	c.path[_LIB_PCSCD] = bench_get_arg_str(argc, argv, "pcscd", "libpcsclite.so.1");
+	c.path[_LIB_IFD] = bench_get_arg_str(argc, argv, "ifd", "./libitecard_ifd.so");
+	c.path[_LIB_DIRECT] = bench_get_arg_str(argc, argv, "direct", "./libpcsclite.so.1");
+	c.reader = bench_get_arg_str(argc, argv, "reader", "");
+	c.device = bench_get_arg_str(argc, argv, "device", "ReaderDevice1:0");
+	c.size = (uint32_t)bench_get_arg_uint(argc, argv, "size", 0);
+	c.transmits = bench_get_arg_uint(argc, argv, "transmits", 1000);
+	c.warmup = bench_get_arg_uint(argc, argv, "warmup", 100);
+
+	if (c.size > _MAX_SIZE) {
+		fprintf(stderr, "--size must be 0..%u\n", _MAX_SIZE);
+		return 1;
+	}
+
+	hist = malloc(sizeof(struct bench_hist));
+	if (hist == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < _LIB_NUM; i++) {
+		bool ret = (i == _LIB_IFD) ? _run_ifd(&c, hist) : _run(&c, (_lib_t)i, hist);
+
+		if (ret == true)
+			ok++;
+	}
+
+	free(hist);
+
+	return (ok != 0) ? 0 : 1;
+}
+
+#else
+
+int bench_pcsc_main(int argc, char *argv[])
+{
+	fprintf(stderr, "pcsc runs on Linux, with the interface of PC/SC Lite\n");
+	return 1;
+}
+
+#endif
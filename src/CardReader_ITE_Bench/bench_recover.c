@@ -0,0 +1,356 @@
+// bench_recover.c
+//
+// recovery of a device database (devdb) from the processes which die in it.
+//
+//   lock:    a process which holds the lock, and references to a slot, is killed with
+//            SIGKILL while others wait for the lock. the lock has to be handed over to
+//            them, and the references reclaimed.
+//   refs:    a process which holds references to a slot, but not the lock, is killed.
+//   stopped: a process which holds the lock is stopped with SIGSTOP for longer than the
+//            claim timeout of the lock. it is alive, so it must keep the lock.
+//
+// the time to recover is reported, and the command fails if a check does not hold. a
+// database of its own is created for each run. it runs on Linux.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../CardReader_ITE/devdb.h"
+
+#define _MAX_WAITER_NUM	16
+
+// a run which does not recover is cut off
+#define _RUN_TIMEOUT	60		// seconds
+
+enum _scenario
+{
+	_SCENARIO_LOCK,
+	_SCENARIO_REFS,
+	_SCENARIO_STOPPED,
+};
+
+static const char *const _scenario_name[] = { "lock", "refs", "stopped" };
+
+// shared with the child processes
+struct _shared
+{
+	uint32_t ready;
+	uint32_t release;	// the holder is to release the lock
+	uint32_t released;	// the lock may be taken by the waiters from here
+	uint32_t acquired;	// waiters which have taken the lock
+	uint32_t stolen;	// waiters which have taken it before it was released
+};
+
+struct _config
+{
+	uint32_t iterations;
+	uint32_t refs;
+	uint32_t waiters;
+	uint32_t stop;			// milliseconds
+	wchar_t name[64];
+};
+
+static void _futex_wait(uint32_t *const addr, const uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t *const addr, const int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+static void _child_open(devdb *const db, const struct _config *const c)
+{
+	// the children do not outlive a parent which has been cut off
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	if (devdb_open(db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+		fprintf(stderr, "devdb_open failed\n");
+		_exit(1);
+	}
+}
+
+static void _holder_main(struct _shared *const s, const struct _config *const c, const uint32_t refs, const bool hold)
+{
+	devdb db;
+
+	_child_open(&db, c);
+
+	devdb_lock(&db);
+
+	for (uint32_t i = 0; i < refs; i++) {
+		if (devdb_ref_nolock(&db, 0, NULL) != DEVDB_S_OK) {
+			fprintf(stderr, "devdb_ref_nolock failed\n");
+			_exit(1);
+		}
+	}
+
+	if (hold == false)
+		devdb_unlock(&db);
+
+	__atomic_add_fetch(&s->ready, 1, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&s->release, __ATOMIC_ACQUIRE) == 0)
+		_futex_wait(&s->release, 0);
+
+	if (hold == true) {
+		__atomic_store_n(&s->released, 1, __ATOMIC_RELEASE);
+		devdb_unlock(&db);
+	}
+
+	devdb_close(&db);
+
+	_exit(0);
+}
+
+static void _waiter_main(struct _shared *const s, const struct _config *const c)
+{
+	devdb db;
+
+	_child_open(&db, c);
+
+	devdb_lock(&db);
+
+	if (__atomic_load_n(&s->released, __ATOMIC_ACQUIRE) == 0)
+		__atomic_add_fetch(&s->stolen, 1, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&s->acquired, 1, __ATOMIC_RELAXED);
+
+	devdb_unlock(&db);
+	devdb_close(&db);
+
+	_exit(0);
+}
+
+static pid_t _fork(void (*fn)(struct _shared *const, const struct _config *const), struct _shared *const s, const struct _config *const c)
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+		fn(s, c);
+
+	return pid;
+}
+
+static uint32_t _queued(devdb *const db)
+{
+	return __atomic_load_n(&db->info->ticket, __ATOMIC_ACQUIRE) - __atomic_load_n(&db->info->serving, __ATOMIC_ACQUIRE);
+}
+
+// one iteration of a scenario. returns the time to recover, or UINT64_MAX if a check fails.
+static uint64_t _iterate(devdb *const db, struct _shared *const s, const struct _config *const c, const enum _scenario scenario, uint32_t *const reclaimed)
+{
+	pid_t holder, waiter[_MAX_WAITER_NUM];
+	uint32_t waiters = (scenario == _SCENARIO_REFS) ? 0 : c->waiters;
+	uint32_t refs = (scenario == _SCENARIO_STOPPED) ? 0 : c->refs;
+	bool hold = (scenario != _SCENARIO_REFS) ? true : false;
+	uint32_t forked = 0, ref = 0;
+	uint64_t t0 = 0, t1 = 0;
+	bool ok = true;
+
+	memset(s, 0, sizeof(struct _shared));
+
+	holder = fork();
+	if (holder == 0)
+		_holder_main(s, c, refs, hold);
+	if (holder < 0) {
+		fprintf(stderr, "fork failed\n");
+		return UINT64_MAX;
+	}
+
+	while (__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE) == 0)
+		usleep(1000);
+
+	// the waiters queue up behind the holder
+	for (uint32_t i = 0; i < waiters; i++) {
+		waiter[i] = _fork(_waiter_main, s, c);
+		if (waiter[i] < 0) {
+			fprintf(stderr, "fork failed\n");
+			ok = false;
+			break;
+		}
+		forked++;
+	}
+
+	while (_queued(db) < ((hold == true) ? 1 : 0) + forked)
+		usleep(1000);
+
+	*reclaimed = 0;
+
+	switch (scenario)
+	{
+	case _SCENARIO_LOCK:
+	case _SCENARIO_REFS:
+		t0 = bench_get_time_ns();
+		__atomic_store_n(&s->released, 1, __ATOMIC_RELEASE);
+		kill(holder, SIGKILL);
+		waitpid(holder, NULL, 0);
+
+		devdb_lock(db);
+		devdb_reclaim_nolock(db, 0, reclaimed);
+		devdb_get_ref_count_nolock(db, 0, &ref);
+		t1 = bench_get_time_ns();
+		devdb_unlock(db);
+		break;
+
+	case _SCENARIO_STOPPED:
+		kill(holder, SIGSTOP);
+		usleep(c->stop * 1000);
+
+		t0 = bench_get_time_ns();
+		kill(holder, SIGCONT);
+		__atomic_store_n(&s->release, 1, __ATOMIC_RELEASE);
+		_futex_wake(&s->release, INT_MAX);
+		waitpid(holder, NULL, 0);
+
+		devdb_lock(db);
+		t1 = bench_get_time_ns();
+		devdb_unlock(db);
+		break;
+	}
+
+	for (uint32_t i = 0; i < forked; i++)
+		waitpid(waiter[i], NULL, 0);
+
+	if (*reclaimed != refs || ref != 0) {
+		fprintf(stderr, "%s: %u of %u references reclaimed, %u left\n", _scenario_name[scenario], *reclaimed, refs, ref);
+		ok = false;
+	}
+
+	if (s->acquired != forked || s->stolen != 0) {
+		fprintf(stderr, "%s: %u of %u waiters have taken the lock, %u before it was released\n", _scenario_name[scenario], s->acquired, forked, s->stolen);
+		ok = false;
+	}
+
+	return (ok == true) ? t1 - t0 : UINT64_MAX;
+}
+
+static bool _run(struct _shared *const s, const struct _config *const c, const enum _scenario scenario)
+{
+	struct devdb_lock_stats ls;
+	uint64_t total = 0, max = 0;
+	uint32_t generation, reclaimed = 0, recover, expected;
+	devdb db;
+	bool r = true;
+
+	if (devdb_open(&db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+		fprintf(stderr, "devdb_open failed\n");
+		return false;
+	}
+
+	// a simulated device gives the database its slot
+	devdb_set_simulated(&db, L"bench", 1);
+	if (devdb_update(&db) != DEVDB_S_OK) {
+		fprintf(stderr, "devdb_update failed\n");
+		r = false;
+		goto end;
+	}
+
+	devdb_get_lock_stats(&db, &ls);
+	recover = ls.recover;
+
+	for (uint32_t i = 0; i < c->iterations; i++)
+	{
+		uint32_t n;
+		uint64_t t = _iterate(&db, s, c, scenario, &n);
+
+		if (t == UINT64_MAX) {
+			r = false;
+			goto end;
+		}
+
+		total += t;
+		if (max < t)
+			max = t;
+		reclaimed += n;
+	}
+
+	// the lock is taken back once for each holder killed, and never from a live one
+	devdb_get_lock_stats(&db, &ls);
+	recover = ls.recover - recover;
+	expected = (scenario == _SCENARIO_LOCK) ? c->iterations : 0;
+
+	if (recover != expected) {
+		fprintf(stderr, "%s: the lock has been taken back %u times, instead of %u\n", _scenario_name[scenario], recover, expected);
+		r = false;
+	}
+
+	printf("{\"scenario\":\"%s\",\"iterations\":%u,\"waiters\":%u,\"refs\":%u,\"recover_ms_avg\":%.1f,\"recover_ms_max\":%.1f,\"reclaimed\":%u,\"recover\":%u,\"ok\":%s}\n",
+		_scenario_name[scenario], c->iterations, (scenario == _SCENARIO_REFS) ? 0 : c->waiters, (scenario == _SCENARIO_STOPPED) ? 0 : c->refs,
+		total / 1000000.0 / c->iterations, max / 1000000.0, reclaimed, recover, (r == true) ? "true" : "false");
+
+end:
+	generation = db.info->generation;
+	devdb_close(&db);
+	bench_devdb_remove(c->name, generation);
+
+	return r;
+}
+
+int bench_recover_main(int argc, char *argv[])
+{
+	struct _config c;
+	struct _shared *s;
+	int r = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.iterations = (uint32_t)bench_get_arg_uint(argc, argv, "iterations", 3);
+	c.refs = (uint32_t)bench_get_arg_uint(argc, argv, "refs", 4);
+	c.waiters = (uint32_t)bench_get_arg_uint(argc, argv, "waiters", 2);
+	c.stop = (uint32_t)bench_get_arg_uint(argc, argv, "stop", 2500);
+
+	if (c.iterations == 0 || c.waiters > _MAX_WAITER_NUM) {
+		fprintf(stderr, "--iterations must be 1 or more, and --waiters %u or less\n", _MAX_WAITER_NUM);
+		return 1;
+	}
+
+	s = mmap(NULL, sizeof(struct _shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < sizeof(_scenario_name) / sizeof(_scenario_name[0]); i++)
+	{
+		swprintf(c.name, sizeof(c.name) / sizeof(wchar_t), L"bench_recover_%u_%u", (uint32_t)getpid(), i);
+
+		alarm(_RUN_TIMEOUT);
+
+		if (_run(s, &c, (enum _scenario)i) == false)
+			r = 1;
+
+		alarm(0);
+	}
+
+	munmap(s, sizeof(struct _shared));
+
+	return r;
+}
+
+#else
+
+int bench_recover_main(int argc, char *argv[])
+{
+	fprintf(stderr, "recover runs on Linux, over POSIX shared memory and futexes\n");
+	return 1;
+}
+
+#endif
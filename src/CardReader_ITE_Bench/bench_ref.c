@@ -0,0 +1,656 @@
+// bench_ref.c
+//
+// contended references to the slots of a device database (devdb). --processes processes
+// of --threads threads each take and drop references to --slots slots (the same one by
+// default) in a loop, each under the lock of the database, as devdb_ref and devdb_unref
+// do. the throughput, the time the lock is held for each of them, and the statistics
+// devdb keeps of its lock are reported.
+//
+// a database of its own is created for each run. it runs on Linux, where devdb is
+// POSIX shared memory and futexes.
+//
+// --packed runs, instead of devdb, a model of its lock and of devdb_ref/devdb_unref on
+// an anonymous mapping, once with the hot words (the lock word, the ticket counters, the
+// statistics, the reference counts and the owner table) at the offsets of the cache lines
+// of devdb.h and once at the offsets of the #pragma pack(1) layout they replaced, where
+// they sit among the path strings. both are reported one after the other for each run.
+//
+// the processes are spread over --cpus processors (all of those the bench may run on, by
+// default), process i on the (i % cpus)th.
+
+// sched_setaffinity
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "bench.h"
+
+#if !defined(_WIN32) && defined(__linux__)
+
+#include <limits.h>
+#include <stddef.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "../CardReader_ITE/devdb.h"
+
+#define _MAX_PROCESS_NUM	16
+#define _MAX_THREAD_NUM		16
+#define _MAX_CPU_NUM		256
+
+#define _MODEL_SPIN			1000	// spins of the next in line before blocking
+#define _MODEL_SPIN_YIELD	100		// spins on the internal lock before yielding
+
+// offsets of the words of devdb touched by a reference, in the control block and in a slot
+struct _layout
+{
+	const char *name;
+	uint32_t lock;
+	uint32_t ticket;
+	uint32_t serving;
+	uint32_t owner;
+	uint32_t waiting;
+	uint32_t acquire;
+	uint32_t contended;
+	uint32_t sleep;
+	uint32_t info_size;
+	uint32_t slot_ref;
+	uint32_t slot_owner;
+	uint32_t slot_size;
+};
+
+// the owner table of a slot has DEVDB_DEFAULT_DEV_OWNER_NUM entries: it is only grown by
+// more processes than the model runs.
+#define _line_round(n)			(((uint32_t)(n) + (DEVDB_CACHE_LINE_SIZE - 1)) & ~(DEVDB_CACHE_LINE_SIZE - 1))
+#define _owner_offset(user_size)	_line_round(offsetof(struct devdb_shared_devinfo, user) + (user_size))
+#define _slot_size(user_size)	_line_round(_owner_offset(user_size) + sizeof(struct devdb_shared_devref) * DEVDB_DEFAULT_DEV_OWNER_NUM)
+
+static const struct _layout _layout[] = {
+	// devdb.h. the owner is the pid in the high half of the claim, the waiters those of the first slot.
+	{
+		"lines",
+		offsetof(struct devdb_shared_info, lock),
+		offsetof(struct devdb_shared_info, ticket),
+		offsetof(struct devdb_shared_info, serving),
+		offsetof(struct devdb_shared_info, claim) + 4,
+		offsetof(struct devdb_shared_info, slot[0].waiting),
+		offsetof(struct devdb_shared_info, stats.acquire),
+		offsetof(struct devdb_shared_info, stats.contended),
+		offsetof(struct devdb_shared_info, stats.sleep),
+		sizeof(struct devdb_shared_info),
+		offsetof(struct devdb_shared_devinfo, ref),
+		_owner_offset(0),
+		_slot_size(0),
+	},
+	// #pragma pack(1), with the wchar_t of 2 bytes of Windows: the control block was
+	// signature, version, lock, ticket, serving, claim, owner, waiting, spin, stall_ticket,
+	// stall_tick and the statistics, and a slot path[512], id[64], ref, available and the
+	// owner table.
+	{ "packed", 8, 12, 16, 24, 28, 44, 48, 52, 84, 1152, 1160, 1160 + sizeof(struct devdb_shared_devref) * DEVDB_DEFAULT_DEV_OWNER_NUM },
+};
+
+struct _thread_result
+{
+	uint64_t ops;
+	struct bench_hist hist;		// of the time the lock is held
+};
+
+// shared with the child processes
+struct _shared
+{
+	uint32_t start;
+	uint32_t ready;
+	uint32_t failed;
+	uint64_t end;			// bench_get_time_ns
+	struct _thread_result result[_MAX_PROCESS_NUM][_MAX_THREAD_NUM];
+};
+
+struct _config
+{
+	uint32_t processes;
+	uint32_t threads;
+	uint32_t slots;
+	uint64_t duration;		// nanoseconds
+	uint32_t cpus;
+	int cpu[_MAX_CPU_NUM];
+	const struct _layout *layout;	// NULL for devdb
+	uint8_t *model;
+	wchar_t name[64];
+};
+
+struct _thread
+{
+	devdb *db;
+	const struct _layout *layout;
+	uint8_t *model;
+	struct _shared *shared;
+	struct _thread_result *result;
+	uint32_t slot;
+};
+
+static void _futex_wait(uint32_t *const addr, const uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t *const addr, const int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+#define _model_word(m, off)	((uint32_t *)((m) + (off)))
+
+static void _model_spin_lock(uint32_t *const lock, const uint32_t pid)
+{
+	uint32_t i = 0, expected = 0;
+
+	while (__atomic_compare_exchange_n(lock, &expected, pid, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) == false) {
+		expected = 0;
+		if (++i % _MODEL_SPIN_YIELD == 0)
+			sched_yield();
+	}
+}
+
+static void _model_spin_unlock(uint32_t *const lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// the ticket lock of devdb_lock, with a single futex for all of the waiters
+static void _model_lock(uint8_t *const m, const struct _layout *const l, const uint32_t pid)
+{
+	uint32_t *serving = _model_word(m, l->serving);
+	uint32_t ticket, seq;
+	bool slept = false;
+
+	ticket = __atomic_fetch_add(_model_word(m, l->ticket), 1, __ATOMIC_ACQ_REL);
+
+	if (__atomic_load_n(serving, __ATOMIC_ACQUIRE) == ticket) {
+		*_model_word(m, l->owner) = pid;
+		(*_model_word(m, l->acquire))++;
+		return;
+	}
+
+	// next in line: spin for a while before blocking
+	if (__atomic_load_n(serving, __ATOMIC_ACQUIRE) + 1 == ticket)
+		for (uint32_t i = 0; i < _MODEL_SPIN && __atomic_load_n(serving, __ATOMIC_ACQUIRE) != ticket; i++);
+
+	while ((seq = __atomic_load_n(serving, __ATOMIC_ACQUIRE)) != ticket)
+	{
+		_model_spin_lock(_model_word(m, l->lock), pid);
+
+		seq = *serving;
+		if (seq == ticket) {
+			_model_spin_unlock(_model_word(m, l->lock));
+			break;
+		}
+
+		(*_model_word(m, l->waiting))++;
+		_model_spin_unlock(_model_word(m, l->lock));
+
+		_futex_wait(serving, seq);
+		slept = true;
+	}
+
+	*_model_word(m, l->owner) = pid;
+	(*_model_word(m, l->acquire))++;
+	(*_model_word(m, l->contended))++;
+	if (slept == true)
+		(*_model_word(m, l->sleep))++;
+}
+
+static void _model_unlock(uint8_t *const m, const struct _layout *const l, const uint32_t pid)
+{
+	uint32_t *serving = _model_word(m, l->serving);
+	uint32_t waiting;
+
+	_model_spin_lock(_model_word(m, l->lock), pid);
+
+	__atomic_store_n(serving, *serving + 1, __ATOMIC_RELEASE);
+	waiting = *_model_word(m, l->waiting);
+	*_model_word(m, l->waiting) = 0;
+
+	_model_spin_unlock(_model_word(m, l->lock));
+
+	if (waiting != 0)
+		_futex_wake(serving, INT_MAX);
+}
+
+// devdb_ref_nolock and devdb_unref_nolock
+static bool _model_ref(uint8_t *const m, const struct _layout *const l, const uint32_t slot, const uint32_t pid, const bool ref)
+{
+	uint8_t *s = m + l->info_size + (size_t)l->slot_size * slot;
+	struct devdb_shared_devref *owner = (struct devdb_shared_devref *)(s + l->slot_owner);
+	struct devdb_shared_devref *devref = NULL;
+	uint32_t *count = _model_word(s, l->slot_ref);
+
+	for (uint32_t i = 0; i < DEVDB_DEFAULT_DEV_OWNER_NUM && devref == NULL; i++) {
+		if (owner[i].pid == pid)
+			devref = &owner[i];
+	}
+
+	if (ref == true) {
+		for (uint32_t i = 0; i < DEVDB_DEFAULT_DEV_OWNER_NUM && devref == NULL; i++) {
+			if (owner[i].pid == 0) {
+				devref = &owner[i];
+				devref->pid = pid;
+				devref->count = 0;
+			}
+		}
+
+		if (devref == NULL)
+			return false;
+
+		devref->count++;
+		(*count)++;
+	}
+	else {
+		if (devref == NULL || devref->count == 0 || *count == 0)
+			return false;
+
+		if (--devref->count == 0)
+			devref->pid = 0;
+
+		(*count)--;
+	}
+
+	return true;
+}
+
+// takes or drops a reference under the lock
+static bool _ref(struct _thread *const t, const bool ref)
+{
+	uint64_t t0;
+	bool r;
+
+	if (t->layout == NULL) {
+		devdb_lock(t->db);
+		t0 = bench_get_time_ns();
+		r = (((ref == true) ? devdb_ref_nolock(t->db, t->slot, NULL) : devdb_unref_nolock(t->db, t->slot, NULL)) == DEVDB_S_OK) ? true : false;
+		bench_hist_add(&t->result->hist, bench_get_time_ns() - t0);
+		devdb_unlock(t->db);
+	}
+	else {
+		// as devdb, which looks it up for each of them
+		uint32_t pid = (uint32_t)getpid();
+
+		_model_lock(t->model, t->layout, pid);
+		t0 = bench_get_time_ns();
+		r = _model_ref(t->model, t->layout, t->slot, pid, ref);
+		bench_hist_add(&t->result->hist, bench_get_time_ns() - t0);
+		_model_unlock(t->model, t->layout, pid);
+	}
+
+	return r;
+}
+
+static void _thread_main(void *arg)
+{
+	struct _thread *t = arg;
+	struct _thread_result *res = t->result;
+
+	while (__atomic_load_n(&t->shared->start, __ATOMIC_ACQUIRE) == 0)
+		_futex_wait(&t->shared->start, 0);
+
+	while (bench_get_time_ns() < t->shared->end)
+	{
+		if (_ref(t, true) == false)
+			break;
+
+		if (_ref(t, false) == false)
+			break;
+
+		res->ops += 2;
+	}
+
+	if (bench_get_time_ns() < t->shared->end)
+		__atomic_store_n(&t->shared->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void _process_main(struct _shared *const s, const struct _config *const c, const uint32_t index)
+{
+	struct _thread thread[_MAX_THREAD_NUM];
+	bench_thread handle[_MAX_THREAD_NUM];
+	uint32_t created = 0;
+	cpu_set_t cpu;
+	devdb db;
+
+	CPU_ZERO(&cpu);
+	CPU_SET(c->cpu[index % c->cpus], &cpu);
+	sched_setaffinity(0, sizeof(cpu), &cpu);
+
+	if (c->layout == NULL)
+	{
+		if (devdb_open(&db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+			fprintf(stderr, "devdb_open failed\n");
+			__atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&s->ready, 1, __ATOMIC_RELEASE);
+			_exit(1);
+		}
+
+		// the table of the slots is mapped before the run
+		devdb_lock(&db);
+		devdb_unlock(&db);
+	}
+
+	for (uint32_t i = 0; i < c->threads; i++) {
+		thread[i].db = &db;
+		thread[i].layout = c->layout;
+		thread[i].model = c->model;
+		thread[i].shared = s;
+		thread[i].result = &s->result[index][i];
+		thread[i].slot = (index * c->threads + i) % c->slots;
+
+		handle[i] = bench_thread_create(_thread_main, &thread[i]);
+		if (handle[i] == NULL) {
+			fprintf(stderr, "bench_thread_create failed\n");
+			__atomic_store_n(&s->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		created++;
+	}
+
+	__atomic_add_fetch(&s->ready, 1, __ATOMIC_RELEASE);
+
+	for (uint32_t i = 0; i < created; i++)
+		bench_thread_join(handle[i]);
+
+	if (c->layout == NULL)
+		devdb_close(&db);
+
+	_exit(0);
+}
+
+static bool _run(struct _shared *const s, const struct _config *const c)
+{
+	const struct _layout *l = c->layout;
+	pid_t pid[_MAX_PROCESS_NUM];
+	struct rusage ru_child;
+	struct bench_hist *all;
+	struct devdb_lock_stats ls;
+	uint64_t ops = 0, start, elapsed;
+	uint32_t generation, forked = 0, ref = 0;
+	devdb db;
+	bool r = false;
+
+	memset(s, 0, sizeof(struct _shared));
+
+	all = malloc(sizeof(struct bench_hist));
+	if (all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return false;
+	}
+
+	bench_hist_init(all);
+
+	if (l == NULL)
+	{
+		// created by this process, and kept open for the statistics
+		if (devdb_open(&db, c->name, L"", 0, 1) != DEVDB_S_OK) {
+			fprintf(stderr, "devdb_open failed\n");
+			free(all);
+			return false;
+		}
+
+		// simulated devices give the database its slots
+		devdb_set_simulated(&db, L"bench", c->slots);
+		if (devdb_update(&db) != DEVDB_S_OK) {
+			fprintf(stderr, "devdb_update failed\n");
+			goto end;
+		}
+	}
+	else
+	{
+		memset(c->model, 0, l->info_size + (size_t)l->slot_size * c->slots);
+	}
+
+	for (uint32_t i = 0; i < c->processes; i++)
+		for (uint32_t j = 0; j < c->threads; j++)
+			bench_hist_init(&s->result[i][j].hist);
+
+	for (uint32_t i = 0; i < c->processes; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0)
+			_process_main(s, c, i);
+		if (pid[i] < 0) {
+			fprintf(stderr, "fork failed\n");
+			goto end;
+		}
+		forked++;
+	}
+
+	while (__atomic_load_n(&s->ready, __ATOMIC_ACQUIRE) < c->processes)
+		usleep(1000);
+
+	// the statistics of the opens are left out
+	if (l == NULL) {
+		devdb_lock(&db);
+		memset(&db.info->stats, 0, sizeof(db.info->stats));
+		devdb_unlock(&db);
+	}
+
+	start = bench_get_time_ns();
+	s->end = start + c->duration;
+	__atomic_store_n(&s->start, 1, __ATOMIC_RELEASE);
+	_futex_wake(&s->start, INT_MAX);
+
+	for (uint32_t i = 0; i < c->processes; i++)
+		waitpid(pid[i], NULL, 0);
+
+	elapsed = bench_get_time_ns() - start;
+
+	if (s->failed != 0) {
+		fprintf(stderr, "a process has failed\n");
+		goto end;
+	}
+
+	// every reference taken has been dropped
+	for (uint32_t i = 0; i < c->slots; i++) {
+		uint32_t n = 0;
+
+		if (l == NULL)
+			devdb_get_ref_count(&db, i, &n);
+		else
+			n = *_model_word(c->model + l->info_size + (size_t)l->slot_size * i, l->slot_ref);
+		ref += n;
+	}
+
+	if (ref != 0) {
+		fprintf(stderr, "%u references are left\n", ref);
+		goto end;
+	}
+
+	getrusage(RUSAGE_CHILDREN, &ru_child);
+
+	if (l == NULL) {
+		devdb_get_lock_stats(&db, &ls);
+	}
+	else {
+		// the model keeps no wait times
+		memset(&ls, 0, sizeof(ls));
+		ls.contended = *_model_word(c->model, l->contended);
+		ls.sleep = *_model_word(c->model, l->sleep);
+	}
+
+	for (uint32_t i = 0; i < c->processes; i++) {
+		for (uint32_t j = 0; j < c->threads; j++) {
+			ops += s->result[i][j].ops;
+			bench_hist_merge(all, &s->result[i][j].hist);
+		}
+	}
+
+	// the children of the earlier runs are counted too
+	static uint64_t child_csw = 0;
+	uint64_t csw = (uint64_t)(ru_child.ru_nvcsw + ru_child.ru_nivcsw) - child_csw;
+
+	child_csw += csw;
+
+	printf("{\"layout\":\"%s\",\"cpus\":%u,\"processes\":%u,\"threads\":%u,\"slots\":%u,\"ops\":%llu,\"ops_per_sec\":%.1f,\"hold_p50_ns\":%llu,\"hold_p99_ns\":%llu,\"hold_max_ns\":%llu,\"csw_per_op\":%.3f,"
+		"\"contended\":%u,\"sleep\":%u",
+		(l == NULL) ? "devdb" : l->name, (c->cpus < c->processes) ? c->cpus : c->processes,
+		c->processes, c->threads, c->slots, (unsigned long long)ops, (double)ops * 1000000000.0 / elapsed,
+		(unsigned long long)bench_hist_percentile(all, 0.5), (unsigned long long)bench_hist_percentile(all, 0.99), (unsigned long long)all->max,
+		(ops != 0) ? (double)csw / ops : 0.0, ls.contended, ls.sleep);
+
+	if (l == NULL)
+		printf(",\"lock_wait_avg_us\":%.1f,\"lock_wait_max_us\":%u", (ls.contended != 0) ? (double)ls.wait_total / ls.contended : 0.0, ls.wait_max);
+
+	printf("}\n");
+
+	r = true;
+
+end:
+	// the children forked before a failure see the run as already over
+	if (forked != 0 && r == false) {
+		__atomic_store_n(&s->start, 1, __ATOMIC_RELEASE);
+		_futex_wake(&s->start, INT_MAX);
+
+		for (uint32_t i = 0; i < forked; i++)
+			waitpid(pid[i], NULL, 0);
+	}
+
+	if (l == NULL) {
+		generation = db.info->generation;
+		devdb_close(&db);
+		bench_devdb_remove(c->name, generation);
+	}
+
+	free(all);
+
+	return r;
+}
+
+// the next number of a list such as "1,2,4". returns false at its end, or on an error.
+static bool _next(const char **const list, uint32_t *const v, const uint32_t max, bool *const error)
+{
+	char *next;
+
+	if (**list == '\0')
+		return false;
+
+	*v = (uint32_t)strtoul(*list, &next, 10);
+	if (next == *list || *v == 0 || *v > max) {
+		*error = true;
+		return false;
+	}
+
+	*list = (*next == ',') ? next + 1 : next;
+
+	return true;
+}
+
+int bench_ref_main(int argc, char *argv[])
+{
+	const char *processes = bench_get_arg_str(argc, argv, "processes", "1,2,4");
+	const char *threads = bench_get_arg_str(argc, argv, "threads", "1,4");
+	bool packed = bench_get_arg_flag(argc, argv, "packed");
+	uint32_t cpus = (uint32_t)bench_get_arg_uint(argc, argv, "cpus", _MAX_CPU_NUM);
+	size_t model_size = 0;
+	struct _config c;
+	struct _shared *s;
+	cpu_set_t cpu;
+	bool error = false;
+	int r = 0;
+
+	memset(&c, 0, sizeof(c));
+	c.duration = bench_get_arg_uint(argc, argv, "duration", 2000) * 1000000;
+	c.slots = (uint32_t)bench_get_arg_uint(argc, argv, "slots", 1);
+
+	if (c.slots == 0 || c.slots > 0x10000) {
+		fprintf(stderr, "--slots must be 1..65536\n");
+		return 1;
+	}
+
+	// the processors this process may run on
+	CPU_ZERO(&cpu);
+	sched_getaffinity(0, sizeof(cpu), &cpu);
+
+	for (int i = 0; i < CPU_SETSIZE && c.cpus < cpus && c.cpus < _MAX_CPU_NUM; i++) {
+		if (CPU_ISSET(i, &cpu))
+			c.cpu[c.cpus++] = i;
+	}
+
+	if (c.cpus == 0) {
+		fprintf(stderr, "--cpus must be 1 or more\n");
+		return 1;
+	}
+
+	s = mmap(NULL, sizeof(struct _shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (s == MAP_FAILED) {
+		fprintf(stderr, "mmap failed\n");
+		return 1;
+	}
+
+	if (packed == true)
+	{
+		for (uint32_t i = 0; i < sizeof(_layout) / sizeof(_layout[0]); i++) {
+			size_t size = _layout[i].info_size + (size_t)_layout[i].slot_size * c.slots;
+
+			if (model_size < size)
+				model_size = size;
+		}
+
+		c.model = mmap(NULL, model_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (c.model == MAP_FAILED) {
+			fprintf(stderr, "mmap failed\n");
+			munmap(s, sizeof(struct _shared));
+			return 1;
+		}
+	}
+
+	for (const char *p = processes; r == 0 && _next(&p, &c.processes, _MAX_PROCESS_NUM, &error) == true; )
+	{
+		for (const char *t = threads; _next(&t, &c.threads, _MAX_THREAD_NUM, &error) == true; )
+		{
+			swprintf(c.name, sizeof(c.name) / sizeof(wchar_t), L"bench_ref_%u_%u_%u", (uint32_t)getpid(), c.processes, c.threads);
+
+			if (packed == false) {
+				if (_run(s, &c) == false)
+					r = 1;
+			}
+			else {
+				// the layouts of a run are next to each other
+				for (uint32_t i = 0; r == 0 && i < sizeof(_layout) / sizeof(_layout[0]); i++) {
+					c.layout = &_layout[i];
+					if (_run(s, &c) == false)
+						r = 1;
+				}
+			}
+
+			if (r != 0)
+				break;
+		}
+	}
+
+	if (error == true) {
+		fprintf(stderr, "--processes and --threads must be lists of 1..%u\n", _MAX_THREAD_NUM);
+		r = 1;
+	}
+
+	if (c.model != NULL)
+		munmap(c.model, model_size);
+
+	munmap(s, sizeof(struct _shared));
+
+	return r;
+}
+
+#else
+
+int bench_ref_main(int argc, char *argv[])
+{
+	fprintf(stderr, "ref runs on Linux, over POSIX shared memory and futexes\n");
+	return 1;
+}
+
+#endif
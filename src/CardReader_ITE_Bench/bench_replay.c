@@ -0,0 +1,221 @@
+// bench_replay.c
+//
+// replays a recording of the device control requests (DevctlRecordFile) through
+// itecard.c. the itecard calls of every session are made again in the order the
+// sessions started, against a transport which answers with the recorded responses
+// after the recorded delays, and the results and the latencies are compared.
+//
+// the sessions are replayed one after another, so the contention between the
+// processes which made them is not reproduced.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/itecard.h"
+#include "../CardReader_ITE/iterec.h"
+#include "bench.h"
+
+struct _result
+{
+	uint64_t calls;
+	uint64_t mismatches;
+	uint64_t skipped;
+	uint64_t unmatched;
+	uint64_t diverged;
+	struct bench_hist recorded;		// of the transmits
+	struct bench_hist replayed;
+};
+
+static void _add_result(struct _result *const dst, const struct _result *const src)
+{
+	dst->calls += src->calls;
+	dst->mismatches += src->mismatches;
+	dst->skipped += src->skipped;
+	dst->unmatched += src->unmatched;
+	dst->diverged += src->diverged;
+	bench_hist_merge(&dst->recorded, &src->recorded);
+	bench_hist_merge(&dst->replayed, &src->replayed);
+}
+
+static void _print_result(const char *const name, const uint32_t index, const struct _result *const res)
+{
+	printf("{\"%s\":%u,\"calls\":%llu,\"mismatches\":%llu,\"skipped\":%llu,\"unmatched\":%llu,\"diverged\":%llu,\"transmits\":%llu,"
+		"\"recorded_p50_us\":%.1f,\"recorded_p99_us\":%.1f,\"replayed_p50_us\":%.1f,\"replayed_p99_us\":%.1f}\n",
+		name, index, (unsigned long long)res->calls, (unsigned long long)res->mismatches,
+		(unsigned long long)res->skipped, (unsigned long long)res->unmatched, (unsigned long long)res->diverged,
+		(unsigned long long)res->recorded.total,
+		bench_hist_percentile(&res->recorded, 0.5) / 1000.0, bench_hist_percentile(&res->recorded, 0.99) / 1000.0,
+		bench_hist_percentile(&res->replayed, 0.5) / 1000.0, bench_hist_percentile(&res->replayed, 0.99) / 1000.0);
+}
+
+static void _replay_session(const struct iterec_trace *const trace, const uint32_t index, const wchar_t *const file, struct itecard_shared_readerinfo *const readers, struct _result *const res)
+{
+	const struct iterec_session *s = &trace->session[index];
+	struct itecard_handle h;
+	wchar_t path[ITEREC_REPLAY_PATH_PREFIX_LEN + 12 + 1024];
+	uint8_t recv[ITEREC_MAX_DATA_SIZE];
+
+	memset(&h, 0, sizeof(struct itecard_handle));
+	swprintf(path, sizeof(path) / sizeof(wchar_t), L"%ls%u#%ls", ITEREC_REPLAY_PATH_PREFIX, index, file);
+
+	for (uint32_t i = 0; i < s->record_num; i++)
+	{
+		const struct iterec_record *r = s->record[i];
+		const uint8_t *in = (const uint8_t *)r + sizeof(struct iterec_record);
+		const uint8_t *out = in + r->in_len;
+		uint32_t out_len = r->size - sizeof(struct iterec_record) - r->in_len;
+		itecard_status_t ret = ITECARD_E_INTERNAL;
+		bool match = true;
+
+		if (r->kind != ITEREC_KIND_CALL)
+			continue;
+
+		switch (r->code)
+		{
+		case ITEREC_CALL_OPEN:
+			if (r->in_len < 3 || s->device >= trace->device_num) {
+				match = false;
+				break;
+			}
+			ret = itecard_open(&h, path, &readers[s->device], (itecard_protocol_t)in[0], (in[1] != 0) ? true : false, (in[2] != 0) ? true : false);
+			break;
+
+		case ITEREC_CALL_CLOSE:
+			if (r->in_len < 3) {
+				match = false;
+				break;
+			}
+			ret = itecard_close(&h, (in[0] != 0) ? true : false, (in[1] != 0) ? true : false, (in[2] != 0) ? true : false);
+			break;
+
+		case ITEREC_CALL_DETECT:
+		{
+			bool b = false;
+
+			ret = itecard_detect(&h, &b);
+			if (ret == ITECARD_S_OK && out_len >= 1 && b != (out[0] != 0))
+				match = false;
+			break;
+		}
+
+		case ITEREC_CALL_INIT:
+			ret = itecard_init(&h);
+			break;
+
+		case ITEREC_CALL_TRANSMIT:
+		{
+			uint32_t recv_size, recv_len;
+			uint64_t t;
+
+			if (r->in_len < 5) {
+				match = false;
+				break;
+			}
+
+			memcpy(&recv_size, in + 1, 4);
+			recv_len = (recv_size < sizeof(recv)) ? recv_size : sizeof(recv);
+
+			t = bench_get_time_ns();
+			ret = itecard_transmit(&h, (itecard_protocol_t)in[0], in + 5, r->in_len - 5, recv, &recv_len);
+			bench_hist_add(&res->replayed, bench_get_time_ns() - t);
+			bench_hist_add(&res->recorded, (uint64_t)r->duration * 1000);
+
+			if (ret == ITECARD_S_OK && (recv_len != out_len || memcmp(recv, out, out_len) != 0))
+				match = false;
+			break;
+		}
+
+		default:
+			match = false;
+		}
+
+		if (ret != (itecard_status_t)r->result)
+			match = false;
+
+		res->calls++;
+		if (match == false)
+			res->mismatches++;
+	}
+
+	// the process ended without closing the card: leave the reader as it was
+	itecard_close(&h, false, false, false);
+
+	res->skipped += s->skipped;
+	res->unmatched += s->unmatched;
+	res->diverged += s->diverged;
+}
+
+int bench_replay_main(int argc, char *argv[])
+{
+	const char *file = bench_get_arg_str(argc, argv, "trace", NULL);
+	uint64_t session = bench_get_arg_uint(argc, argv, "session", UINT64_MAX);
+	wchar_t wfile[1024];
+	const struct iterec_trace *trace;
+	struct itecard_shared_readerinfo *readers;
+	struct _result *total, *res;
+
+	if (file == NULL) {
+		fprintf(stderr, "--trace is required\n");
+		return 1;
+	}
+
+	if (mbstowcs(wfile, file, sizeof(wfile) / sizeof(wchar_t)) >= sizeof(wfile) / sizeof(wchar_t)) {
+		fprintf(stderr, "--trace is too long\n");
+		return 1;
+	}
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	trace = iterec_trace_load(wfile);
+	if (trace == NULL) {
+		fprintf(stderr, "failed to load %s\n", file);
+		return 1;
+	}
+
+	if (session != UINT64_MAX && session >= trace->session_num) {
+		fprintf(stderr, "--session must be 0..%u\n", trace->session_num - 1);
+		return 1;
+	}
+
+	// the state of the readers is carried from a session to the next, as the shared one is
+	readers = calloc(trace->device_num + 1, sizeof(struct itecard_shared_readerinfo));
+	total = calloc(1, sizeof(struct _result));
+	res = malloc(sizeof(struct _result));
+	if (readers == NULL || total == NULL || res == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < trace->device_num; i++)
+		card_clear(&readers[i].card);
+
+	for (uint32_t i = 0; i < trace->session_num; i++)
+	{
+		if (session != UINT64_MAX && session != i)
+			continue;
+
+		memset(res, 0, sizeof(struct _result));
+		_replay_session(trace, i, wfile, readers, res);
+		_print_result("session", i, res);
+		_add_result(total, res);
+	}
+
+	_print_result("sessions", trace->session_num, total);
+
+	// a replay which does not reproduce the recording is a failure
+	int r = (total->mismatches != 0 || total->unmatched != 0) ? 2 : 0;
+
+	free(res);
+	free(total);
+	free(readers);
+
+	return r;
+}
@@ -0,0 +1,713 @@
+// bench_soak.c
+//
+// long runs of SCardConnect, SCardTransmit and SCardDisconnect against simulated
+// devices (see bench_e2e.c), to find what grows slowly: latency, memory, card
+// handles and device references which are not given back, and T=1 recoveries.
+//
+// a sample of all the processes is printed as one JSON line every --interval
+// seconds. the counters of the module are read from its statistics when --stats
+// names the FriendlyName of the device.
+//
+// the samples after --warmup are split in quarters at the end. the exit code is 2
+// if a metric rises through every quarter by more than --drift percent in total,
+// if a process has fewer free card handle slots than before, or if card handles
+// or device references are left once the workload has stopped.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winscard.h>
+#include <psapi.h>
+
+#pragma comment(lib, "Psapi.lib")
+#endif
+
+#include "../CardReader_ITE/stats.h"
+#include "bench.h"
+
+#ifdef _WIN32
+
+#define _MAX_THREAD_NUM		64
+#define _MAX_PROCESS_NUM	16
+#define _MAX_READER_NUM		16
+#define _MAX_SLOT_NUM		1024	// card handles probed at most
+#define _MAX_SAMPLE_NUM		100000
+
+struct _config
+{
+	uint64_t cycles;		// connect, transmit and disconnect of all the threads
+	uint64_t duration;		// seconds, 0: until the cycles are done
+	uint32_t processes;
+	uint32_t threads;
+	uint32_t devices;
+	uint32_t transmits;		// commands in a cycle
+	uint32_t reset;			// every n-th cycle resets the card when disconnecting
+};
+
+// shared by the processes of a run. the latencies are counted cumulatively, and
+// the parent takes the difference between two samples.
+struct _shared_process
+{
+	volatile LONGLONG cycles;
+	volatile LONGLONG errors;
+	volatile LONGLONG heap;		// bytes allocated from all the heaps of the process
+	volatile LONGLONG rss;		// working set
+	volatile LONGLONG private_bytes;
+	volatile LONG connected;	// card handles the threads hold now
+	volatile LONG finished;		// threads which have finished
+	volatile LONG slots_begin;	// free card handle slots before the workload
+	volatile LONG slots_end;	// and after it
+	volatile LONG state;		// 0: starting, 1: ready, 2: done, 3: failed
+};
+
+struct _shared
+{
+	volatile LONG start;
+	volatile LONG stop;
+	volatile LONGLONG issued;
+	struct _shared_process process[_MAX_PROCESS_NUM];
+	volatile LONG hist[BENCH_HIST_SIZE];
+};
+
+struct _worker
+{
+	const struct bench_scard_api *api;
+	const struct _config *config;
+	const char *reader;
+	struct _shared *shared;
+	struct _shared_process *process;
+};
+
+// the counts with "since the last sample" are rates, the others are levels
+struct _sample
+{
+	double t;
+	double cycles;
+	double errors;			// since the last sample
+	double p50_us;			// of the cycles since the last sample
+	double p99_us;
+	double p999_us;
+	double rss_kb;
+	double private_kb;
+	double heap_kb;
+	double connected;		// card handles held by the threads
+	// from the statistics of the module, summed over the devices
+	double handles;
+	double ref;
+	double retry;			// since the last sample
+	double resynch;
+	double reinit;
+	double card_init;
+};
+
+static const uint8_t _cmd[] = { 0x90, 0x30, 0x00, 0x02, 0x00 };
+
+static void _worker_proc(void *arg)
+{
+	struct _worker *w = arg;
+	const struct bench_scard_api *api = w->api;
+	const struct _config *config = w->config;
+	SCARDCONTEXT ctx = 0;
+	uint64_t n = 0;
+
+	if (api->EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx) != SCARD_S_SUCCESS) {
+		InterlockedIncrement64(&w->process->errors);
+		goto end;
+	}
+
+	while (w->shared->stop == 0)
+	{
+		SCARDHANDLE card;
+		DWORD protocol;
+		LONG r;
+		uint64_t t0;
+
+		if (config->cycles != 0 && (uint64_t)InterlockedIncrement64(&w->shared->issued) > config->cycles)
+			break;
+
+		n++;
+		t0 = bench_get_time_ns();
+
+		r = api->ConnectA(ctx, w->reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card, &protocol);
+		if (r == SCARD_S_SUCCESS)
+		{
+			InterlockedIncrement(&w->process->connected);
+
+			for (uint32_t i = 0; i < config->transmits && r == SCARD_S_SUCCESS; i++) {
+				uint8_t res[260];
+				DWORD res_len = sizeof(res);
+
+				r = api->Transmit(card, SCARD_PCI_T1, _cmd, sizeof(_cmd), NULL, res, &res_len);
+			}
+
+			if (api->Disconnect(card, (config->reset != 0 && (n % config->reset) == 0) ? SCARD_RESET_CARD : SCARD_LEAVE_CARD) != SCARD_S_SUCCESS)
+				r = SCARD_F_INTERNAL_ERROR;
+
+			InterlockedDecrement(&w->process->connected);
+		}
+
+		if (r == SCARD_S_SUCCESS) {
+			InterlockedIncrement(&w->shared->hist[bench_hist_index(bench_get_time_ns() - t0)]);
+			InterlockedIncrement64(&w->process->cycles);
+		}
+		else {
+			InterlockedIncrement64(&w->process->errors);
+		}
+	}
+
+	api->ReleaseContext(ctx);
+
+end:
+	InterlockedIncrement(&w->process->finished);
+}
+
+// connects until the list of card handles is full. it is only called while the
+// threads of the process are not running.
+static LONG _probe_slots(const struct bench_scard_api *const api, const char *const reader)
+{
+	SCARDCONTEXT ctx;
+	SCARDHANDLE *card;
+	LONG n = 0;
+
+	card = malloc(sizeof(SCARDHANDLE) * _MAX_SLOT_NUM);
+	if (card == NULL)
+		return -1;
+
+	if (api->EstablishContext(SCARD_SCOPE_USER, NULL, NULL, &ctx) == SCARD_S_SUCCESS) {
+		DWORD protocol;
+
+		while (n < _MAX_SLOT_NUM && api->ConnectA(ctx, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &card[n], &protocol) == SCARD_S_SUCCESS)
+			n++;
+
+		for (LONG i = 0; i < n; i++)
+			api->Disconnect(card[i], SCARD_LEAVE_CARD);
+
+		api->ReleaseContext(ctx);
+	}
+	else {
+		n = -1;
+	}
+
+	free(card);
+
+	return n;
+}
+
+// memAlloc of the module takes its own heap, which is one of the heaps of the process
+static uint64_t _heap_bytes(void)
+{
+	HANDLE heap[64];
+	DWORD num;
+	uint64_t total = 0;
+
+	num = GetProcessHeaps(64, heap);
+	if (num > 64)
+		num = 64;
+
+	for (DWORD i = 0; i < num; i++) {
+		PROCESS_HEAP_ENTRY e;
+
+		if (HeapLock(heap[i]) == FALSE)
+			continue;
+
+		e.lpData = NULL;
+		while (HeapWalk(heap[i], &e) != FALSE) {
+			if (e.wFlags & PROCESS_HEAP_ENTRY_BUSY)
+				total += e.cbData;
+		}
+
+		HeapUnlock(heap[i]);
+	}
+
+	return total;
+}
+
+static void _update_memory(struct _shared_process *const process)
+{
+	PROCESS_MEMORY_COUNTERS_EX pmc;
+
+	memset(&pmc, 0, sizeof(pmc));
+	pmc.cb = sizeof(pmc);
+
+	if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&pmc, sizeof(pmc)) != FALSE) {
+		InterlockedExchange64(&process->rss, pmc.WorkingSetSize);
+		InterlockedExchange64(&process->private_bytes, pmc.PrivateUsage);
+	}
+
+	InterlockedExchange64(&process->heap, _heap_bytes());
+}
+
+// the part which every process runs. the parent calls sample() between the updates of the memory.
+static bool _run_process(const struct bench_scard_api *const api, const struct _config *const config, const char *const *const readers, struct _shared *const shared, const uint32_t index, const uint32_t interval, bool (*sample)(void *prm), void *prm)
+{
+	struct _shared_process *process = &shared->process[index];
+	struct _worker *w;
+	bench_thread th[_MAX_THREAD_NUM];
+	bool r = true;
+
+	w = malloc(sizeof(struct _worker) * config->threads);
+	if (w == NULL) {
+		fprintf(stderr, "out of memory\n");
+		InterlockedExchange(&process->state, 3);
+		return false;
+	}
+
+	InterlockedExchange(&process->slots_begin, _probe_slots(api, readers[0]));
+	_update_memory(process);
+	InterlockedExchange(&process->state, 1);
+
+	while (shared->start == 0)
+		Sleep(1);
+
+	for (uint32_t i = 0; i < config->threads; i++) {
+		w[i].api = api;
+		w[i].config = config;
+		w[i].reader = readers[(index * config->threads + i) % config->devices];
+		w[i].shared = shared;
+		w[i].process = process;
+		th[i] = bench_thread_create(_worker_proc, &w[i]);
+	}
+
+	while ((uint32_t)process->finished < config->threads) {
+		Sleep(interval);
+		_update_memory(process);
+
+		if (sample != NULL && sample(prm) == false) {
+			InterlockedExchange(&shared->stop, 1);
+			r = false;
+		}
+	}
+
+	for (uint32_t i = 0; i < config->threads; i++)
+		bench_thread_join(th[i]);
+
+	free(w);
+
+	InterlockedExchange(&process->slots_end, _probe_slots(api, readers[0]));
+	_update_memory(process);
+	InterlockedExchange(&process->state, 2);
+
+	return r;
+}
+
+struct _monitor
+{
+	const struct _config *config;
+	struct _shared *shared;
+	const struct stats_shared_info *stats;
+	uint64_t begin;
+	uint32_t hist[BENCH_HIST_SIZE];		// counts at the last sample
+	struct bench_hist delta;
+	struct stats_shared_reader prev;
+	uint64_t errors;
+	struct _sample *sample;
+	uint32_t sample_num;
+};
+
+static void _sum_stats(const struct stats_shared_info *const info, struct stats_shared_reader *const sum)
+{
+	memset(sum, 0, sizeof(struct stats_shared_reader));
+
+	if (info == NULL)
+		return;
+
+	for (uint32_t i = 0; i < info->count && i < STATS_MAX_READER_NUM; i++) {
+		const struct stats_shared_reader *rd = &info->reader[i];
+
+		if (rd->active == 0)
+			continue;
+
+		sum->retry += rd->retry;
+		sum->resynch += rd->resynch;
+		sum->reinit += rd->reinit;
+		sum->card_init += rd->card_init;
+		sum->handle_num += rd->handle_num;
+		sum->ref += rd->ref;
+	}
+}
+
+static void _take_sample(struct _monitor *const m, struct _sample *const s)
+{
+	struct stats_shared_reader cur;
+	uint64_t cycles = 0, errors = 0, rss = 0, private_bytes = 0, heap = 0;
+	uint32_t connected = 0;
+
+	memset(s, 0, sizeof(struct _sample));
+	s->t = (bench_get_time_ns() - m->begin) / 1000000000.0;
+
+	for (uint32_t i = 0; i < m->config->processes; i++) {
+		const struct _shared_process *p = &m->shared->process[i];
+
+		cycles += p->cycles;
+		errors += p->errors;
+		rss += p->rss;
+		private_bytes += p->private_bytes;
+		heap += p->heap;
+		connected += p->connected;
+	}
+
+	s->cycles = (double)cycles;
+	s->errors = (double)(errors - m->errors);
+	s->rss_kb = (double)(rss / 1024);
+	s->private_kb = (double)(private_bytes / 1024);
+	s->heap_kb = (double)(heap / 1024);
+	s->connected = connected;
+	m->errors = errors;
+
+	bench_hist_init(&m->delta);
+	for (uint32_t i = 0; i < BENCH_HIST_SIZE; i++) {
+		uint32_t c = (uint32_t)m->shared->hist[i];
+
+		m->delta.count[i] = c - m->hist[i];
+		m->delta.total += m->delta.count[i];
+		m->hist[i] = c;
+	}
+	m->delta.max = UINT64_MAX;
+
+	s->p50_us = bench_hist_percentile(&m->delta, 0.5) / 1000.0;
+	s->p99_us = bench_hist_percentile(&m->delta, 0.99) / 1000.0;
+	s->p999_us = bench_hist_percentile(&m->delta, 0.999) / 1000.0;
+
+	_sum_stats(m->stats, &cur);
+
+	s->handles = cur.handle_num;
+	s->ref = cur.ref;
+	s->retry = cur.retry - m->prev.retry;
+	s->resynch = cur.resynch - m->prev.resynch;
+	s->reinit = cur.reinit - m->prev.reinit;
+	s->card_init = cur.card_init - m->prev.card_init;
+
+	m->prev = cur;
+}
+
+static void _print_sample(const struct _monitor *const m, const struct _sample *const s)
+{
+	printf("{\"t\":%.1f,\"cycles\":%.0f,\"errors\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"rss_kb\":%.0f,\"private_kb\":%.0f,\"heap_kb\":%.0f,\"connected\":%.0f",
+		s->t, s->cycles, s->errors, s->p50_us, s->p99_us, s->p999_us, s->rss_kb, s->private_kb, s->heap_kb, s->connected);
+
+	if (m->stats != NULL) {
+		printf(",\"handles\":%.0f,\"ref\":%.0f,\"retry\":%.0f,\"resynch\":%.0f,\"reinit\":%.0f,\"card_init\":%.0f",
+			s->handles, s->ref, s->retry, s->resynch, s->reinit, s->card_init);
+	}
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+static bool _monitor_sample(void *prm)
+{
+	struct _monitor *m = prm;
+	struct _sample *s;
+
+	if (m->sample_num >= _MAX_SAMPLE_NUM)
+		return true;
+
+	s = &m->sample[m->sample_num++];
+	_take_sample(m, s);
+	_print_sample(m, s);
+
+	if (m->config->duration != 0 && s->t >= (double)m->config->duration)
+		InterlockedExchange(&m->shared->stop, 1);
+
+	return true;
+}
+
+// the metrics which must not keep rising
+
+static const struct {
+	const char *name;
+	size_t offset;
+} _metrics[] = {
+	{ "p50_us", offsetof(struct _sample, p50_us) },
+	{ "p99_us", offsetof(struct _sample, p99_us) },
+	{ "p999_us", offsetof(struct _sample, p999_us) },
+	{ "rss_kb", offsetof(struct _sample, rss_kb) },
+	{ "private_kb", offsetof(struct _sample, private_kb) },
+	{ "heap_kb", offsetof(struct _sample, heap_kb) },
+	{ "errors", offsetof(struct _sample, errors) },
+	{ "handles", offsetof(struct _sample, handles) },
+	{ "ref", offsetof(struct _sample, ref) },
+	{ "retry", offsetof(struct _sample, retry) },
+	{ "resynch", offsetof(struct _sample, resynch) },
+	{ "reinit", offsetof(struct _sample, reinit) },
+};
+
+static bool _check_drift(const struct _monitor *const m, const double warmup, const double drift)
+{
+	uint32_t first = 0, n;
+	bool drifted = false;
+
+	while (first < m->sample_num && m->sample[first].t < warmup)
+		first++;
+
+	n = m->sample_num - first;
+	if (n < 8) {
+		fprintf(stderr, "too few samples after the warmup (%u) to check the drift\n", n);
+		return false;
+	}
+
+	for (uint32_t i = 0; i < sizeof(_metrics) / sizeof(_metrics[0]); i++)
+	{
+		double q[4];
+
+		for (uint32_t j = 0; j < 4; j++) {
+			uint32_t b = first + (n * j) / 4, e = first + (n * (j + 1)) / 4;
+
+			q[j] = 0;
+			for (uint32_t k = b; k < e; k++)
+				q[j] += *(const double *)((const uint8_t *)&m->sample[k] + _metrics[i].offset);
+			q[j] /= (e - b);
+		}
+
+		if (q[0] <= q[1] && q[1] <= q[2] && q[2] <= q[3] && q[3] > q[0] && q[3] > q[0] * (1.0 + (drift / 100))) {
+			fprintf(stderr, "drift: %s rises through the quarters: %.1f %.1f %.1f %.1f\n", _metrics[i].name, q[0], q[1], q[2], q[3]);
+			drifted = true;
+		}
+	}
+
+	return drifted;
+}
+
+static bool _check_leaks(const struct _monitor *const m, const struct stats_shared_reader *const before)
+{
+	struct stats_shared_reader after;
+	bool leaked = false;
+
+	for (uint32_t i = 0; i < m->config->processes; i++) {
+		const struct _shared_process *p = &m->shared->process[i];
+
+		if (p->slots_end < p->slots_begin) {
+			fprintf(stderr, "leak: process %u has %ld free card handle slots, %ld before\n", i, p->slots_end, p->slots_begin);
+			leaked = true;
+		}
+	}
+
+	if (m->stats != NULL) {
+		_sum_stats(m->stats, &after);
+
+		if (after.handle_num != before->handle_num) {
+			fprintf(stderr, "leak: %u card handles are open, %u before\n", after.handle_num, before->handle_num);
+			leaked = true;
+		}
+		if (after.ref != before->ref) {
+			fprintf(stderr, "leak: %u device references, %u before\n", after.ref, before->ref);
+			leaked = true;
+		}
+	}
+
+	return leaked;
+}
+
+static const struct stats_shared_info * _open_stats(const char *const name)
+{
+	char obj_name[256];
+	HANDLE shmem;
+	const struct stats_shared_info *info;
+
+	snprintf(obj_name, sizeof(obj_name), "itecard_stats_%s_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}", name);
+
+	shmem = OpenFileMappingA(FILE_MAP_READ, FALSE, obj_name);
+	if (shmem == NULL) {
+		fprintf(stderr, "OpenFileMapping(%s) failed: %lu\n", obj_name, GetLastError());
+		return NULL;
+	}
+
+	info = MapViewOfFile(shmem, FILE_MAP_READ, 0, 0, 0);
+	if (info == NULL || info->signature != STATS_SHARED_INFO_SIGNATURE || info->version != STATS_SHARED_INFO_VERSION) {
+		fprintf(stderr, "the statistics are not available\n");
+		if (info != NULL)
+			UnmapViewOfFile(info);
+		CloseHandle(shmem);
+		return NULL;
+	}
+
+	return info;
+}
+
+static struct _shared * _open_shared(const uint64_t parent, const bool create)
+{
+	char name[64];
+	HANDLE shmem;
+
+	snprintf(name, sizeof(name), "itecard_bench_soak_%llu", (unsigned long long)parent);
+
+	if (create == true) {
+		shmem = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(struct _shared), name);
+	}
+	else {
+		shmem = OpenFileMappingA(FILE_MAP_WRITE, FALSE, name);
+	}
+
+	if (shmem == NULL) {
+		fprintf(stderr, "CreateFileMapping/OpenFileMapping failed: %lu\n", GetLastError());
+		return NULL;
+	}
+
+	// the mapping is zeroed when it is created, and is kept until the process exits
+	return MapViewOfFile(shmem, FILE_MAP_WRITE, 0, 0, 0);
+}
+
+static bool _spawn_children(const struct _config *const config, const char *const module, const uint32_t interval, PROCESS_INFORMATION *const pi)
+{
+	char exe[MAX_PATH + 1];
+
+	GetModuleFileNameA(NULL, exe, MAX_PATH);
+
+	// the parent is process 0
+	for (uint32_t i = 1; i < config->processes; i++)
+	{
+		char cmdline[MAX_PATH * 3];
+		STARTUPINFOA si;
+
+		snprintf(cmdline, sizeof(cmdline), "\"%s\" soak --child %u --parent %lu --module \"%s\" --cycles %llu --threads %u --devices %u --transmits %u --reset %u --interval %u",
+			exe, i, GetCurrentProcessId(), module, (unsigned long long)config->cycles, config->threads, config->devices, config->transmits, config->reset, interval / 1000);
+
+		memset(&si, 0, sizeof(si));
+		si.cb = sizeof(si);
+
+		if (CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi[i]) == FALSE) {
+			fprintf(stderr, "CreateProcess failed: %lu\n", GetLastError());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int bench_soak_main(int argc, char *argv[])
+{
+	const char *module = bench_get_arg_str(argc, argv, "module", "CardReader_ITE.dll");
+	const char *stats_name = bench_get_arg_str(argc, argv, "stats", NULL);
+	const char *child = bench_get_arg_str(argc, argv, "child", NULL);
+	uint32_t interval = (uint32_t)bench_get_arg_uint(argc, argv, "interval", 10) * 1000;
+	double warmup = (double)bench_get_arg_uint(argc, argv, "warmup", 60);
+	double drift = (double)bench_get_arg_uint(argc, argv, "drift", 10);
+	PROCESS_INFORMATION pi[_MAX_PROCESS_NUM];
+	struct stats_shared_reader before;
+	struct _config config;
+	struct _shared *shared;
+	struct _monitor *m;
+	struct bench_scard_api api;
+	char buf[0x1000];
+	const char *readers[_MAX_READER_NUM];
+	uint32_t reader_num;
+	int r = 0;
+
+	config.cycles = bench_get_arg_uint(argc, argv, "cycles", 1000000);
+	config.duration = bench_get_arg_uint(argc, argv, "duration", 0);
+	config.processes = (uint32_t)bench_get_arg_uint(argc, argv, "processes", 1);
+	config.threads = (uint32_t)bench_get_arg_uint(argc, argv, "threads", 4);
+	config.devices = (uint32_t)bench_get_arg_uint(argc, argv, "devices", 1);
+	config.transmits = (uint32_t)bench_get_arg_uint(argc, argv, "transmits", 4);
+	config.reset = (uint32_t)bench_get_arg_uint(argc, argv, "reset", 100);
+
+	if (config.processes == 0 || config.processes > _MAX_PROCESS_NUM || config.threads == 0 || config.threads > _MAX_THREAD_NUM || interval == 0) {
+		fprintf(stderr, "--processes must be 1..%u, --threads 1..%u and --interval 1 or more\n", _MAX_PROCESS_NUM, _MAX_THREAD_NUM);
+		return 1;
+	}
+
+	if (bench_scard_load(&api, module) == false)
+		return 1;
+
+	reader_num = bench_scard_list_readers(&api, buf, sizeof(buf), readers, _MAX_READER_NUM);
+	if (reader_num == 0) {
+		fprintf(stderr, "no readers\n");
+		return 1;
+	}
+
+	if (config.devices == 0 || config.devices > reader_num)
+		config.devices = reader_num;
+
+	if (child != NULL) {
+		uint32_t index = (uint32_t)strtoul(child, NULL, 10);
+
+		shared = _open_shared(bench_get_arg_uint(argc, argv, "parent", 0), false);
+		if (shared == NULL || index == 0 || index >= _MAX_PROCESS_NUM)
+			return 1;
+
+		return (_run_process(&api, &config, readers, shared, index, interval, NULL, NULL) == true) ? 0 : 1;
+	}
+
+	shared = _open_shared(GetCurrentProcessId(), true);
+	m = calloc(1, sizeof(struct _monitor));
+	if (shared == NULL || m == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	m->config = &config;
+	m->shared = shared;
+	m->stats = (stats_name != NULL) ? _open_stats(stats_name) : NULL;
+	m->sample = malloc(sizeof(struct _sample) * _MAX_SAMPLE_NUM);
+	if (m->sample == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	// the counters of the module before any process has connected
+	_sum_stats(m->stats, &before);
+	m->prev = before;
+
+	memset(pi, 0, sizeof(pi));
+
+	if (_spawn_children(&config, module, interval, pi) == false) {
+		InterlockedExchange(&shared->stop, 1);
+		r = 1;
+	}
+
+	for (uint32_t i = 1; i < config.processes; i++) {
+		while (pi[i].hProcess != NULL && shared->process[i].state == 0 && WaitForSingleObject(pi[i].hProcess, 1) == WAIT_TIMEOUT)
+			;
+	}
+
+	m->begin = bench_get_time_ns();
+	InterlockedExchange(&shared->start, 1);
+
+	if (_run_process(&api, &config, readers, shared, 0, interval, _monitor_sample, m) == false)
+		r = 1;
+
+	// the parent may finish earlier than the children
+	for (uint32_t i = 1; i < config.processes; i++) {
+		if (pi[i].hProcess == NULL)
+			continue;
+
+		while (WaitForSingleObject(pi[i].hProcess, interval) == WAIT_TIMEOUT) {
+			_monitor_sample(m);
+		}
+
+		if (shared->process[i].state != 2) {
+			fprintf(stderr, "the child process %u failed\n", i);
+			r = 1;
+		}
+
+		CloseHandle(pi[i].hThread);
+		CloseHandle(pi[i].hProcess);
+	}
+
+	_monitor_sample(m);
+
+	if (r == 0 && (_check_drift(m, warmup, drift) == true || _check_leaks(m, &before) == true))
+		r = 2;
+
+	free(m->sample);
+	free(m);
+
+	FreeLibrary(api.module);
+
+	return r;
+}
+
+#else
+
+int bench_soak_main(int argc, char *argv[])
+{
+	fprintf(stderr, "soak needs the module, run the Windows build (under Wine on Linux)\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,320 @@
+// bench_worker.c
+//
+// compares the two ways the module does the I/O of a device (WorkerThread in the
+// INI file), with the threads of one process transmitting to one device:
+//
+//   direct: every thread takes the lock and transmits on its own handle, as the
+//           module does by default
+//   worker: every thread submits its transmits to the worker of the device, which
+//           runs them back to back under the lock
+//
+// the device is usually a simulated one:
+//
+//   --device "\\?\itecard#sim#1#C:\CardReader_ITE\sim_bcas.ini"
+//
+// a lock of this process stands in for the devdb lock.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "bench.h"
+
+#ifdef _WIN32
+
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/itecard.h"
+#include "../CardReader_ITE/worker.h"
+
+#define _MAX_THREAD_NUM	64
+
+typedef enum {
+	_MODEL_DIRECT,
+	_MODEL_WORKER,
+	_MODEL_NUM
+} _model_t;
+
+static const char *const _model_name[_MODEL_NUM] = { "direct", "worker" };
+
+struct _shared
+{
+	_model_t model;
+	SRWLOCK lock;
+	worker *w;
+	uint64_t duration;		// nanoseconds
+	const uint8_t *cmd;
+	uint32_t cmd_len;
+	HANDLE start_event;
+};
+
+struct _thread
+{
+	struct _shared *shared;
+	struct itecard_handle h;
+	HANDLE done;
+	uint64_t ops;
+	uint64_t errors;
+	struct bench_hist hist;
+};
+
+struct _transmit
+{
+	struct _thread *t;
+	uint8_t *recv;
+	uint32_t *recv_len;
+};
+
+static void _lock(void *ctx)
+{
+	AcquireSRWLockExclusive(&((struct _shared *)ctx)->lock);
+}
+
+static void _unlock(void *ctx)
+{
+	ReleaseSRWLockExclusive(&((struct _shared *)ctx)->lock);
+}
+
+static LONG _execute(void *ctx, void *prm)
+{
+	struct _transmit *tx = prm;
+
+	return (LONG)itecard_transmit(&tx->t->h, ITECARD_PROTOCOL_T1, tx->t->shared->cmd, tx->t->shared->cmd_len, tx->recv, tx->recv_len);
+}
+
+static const struct worker_ops _ops = { _lock, _unlock, _execute };
+
+static void _thread_proc(void *arg)
+{
+	struct _thread *t = arg;
+	struct _shared *s = t->shared;
+	uint8_t recv[260];
+	uint64_t begin, end;
+
+	WaitForSingleObject(s->start_event, INFINITE);
+
+	begin = bench_get_time_ns();
+	end = begin + s->duration;
+
+	while (1)
+	{
+		uint32_t recv_len = sizeof(recv);
+		itecard_status_t ret;
+		uint64_t t0, t1;
+
+		t0 = bench_get_time_ns();
+		if (t0 >= end)
+			break;
+
+		if (s->model == _MODEL_DIRECT) {
+			_lock(s);
+			ret = itecard_transmit(&t->h, ITECARD_PROTOCOL_T1, s->cmd, s->cmd_len, recv, &recv_len);
+			_unlock(s);
+		}
+		else {
+			struct _transmit tx;
+			struct worker_request req;
+
+			tx.t = t;
+			tx.recv = recv;
+			tx.recv_len = &recv_len;
+			req.prm = &tx;
+			req.done = t->done;
+
+			worker_submit(s->w, &req);
+			ret = (itecard_status_t)req.result;
+		}
+
+		t1 = bench_get_time_ns();
+		bench_hist_add(&t->hist, t1 - t0);
+
+		t->ops++;
+		if (ret != ITECARD_S_OK)
+			t->errors++;
+	}
+}
+
+static bool _run(struct _shared *const s, struct _thread *const threads, const uint32_t thread_num, const wchar_t *const path, struct itecard_shared_readerinfo *const reader)
+{
+	bench_thread th[_MAX_THREAD_NUM];
+	struct worker_stats ws = { 0, 0 };
+	struct bench_hist *all;
+	uint64_t ops = 0, errors = 0;
+
+	all = malloc(sizeof(struct bench_hist));
+	if (all == NULL) {
+		fprintf(stderr, "no memory\n");
+		return false;
+	}
+
+	bench_hist_init(all);
+	InitializeSRWLock(&s->lock);
+	s->w = NULL;
+
+	for (uint32_t i = 0; i < thread_num; i++)
+	{
+		struct _thread *t = &threads[i];
+
+		memset(&t->h, 0, sizeof(struct itecard_handle));
+		t->shared = s;
+		t->ops = 0;
+		t->errors = 0;
+		bench_hist_init(&t->hist);
+
+		if (itecard_open(&t->h, path, reader, ITECARD_PROTOCOL_T1, false, true) != ITECARD_S_OK) {
+			fprintf(stderr, "failed to open the device\n");
+			return false;
+		}
+	}
+
+	if (s->model == _MODEL_WORKER) {
+		s->w = worker_create(&_ops, s);
+		if (s->w == NULL) {
+			fprintf(stderr, "worker_create failed\n");
+			return false;
+		}
+	}
+
+	ResetEvent(s->start_event);
+
+	for (uint32_t i = 0; i < thread_num; i++)
+		th[i] = bench_thread_create(_thread_proc, &threads[i]);
+
+	SetEvent(s->start_event);
+
+	for (uint32_t i = 0; i < thread_num; i++)
+	{
+		bench_thread_join(th[i]);
+
+		ops += threads[i].ops;
+		errors += threads[i].errors;
+		bench_hist_merge(all, &threads[i].hist);
+	}
+
+	if (s->w != NULL) {
+		worker_get_stats(s->w, &ws);
+		worker_destroy(s->w);
+		s->w = NULL;
+	}
+
+	for (uint32_t i = 0; i < thread_num; i++)
+		itecard_close(&threads[i].h, false, (i == thread_num - 1) ? true : false, false);
+
+	printf("{\"model\":\"%s\",\"threads\":%u,\"size\":%u,\"ops\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"batch_avg\":%.2f}\n",
+		_model_name[s->model], thread_num, s->cmd_len, (unsigned long long)ops, (unsigned long long)errors,
+		(double)ops * 1000000000.0 / s->duration,
+		bench_hist_percentile(all, 0.5) / 1000.0, bench_hist_percentile(all, 0.99) / 1000.0, all->max / 1000.0,
+		(ws.batch != 0) ? (double)ws.request / ws.batch : 0.0);
+
+	free(all);
+
+	return true;
+}
+
+int bench_worker_main(int argc, char *argv[])
+{
+	const char *device = bench_get_arg_str(argc, argv, "device", NULL);
+	uint32_t thread_num = (uint32_t)bench_get_arg_uint(argc, argv, "threads", 4);
+	uint32_t size = (uint32_t)bench_get_arg_uint(argc, argv, "size", 5);
+	struct _shared s;
+	struct _thread *threads;
+	struct itecard_shared_readerinfo reader;
+	wchar_t path[1024];
+	uint8_t cmd[260];
+	int r = 0;
+
+	if (device == NULL) {
+		fprintf(stderr, "--device is required\n");
+		return 1;
+	}
+
+	if (mbstowcs(path, device, sizeof(path) / sizeof(wchar_t)) >= sizeof(path) / sizeof(wchar_t)) {
+		fprintf(stderr, "--device is too long\n");
+		return 1;
+	}
+
+	if (thread_num == 0 || thread_num > _MAX_THREAD_NUM) {
+		fprintf(stderr, "--threads must be 1..%u\n", _MAX_THREAD_NUM);
+		return 1;
+	}
+
+	if (size < 5 || size > sizeof(cmd)) {
+		fprintf(stderr, "--size must be 5..%u\n", (uint32_t)sizeof(cmd));
+		return 1;
+	}
+
+	if (memInit() == false) {
+		fprintf(stderr, "memInit failed\n");
+		return 1;
+	}
+
+	// the same APDU as the e2e benchmark
+	cmd[0] = 0x90;
+	cmd[1] = 0x30;
+	cmd[2] = 0x00;
+	cmd[3] = 0x02;
+	if (size == 5) {
+		cmd[4] = 0x00;
+	}
+	else {
+		cmd[4] = (uint8_t)(size - 5);
+		for (uint32_t i = 5; i < size; i++)
+			cmd[i] = (uint8_t)i;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.duration = bench_get_arg_uint(argc, argv, "duration", 5000) * 1000000;
+	s.cmd = cmd;
+	s.cmd_len = size;
+	s.start_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	threads = calloc(thread_num, sizeof(struct _thread));
+	if (s.start_event == NULL || threads == NULL) {
+		fprintf(stderr, "no memory\n");
+		return 1;
+	}
+
+	for (uint32_t i = 0; i < thread_num; i++) {
+		threads[i].done = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (threads[i].done == NULL) {
+			fprintf(stderr, "CreateEventW failed\n");
+			return 1;
+		}
+	}
+
+	// the handles of both models share the state of the reader, as in the module
+	memset(&reader, 0, sizeof(reader));
+	card_clear(&reader.card);
+
+	for (uint32_t m = 0; m < _MODEL_NUM; m++) {
+		s.model = (_model_t)m;
+		if (_run(&s, threads, thread_num, path, &reader) == false) {
+			r = 1;
+			break;
+		}
+	}
+
+	for (uint32_t i = 0; i < thread_num; i++)
+		CloseHandle(threads[i].done);
+
+	CloseHandle(s.start_event);
+	free(threads);
+
+	return r;
+}
+
+#else
+
+int bench_worker_main(int argc, char *argv[])
+{
+	fprintf(stderr, "worker needs Win32 threads and a device, run the Windows build (under Wine on Linux)\n");
+	return 1;
+}
+
+#endif
@@ -0,0 +1,929 @@
+// ifdhandler.c
+//
+// a driver of pcscd (an IFD handler) on the engine of CardReader_ITE, for the hosts
+// which keep the PC/SC stack of the system. pcscd loads it for the readers listed in
+// reader.conf, and its clients reach the cards through it as through any other reader.
+//
+//   cc -O2 -shared -fPIC -fvisibility=hidden -o libitecard_ifd.so ifdhandler.c
+//       ../CardReader_ITE/memory.c ../CardReader_ITE/logring.c ../CardReader_ITE/card.c ../CardReader_ITE/handle.c ../CardReader_ITE/string.c
+//       ../CardReader_ITE/itecard.c ../CardReader_ITE/ite.c ../CardReader_ITE/iterec.c ../CardReader_ITE/itefault.c ../CardReader_ITE/itesim.c
+//       ../CardReader_ITE/profile.c ../CardReader_ITE/devdb.c ../CardReader_ITE/iteloop.c ../CardReader_ITE/stats.c ../CardReader_ITE/trace.c
+//       ../CardReader_ITE/reader.c -lpthread -ldl
+//
+// /etc/reader.conf.d/itecard:
+//
+//   FRIENDLYNAME "ITE ICC Reader"
+//   DEVICENAME   ReaderDevice1:0
+//   LIBPATH      /usr/lib/pcsc/drivers/serial/libitecard_ifd.so
+//
+// DEVICENAME is the section of the device in CardReader_ITE.ini and its id, as in the
+// names of the readers of the module. the INI file is that of the pcsc-lite compatible
+// library (ITECARD_PCSC_CONFIG in the environment of pcscd, /etc/itecard/CardReader_ITE.ini
+// by default), and the devices are shared with the processes using it through devdb.
+//
+// the device of a reader is kept open, so that a check of the card takes a single
+// request to the device. a card which exchanged with the host, or was seen, less
+// than PollInterval milliseconds ago is taken to be there without asking the device,
+// and the polling thread of pcscd sleeps in the driver for as long, unless an
+// exchange finds that the card has gone.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "../CardReader_ITE/debug.h"
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/string.h"
+#include "../CardReader_ITE/profile.h"
+#include "../CardReader_ITE/devdb.h"
+#include "../CardReader_ITE/itecard.h"
+#include "../CardReader_ITE/reader.h"
+#include "ifdhandler.h"
+
+#define IFD_API	__attribute__((visibility("default")))
+
+/* macros */
+
+#define _MAX_SLOT_NUM		16		// readers of pcscd
+#define _MAX_DEVICE_NUM		8		// sections of the INI file in use
+
+#define _DEFAULT_CONFIG			L"/etc/itecard/CardReader_ITE.ini"
+#define _DEFAULT_SECTION		L"ReaderDevice1"
+#define _DEFAULT_POLL_INTERVAL	500		// milliseconds between the checks of the card
+
+/* structures */
+
+struct _reader_device
+{
+	uint32_t ref;	// slots using the device
+	wchar_t section[32];
+	struct reader_device core;	// the engine, shared with the other front ends
+};
+
+struct _slot
+{
+	bool used;
+	bool powered;	// between IFD_POWER_UP and IFD_POWER_DOWN, with a reference to the device
+	DWORD lun;
+	struct _reader_device *dev;
+	uint32_t id;
+	pthread_mutex_t sct;
+	struct itecard_handle itecard;	// open for as long as the channel, unless the device failed
+	uint64_t present;				// stats_get_time when the card was last seen, 0 if it is not known to be there
+	volatile uint32_t event;		// incremented when the card may have gone, waited on by the polling thread
+	volatile uint32_t stop;
+};
+
+/* variables */
+
+static bool _ready = false;
+
+static pthread_mutex_t _sct = PTHREAD_MUTEX_INITIALIZER;	// of the slots and the devices
+
+static struct _slot _slot[_MAX_SLOT_NUM];
+static struct _reader_device _device[_MAX_DEVICE_NUM];
+
+static wchar_t _config[DEVDB_MAX_PATH_SIZE];
+static uint32_t _poll_interval = _DEFAULT_POLL_INTERVAL;
+
+static void *_transport_lib = NULL;
+
+/* functions */
+
+static RESPONSECODE itecard_status_to_ifd_status(itecard_status_t status)
+{
+	switch (status)
+	{
+	case ITECARD_S_OK:
+	case ITECARD_S_FALSE:
+		return IFD_SUCCESS;
+
+	case ITECARD_E_NO_DEVICE:
+		return IFD_NO_SUCH_DEVICE;
+
+	case ITECARD_E_NO_CARD:
+		return IFD_ICC_NOT_PRESENT;
+
+	case ITECARD_E_INSUFFICIENT_BUFFER:
+		return IFD_ERROR_INSUFFICIENT_BUFFER;
+
+	case ITECARD_E_UNRESPONSIVE_CARD:
+		return IFD_RESPONSE_TIMEOUT;
+
+	case ITECARD_E_UNSUPPORTED:
+	case ITECARD_E_PROTO_MISMATCH:
+		return IFD_PROTOCOL_NOT_SUPPORTED;
+
+	default:
+		dbg("itecard_status_to_ifd_status: %d", status);
+		return IFD_COMMUNICATION_ERROR;
+	}
+}
+
+static bool _reader_device_load(struct _reader_device *const rd, const wchar_t *const section)
+{
+	uint32_t capacity;
+
+	capacity = profile_get_int(L"CardReader", L"DeviceNum", DEVDB_DEFAULT_DEV_NUM, _config);
+	if (capacity == 0) {
+		capacity = DEVDB_DEFAULT_DEV_NUM;
+	}
+
+	wchar_t friendlyName[128];
+
+	if (reader_device_load(&rd->core, section, capacity, _config, friendlyName) == false)
+		return false;
+
+	wstrCopy(rd->section, section);
+
+	return true;
+}
+
+// the device of the section, loaded by the first slot using it (called with _sct held)
+static struct _reader_device * _reader_device_get(const wchar_t *const section)
+{
+	struct _reader_device *free_rd = NULL;
+
+	for (uint32_t i = 0; i < _MAX_DEVICE_NUM; i++)
+	{
+		struct _reader_device *rd = &_device[i];
+
+		if (rd->ref == 0) {
+			if (free_rd == NULL)
+				free_rd = rd;
+		}
+		else if (wstrCompare(rd->section, section) == true) {
+			rd->ref++;
+			return rd;
+		}
+	}
+
+	if (free_rd == NULL) {
+		internal_err("_reader_device_get: too many devices");
+		return NULL;
+	}
+
+	memset(free_rd, 0, sizeof(struct _reader_device));
+
+	if (_reader_device_load(free_rd, section) == false)
+		return NULL;
+
+	free_rd->ref = 1;
+
+	return free_rd;
+}
+
+static void _reader_device_put(struct _reader_device *const rd)
+{
+	if (--rd->ref == 0) {
+		reader_device_unload(&rd->core);
+	}
+}
+
+static void _slot_sync_nolock(struct _slot *const s)
+{
+	reader_sync_nolock(&s->dev->core, s->id, &s->itecard);
+}
+
+// opens the device of the slot for the checks of the card
+static itecard_status_t _slot_open_nolock(struct _slot *const s)
+{
+	return reader_open_nolock(&s->dev->core, s->id, &s->itecard, false);
+}
+
+// wakes up the polling thread of the slot
+static void _slot_notify(struct _slot *const s)
+{
+	__atomic_add_fetch(&s->event, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &s->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// the slot of the reader, locked, or NULL
+static struct _slot * _slot_get(const DWORD Lun)
+{
+	if (_ready == false)
+		return NULL;
+
+	pthread_mutex_lock(&_sct);
+
+	for (uint32_t i = 0; i < _MAX_SLOT_NUM; i++)
+	{
+		struct _slot *s = &_slot[i];
+
+		if (s->used == true && s->lun == Lun) {
+			pthread_mutex_lock(&s->sct);
+			pthread_mutex_unlock(&_sct);
+			return s;
+		}
+	}
+
+	pthread_mutex_unlock(&_sct);
+
+	return NULL;
+}
+
+// IFD_ICC_PRESENT or IFD_ICC_NOT_PRESENT, from the device only if the card has not been
+// seen for PollInterval milliseconds
+static RESPONSECODE _slot_presence(struct _slot *const s)
+{
+	uint64_t now = stats_get_time();
+	RESPONSECODE r;
+	bool b = false;
+
+	if (s->present != 0 && stats_get_us(s->present, now) < (uint64_t)_poll_interval * 1000)
+		return IFD_ICC_PRESENT;
+
+	devdb_lock(&s->dev->core.db);
+	_slot_sync_nolock(s);
+
+	// the device is opened again if it failed before
+	if (s->itecard.init == false && _slot_open_nolock(s) != ITECARD_S_OK) {
+		devdb_unlock(&s->dev->core.db);
+		s->present = 0;
+		return IFD_NO_SUCH_DEVICE;
+	}
+
+	if (reader_detect_nolock(&s->itecard, &b) != ITECARD_S_OK) {
+		internal_err("_slot_presence: reader_detect_nolock failed");
+		if (s->powered == false) {
+			itecard_close(&s->itecard, false, false, false);
+		}
+	}
+
+	if (b == true) {
+		s->present = now;
+		r = IFD_ICC_PRESENT;
+	}
+	else {
+		s->present = 0;
+		r = IFD_ICC_NOT_PRESENT;
+	}
+
+	devdb_unlock(&s->dev->core.db);
+
+	return r;
+}
+
+static RESPONSECODE _slot_power_up_nolock(struct _slot *const s, PUCHAR Atr, PDWORD AtrLength)
+{
+	itecard_status_t cr;
+
+	if (s->powered == false)
+	{
+		// the handle of the checks gives way to a connection in T=1, whose reference
+		// turns the power on if it is the first one
+		itecard_close(&s->itecard, false, false, false);
+		memset(&s->itecard, 0, sizeof(struct itecard_handle));
+
+		cr = reader_connect_nolock(&s->dev->core, s->id, &s->itecard, ITECARD_PROTOCOL_T1, false);
+		if (cr != ITECARD_S_OK) {
+			internal_err("_slot_power_up_nolock: reader_connect_nolock failed");
+			_slot_open_nolock(s);
+			s->present = 0;
+			return (cr == ITECARD_E_NO_DEVICE) ? IFD_NO_SUCH_DEVICE : IFD_ERROR_POWER_ACTION;
+		}
+
+		s->powered = true;
+	}
+	else
+	{
+		cr = itecard_init(&s->itecard);
+		if (cr != ITECARD_S_OK && cr != ITECARD_S_FALSE) {
+			internal_err("_slot_power_up_nolock: itecard_init failed");
+			s->present = 0;
+			return (cr == ITECARD_E_NO_DEVICE) ? IFD_NO_SUCH_DEVICE : IFD_ERROR_POWER_ACTION;
+		}
+	}
+
+	struct card_info *card = &s->itecard.reader->card;
+
+	if (Atr != NULL && AtrLength != NULL) {
+		DWORD len = (card->atr_len > MAX_ATR_SIZE) ? MAX_ATR_SIZE : card->atr_len;
+
+		memcpy(Atr, card->atr, len);
+		*AtrLength = len;
+	}
+
+	s->present = stats_get_time();
+
+	return IFD_SUCCESS;
+}
+
+static RESPONSECODE _slot_power_down_nolock(struct _slot *const s)
+{
+	if (s->powered == false)
+		return IFD_SUCCESS;
+
+	s->powered = false;
+
+	// the power is turned off by the last user, and the card is reset when powered up again
+	if (reader_disconnect_nolock(&s->dev->core, s->id, &s->itecard, true) != ITECARD_S_OK) {
+		internal_err("_slot_power_down_nolock: reader_disconnect_nolock failed");
+		itecard_close(&s->itecard, false, false, false);
+	}
+
+	// kept open for the checks of the card
+	_slot_open_nolock(s);
+
+	return IFD_SUCCESS;
+}
+
+static RESPONSECODE _create_channel(const DWORD Lun, const wchar_t *const section, const uint32_t id)
+{
+	struct _slot *s = NULL;
+	RESPONSECODE r = IFD_COMMUNICATION_ERROR;
+
+	if (_ready == false)
+		return IFD_COMMUNICATION_ERROR;
+
+	pthread_mutex_lock(&_sct);
+
+	for (uint32_t i = 0; i < _MAX_SLOT_NUM; i++)
+	{
+		if (_slot[i].used == true && _slot[i].lun == Lun) {
+			internal_err("_create_channel: the lun is in use");
+			goto end;
+		}
+
+		if (_slot[i].used == false && s == NULL)
+			s = &_slot[i];
+	}
+
+	if (s == NULL) {
+		internal_err("_create_channel: too many readers");
+		goto end;
+	}
+
+	s->dev = _reader_device_get(section);
+	if (s->dev == NULL) {
+		r = IFD_NO_SUCH_DEVICE;
+		goto end;
+	}
+
+	s->lun = Lun;
+	s->id = id;
+	s->powered = false;
+	s->present = 0;
+	s->event = 0;
+	s->stop = 0;
+
+	devdb_lock(&s->dev->core.db);
+
+	if (devdb_update_nolock(&s->dev->core.db) != DEVDB_S_OK || _slot_open_nolock(s) != ITECARD_S_OK) {
+		internal_err("_create_channel: no device");
+		devdb_unlock(&s->dev->core.db);
+		_reader_device_put(s->dev);
+		r = IFD_NO_SUCH_DEVICE;
+		goto end;
+	}
+
+	devdb_unlock(&s->dev->core.db);
+
+	s->used = true;
+	r = IFD_SUCCESS;
+
+end:
+	pthread_mutex_unlock(&_sct);
+	return r;
+}
+
+// waits for up to timeout milliseconds until the card may have been inserted or
+// removed. pcscd checks the card again when it returns.
+static RESPONSECODE _polling(DWORD Lun, int timeout)
+{
+	struct _slot *s;
+	RESPONSECODE last;
+	uint32_t event;
+	uint64_t start = stats_get_time();
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	last = _slot_presence(s);
+	event = __atomic_load_n(&s->event, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_unlock(&s->sct);
+
+	if (last == IFD_NO_SUCH_DEVICE)
+		return IFD_NO_SUCH_DEVICE;
+
+	while (1)
+	{
+		uint32_t wait = _poll_interval;
+		uint64_t elapsed = stats_get_us(start, stats_get_time()) / 1000;
+
+		if (timeout >= 0) {
+			if (elapsed >= (uint64_t)timeout)
+				break;
+
+			if ((uint64_t)timeout - elapsed < wait)
+				wait = (uint32_t)(timeout - elapsed);
+		}
+
+		struct timespec ts = { wait / 1000, (wait % 1000) * 1000000 };
+
+		syscall(SYS_futex, &s->event, FUTEX_WAIT_PRIVATE, event, &ts, NULL, 0);
+
+		if (__atomic_load_n(&s->stop, __ATOMIC_SEQ_CST) != 0 || __atomic_load_n(&s->event, __ATOMIC_SEQ_CST) != event)
+			break;
+
+		RESPONSECODE cur;
+
+		pthread_mutex_lock(&s->sct);
+		cur = _slot_presence(s);
+		pthread_mutex_unlock(&s->sct);
+
+		if (cur != last)
+			break;
+	}
+
+	return IFD_SUCCESS;
+}
+
+static RESPONSECODE _stop_polling(DWORD Lun)
+{
+	struct _slot *s;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	__atomic_store_n(&s->stop, 1, __ATOMIC_SEQ_CST);
+	_slot_notify(s);
+
+	pthread_mutex_unlock(&s->sct);
+
+	return IFD_SUCCESS;
+}
+
+// the transport of the devices, from a library which exports it as itecard_transport
+static void _load_transport(void)
+{
+	wchar_t file[DEVDB_MAX_PATH_SIZE];
+	char name[DEVDB_MAX_PATH_SIZE * 4];
+	const struct ite_transport *transport;
+
+	if (profile_get_string(L"CardReader", L"Transport", L"", file, DEVDB_MAX_PATH_SIZE, _config) == 0)
+		return;
+
+	if (wstrToUtf8(name, sizeof(name), file) == 0)
+		return;
+
+	_transport_lib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+	if (_transport_lib == NULL) {
+		internal_err("_load_transport: dlopen failed");
+		return;
+	}
+
+	transport = dlsym(_transport_lib, "itecard_transport");
+	if (transport == NULL || ite_register_transport(transport) == false) {
+		internal_err("_load_transport: no transport");
+		dlclose(_transport_lib);
+		_transport_lib = NULL;
+	}
+}
+
+__attribute__((constructor)) static void _ifdhandler_attach(void)
+{
+	if (memInit() == false) {
+		return;
+	}
+
+	const char *env = getenv("ITECARD_PCSC_CONFIG");
+
+	if (env == NULL || wstrFromUtf8(_config, DEVDB_MAX_PATH_SIZE, env) == 0) {
+		wstrCopy(_config, _DEFAULT_CONFIG);
+	}
+
+	_poll_interval = profile_get_int(L"CardReader", L"PollInterval", _DEFAULT_POLL_INTERVAL, _config);
+	if (_poll_interval == 0) {
+		_poll_interval = _DEFAULT_POLL_INTERVAL;
+	}
+
+	_load_transport();
+	reader_load_access(_config);
+
+	for (uint32_t i = 0; i < _MAX_SLOT_NUM; i++) {
+		pthread_mutex_init(&_slot[i].sct, NULL);
+	}
+
+	// 初期化完了
+	_ready = true;
+}
+
+__attribute__((destructor)) static void _ifdhandler_detach(void)
+{
+	if (_ready == false)
+		return;
+
+	_ready = false;
+
+	// the channels left open by pcscd are closed, so that the other processes see the devices released
+	for (uint32_t i = 0; i < _MAX_SLOT_NUM; i++)
+	{
+		struct _slot *s = &_slot[i];
+
+		if (s->used == true) {
+			devdb_lock(&s->dev->core.db);
+			_slot_sync_nolock(s);
+			_slot_power_down_nolock(s);
+			itecard_close(&s->itecard, false, false, false);
+			devdb_unlock(&s->dev->core.db);
+
+			_reader_device_put(s->dev);
+			s->used = false;
+		}
+
+		pthread_mutex_destroy(&s->sct);
+	}
+
+	if (_transport_lib != NULL) {
+		dlclose(_transport_lib);
+		_transport_lib = NULL;
+	}
+
+	memDeinit();
+}
+
+/* IFD handler functions */
+
+// DeviceName: "ReaderDevice1:0", the section of the device and its id
+IFD_API RESPONSECODE IFDHCreateChannelByName(DWORD Lun, LPSTR DeviceName)
+{
+	dbg("IFDHCreateChannelByName(ITE)");
+
+	wchar_t name[64];
+	wchar_t *sep;
+	uint32_t id = 0;
+
+	if (DeviceName == NULL || wstrFromUtf8(name, 64, DeviceName) == 0)
+		return IFD_NO_SUCH_DEVICE;
+
+	for (sep = name; *sep != L'\0' && *sep != L':'; sep++);
+
+	if (*sep == L':') {
+		*sep++ = L'\0';
+
+		while (*sep >= L'0' && *sep <= L'9') {
+			id = id * 10 + (*sep - L'0');
+			sep++;
+		}
+	}
+
+	return _create_channel(Lun, name, id);
+}
+
+// the device of [ReaderDevice1] whose id is Channel
+IFD_API RESPONSECODE IFDHCreateChannel(DWORD Lun, DWORD Channel)
+{
+	dbg("IFDHCreateChannel(ITE)");
+
+	return _create_channel(Lun, _DEFAULT_SECTION, (uint32_t)Channel);
+}
+
+IFD_API RESPONSECODE IFDHCloseChannel(DWORD Lun)
+{
+	dbg("IFDHCloseChannel(ITE)");
+
+	struct _slot *s;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	devdb_lock(&s->dev->core.db);
+	_slot_sync_nolock(s);
+	_slot_power_down_nolock(s);
+	itecard_close(&s->itecard, false, false, false);
+	devdb_unlock(&s->dev->core.db);
+
+	pthread_mutex_lock(&_sct);
+	_reader_device_put(s->dev);
+	s->dev = NULL;
+	s->used = false;
+	pthread_mutex_unlock(&_sct);
+
+	pthread_mutex_unlock(&s->sct);
+
+	return IFD_SUCCESS;
+}
+
+// copies a value of IFDHGetCapabilities
+static RESPONSECODE _copy_value(const void *const value, const DWORD len, PDWORD Length, PUCHAR Value)
+{
+	if (*Length < len)
+		return IFD_ERROR_INSUFFICIENT_BUFFER;
+
+	memcpy(Value, value, len);
+	*Length = len;
+
+	return IFD_SUCCESS;
+}
+
+IFD_API RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length, PUCHAR Value)
+{
+	dbg_trace("IFDHGetCapabilities(ITE)");
+
+	if (Length == NULL || Value == NULL)
+		return IFD_ERROR_TAG;
+
+	switch (Tag)
+	{
+	case TAG_IFD_SLOTS_NUMBER:
+	{
+		UCHAR v = 1;
+		return _copy_value(&v, 1, Length, Value);
+	}
+
+	case TAG_IFD_SIMULTANEOUS_ACCESS:
+	{
+		UCHAR v = _MAX_SLOT_NUM;
+		return _copy_value(&v, 1, Length, Value);
+	}
+
+	case TAG_IFD_THREAD_SAFE:
+	{
+		// the readers are locked one by one
+		UCHAR v = 1;
+		return _copy_value(&v, 1, Length, Value);
+	}
+
+	case TAG_IFD_SLOT_THREAD_SAFE:
+	{
+		UCHAR v = 0;
+		return _copy_value(&v, 1, Length, Value);
+	}
+
+	case TAG_IFD_POLLING_THREAD_WITH_TIMEOUT:
+	{
+		IFDH_POLLING_WITH_TIMEOUT fn = _polling;
+		return _copy_value(&fn, sizeof(fn), Length, Value);
+	}
+
+	case TAG_IFD_STOP_POLLING_THREAD:
+	{
+		IFDH_STOP_POLLING fn = _stop_polling;
+		return _copy_value(&fn, sizeof(fn), Length, Value);
+	}
+
+	default:
+		break;
+	}
+
+	struct _slot *s;
+	RESPONSECODE r;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	switch (Tag)
+	{
+	case TAG_IFD_ATR:
+	case SCARD_ATTR_ATR_STRING:
+	{
+		struct card_info *card;
+
+		devdb_lock(&s->dev->core.db);
+		_slot_sync_nolock(s);
+
+		card = (s->powered == true) ? &s->itecard.reader->card : NULL;
+
+		if (card == NULL || card->atr_len == 0) {
+			*Length = 0;
+			r = IFD_SUCCESS;
+		}
+		else {
+			r = _copy_value(card->atr, (card->atr_len > MAX_ATR_SIZE) ? MAX_ATR_SIZE : card->atr_len, Length, Value);
+		}
+
+		devdb_unlock(&s->dev->core.db);
+		break;
+	}
+
+	case SCARD_ATTR_ICC_PRESENCE:
+	{
+		UCHAR v = (_slot_presence(s) == IFD_ICC_PRESENT) ? 2 : 0;
+
+		r = _copy_value(&v, 1, Length, Value);
+		break;
+	}
+
+	case SCARD_ATTR_ICC_INTERFACE_STATUS:
+	{
+		UCHAR v = (s->powered == true) ? 1 : 0;
+
+		r = _copy_value(&v, 1, Length, Value);
+		break;
+	}
+
+	default:
+		r = IFD_ERROR_TAG;
+		break;
+	}
+
+	pthread_mutex_unlock(&s->sct);
+
+	return r;
+}
+
+IFD_API RESPONSECODE IFDHSetCapabilities(DWORD Lun, DWORD Tag, DWORD Length, PUCHAR Value)
+{
+	return IFD_NOT_SUPPORTED;
+}
+
+// the cards are exchanged with in T=1 only
+IFD_API RESPONSECODE IFDHSetProtocolParameters(DWORD Lun, DWORD Protocol, UCHAR Flags, UCHAR PTS1, UCHAR PTS2, UCHAR PTS3)
+{
+	dbg("IFDHSetProtocolParameters(ITE)");
+
+	struct _slot *s;
+	RESPONSECODE r;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	devdb_lock(&s->dev->core.db);
+	_slot_sync_nolock(s);
+
+	if (Protocol == SCARD_PROTOCOL_T1 && s->powered == true && s->itecard.reader->card.T1.b == true)
+		r = IFD_SUCCESS;
+	else
+		r = IFD_PROTOCOL_NOT_SUPPORTED;
+
+	devdb_unlock(&s->dev->core.db);
+	pthread_mutex_unlock(&s->sct);
+
+	return r;
+}
+
+IFD_API RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr, PDWORD AtrLength)
+{
+	dbg("IFDHPowerICC(ITE)");
+
+	struct _slot *s;
+	RESPONSECODE r;
+
+	if (AtrLength != NULL) {
+		*AtrLength = 0;
+	}
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	devdb_lock(&s->dev->core.db);
+	_slot_sync_nolock(s);
+
+	switch (Action)
+	{
+	case IFD_POWER_UP:
+		// the card which is still initialized is not reset
+		r = _slot_power_up_nolock(s, Atr, AtrLength);
+		break;
+
+	case IFD_RESET:
+		if (s->powered == true) {
+			reader_reinit_card(&s->itecard);
+		}
+		r = _slot_power_up_nolock(s, Atr, AtrLength);
+		break;
+
+	case IFD_POWER_DOWN:
+		r = _slot_power_down_nolock(s);
+		break;
+
+	default:
+		r = IFD_NOT_SUPPORTED;
+		break;
+	}
+
+	devdb_unlock(&s->dev->core.db);
+	pthread_mutex_unlock(&s->sct);
+
+	return r;
+}
+
+IFD_API RESPONSECODE IFDHTransmitToICC(DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, PDWORD RxLength, PSCARD_IO_HEADER RecvPci)
+{
+	dbg_trace("IFDHTransmitToICC(ITE)");
+
+	if (TxBuffer == NULL || RxBuffer == NULL || RxLength == NULL)
+		return IFD_COMMUNICATION_ERROR;
+
+	struct _slot *s;
+	uint64_t enter = stats_get_time(), start;
+	uint32_t len = (*RxLength > UINT32_MAX) ? UINT32_MAX : (uint32_t)*RxLength;
+	itecard_status_t cr;
+	struct trace_tx tx;
+
+	*RxLength = 0;
+
+	if (SendPci.Protocol != 1)
+		return IFD_PROTOCOL_NOT_SUPPORTED;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	if (s->powered == false) {
+		pthread_mutex_unlock(&s->sct);
+		return IFD_COMMUNICATION_ERROR;
+	}
+
+	start = stats_get_time();
+
+	stats_inc(s->itecard.stats, pending);
+
+	// the lookup of the slot is traced as the one of a handle
+	if (trace_tx_begin(&s->dev->core.trace, &tx, s->id, enter) == true) {
+		trace_tx_lookup(&tx, start, (uint32_t)TxLength);
+		s->itecard.trace = &tx;
+	}
+
+	trace_begin(s->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	devdb_lock(&s->dev->core.db);
+	_slot_sync_nolock(s);
+
+	stats_record(s->itecard.stats, STATS_HIST_LOCK_WAIT, start);
+	trace_end(s->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	// an identical exchange which completed while the reader was waiting answers the command too
+	s->itecard.since = (TxLength >= 2 && s->dev->core.coalesce_ins[TxBuffer[1]] != 0) ? start : 0;
+	s->itecard.ttl = (TxLength >= 2) ? s->dev->core.cache_ttl[TxBuffer[1]] : 0;
+
+	cr = itecard_transmit(&s->itecard, ITECARD_PROTOCOL_T1, TxBuffer, (uint32_t)TxLength, RxBuffer, &len);
+
+	devdb_unlock(&s->dev->core.db);
+
+	if (s->itecard.trace != NULL) {
+		trace_end(s->itecard.trace, TRACE_STAGE_TRANSMIT);
+		tx.rec.recv_len = (cr == ITECARD_S_OK) ? (uint16_t)len : 0;
+		trace_tx_end(&s->dev->core.trace, &tx, (int32_t)itecard_status_to_ifd_status(cr));
+
+		s->itecard.trace = NULL;
+	}
+
+	stats_add(s->itecard.stats, pending, -1);
+
+	if (cr == ITECARD_S_OK) {
+		*RxLength = len;
+		s->present = stats_get_time();
+
+		if (RecvPci != NULL) {
+			RecvPci->Protocol = 1;
+			RecvPci->Length = 0;
+		}
+	}
+	else if (cr == ITECARD_E_NO_CARD || cr == ITECARD_E_FAILED || cr == ITECARD_E_NO_DEVICE) {
+		// pcscd hears of the card at once, instead of at the next check
+		s->present = 0;
+		_slot_notify(s);
+	}
+
+	pthread_mutex_unlock(&s->sct);
+
+	return itecard_status_to_ifd_status(cr);
+}
+
+IFD_API RESPONSECODE IFDHControl(DWORD Lun, DWORD dwControlCode, PUCHAR TxBuffer, DWORD TxLength, PUCHAR RxBuffer, DWORD RxLength, LPDWORD pdwBytesReturned)
+{
+	if (pdwBytesReturned != NULL) {
+		*pdwBytesReturned = 0;
+	}
+
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
+IFD_API RESPONSECODE IFDHICCPresence(DWORD Lun)
+{
+	dbg_trace("IFDHICCPresence(ITE)");
+
+	struct _slot *s;
+	RESPONSECODE r;
+
+	s = _slot_get(Lun);
+	if (s == NULL)
+		return IFD_NO_SUCH_DEVICE;
+
+	r = _slot_presence(s);
+
+	pthread_mutex_unlock(&s->sct);
+
+	return r;
+}
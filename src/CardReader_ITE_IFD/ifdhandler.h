@@ -0,0 +1,59 @@
+// ifdhandler.h
+//
+// the interface of the drivers of pcscd (ifdhandler.h and reader.h of pcsc-lite, version
+// 3.0), so that the driver builds without its headers. the types are those of
+// pcsclite.h.
+
+#pragma once
+
+#include "../CardReader_ITE_PCSC/pcsclite.h"
+
+typedef long RESPONSECODE;
+typedef DWORD *PDWORD;
+
+typedef struct _SCARD_IO_HEADER
+{
+	DWORD Protocol;		// 0 for T=0, 1 for T=1
+	DWORD Length;
+} SCARD_IO_HEADER, *PSCARD_IO_HEADER;
+
+#define IFD_SUCCESS						0
+#define IFD_ERROR_TAG					600
+#define IFD_ERROR_SET_FAILURE			601
+#define IFD_ERROR_VALUE_READ_ONLY		602
+#define IFD_ERROR_PTS_FAILURE			605
+#define IFD_ERROR_NOT_SUPPORTED			606
+#define IFD_PROTOCOL_NOT_SUPPORTED		607
+#define IFD_ERROR_POWER_ACTION			608
+#define IFD_ERROR_SWALLOW				609
+#define IFD_ERROR_EJECT					610
+#define IFD_ERROR_CONFISCATE			611
+#define IFD_COMMUNICATION_ERROR			612
+#define IFD_RESPONSE_TIMEOUT			613
+#define IFD_NOT_SUPPORTED				614
+#define IFD_ICC_PRESENT					615
+#define IFD_ICC_NOT_PRESENT				616
+#define IFD_NO_SUCH_DEVICE				617
+#define IFD_ERROR_INSUFFICIENT_BUFFER	618
+
+#define IFD_POWER_UP	500
+#define IFD_POWER_DOWN	501
+#define IFD_RESET		502
+
+#define TAG_IFD_ATR							0x0303
+#define TAG_IFD_SLOTNUM						0x0180
+#define TAG_IFD_SLOT_THREAD_SAFE			0x0FAC
+#define TAG_IFD_THREAD_SAFE					0x0FAD
+#define TAG_IFD_SLOTS_NUMBER				0x0FAE
+#define TAG_IFD_SIMULTANEOUS_ACCESS			0x0FAF
+#define TAG_IFD_POLLING_THREAD				0x0FB0
+#define TAG_IFD_POLLING_THREAD_KILLABLE		0x0FB1
+#define TAG_IFD_STOP_POLLING_THREAD			0x0FB2
+#define TAG_IFD_POLLING_THREAD_WITH_TIMEOUT	0x0FB3
+
+#define SCARD_ATTR_ICC_PRESENCE				0x00090300
+#define SCARD_ATTR_ICC_INTERFACE_STATUS		0x00090301
+
+// the functions given for TAG_IFD_POLLING_THREAD_WITH_TIMEOUT and TAG_IFD_STOP_POLLING_THREAD
+typedef RESPONSECODE (*IFDH_POLLING_WITH_TIMEOUT)(DWORD Lun, int timeout);
+typedef RESPONSECODE (*IFDH_STOP_POLLING)(DWORD Lun);
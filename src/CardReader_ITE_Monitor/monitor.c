@@ -0,0 +1,334 @@
+// monitor.c
+//
+// prints the statistics of CardReader_ITE live, or writes the traced
+// transactions as a Chrome trace-event JSON file (chrome://tracing, Perfetto).
+//
+//   Windows: CardReader_ITE_Monitor.exe <FriendlyName> [interval(ms)]
+//            CardReader_ITE_Monitor.exe <FriendlyName> --trace <output.json>
+//   other:   cc -O2 -o itecard_monitor monitor.c && ./itecard_monitor <FriendlyName|StatsFile> [interval(ms)]
+//            ./itecard_monitor <FriendlyName|TraceFile> --trace <output.json>
+//
+// the region is looked up by the FriendlyName of the device on Windows. on other
+// platforms it is read from the file given by StatsFile or TraceFile (e.g. that of the
+// module running under Wine), or, when there is no such file, from the shared memory
+// of the native libraries (/dev/shm/itecard_stats_<FriendlyName>).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "../CardReader_ITE/stats.h"
+#include "../CardReader_ITE/trace.h"
+
+static const char *const hist_name[STATS_HIST_NUM] = { "transmit", "lock wait", "card init", "high wait", "norm wait", "low wait" };
+static const char *const stage_name[TRACE_STAGE_NUM] = { "SCardTransmit", "handle", "lock wait", "detect", "init", "reinit", "IFSD", "RESYNCH", "send", "BGT", "recv" };
+
+#ifdef _WIN32
+
+static const void * _attach(const char *const type, const char *const name, const size_t size)
+{
+	wchar_t obj_name[256];
+	HANDLE shmem;
+
+	_snwprintf(obj_name, 256, L"itecard_%hs_%hs_{5EFFECB0-706A-4ED7-B944-9C65B3BE1722}", type, name);
+	obj_name[255] = L'\0';
+
+	shmem = OpenFileMappingW(FILE_MAP_READ, FALSE, obj_name);
+	if (shmem == NULL) {
+		fprintf(stderr, "OpenFileMappingW failed (%lu)\n", GetLastError());
+		return NULL;
+	}
+
+	return MapViewOfFile(shmem, FILE_MAP_READ, 0, 0, 0);
+}
+
+static void _sleep(const uint32_t ms)
+{
+	Sleep(ms);
+}
+
+static uint64_t _get_time(void)
+{
+	return GetTickCount64();
+}
+
+#else
+
+static const void * _attach(const char *const type, const char *const name, const size_t size)
+{
+	char obj_name[512];
+	struct stat st;
+	int fd;
+	void *p;
+
+	fd = open(name, O_RDONLY);
+	if (fd == -1 && errno == ENOENT) {
+		// the '/' of the name are '_' in that of the object
+		snprintf(obj_name, sizeof(obj_name), "/itecard_%s_%s", type, name);
+		for (char *c = obj_name + 1; *c != '\0'; c++) {
+			if (*c == '/')
+				*c = '_';
+		}
+
+		fd = shm_open(obj_name, O_RDONLY, 0);
+	}
+	if (fd == -1) {
+		perror("open");
+		return NULL;
+	}
+
+	// a region not sized yet cannot be read
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)size) {
+		fprintf(stderr, "%s is too small\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return p;
+}
+
+static void _sleep(const uint32_t ms)
+{
+	usleep(ms * 1000);
+}
+
+static uint64_t _get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+#endif
+
+// upper bound of the bucket which holds the given percentile (microseconds)
+static uint64_t _percentile(const uint32_t *const cur, const uint32_t *const prev, const uint32_t permille)
+{
+	uint64_t total = 0, n = 0;
+	uint32_t i;
+
+	for (i = 0; i < STATS_HIST_BUCKET_NUM; i++) {
+		total += cur[i] - prev[i];
+	}
+
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < STATS_HIST_BUCKET_NUM; i++) {
+		n += cur[i] - prev[i];
+		if (n * 1000 >= total * permille)
+			break;
+	}
+
+	return (uint64_t)2 << ((i < STATS_HIST_BUCKET_NUM) ? i : STATS_HIST_BUCKET_NUM - 1);
+}
+
+static void _print(const struct stats_shared_reader *const cur, const struct stats_shared_reader *const prev, const uint32_t count, const uint64_t elapsed)
+{
+	double sec = (elapsed != 0) ? elapsed / 1000.0 : 1.0;
+
+	printf("\n%3s %9s %10s %10s %7s %7s %7s %7s %7s %7s %7s %7s %7s\n", "id", "apdu/s", "sent B/s", "recv B/s", "err/s", "retry", "resynch", "init", "detect", "reinit", "reject", "handles", "ref");
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const struct stats_shared_reader *c = &cur[i], *p = &prev[i];
+
+		if (c->active == 0)
+			continue;
+
+		printf("%3u %9.1f %10.1f %10.1f %7.1f %7u %7u %7u %7u %7u %7u %7u %7u\n", i,
+			(c->apdu - p->apdu) / sec,
+			(c->bytes_sent - p->bytes_sent) / sec,
+			(c->bytes_recv - p->bytes_recv) / sec,
+			(c->error - p->error) / sec,
+			c->retry - p->retry,
+			c->resynch - p->resynch,
+			c->card_init - p->card_init,
+			c->detect - p->detect,
+			c->reinit - p->reinit,
+			c->rejected - p->rejected,
+			c->handle_num,
+			c->ref);
+
+		if (c->latency_us != 0) {
+			printf("    pending %7u  latency avg %8u us\n", c->pending, c->latency_us);
+		}
+
+		if (c->coalesced != 0) {
+			printf("    coalesced %7.1f/s  card time saved %8.1f ms/s\n",
+				(c->coalesced - p->coalesced) / sec,
+				(c->coalesced_us - p->coalesced_us) / 1000.0 / sec);
+		}
+
+		if (c->cache_hit != 0 || c->cache_miss != 0) {
+			printf("    cache hit %7.1f/s  miss %7.1f/s\n",
+				(c->cache_hit - p->cache_hit) / sec,
+				(c->cache_miss - p->cache_miss) / sec);
+		}
+
+		for (uint32_t h = 0; h < STATS_HIST_NUM; h++) {
+			printf("    %-9s p50 <%8llu us  p99 <%8llu us  p99.9 <%8llu us\n", hist_name[h],
+				(unsigned long long)_percentile(c->hist[h], p->hist[h], 500),
+				(unsigned long long)_percentile(c->hist[h], p->hist[h], 990),
+				(unsigned long long)_percentile(c->hist[h], p->hist[h], 999));
+		}
+	}
+
+	fflush(stdout);
+}
+
+static void _print_event(FILE *const fp, const struct trace_shared_record *const rec, const struct trace_shared_event *const ev, const uint64_t freq, const bool first)
+{
+	double ts = ((double)(rec->start + ev->offset) * 1000000.0) / freq;
+
+	fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"itecard\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%u,\"tid\":%u",
+		(first) ? "" : ",",
+		(ev->stage < TRACE_STAGE_NUM) ? stage_name[ev->stage] : "unknown",
+		(ev->phase == TRACE_PHASE_BEGIN) ? "B" : "E",
+		ts, rec->pid, rec->tid);
+
+	if (ev->stage == TRACE_STAGE_TRANSMIT && ev->phase == TRACE_PHASE_END) {
+		fprintf(fp, ",\"args\":{\"reader\":%u,\"result\":\"0x%08X\",\"send\":%u,\"recv\":%u,\"ioctl\":%u,\"poll\":%u,\"retry\":%u}",
+			rec->reader_id, (uint32_t)rec->result, rec->send_len, rec->recv_len, rec->ioctl, rec->poll, rec->retry);
+	}
+
+	fputc('}', fp);
+}
+
+static int _export_trace(const char *const name, const char *const path)
+{
+	const struct trace_shared_info *info;
+	struct trace_shared_record rec;
+	uint32_t n = 0;
+	bool first = true;
+	FILE *fp;
+
+	info = _attach("trace", name, sizeof(struct trace_shared_info));
+	if (info == NULL) {
+		return 1;
+	}
+
+	if (info->signature != TRACE_SHARED_INFO_SIGNATURE || info->version != TRACE_SHARED_INFO_VERSION || info->count != TRACE_RECORD_NUM || info->freq == 0) {
+		fprintf(stderr, "incompatible trace region\n");
+		return 1;
+	}
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (uint32_t i = 0; i < TRACE_RECORD_NUM; i++)
+	{
+		const struct trace_shared_record *r = &info->record[i];
+		uint32_t seq = r->seq;
+
+		// skip the records which are empty or being written
+		if (seq == 0)
+			continue;
+
+		memcpy(&rec, (const void *)r, sizeof(struct trace_shared_record));
+		if (r->seq != seq || rec.event_num > TRACE_MAX_EVENT_NUM)
+			continue;
+
+		for (uint32_t j = 0; j < rec.event_num; j++) {
+			_print_event(fp, &rec, &rec.event[j], info->freq, first);
+			first = false;
+		}
+
+		n++;
+	}
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	printf("%u transactions written to %s\n", n, path);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const struct stats_shared_info *info;
+	struct stats_shared_reader *cur, *prev;
+	uint32_t interval = 1000;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <name> [interval(ms)]\n", argv[0]);
+		fprintf(stderr, "       %s <name> --trace <output.json>\n", argv[0]);
+		return 1;
+	}
+
+	if (argc >= 4 && strcmp(argv[2], "--trace") == 0) {
+		return _export_trace(argv[1], argv[3]);
+	}
+
+	if (argc >= 3) {
+		interval = (uint32_t)strtoul(argv[2], NULL, 10);
+		if (interval == 0) {
+			interval = 1000;
+		}
+	}
+
+	info = _attach("stats", argv[1], sizeof(struct stats_shared_info));
+	if (info == NULL) {
+		return 1;
+	}
+
+	if (info->signature != STATS_SHARED_INFO_SIGNATURE || info->version != STATS_SHARED_INFO_VERSION || info->count != STATS_MAX_READER_NUM || info->bucket_num != STATS_HIST_BUCKET_NUM) {
+		fprintf(stderr, "incompatible statistics region\n");
+		return 1;
+	}
+
+	cur = calloc(STATS_MAX_READER_NUM, sizeof(struct stats_shared_reader));
+	prev = calloc(STATS_MAX_READER_NUM, sizeof(struct stats_shared_reader));
+	if (cur == NULL || prev == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	uint64_t t = _get_time();
+
+	memcpy(prev, info->reader, sizeof(struct stats_shared_reader) * STATS_MAX_READER_NUM);
+
+	while (1)
+	{
+		_sleep(interval);
+
+		uint64_t now = _get_time();
+
+		memcpy(cur, info->reader, sizeof(struct stats_shared_reader) * STATS_MAX_READER_NUM);
+		_print(cur, prev, STATS_MAX_READER_NUM, now - t);
+
+		memcpy(prev, cur, sizeof(struct stats_shared_reader) * STATS_MAX_READER_NUM);
+		t = now;
+	}
+
+	return 0;
+}
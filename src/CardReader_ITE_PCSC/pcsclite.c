@@ -0,0 +1,1897 @@
+// pcsclite.c
+//
+// a library with the interface of libpcsclite (PC/SC Lite) which reaches the devices of
+// CardReader_ITE directly, without pcscd: an application linked with libpcsclite.so.1
+// takes it in its place and exchanges with the card from its own thread, with no
+// message to the daemon and back for every APDU.
+//
+//   cc -O2 -shared -fPIC -fvisibility=hidden -Wl,-soname,libpcsclite.so.1 -o libpcsclite.so.1 pcsclite.c
+//       ../CardReader_ITE/memory.c ../CardReader_ITE/logring.c ../CardReader_ITE/card.c ../CardReader_ITE/handle.c ../CardReader_ITE/string.c
+//       ../CardReader_ITE/itecard.c ../CardReader_ITE/ite.c ../CardReader_ITE/iterec.c ../CardReader_ITE/itefault.c ../CardReader_ITE/itesim.c
+//       ../CardReader_ITE/profile.c ../CardReader_ITE/devdb.c ../CardReader_ITE/iteloop.c ../CardReader_ITE/stats.c ../CardReader_ITE/trace.c
+//       ../CardReader_ITE/reader.c -lpthread -ldl
+//   LD_LIBRARY_PATH=<dir> <application>
+//
+// the settings are those of CardReader_ITE.ini, read from the file given by the
+// environment variable ITECARD_PCSC_CONFIG (/etc/itecard/CardReader_ITE.ini by default).
+// the devices of a [ReaderDeviceN] are listed by Device1 to Device8 and are opened
+// through the transport loaded from Transport of [CardReader], as there is no driver of
+// the ITE devices to enumerate them. the simulated devices (SimulatedDevice) need none.
+//
+// the state of the devices is shared with the other processes through devdb, as it is
+// on Windows. the worker threads, the event loop, the broker, the scheduler, the pooled
+// readers and the statistics of the module are not there. SCardBeginTransaction only
+// checks the handle: the exchanges are serialized by the lock of the device, but a
+// transaction does not keep the other processes out of the card.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define DBG_CATEGORY	DBG_CAT_API
+
+#include "../CardReader_ITE/debug.h"
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/string.h"
+#include "../CardReader_ITE/handle.h"
+#include "../CardReader_ITE/profile.h"
+#include "../CardReader_ITE/devdb.h"
+#include "../CardReader_ITE/itecard.h"
+#include "../CardReader_ITE/iterec.h"
+#include "../CardReader_ITE/reader.h"
+#include "pcsclite.h"
+
+#define PCSC_API	__attribute__((visibility("default")))
+
+/* macros */
+
+#define _CONTEXT_BASE	0x8c110000
+#define _HANDLE_BASE	0xda910000
+
+#define _CONTEXT_SIGNATURE	0x83fc937b
+#define _HANDLE_SIGNATURE	0xa7350c12
+
+#define _context_check_signature(ctx) ((ctx)->signature == _CONTEXT_SIGNATURE)
+#define _context_check(ctx) ((ctx) != NULL && _context_check_signature((ctx)))
+
+#define _handle_check_signature(handle) ((handle)->signature == _HANDLE_SIGNATURE)
+#define _handle_check(handle) ((handle) != NULL && _handle_check_signature((handle)))
+
+#define _POOL_SLAB_NUM	8
+
+#define _DEFAULT_CONFIG			L"/etc/itecard/CardReader_ITE.ini"
+#define _DEFAULT_POLL_INTERVAL	500		// milliseconds between the checks of SCardGetStatusChange
+
+#define _PNP_NOTIFICATION	"\\\\?PnP?\\Notification"
+
+// the bits compared by SCardGetStatusChange. the upper half of the state is the
+// number of readers for the notification of pcsc-lite.
+#define _STATE_MASK		(0xffff & ~SCARD_STATE_CHANGED)
+
+/* structures */
+
+struct _context {
+	uint32_t signature;
+	pthread_mutex_t sct;
+	volatile uint32_t cancel;	// incremented by SCardCancel, waited on by SCardGetStatusChange
+};
+
+struct _handle {
+	uint32_t signature;
+	pthread_mutex_t sct;
+	uint32_t id;
+	struct _reader_device *dev;
+	struct itecard_handle itecard;
+};
+
+struct _reader_device {
+	struct reader_device core;	// the engine, shared with the other front ends
+	wchar_t reader_W[128];
+	char reader_A[128 * 4];
+	uint32_t reader_len_A;
+};
+
+struct _reader_list_A
+{
+	struct _reader_device *dev;
+	uint32_t size;
+	uint32_t len;
+	char *list;
+};
+
+/* variables */
+
+PCSC_API const SCARD_IO_REQUEST g_rgSCardT0Pci = { SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST) };
+PCSC_API const SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST) };
+PCSC_API const SCARD_IO_REQUEST g_rgSCardRawPci = { SCARD_PROTOCOL_RAW, sizeof(SCARD_IO_REQUEST) };
+
+static bool _ready = false;
+
+static handle_list _hlist_ctx;
+static handle_list _hlist_card;
+
+static mem_pool _pool_ctx = NULL;
+static mem_pool _pool_card = NULL;
+
+static uint32_t _device_capacity = DEVDB_DEFAULT_DEV_NUM;
+
+static struct _reader_device *_device = NULL;
+static uintptr_t _device_num = 0;
+static LONG _no_reader_status = SCARD_E_NO_READERS_AVAILABLE;	// SCARD_E_NO_ACCESS if a device was denied its shared memory
+
+static uint32_t _poll_interval = _DEFAULT_POLL_INTERVAL;
+
+static void *_transport_lib = NULL;
+
+/* functions */
+
+static LONG itecard_status_to_scard_status(itecard_status_t status)
+{
+	switch (status)
+	{
+	case ITECARD_S_OK:
+	case ITECARD_S_FALSE:
+		return SCARD_S_SUCCESS;
+
+	case ITECARD_E_FAILED:
+		return SCARD_F_COMM_ERROR;
+
+	case ITECARD_E_FATAL:
+		return SCARD_F_UNKNOWN_ERROR;
+
+	case ITECARD_E_INTERNAL:
+	case ITECARD_E_INVALID_PARAMETER:
+		return SCARD_F_INTERNAL_ERROR;
+
+	case ITECARD_E_UNSUPPORTED:
+		return SCARD_E_READER_UNSUPPORTED;
+
+	case ITECARD_E_TOO_LARGE:
+		return SCARD_E_INVALID_PARAMETER;
+
+	case ITECARD_E_INSUFFICIENT_BUFFER:
+		return SCARD_E_INSUFFICIENT_BUFFER;
+
+	case ITECARD_E_NO_MEMORY:
+		return SCARD_E_NO_MEMORY;
+
+	case ITECARD_E_NO_DEVICE:
+		return SCARD_E_READER_UNAVAILABLE;
+
+	case ITECARD_E_NOT_READY:
+		return SCARD_E_NOT_READY;
+
+	case ITECARD_E_NO_CARD:
+		return SCARD_W_REMOVED_CARD;
+
+	case ITECARD_E_NOT_SHARED:
+	case ITECARD_E_SHARED:
+		return SCARD_E_SHARING_VIOLATION;
+
+	case ITECARD_E_UNRESPONSIVE_CARD:
+		return SCARD_W_UNRESPONSIVE_CARD;
+
+	case ITECARD_E_UNSUPPORTED_CARD:
+		return SCARD_W_UNSUPPORTED_CARD;
+
+	case ITECARD_E_PROTO_MISMATCH:
+		return SCARD_E_PROTO_MISMATCH;
+
+	case ITECARD_E_COMM_FAILED:
+		return SCARD_E_COMM_DATA_LOST;
+
+	default:
+		dbg("itecard_status_to_scard_status: %d", status);
+		return SCARD_F_INTERNAL_ERROR;
+	}
+}
+
+static LONG devdb_status_to_scard_status(devdb_status_t status)
+{
+	switch (status)
+	{
+	case DEVDB_S_OK:
+		return SCARD_S_SUCCESS;
+
+	case DEVDB_E_INTERNAL:
+		return SCARD_F_INTERNAL_ERROR;
+
+	case DEVDB_E_NO_MEMORY:
+		return SCARD_E_NO_MEMORY;
+
+	case DEVDB_E_API:
+		return SCARD_F_UNKNOWN_ERROR;
+
+	case DEVDB_E_NO_DEVICES:
+		return SCARD_E_NO_READERS_AVAILABLE;
+
+	case DEVDB_E_DEVICE_NOT_FOUND:
+		return SCARD_E_READER_UNAVAILABLE;
+
+	case DEVDB_E_ACCESS_DENIED:
+		return SCARD_E_NO_ACCESS;
+
+	default:
+		return SCARD_F_INTERNAL_ERROR;
+	}
+}
+
+static int _enum_readers_callback_A(devdb *const db, const uint32_t id, const struct devdb_shared_devinfo *const devinfo, void *prm)
+{
+	struct _reader_list_A *rl = prm;
+	struct _reader_device *rd = rl->dev;
+
+	char name[sizeof(rd->reader_A) + 12];
+	uint32_t id_len, name_len;
+
+	memcpy(name, rd->reader_A, rd->reader_len_A * sizeof(char));
+	name[rd->reader_len_A] = ' ';
+	id_len = strFromUInt32(name + rd->reader_len_A + 1, 11, id, 10);
+
+	name_len = rd->reader_len_A + 1 + id_len + 1;
+
+	if (rl->list != NULL)
+	{
+		if (rl->len + name_len > rl->size) {
+			rl->len = 0;
+			return 0;
+		}
+		memcpy(rl->list + rl->len, name, name_len * sizeof(char));
+	}
+
+	rl->len += name_len;
+
+	return 1;
+}
+
+static LONG _list_readers_A(struct _reader_list_A *const rl)
+{
+	LONG r = _no_reader_status;
+	devdb_status_t ret = DEVDB_E_INTERNAL;
+	uintptr_t i;
+
+	for (i = 0; i < _device_num; i++)
+	{
+		struct _reader_device *dev = &_device[i];
+
+		devdb_lock(&dev->core.db);
+
+		ret = devdb_update_nolock(&dev->core.db);
+		if (ret != DEVDB_S_OK && ret != DEVDB_E_NO_DEVICES) {
+			r = devdb_status_to_scard_status(ret);
+			devdb_unlock(&dev->core.db);
+			break;
+		}
+
+		rl->dev = dev;
+
+		ret = devdb_enum_nolock(&dev->core.db, _enum_readers_callback_A, rl);
+		if (ret != DEVDB_E_NO_DEVICES) {
+			if (ret != DEVDB_S_OK) {
+				r = SCARD_F_INTERNAL_ERROR;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else if (rl->len == 0) {
+				r = SCARD_E_INSUFFICIENT_BUFFER;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else {
+				r = SCARD_S_SUCCESS;
+			}
+		}
+		else if (r != SCARD_S_SUCCESS) {
+			r = _no_reader_status;
+		}
+
+		devdb_unlock(&dev->core.db);
+	}
+
+	return r;
+}
+
+static int _count_readers_callback(devdb *const db, const uint32_t id, const struct devdb_shared_devinfo *const devinfo, void *prm)
+{
+	(*(uint32_t *)prm)++;
+
+	return 1;
+}
+
+// the number of readers, for the notification of SCardGetStatusChange
+static uint32_t _count_readers(void)
+{
+	uint32_t n = 0;
+
+	for (uintptr_t i = 0; i < _device_num; i++)
+	{
+		struct _reader_device *dev = &_device[i];
+
+		devdb_lock(&dev->core.db);
+		devdb_update_nolock(&dev->core.db);
+		devdb_enum_nolock(&dev->core.db, _count_readers_callback, &n);
+		devdb_unlock(&dev->core.db);
+	}
+
+	return n;
+}
+
+static bool _get_reader_id_A(const char *const name, uintptr_t *const pos, struct _reader_device **const rd, uint32_t *const id)
+{
+	struct _reader_device *d = _device;
+	uintptr_t n = _device_num;
+
+	if (*pos >= n) {
+		return false;
+	}
+
+	d += *pos;
+	n -= *pos;
+
+	while (n--) {
+		if (strCompareN(d->reader_A, name, d->reader_len_A) != false && name[d->reader_len_A] == ' ' && strToUInt32(&name[d->reader_len_A + 1], id) != false) {
+			*rd = d;
+			*pos = d - _device;
+			return true;
+		}
+		d++;
+	}
+
+	return false;
+}
+
+static LONG _connect_card(struct _handle *const handle, struct _reader_device *const rd, const uint32_t id, DWORD dwShareMode, DWORD dwPreferredProtocols, LPDWORD pdwActiveProtocol)
+{
+	if (dwShareMode == SCARD_SHARE_DIRECT)
+		return SCARD_E_READER_UNSUPPORTED;
+
+	itecard_protocol_t protocol = ITECARD_PROTOCOL_UNDEFINED;
+
+	if (dwPreferredProtocols & SCARD_PROTOCOL_T1)
+		protocol |= ITECARD_PROTOCOL_T1;
+
+	if (protocol == ITECARD_PROTOCOL_UNDEFINED)
+		return SCARD_E_PROTO_MISMATCH;
+
+	itecard_status_t cr;
+
+	cr = reader_connect_nolock(&rd->core, id, &handle->itecard, protocol, ((dwShareMode == SCARD_SHARE_EXCLUSIVE) ? true : false));
+	if (cr != ITECARD_S_OK) {
+		// pcsc-lite tells an empty reader apart from a card which was there
+		return (cr == ITECARD_E_NO_CARD || cr == ITECARD_E_FAILED) ? SCARD_E_NO_SMARTCARD : itecard_status_to_scard_status(cr);
+	}
+
+	*pdwActiveProtocol |= SCARD_PROTOCOL_T1;
+
+	handle->id = id;
+	handle->dev = rd;
+
+	return SCARD_S_SUCCESS;
+}
+
+static void _handle_sync_nolock(struct _handle *const handle)
+{
+	reader_sync_nolock(&handle->dev->core, handle->id, &handle->itecard);
+}
+
+static LONG _disconnect_card(struct _handle *const handle, const bool reset)
+{
+	_handle_sync_nolock(handle);
+
+	return itecard_status_to_scard_status(reader_disconnect_nolock(&handle->dev->core, handle->id, &handle->itecard, reset));
+}
+
+static LONG _copy_atr(const uint8_t *const card_atr, const uint32_t card_atr_len, LPBYTE pbAtr, LPDWORD pcbAtrLen, uint32_t max_atr_len)
+{
+	LONG r = SCARD_S_SUCCESS;
+
+	if (pcbAtrLen != NULL)
+	{
+		uint8_t atr_len;
+
+		atr_len = (card_atr_len > max_atr_len) ? max_atr_len : card_atr_len;
+
+		if (pbAtr != NULL)
+		{
+			uint8_t *atr = NULL;
+
+			if (*pcbAtrLen == SCARD_AUTOALLOCATE)
+			{
+				atr = memAllocRaw(atr_len);
+				if (atr == NULL) {
+					r = SCARD_E_NO_MEMORY;
+					goto end;
+				}
+
+				*((LPBYTE *)pbAtr) = atr;
+			}
+			else {
+				if (*pcbAtrLen < atr_len) {
+					r = SCARD_E_INSUFFICIENT_BUFFER;
+				}
+				else {
+					atr = pbAtr;
+				}
+			}
+
+			if (atr != NULL) {
+				memcpy(atr, card_atr, atr_len);
+			}
+		}
+
+		*pcbAtrLen = atr_len;
+	}
+
+end:
+	return r;
+}
+
+static LONG _get_card_atr(struct itecard_handle *const itecard, LPBYTE pbAtr, LPDWORD pcbAtrLen, uint32_t max_atr_len)
+{
+	return _copy_atr(itecard->reader->card.atr, itecard->reader->card.atr_len, pbAtr, pcbAtrLen, max_atr_len);
+}
+
+// pcsc-lite reports a mute card as present
+static DWORD _get_reader_state(struct _reader_device *const rd, const uint32_t id, LPDWORD pcbAtr, LPBYTE rgbAtr)
+{
+	static const DWORD map[][2] = {
+		{ READER_STATE_UNAVAILABLE, SCARD_STATE_UNAVAILABLE },
+		{ READER_STATE_EMPTY, SCARD_STATE_EMPTY },
+		{ READER_STATE_PRESENT, SCARD_STATE_PRESENT },
+		{ READER_STATE_MUTE, SCARD_STATE_MUTE },
+		{ READER_STATE_UNPOWERED, SCARD_STATE_UNPOWERED },
+		{ READER_STATE_INUSE, SCARD_STATE_INUSE },
+		{ READER_STATE_EXCLUSIVE, SCARD_STATE_EXCLUSIVE },
+	};
+
+	uint8_t atr[READER_MAX_ATR_SIZE];
+	uint32_t atr_len, st;
+	DWORD state = 0;
+
+	st = reader_get_state_nolock(&rd->core, id, atr, &atr_len);
+
+	for (uint32_t i = 0; i < sizeof(map) / sizeof(map[0]); i++) {
+		if (st & map[i][0]) {
+			state |= map[i][1];
+		}
+	}
+
+	if ((st & READER_STATE_PRESENT) && !(st & READER_STATE_MUTE)) {
+		_copy_atr(atr, atr_len, rgbAtr, pcbAtr, MAX_ATR_SIZE);
+	}
+
+	return state;
+}
+
+static LONG _get_card_status(struct _handle *const handle, LPDWORD pdwState, LPDWORD pdwProtocol)
+{
+	struct itecard_handle *itecard = &handle->itecard;
+	itecard_status_t ret;
+
+	ret = itecard_init(itecard);
+	if (ret == ITECARD_E_FAILED) {
+		ret = ITECARD_E_NO_CARD;
+	}
+
+	if (pdwState != NULL)
+	{
+		if (ret == ITECARD_E_NO_CARD) {
+			*pdwState = SCARD_ABSENT;
+		}
+		else if (ret == ITECARD_S_OK || ret == ITECARD_S_FALSE)
+		{
+			DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+
+			if ((itecard->protocol & ITECARD_PROTOCOL_T1) && (itecard->reader->card.T1.b == true))
+				protocol |= SCARD_PROTOCOL_T1;
+
+			// pcsc-lite reports every state the card has reached
+			if (protocol == SCARD_PROTOCOL_UNDEFINED) {
+				*pdwState = SCARD_PRESENT | SCARD_POWERED;
+			}
+			else {
+				*pdwState = SCARD_PRESENT | SCARD_POWERED | SCARD_NEGOTIABLE | SCARD_SPECIFIC;
+
+				if (pdwProtocol != NULL) {
+					*pdwProtocol = protocol;
+				}
+			}
+		}
+		else {
+			*pdwState = SCARD_PRESENT | SCARD_POWERED;
+		}
+	}
+
+	return (ret == ITECARD_E_NO_CARD) ? SCARD_W_REMOVED_CARD : SCARD_S_SUCCESS;
+}
+
+static bool _context_alloc(struct _context **const ctx)
+{
+	struct _context *c;
+
+	c = memPoolAlloc(_pool_ctx);
+	if (c == NULL)
+		return false;
+
+	c->signature = _CONTEXT_SIGNATURE;
+	pthread_mutex_init(&c->sct, NULL);
+	c->cancel = 0;
+
+	*ctx = c;
+
+	return true;
+}
+
+static bool _context_free(struct _context *const ctx)
+{
+	pthread_mutex_destroy(&ctx->sct);
+	memPoolFree(_pool_ctx, ctx);
+
+	return true;
+}
+
+static void _context_lock(struct _context *const ctx)
+{
+	pthread_mutex_lock(&ctx->sct);
+	return;
+}
+
+static void _context_unlock(struct _context *const ctx)
+{
+	pthread_mutex_unlock(&ctx->sct);
+	return;
+}
+
+// wakes up SCardGetStatusChange of the context (called with the list of the contexts locked)
+static void _context_cancel(struct _context *const ctx)
+{
+	__atomic_add_fetch(&ctx->cancel, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ctx->cancel, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// sleeps for up to milliseconds unless the context is cancelled. returns false if it has been.
+static bool _context_wait(struct _context *const ctx, const uint32_t cancel, const uint32_t milliseconds)
+{
+	struct timespec ts = { milliseconds / 1000, (milliseconds % 1000) * 1000000 };
+
+	syscall(SYS_futex, &ctx->cancel, FUTEX_WAIT_PRIVATE, cancel, &ts, NULL, 0);
+
+	return (__atomic_load_n(&ctx->cancel, __ATOMIC_SEQ_CST) == cancel) ? true : false;
+}
+
+static uintptr_t _context_release_callback(void *h, void *prm)
+{
+	_context_lock(h);
+	_context_unlock(h);
+
+	_context_free(h);
+
+	return 0;
+}
+
+static bool _handle_alloc(struct _handle **const handle)
+{
+	struct _handle *h;
+
+	h = memPoolAlloc(_pool_card);
+	if (h == NULL)
+		return false;
+
+	h->signature = _HANDLE_SIGNATURE;
+	pthread_mutex_init(&h->sct, NULL);
+	h->id = 0;
+	h->dev = NULL;
+	memset(&h->itecard, 0, sizeof(struct itecard_handle));
+
+	*handle = h;
+
+	return true;
+}
+
+static bool _handle_free(struct _handle *const handle)
+{
+	pthread_mutex_destroy(&handle->sct);
+	memPoolFree(_pool_card, handle);
+
+	return true;
+}
+
+static void _handle_lock(struct _handle *const handle)
+{
+	pthread_mutex_lock(&handle->sct);
+	return;
+}
+
+static void _handle_unlock(struct _handle *const handle)
+{
+	pthread_mutex_unlock(&handle->sct);
+	return;
+}
+
+static uintptr_t _handle_release_callback(void *h, void *prm)
+{
+	LONG r;
+	struct _handle *handle = (struct _handle *)h;
+	bool reset = (prm != NULL) ? *((bool *)prm) : false;
+
+	_handle_lock(handle);
+
+	devdb_lock(&handle->dev->core.db);
+	r = _disconnect_card(handle, reset);
+	devdb_unlock(&handle->dev->core.db);
+
+	_handle_unlock(handle);
+
+	_handle_free(h);
+
+	return (uintptr_t)r;
+}
+
+// the handle locked and valid, or NULL
+static struct _handle * _handle_get(SCARDHANDLE hCard)
+{
+	struct _handle *handle;
+
+	if (_ready == false)
+		return NULL;
+
+	handle_list_lock(_hlist_card);
+
+	handle_list_get_nolock(_hlist_card, (uintptr_t)hCard, (void **)&handle);
+	if (!_handle_check(handle)) {
+		handle_list_unlock(_hlist_card);
+		return NULL;
+	}
+
+	_handle_lock(handle);
+	handle_list_unlock(_hlist_card);
+
+	return handle;
+}
+
+// the context locked and valid, or NULL
+static struct _context * _context_get(SCARDCONTEXT hContext)
+{
+	struct _context *ctx;
+
+	if (_ready == false)
+		return NULL;
+
+	handle_list_lock(_hlist_ctx);
+
+	handle_list_get_nolock(_hlist_ctx, (uintptr_t)hContext, (void **)&ctx);
+	if (!_context_check(ctx)) {
+		handle_list_unlock(_hlist_ctx);
+		return NULL;
+	}
+
+	_context_lock(ctx);
+	handle_list_unlock(_hlist_ctx);
+
+	return ctx;
+}
+
+static bool _reader_device_load(const uint8_t dev_id, const wchar_t *const name, struct _reader_device *const rd, const wchar_t *const path)
+{
+	wchar_t _name[32], def[32];
+	wchar_t *nm;
+
+	if (name != NULL) {
+		nm = (wchar_t *)name;
+		memcpy(def, L"ITE ICC Reader", 15 * sizeof(wchar_t));
+	}
+	else {
+		memcpy(_name, L"ReaderDevice", 12 * sizeof(wchar_t));
+		wstrFromUInt32(_name + 12, 11, dev_id, 10);
+		nm = _name;
+
+		memcpy(def, L"ITE ICC Reader ", 15 * sizeof(wchar_t));
+		wstrFromUInt32(def + 15, 11, dev_id, 10);
+	}
+
+	profile_get_string(nm, L"ReaderName", def, rd->reader_W, 128, path);
+	rd->reader_len_A = wstrToUtf8(rd->reader_A, sizeof(rd->reader_A), rd->reader_W);
+	if (rd->reader_len_A == 0) {
+		dbg("_reader_device_load: rd->reader_len_A == 0");
+		return false;
+	}
+
+	wchar_t friendlyName[128];
+
+	return reader_device_load(&rd->core, nm, _device_capacity, path, friendlyName);
+}
+
+// the transport of the devices, from a library which exports it as itecard_transport
+static void _load_transport(const wchar_t *const path)
+{
+	wchar_t file[DEVDB_MAX_PATH_SIZE];
+	char name[DEVDB_MAX_PATH_SIZE * 4];
+	const struct ite_transport *transport;
+
+	if (profile_get_string(L"CardReader", L"Transport", L"", file, DEVDB_MAX_PATH_SIZE, path) == 0)
+		return;
+
+	if (wstrToUtf8(name, sizeof(name), file) == 0)
+		return;
+
+	_transport_lib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+	if (_transport_lib == NULL) {
+		internal_err("_load_transport: dlopen failed");
+		return;
+	}
+
+	transport = dlsym(_transport_lib, "itecard_transport");
+	if (transport == NULL || ite_register_transport(transport) == false) {
+		internal_err("_load_transport: no transport");
+		dlclose(_transport_lib);
+		_transport_lib = NULL;
+	}
+}
+
+__attribute__((constructor)) static void _pcsclite_attach(void)
+{
+	if (memInit() == false) {
+		return;
+	}
+
+	wchar_t path[DEVDB_MAX_PATH_SIZE];
+	const char *env = getenv("ITECARD_PCSC_CONFIG");
+
+	if (env == NULL || wstrFromUtf8(path, DEVDB_MAX_PATH_SIZE, env) == 0) {
+		wstrCopy(path, _DEFAULT_CONFIG);
+	}
+
+	uintptr_t max_ctx, max_card;
+	wchar_t use_dev[1024];
+	uint32_t use_dev_len;
+	uint8_t dev_ids[256];
+
+	max_ctx = profile_get_int(L"ResourceManager", L"MaxContextNum", 32, path);
+	max_card = profile_get_int(L"CardReader", L"MaxHandleNum", 32, path);
+	_device_capacity = profile_get_int(L"CardReader", L"DeviceNum", DEVDB_DEFAULT_DEV_NUM, path);
+	if (_device_capacity == 0) {
+		_device_capacity = DEVDB_DEFAULT_DEV_NUM;
+	}
+	_poll_interval = profile_get_int(L"CardReader", L"PollInterval", _DEFAULT_POLL_INTERVAL, path);
+	if (_poll_interval == 0) {
+		_poll_interval = _DEFAULT_POLL_INTERVAL;
+	}
+	use_dev_len = profile_get_string(L"CardReader", L"UseDevice", NULL, use_dev, 1024, path);
+
+	_load_transport(path);
+	reader_load_access(path);
+
+	_device_num = 0;
+
+	{
+		// UseDevice から番号を取り出す
+
+		uint32_t i, j;
+
+		for (i = 0, j = 0; i < use_dev_len && j < 256; i++)
+		{
+			uint8_t num = 0;
+
+			while (use_dev[i] >= L'0' && use_dev[i] <= L'9') {
+				num *= 10;
+				num += use_dev[i] - L'0';
+				i++;
+			}
+
+			if (num != 0) {
+				dev_ids[j++] = num;
+			}
+		}
+
+		_device_num = j;
+	}
+
+	_device = memAlloc((_device_num + 1) * sizeof(struct _reader_device));
+	if (_device == NULL) {
+		goto attach_err1;
+	}
+
+	if (_device_num != 0)
+	{
+		// 設定ファイルから該当する番号のデバイス情報を読み込む
+
+		uintptr_t i, j;
+
+		for (i = 0, j = 0; i < _device_num; i++) {
+			if (_reader_device_load(dev_ids[i], NULL, &_device[j], path) != false) {
+				j++;
+			}
+			else if (_device[j].core.open_status == DEVDB_E_ACCESS_DENIED) {
+				_no_reader_status = SCARD_E_NO_ACCESS;
+			}
+		}
+
+		if (_device_num > j) {
+			memset(_device + j, 0, (_device_num - j) * sizeof(struct _reader_device));
+		}
+
+		_device_num = j;
+	}
+
+	// 古いiniファイルの記述方法としても読み込んでみる
+
+	if (_reader_device_load(0, L"CardReader", &_device[_device_num], path) != false) {
+		_device_num++;
+	}
+	else if (_reader_device_load(0, L"Setting", &_device[_device_num], path) != false) {
+		_device_num++;
+	}
+
+	_pool_ctx = memPoolCreate(sizeof(struct _context), _POOL_SLAB_NUM);
+	_pool_card = memPoolCreate(sizeof(struct _handle), _POOL_SLAB_NUM);
+
+	if (_pool_ctx != NULL && _pool_card != NULL && handle_list_init(&_hlist_ctx, _CONTEXT_BASE, max_ctx, _context_release_callback) != false) {
+		if (handle_list_init(&_hlist_card, _HANDLE_BASE, max_card, _handle_release_callback) != false) {
+			// 初期化完了
+			_ready = true;
+			return;
+		}
+		handle_list_deinit(_hlist_ctx);
+	}
+
+	memPoolDestroy(_pool_card);
+	memPoolDestroy(_pool_ctx);
+
+	for (uintptr_t i = 0; i < _device_num; i++) {
+		reader_device_unload(&_device[i].core);
+	}
+
+	memFree(_device);
+	_device = NULL;
+	_device_num = 0;
+
+attach_err1:
+	if (_transport_lib != NULL) {
+		dlclose(_transport_lib);
+		_transport_lib = NULL;
+	}
+
+	memDeinit();
+}
+
+__attribute__((destructor)) static void _pcsclite_detach(void)
+{
+	if (_ready == false)
+		return;
+
+	_ready = false;
+
+	// the handles left open are disconnected, so that the other processes see the cards released
+	handle_list_deinit(_hlist_card);
+	handle_list_deinit(_hlist_ctx);
+	memPoolDestroy(_pool_card);
+	memPoolDestroy(_pool_ctx);
+
+	for (uintptr_t i = 0; i < _device_num; i++) {
+		reader_device_unload(&_device[i].core);
+	}
+
+	memFree(_device);
+	_device = NULL;
+	_device_num = 0;
+
+	// the devices of the transport are closed by now
+	if (_transport_lib != NULL) {
+		dlclose(_transport_lib);
+		_transport_lib = NULL;
+	}
+
+	memDeinit();
+}
+
+/* Resource Manager Context Functions */
+
+PCSC_API LONG SCardEstablishContext(DWORD dwScope, LPCVOID pvReserved1, LPCVOID pvReserved2, LPSCARDCONTEXT phContext)
+{
+	dbg("SCardEstablishContext(ITE)");
+
+	if (phContext == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	*phContext = 0;
+
+	if (_ready == false)
+		return SCARD_E_NO_SERVICE;
+
+	if (dwScope != SCARD_SCOPE_USER && dwScope != SCARD_SCOPE_TERMINAL && dwScope != SCARD_SCOPE_SYSTEM)
+		return SCARD_E_INVALID_VALUE;
+
+	struct _context *ctx;
+	uintptr_t v;
+
+	if (_context_alloc(&ctx) == false)
+		return SCARD_E_NO_MEMORY;
+
+	if (handle_list_put(_hlist_ctx, ctx, &v) == false) {
+		_context_free(ctx);
+		return SCARD_E_NO_MEMORY;
+	}
+
+	*phContext = (SCARDCONTEXT)v;
+
+	return SCARD_S_SUCCESS;
+}
+
+PCSC_API LONG SCardReleaseContext(SCARDCONTEXT hContext)
+{
+	dbg("SCardReleaseContext(ITE)");
+
+	struct _context *ctx;
+	LONG r;
+
+	if (_ready == false)
+		return SCARD_E_INVALID_HANDLE;
+
+	handle_list_lock(_hlist_ctx);
+
+	handle_list_get_nolock(_hlist_ctx, (uintptr_t)hContext, (void **)&ctx);
+	if (!_context_check(ctx)) {
+		r = SCARD_E_INVALID_HANDLE;
+		goto end;
+	}
+
+	// SCardGetStatusChange of another thread returns, and leaves the context to be released
+	_context_cancel(ctx);
+	handle_list_release_nolock(_hlist_ctx, (uintptr_t)hContext, true, NULL, NULL);
+
+	r = SCARD_S_SUCCESS;
+
+end:
+	handle_list_unlock(_hlist_ctx);
+	return r;
+}
+
+PCSC_API LONG SCardIsValidContext(SCARDCONTEXT hContext)
+{
+	struct _context *ctx;
+
+	if (_ready == false)
+		return SCARD_E_INVALID_HANDLE;
+
+	handle_list_lock(_hlist_ctx);
+
+	handle_list_get_nolock(_hlist_ctx, (uintptr_t)hContext, (void **)&ctx);
+	if (!_context_check(ctx)) {
+		handle_list_unlock(_hlist_ctx);
+		return SCARD_E_INVALID_HANDLE;
+	}
+
+	handle_list_unlock(_hlist_ctx);
+
+	return SCARD_S_SUCCESS;
+}
+
+/* Resource Manager Support Function */
+
+PCSC_API LONG SCardFreeMemory(SCARDCONTEXT hContext, LPCVOID pvMem)
+{
+	dbg("SCardFreeMemory(ITE)");
+
+	if (pvMem == NULL)
+		return SCARD_S_SUCCESS;
+
+	struct _context *ctx;
+
+	ctx = _context_get(hContext);
+	if (ctx == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	memFree(pvMem);
+
+	_context_unlock(ctx);
+
+	return SCARD_S_SUCCESS;
+}
+
+/* Smart Card Database Query Functions */
+
+PCSC_API LONG SCardListReaders(SCARDCONTEXT hContext, LPCSTR mszGroups, LPSTR mszReaders, LPDWORD pcchReaders)
+{
+	dbg("SCardListReaders(ITE)");
+
+	if (pcchReaders == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	struct _context *ctx;
+
+	ctx = _context_get(hContext);
+	if (ctx == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	LONG r = SCARD_E_NO_READERS_AVAILABLE;
+
+	bool auto_alloc = false;
+	struct _reader_list_A rl;
+
+	rl.size = 0;
+	rl.len = 0;
+	rl.list = NULL;
+
+	if (mszReaders != NULL)
+	{
+		if (*pcchReaders == SCARD_AUTOALLOCATE)
+		{
+			auto_alloc = true;
+
+			while (1)
+			{
+				// measure the list, then fill a buffer of exactly that size
+
+				rl.size = 0;
+				rl.len = 0;
+				rl.list = NULL;
+
+				r = _list_readers_A(&rl);
+				if (r != SCARD_S_SUCCESS) {
+					goto end;
+				}
+
+				rl.list = memAlloc((rl.len + 1) * sizeof(char));
+				if (rl.list == NULL) {
+					internal_err("SCardListReaders(ITE): memAlloc failed");
+					r = SCARD_E_NO_MEMORY;
+					goto end;
+				}
+
+				rl.size = rl.len;
+				rl.len = 0;
+
+				r = _list_readers_A(&rl);
+				if (r != SCARD_E_INSUFFICIENT_BUFFER) {
+					break;
+				}
+
+				// a reader has been added in the meantime
+				memFree(rl.list);
+			}
+
+			*((LPSTR *)mszReaders) = rl.list;
+			goto end;
+		}
+		else {
+			if (*pcchReaders == 0) {
+				r = SCARD_E_INSUFFICIENT_BUFFER;
+				goto end;
+			}
+
+			rl.list = mszReaders;
+			rl.size = (uint32_t)*pcchReaders - 1;
+		}
+	}
+
+	r = _list_readers_A(&rl);
+
+end:
+	if (r == SCARD_S_SUCCESS)
+	{
+		if (rl.list != NULL) {
+			rl.list[rl.len] = '\0';
+		}
+
+		*pcchReaders = rl.len + 1;
+	}
+	else
+	{
+		if (auto_alloc == true)
+		{
+			*((LPSTR *)mszReaders) = NULL;
+
+			if (rl.list != NULL) {
+				memFree(rl.list);
+				rl.list = NULL;
+			}
+		}
+		*pcchReaders = 0;
+	}
+
+	_context_unlock(ctx);
+
+	return r;
+}
+
+PCSC_API LONG SCardListReaderGroups(SCARDCONTEXT hContext, LPSTR mszGroups, LPDWORD pcchGroups)
+{
+	static const char groups[] = "SCard$DefaultReaders\0";
+
+	if (pcchGroups == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	struct _context *ctx;
+	LONG r = SCARD_S_SUCCESS;
+
+	ctx = _context_get(hContext);
+	if (ctx == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	if (mszGroups != NULL)
+	{
+		if (*pcchGroups == SCARD_AUTOALLOCATE) {
+			char *p = memAllocRaw(sizeof(groups));
+
+			if (p == NULL) {
+				r = SCARD_E_NO_MEMORY;
+			}
+			else {
+				memcpy(p, groups, sizeof(groups));
+				*((LPSTR *)mszGroups) = p;
+			}
+		}
+		else if (*pcchGroups < sizeof(groups)) {
+			r = SCARD_E_INSUFFICIENT_BUFFER;
+		}
+		else {
+			memcpy(mszGroups, groups, sizeof(groups));
+		}
+	}
+
+	*pcchGroups = sizeof(groups);
+
+	_context_unlock(ctx);
+
+	return r;
+}
+
+/* Smart Card Tracking Functions */
+
+// the state of a reader of SCardGetStatusChange, without the changed bit
+static DWORD _get_status(SCARD_READERSTATE *const rs)
+{
+	DWORD state = 0;
+	uintptr_t pos = 0;
+	struct _reader_device *dev;
+	uint32_t id;
+
+	if (strCompare(rs->szReader, _PNP_NOTIFICATION) == true) {
+		return (DWORD)_count_readers() << 16;
+	}
+
+	rs->cbAtr = 0;
+
+	while (1) {
+		DWORD atr_len = MAX_ATR_SIZE;
+
+		if (_get_reader_id_A(rs->szReader, &pos, &dev, &id) == false) {
+			state = SCARD_STATE_IGNORE | SCARD_STATE_UNKNOWN;
+			break;
+		}
+
+		devdb_lock(&dev->core.db);
+		state = _get_reader_state(dev, id, &atr_len, rs->rgbAtr);
+		devdb_unlock(&dev->core.db);
+
+		if (state & SCARD_STATE_PRESENT) {
+			rs->cbAtr = atr_len;
+		}
+
+		pos++;
+
+		if (state != SCARD_STATE_UNAVAILABLE || pos >= _device_num) {
+			break;
+		}
+	}
+
+	return state;
+}
+
+PCSC_API LONG SCardGetStatusChange(SCARDCONTEXT hContext, DWORD dwTimeout, LPSCARD_READERSTATE rgReaderStates, DWORD cReaders)
+{
+	dbg_trace("SCardGetStatusChange(ITE)");
+
+	if (cReaders != 0 && rgReaderStates == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	for (uint32_t i = 0; i < cReaders; i++) {
+		if (rgReaderStates[i].szReader == NULL) {
+			return SCARD_E_INVALID_VALUE;
+		}
+	}
+
+	struct _context *ctx;
+
+	ctx = _context_get(hContext);
+	if (ctx == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	// nothing is waited for before the call
+	uint32_t cancel = __atomic_load_n(&ctx->cancel, __ATOMIC_SEQ_CST);
+	struct timespec ts;
+	uint64_t start;
+	LONG r;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+	while (1)
+	{
+		bool changed = false;
+
+		for (uint32_t i = 0; i < cReaders; i++)
+		{
+			SCARD_READERSTATE *rs = &rgReaderStates[i];
+			DWORD state;
+
+			if (rs->dwCurrentState & SCARD_STATE_IGNORE) {
+				rs->dwEventState = SCARD_STATE_IGNORE;
+				continue;
+			}
+
+			state = _get_status(rs);
+
+			if (strCompare(rs->szReader, _PNP_NOTIFICATION) == true) {
+				if ((state >> 16) != (rs->dwCurrentState >> 16)) {
+					state |= SCARD_STATE_CHANGED;
+					changed = true;
+				}
+			}
+			else if (rs->dwCurrentState == SCARD_STATE_UNAWARE || (state & _STATE_MASK) != (rs->dwCurrentState & _STATE_MASK)) {
+				state |= SCARD_STATE_CHANGED;
+				changed = true;
+			}
+
+			rs->dwEventState = state;
+		}
+
+		if (changed == true || (cReaders == 0 && dwTimeout == 0)) {
+			r = SCARD_S_SUCCESS;
+			break;
+		}
+
+		// the states are polled, as the devices do not tell of a card being inserted
+
+		uint32_t wait = _poll_interval;
+
+		if (dwTimeout != INFINITE) {
+			uint64_t elapsed;
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			elapsed = ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) - start;
+
+			if (elapsed >= dwTimeout) {
+				r = SCARD_E_TIMEOUT;
+				break;
+			}
+
+			if (dwTimeout - elapsed < wait)
+				wait = (uint32_t)(dwTimeout - elapsed);
+		}
+
+		if (_context_wait(ctx, cancel, wait) == false) {
+			r = SCARD_E_CANCELLED;
+			break;
+		}
+	}
+
+	_context_unlock(ctx);
+
+	return r;
+}
+
+PCSC_API LONG SCardCancel(SCARDCONTEXT hContext)
+{
+	dbg("SCardCancel(ITE)");
+
+	struct _context *ctx;
+
+	if (_ready == false)
+		return SCARD_E_INVALID_HANDLE;
+
+	handle_list_lock(_hlist_ctx);
+
+	handle_list_get_nolock(_hlist_ctx, (uintptr_t)hContext, (void **)&ctx);
+	if (!_context_check(ctx)) {
+		handle_list_unlock(_hlist_ctx);
+		return SCARD_E_INVALID_HANDLE;
+	}
+
+	// the context is locked by SCardGetStatusChange while it waits
+	_context_cancel(ctx);
+
+	handle_list_unlock(_hlist_ctx);
+
+	return SCARD_S_SUCCESS;
+}
+
+/* Smart Card and Reader Access Functions */
+
+PCSC_API LONG SCardConnect(SCARDCONTEXT hContext, LPCSTR szReader, DWORD dwShareMode, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard, LPDWORD pdwActiveProtocol)
+{
+	dbg("SCardConnect(ITE)");
+
+	if (szReader == NULL || phCard == NULL || pdwActiveProtocol == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	struct _context *ctx;
+
+	ctx = _context_get(hContext);
+	if (ctx == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	LONG r = SCARD_F_INTERNAL_ERROR;
+	uintptr_t pos = 0;
+
+	while (1)
+	{
+		struct _reader_device *dev;
+		uint32_t id = 0;
+		uintptr_t v;
+
+		*phCard = 0;
+		*pdwActiveProtocol = SCARD_PROTOCOL_UNDEFINED;
+
+		if (_get_reader_id_A(szReader, &pos, &dev, &id) == false) {
+			r = SCARD_E_UNKNOWN_READER;
+			break;
+		}
+
+		struct _handle *handle;
+
+		if (_handle_alloc(&handle) == false) {
+			r = SCARD_E_NO_MEMORY;
+			break;
+		}
+
+		devdb_lock(&dev->core.db);
+
+		r = _connect_card(handle, dev, id, dwShareMode, dwPreferredProtocols, pdwActiveProtocol);
+		if (r == SCARD_S_SUCCESS)
+		{
+			if (handle_list_put(_hlist_card, handle, &v) == true) {
+				*phCard = (SCARDHANDLE)v;
+				devdb_unlock(&dev->core.db);
+				break;
+			}
+			else {
+				_disconnect_card(handle, false);
+				r = SCARD_E_NO_MEMORY;
+			}
+		}
+
+		devdb_unlock(&dev->core.db);
+		_handle_free(handle);
+
+		pos++;
+
+		if (pos >= _device_num) {
+			break;
+		}
+	}
+
+	_context_unlock(ctx);
+
+	return r;
+}
+
+PCSC_API LONG SCardReconnect(SCARDHANDLE hCard, DWORD dwShareMode, DWORD dwPreferredProtocols, DWORD dwInitialization, LPDWORD pdwActiveProtocol)
+{
+	dbg("SCardReconnect(ITE)");
+
+	if (pdwActiveProtocol == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	if (dwShareMode == SCARD_SHARE_DIRECT)
+		return SCARD_E_READER_UNSUPPORTED;
+
+	if (dwShareMode != SCARD_SHARE_SHARED && dwShareMode != SCARD_SHARE_EXCLUSIVE)
+		return SCARD_E_INVALID_VALUE;
+
+	if (!(dwPreferredProtocols & SCARD_PROTOCOL_T1))
+		return SCARD_E_PROTO_MISMATCH;
+
+	struct _handle *handle;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	struct _reader_device *dev = handle->dev;
+	struct itecard_handle *itecard = &handle->itecard;
+	bool exclusive = (dwShareMode == SCARD_SHARE_EXCLUSIVE) ? true : false;
+	uint32_t ref = 0;
+	LONG r = SCARD_S_SUCCESS;
+
+	*pdwActiveProtocol = SCARD_PROTOCOL_UNDEFINED;
+
+	devdb_lock(&dev->core.db);
+	_handle_sync_nolock(handle);
+
+	// the share mode changes only if this handle is the only one on the card
+	if (exclusive != itecard->exclusive)
+	{
+		devdb_get_ref_count_nolock(&dev->core.db, handle->id, &ref);
+
+		if (exclusive == true && ref > 1) {
+			r = SCARD_E_SHARING_VIOLATION;
+			goto end;
+		}
+
+		itecard->reader->exclusive = (exclusive == true) ? 1 : 0;
+		itecard->exclusive = exclusive;
+	}
+
+	// the card is reset by the next initialization
+	if (dwInitialization == SCARD_RESET_CARD || dwInitialization == SCARD_UNPOWER_CARD) {
+		reader_reinit_card(itecard);
+	}
+
+	r = itecard_status_to_scard_status(itecard_init(itecard));
+	if (r != SCARD_S_SUCCESS)
+		goto end;
+
+	if (itecard->reader->card.T1.b == true)
+		*pdwActiveProtocol = SCARD_PROTOCOL_T1;
+	else
+		r = SCARD_E_PROTO_MISMATCH;
+
+end:
+	devdb_unlock(&dev->core.db);
+	_handle_unlock(handle);
+
+	return r;
+}
+
+PCSC_API LONG SCardDisconnect(SCARDHANDLE hCard, DWORD dwDisposition)
+{
+	dbg("SCardDisconnect(ITE)");
+
+	struct _handle *handle;
+	LONG r;
+
+	if (_ready == false)
+		return SCARD_E_INVALID_HANDLE;
+
+	handle_list_lock(_hlist_card);
+
+	handle_list_get_nolock(_hlist_card, (uintptr_t)hCard, (void **)&handle);
+	if (!_handle_check(handle)) {
+		r = SCARD_E_INVALID_HANDLE;
+		goto end;
+	}
+
+	bool reset = (dwDisposition == SCARD_RESET_CARD || dwDisposition == SCARD_UNPOWER_CARD) ? true : false;
+	uintptr_t ret = SCARD_F_INTERNAL_ERROR;
+
+	handle_list_release_nolock(_hlist_card, (uintptr_t)hCard, true, &reset, &ret);
+
+	r = (LONG)ret;
+
+end:
+	handle_list_unlock(_hlist_card);
+	return r;
+}
+
+// the exchanges are serialized by the lock of the device, which is only held for one
+// of them. a transaction of pcsc-lite keeps the card to the handle between them, which
+// is not done here.
+PCSC_API LONG SCardBeginTransaction(SCARDHANDLE hCard)
+{
+	struct _handle *handle;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	_handle_unlock(handle);
+
+	return SCARD_S_SUCCESS;
+}
+
+PCSC_API LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD dwDisposition)
+{
+	struct _handle *handle;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	if (dwDisposition == SCARD_RESET_CARD || dwDisposition == SCARD_UNPOWER_CARD) {
+		devdb_lock(&handle->dev->core.db);
+		_handle_sync_nolock(handle);
+		reader_reinit_card(&handle->itecard);
+		devdb_unlock(&handle->dev->core.db);
+	}
+
+	_handle_unlock(handle);
+
+	return SCARD_S_SUCCESS;
+}
+
+PCSC_API LONG SCardStatus(SCARDHANDLE hCard, LPSTR szReaderName, LPDWORD pcchReaderLen, LPDWORD pdwState, LPDWORD pdwProtocol, LPBYTE pbAtr, LPDWORD pcbAtrLen)
+{
+	dbg_trace("SCardStatus(ITE)");
+
+	struct _handle *handle;
+	struct _reader_device *dev;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	dev = handle->dev;
+
+	LONG r = SCARD_F_INTERNAL_ERROR;
+	bool auto_alloc = false;
+	char *name = NULL;
+	char buf[sizeof(dev->reader_A) + 12];
+	uint32_t len;
+
+	// the name of pcsc-lite is a single string, not a list
+	memcpy(buf, dev->reader_A, dev->reader_len_A * sizeof(char));
+	buf[dev->reader_len_A] = ' ';
+	len = dev->reader_len_A + 1 + strFromUInt32(buf + dev->reader_len_A + 1, 11, handle->id, 10) + 1;
+
+	if (pcchReaderLen != NULL && szReaderName != NULL)
+	{
+		if (*pcchReaderLen == SCARD_AUTOALLOCATE)
+		{
+			auto_alloc = true;
+
+			name = memAllocRaw(len * sizeof(char));
+			if (name == NULL) {
+				r = SCARD_E_NO_MEMORY;
+				goto end2;
+			}
+
+			*((LPSTR *)szReaderName) = name;
+		}
+		else {
+			if (*pcchReaderLen < len) {
+				r = SCARD_E_INSUFFICIENT_BUFFER;
+				goto end2;
+			}
+
+			name = szReaderName;
+		}
+
+		memcpy(name, buf, len * sizeof(char));
+	}
+
+	if (pcchReaderLen != NULL) {
+		*pcchReaderLen = len;
+	}
+
+	devdb_lock(&dev->core.db);
+	_handle_sync_nolock(handle);
+
+	r = _get_card_status(handle, pdwState, pdwProtocol);
+	if (r != SCARD_S_SUCCESS) {
+		devdb_unlock(&dev->core.db);
+		goto end2;
+	}
+
+	r = _get_card_atr(&handle->itecard, pbAtr, pcbAtrLen, MAX_ATR_SIZE);
+	if (r != SCARD_S_SUCCESS) {
+		devdb_unlock(&dev->core.db);
+		goto end2;
+	}
+
+	devdb_unlock(&dev->core.db);
+	goto end1;
+
+end2:
+	if (r != SCARD_S_SUCCESS)
+	{
+		if (pcchReaderLen != NULL)
+		{
+			if (auto_alloc == true)
+			{
+				*((LPSTR *)szReaderName) = NULL;
+
+				if (name != NULL) {
+					memFree(name);
+				}
+			}
+			*pcchReaderLen = 0;
+		}
+
+		if (pdwProtocol != NULL) {
+			*pdwProtocol = SCARD_PROTOCOL_UNDEFINED;
+		}
+
+		if (pcbAtrLen != NULL)
+		{
+			if (pbAtr != NULL && *pcbAtrLen == SCARD_AUTOALLOCATE) {
+				*((LPBYTE *)pbAtr) = NULL;
+			}
+			*pcbAtrLen = 0;
+		}
+	}
+
+end1:
+	_handle_unlock(handle);
+	return r;
+}
+
+// called with the lock held
+static LONG _transmit_nolock(struct _handle *const handle, const uint64_t start, const DWORD protocol, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
+{
+	uint32_t len = (*pcbRecvLength > UINT32_MAX) ? UINT32_MAX : (uint32_t)*pcbRecvLength;
+	LONG r;
+
+	_handle_sync_nolock(handle);
+
+	stats_record(handle->itecard.stats, STATS_HIST_LOCK_WAIT, start);
+	trace_end(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	// an identical exchange which completed while the handle was waiting answers the command too
+	handle->itecard.since = (cbSendLength >= 2 && handle->dev->core.coalesce_ins[pbSendBuffer[1]] != 0) ? start : 0;
+	handle->itecard.ttl = (cbSendLength >= 2) ? handle->dev->core.cache_ttl[pbSendBuffer[1]] : 0;
+
+	switch (protocol)
+	{
+	case SCARD_PROTOCOL_T1:
+		if (handle->itecard.reader->card.T1.b == false) {
+			r = SCARD_E_UNSUPPORTED_FEATURE;
+		}
+		else {
+			r = itecard_status_to_scard_status(itecard_transmit(&handle->itecard, ITECARD_PROTOCOL_T1, pbSendBuffer, (uint32_t)cbSendLength, pbRecvBuffer, &len));
+			*pcbRecvLength = len;
+		}
+		break;
+
+	default:
+		r = SCARD_E_PROTO_MISMATCH;
+		break;
+	}
+
+	return r;
+}
+
+// with the handle locked. enter is the time SCardTransmit was entered.
+static LONG _transmit(struct _handle *const handle, const uint64_t enter, const DWORD protocol, LPCBYTE pbSendBuffer, DWORD cbSendLength, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
+{
+	struct _reader_device *dev = handle->dev;
+	uint64_t start = stats_get_time();
+	struct trace_tx tx;
+	LONG r;
+
+	stats_inc(handle->itecard.stats, pending);
+
+	if (trace_tx_begin(&dev->core.trace, &tx, handle->id, enter) == true) {
+		trace_tx_lookup(&tx, start, cbSendLength);
+		handle->itecard.trace = &tx;
+	}
+
+	trace_begin(handle->itecard.trace, TRACE_STAGE_LOCK_WAIT);
+
+	devdb_lock(&dev->core.db);
+	r = _transmit_nolock(handle, start, protocol, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength);
+	devdb_unlock(&dev->core.db);
+
+	if (handle->itecard.trace != NULL) {
+		trace_end(handle->itecard.trace, TRACE_STAGE_TRANSMIT);
+		tx.rec.recv_len = (r == SCARD_S_SUCCESS) ? (uint16_t)*pcbRecvLength : 0;
+		trace_tx_end(&dev->core.trace, &tx, r);
+
+		handle->itecard.trace = NULL;
+	}
+
+	stats_add(handle->itecard.stats, pending, -1);
+
+	return r;
+}
+
+PCSC_API LONG SCardTransmit(SCARDHANDLE hCard, const SCARD_IO_REQUEST *pioSendPci, LPCBYTE pbSendBuffer, DWORD cbSendLength, SCARD_IO_REQUEST *pioRecvPci, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength)
+{
+	dbg_trace("SCardTransmit(ITE)");
+
+	if (pioSendPci == NULL || pbSendBuffer == NULL || pbRecvBuffer == NULL || pcbRecvLength == NULL || *pcbRecvLength == SCARD_AUTOALLOCATE)
+		return SCARD_E_INVALID_PARAMETER;
+
+	struct _handle *handle;
+	uint64_t enter = stats_get_time();
+	LONG r;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	r = _transmit(handle, enter, pioSendPci->dwProtocol, pbSendBuffer, cbSendLength, pbRecvBuffer, pcbRecvLength);
+
+	if (r == SCARD_S_SUCCESS && pioRecvPci != NULL) {
+		pioRecvPci->dwProtocol = pioSendPci->dwProtocol;
+		pioRecvPci->cbPciLength = sizeof(SCARD_IO_REQUEST);
+	}
+
+	_handle_unlock(handle);
+
+	return r;
+}
+
+PCSC_API LONG SCardControl(SCARDHANDLE hCard, DWORD dwControlCode, LPCVOID pbSendBuffer, DWORD cbSendLength, LPVOID pbRecvBuffer, DWORD cbRecvLength, LPDWORD lpBytesReturned)
+{
+	dbg_trace("SCardControl(ITE)");
+
+	struct _handle *handle;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	if (lpBytesReturned != NULL) {
+		*lpBytesReturned = 0;
+	}
+
+	_handle_unlock(handle);
+
+	return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+// copies an attribute to the buffer of SCardGetAttrib
+static LONG _copy_attrib(const void *const value, const DWORD len, LPBYTE pbAttr, LPDWORD pcbAttrLen)
+{
+	if (pbAttr != NULL)
+	{
+		if (*pcbAttrLen == SCARD_AUTOALLOCATE) {
+			uint8_t *p = memAllocRaw(len);
+
+			if (p == NULL)
+				return SCARD_E_NO_MEMORY;
+
+			memcpy(p, value, len);
+			*((LPBYTE *)pbAttr) = p;
+		}
+		else if (*pcbAttrLen < len) {
+			*pcbAttrLen = len;
+			return SCARD_E_INSUFFICIENT_BUFFER;
+		}
+		else {
+			memcpy(pbAttr, value, len);
+		}
+	}
+
+	*pcbAttrLen = len;
+
+	return SCARD_S_SUCCESS;
+}
+
+PCSC_API LONG SCardGetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPBYTE pbAttr, LPDWORD pcbAttrLen)
+{
+	dbg_trace("SCardGetAttrib(ITE)");
+
+	if (pcbAttrLen == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	struct _handle *handle;
+	struct _reader_device *dev;
+	LONG r;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	dev = handle->dev;
+
+	devdb_lock(&dev->core.db);
+	_handle_sync_nolock(handle);
+
+	switch (dwAttrId)
+	{
+	case SCARD_ATTR_ATR_STRING:
+	{
+		struct card_info *card = &handle->itecard.reader->card;
+
+		r = (card->atr_len == 0) ? SCARD_W_REMOVED_CARD : _copy_attrib(card->atr, card->atr_len, pbAttr, pcbAttrLen);
+		break;
+	}
+
+	case SCARD_ATTR_DEVICE_FRIENDLY_NAME:
+	{
+		char name[sizeof(dev->reader_A) + 12];
+		uint32_t len;
+
+		memcpy(name, dev->reader_A, dev->reader_len_A * sizeof(char));
+		name[dev->reader_len_A] = ' ';
+		len = dev->reader_len_A + 1 + strFromUInt32(name + dev->reader_len_A + 1, 11, handle->id, 10);
+
+		r = _copy_attrib(name, len + 1, pbAttr, pcbAttrLen);
+		break;
+	}
+
+	case SCARD_ATTR_DEVICE_SYSTEM_NAME:
+	{
+		char path[DEVDB_MAX_PATH_SIZE * 4];
+		uint32_t len;
+
+		len = wstrToUtf8(path, sizeof(path), reader_get_path_nolock(&dev->core, handle->id));
+		r = (len == 0) ? SCARD_E_UNSUPPORTED_FEATURE : _copy_attrib(path, len + 1, pbAttr, pcbAttrLen);
+		break;
+	}
+
+	case SCARD_ATTR_CURRENT_PROTOCOL_TYPE:
+	{
+		DWORD protocol = (handle->itecard.reader->card.T1.b == true) ? SCARD_PROTOCOL_T1 : SCARD_PROTOCOL_UNDEFINED;
+
+		r = _copy_attrib(&protocol, sizeof(protocol), pbAttr, pcbAttrLen);
+		break;
+	}
+
+	case SCARD_ATTR_MAXINPUT:
+	{
+		DWORD max = ITECARD_FLIGHT_MAX_SIZE;
+
+		r = _copy_attrib(&max, sizeof(max), pbAttr, pcbAttrLen);
+		break;
+	}
+
+	default:
+		r = SCARD_E_UNSUPPORTED_FEATURE;
+		break;
+	}
+
+	devdb_unlock(&dev->core.db);
+	_handle_unlock(handle);
+
+	return r;
+}
+
+PCSC_API LONG SCardSetAttrib(SCARDHANDLE hCard, DWORD dwAttrId, LPCBYTE pbAttr, DWORD cbAttrLen)
+{
+	struct _handle *handle;
+
+	if (pbAttr == NULL || cbAttrLen == 0)
+		return SCARD_E_INVALID_PARAMETER;
+
+	handle = _handle_get(hCard);
+	if (handle == NULL)
+		return SCARD_E_INVALID_HANDLE;
+
+	_handle_unlock(handle);
+
+	return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+/* Other Functions */
+
+PCSC_API const char * pcsc_stringify_error(const LONG pcscError)
+{
+	static __thread char str[48];
+
+	switch (pcscError)
+	{
+	case SCARD_S_SUCCESS:				return "Command successful.";
+	case SCARD_F_INTERNAL_ERROR:		return "Internal error.";
+	case SCARD_E_CANCELLED:				return "Command cancelled.";
+	case SCARD_E_INVALID_HANDLE:		return "Invalid handle.";
+	case SCARD_E_INVALID_PARAMETER:		return "Invalid parameter given.";
+	case SCARD_E_NO_MEMORY:				return "Not enough memory.";
+	case SCARD_E_INSUFFICIENT_BUFFER:	return "Insufficient buffer.";
+	case SCARD_E_UNKNOWN_READER:		return "Unknown reader specified.";
+	case SCARD_E_TIMEOUT:				return "Command timeout.";
+	case SCARD_E_SHARING_VIOLATION:		return "Sharing violation.";
+	case SCARD_E_NO_SMARTCARD:			return "No smart card inserted.";
+	case SCARD_E_PROTO_MISMATCH:		return "Card protocol mismatch.";
+	case SCARD_E_NOT_READY:				return "Subsystem not ready.";
+	case SCARD_E_INVALID_VALUE:			return "Invalid value given.";
+	case SCARD_F_COMM_ERROR:			return "RPC transport error.";
+	case SCARD_F_UNKNOWN_ERROR:			return "Unknown error.";
+	case SCARD_E_READER_UNAVAILABLE:	return "Reader is unavailable.";
+	case SCARD_E_READER_UNSUPPORTED:	return "Reader not supported.";
+	case SCARD_E_NO_SERVICE:			return "Service not available.";
+	case SCARD_E_UNSUPPORTED_FEATURE:	return "Feature not supported.";
+	case SCARD_E_NO_READERS_AVAILABLE:	return "Cannot find a smart card reader.";
+	case SCARD_E_COMM_DATA_LOST:		return "Communication data lost.";
+	case SCARD_W_UNSUPPORTED_CARD:		return "Card is not supported.";
+	case SCARD_W_UNRESPONSIVE_CARD:		return "Card is unresponsive.";
+	case SCARD_W_UNPOWERED_CARD:		return "Card is unpowered.";
+	case SCARD_W_RESET_CARD:			return "Card was reset.";
+	case SCARD_W_REMOVED_CARD:			return "Card was removed.";
+	default:
+		snprintf(str, sizeof(str), "Unknown error: 0x%08lX", (unsigned long)pcscError);
+		return str;
+	}
+}
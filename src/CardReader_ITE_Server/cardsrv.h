@@ -0,0 +1,112 @@
+// cardsrv.h
+//
+// the protocol of the card server (server.c) and its clients (client.c) on a Unix-domain
+// socket. the socket is local, so the fields are in the byte order of the host.
+
+#pragma once
+
+#include <stdint.h>
+
+#define CARDSRV_MAGIC			0x56525343	// "CSRV"
+#define CARDSRV_VERSION			1
+
+#define CARDSRV_DEFAULT_SOCKET	"/run/itecard/cardsrv.sock"
+
+#define CARDSRV_MAX_BODY_SIZE	32768	// of a request or a response, without the header
+#define CARDSRV_MAX_BATCH_NUM	64		// APDUs in one request
+#define CARDSRV_MAX_SESSION_NUM	16		// cards connected by one connection
+#define CARDSRV_MAX_READERS_SIZE	4096	// the list of the readers
+
+// every request is answered in order, with the seq of the request. a client may send
+// requests without waiting for the responses of the previous ones (pipelining).
+//
+//   request:  header, body (header.len bytes)
+//   response: header (result: SCARD_*), body (header.len bytes)
+
+typedef enum _cardsrv_op_t
+{
+	CARDSRV_OP_HELLO = 1,			// struct cardsrv_hello -> struct cardsrv_hello
+	CARDSRV_OP_LIST_READERS,		// -> the names of the readers, each followed by a terminator, and a terminator after the last one
+	CARDSRV_OP_CONNECT,				// struct cardsrv_connect, the name of the reader with a terminator -> struct cardsrv_protocol, header.session
+	CARDSRV_OP_RECONNECT,			// struct cardsrv_connect -> struct cardsrv_protocol
+	CARDSRV_OP_DISCONNECT,			// struct cardsrv_disposition
+	CARDSRV_OP_STATUS,				// -> struct cardsrv_status, the ATR, the name of the reader with a terminator
+	CARDSRV_OP_BEGIN_TRANSACTION,
+	CARDSRV_OP_END_TRANSACTION,		// struct cardsrv_disposition
+	CARDSRV_OP_TRANSMIT,			// see below
+} cardsrv_op_t;
+
+struct cardsrv_header
+{
+	uint32_t len;		// of the body
+	uint16_t op;		// cardsrv_op_t
+	uint16_t session;	// the card of the connection the request is for, 1 to CARDSRV_MAX_SESSION_NUM
+	uint32_t seq;		// given by the client and returned in the response
+	int32_t result;		// of the response, 0 in the requests
+};
+
+struct cardsrv_hello
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t max_batch;		// of the server
+	uint32_t max_body;		// of the server
+};
+
+struct cardsrv_connect
+{
+	uint32_t share;			// SCARD_SHARE_*
+	uint32_t protocols;		// SCARD_PROTOCOL_*
+	uint32_t init;			// SCARD_*_CARD, for CARDSRV_OP_RECONNECT
+};
+
+struct cardsrv_protocol
+{
+	uint32_t protocol;
+};
+
+struct cardsrv_disposition
+{
+	uint32_t disposition;	// SCARD_*_CARD
+};
+
+struct cardsrv_status
+{
+	uint32_t state;
+	uint32_t protocol;
+	uint32_t atr_len;
+};
+
+// CARDSRV_OP_TRANSMIT carries a batch of APDUs, which are exchanged in order with the
+// card of the session. the response has a struct cardsrv_apdu_res for each APDU of the
+// request, even if the request fails, so that its size up to the data is known to the
+// client, which receives the data into its buffers directly.
+//
+//   request:  struct cardsrv_transmit, struct cardsrv_apdu_req[count], the commands
+//   response: struct cardsrv_transmit, struct cardsrv_apdu_res[count], the responses
+//
+// header.result of the response is that of the first APDU which failed.
+
+#define CARDSRV_TRANSMIT_STOP_ON_ERROR	0x0001	// the APDUs after one which failed are not sent
+
+struct cardsrv_transmit
+{
+	uint16_t count;
+	union {
+		uint16_t flags;		// CARDSRV_TRANSMIT_*, of the request
+		uint16_t sent;		// APDUs sent to the card, of the response
+	};
+};
+
+struct cardsrv_apdu_req
+{
+	uint16_t len;		// of the command
+	uint16_t size;		// of the buffer of the client for the response
+};
+
+struct cardsrv_apdu_res
+{
+	int32_t result;		// SCARD_*, SCARD_E_NOT_TRANSACTED if it was not sent
+	uint16_t len;		// of the response
+	uint16_t reserved;
+};
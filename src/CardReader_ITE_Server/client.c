@@ -0,0 +1,556 @@
+// client.c
+//
+// the client library of the card server (server.c). it needs nothing else of
+// CardReader_ITE, and builds alone:
+//
+//   cc -O2 -shared -fPIC -o libitecard_cardsrv.so client.c
+//
+// the commands are sent from the buffers of the caller and the responses received into
+// them, with the parts of the protocol around them in the same system call (sendmsg and
+// readv): an exchange costs a send and two receives on the socket, whatever the size of
+// the batch.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "client.h"
+
+/* macros */
+
+#define _MAX_STATUS_SIZE	1024	// of the body of the response to CARDSRV_OP_STATUS
+
+/* functions */
+
+static void _iov_advance(struct iovec **const iov, int *const num, size_t done)
+{
+	while (*num != 0 && done >= (*iov)->iov_len) {
+		done -= (*iov)->iov_len;
+		(*iov)++;
+		(*num)--;
+	}
+
+	if (*num != 0) {
+		(*iov)->iov_base = (uint8_t *)(*iov)->iov_base + done;
+		(*iov)->iov_len -= done;
+	}
+}
+
+static bool _sendv(const int fd, struct iovec *iov, int num)
+{
+	_iov_advance(&iov, &num, 0);
+
+	while (num != 0)
+	{
+		struct msghdr msg;
+		ssize_t n;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num;
+
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		_iov_advance(&iov, &num, n);
+	}
+
+	return true;
+}
+
+static bool _recvv(const int fd, struct iovec *iov, int num)
+{
+	_iov_advance(&iov, &num, 0);
+
+	while (num != 0)
+	{
+		ssize_t n = readv(fd, iov, num);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			return false;
+
+		_iov_advance(&iov, &num, n);
+	}
+
+	return true;
+}
+
+// the connection is out of step with the server, and is not used any more
+static LONG _broken(cardsrv_client *const c)
+{
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	c->pending_num = 0;
+	c->pending_size = 0;
+
+	return SCARD_F_COMM_ERROR;
+}
+
+static LONG _drain(cardsrv_client *const c)
+{
+	while (c->pending_num != 0) {
+		// the results are in the APDUs of the requests
+		cardsrv_complete(c);
+	}
+
+	return (c->fd >= 0) ? SCARD_S_SUCCESS : SCARD_E_NO_SERVICE;
+}
+
+// a request which is answered before the next one is sent. the body of the response is
+// copied to res.
+static LONG _call(cardsrv_client *const c, const uint16_t op, const uint16_t session, const void *const req, const uint32_t req_len, const void *const req2, const uint32_t req2_len, void *const res, const uint32_t res_size, uint32_t *const res_len, uint16_t *const res_session)
+{
+	struct cardsrv_header hdr;
+	struct iovec iov[3];
+	LONG r;
+
+	r = _drain(c);
+	if (r != SCARD_S_SUCCESS)
+		return r;
+
+	hdr.len = req_len + req2_len;
+	hdr.op = op;
+	hdr.session = session;
+	hdr.seq = c->seq++;
+	hdr.result = 0;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)req;
+	iov[1].iov_len = req_len;
+	iov[2].iov_base = (void *)req2;
+	iov[2].iov_len = req2_len;
+
+	if (_sendv(c->fd, iov, 3) == false)
+		return _broken(c);
+
+	uint32_t seq = hdr.seq;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+
+	if (_recvv(c->fd, iov, 1) == false || hdr.seq != seq || hdr.op != op || hdr.len > res_size)
+		return _broken(c);
+
+	iov[0].iov_base = res;
+	iov[0].iov_len = hdr.len;
+
+	if (_recvv(c->fd, iov, 1) == false)
+		return _broken(c);
+
+	if (res_len != NULL)
+		*res_len = hdr.len;
+
+	if (res_session != NULL)
+		*res_session = hdr.session;
+
+	return hdr.result;
+}
+
+LONG cardsrv_open(cardsrv_client *const c, const char *const path)
+{
+	struct sockaddr_un addr;
+	struct cardsrv_hello hello;
+	const char *p = path;
+	uint32_t len = 0;
+	LONG r;
+
+	memset(c, 0, sizeof(cardsrv_client));
+	c->fd = -1;
+
+	if (p == NULL)
+		p = getenv("ITECARD_CARDSRV_SOCKET");
+
+	if (p == NULL)
+		p = CARDSRV_DEFAULT_SOCKET;
+
+	if (strlen(p) >= sizeof(addr.sun_path))
+		return SCARD_E_INVALID_PARAMETER;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, p);
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		return SCARD_E_NO_SERVICE;
+
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(c->fd);
+		c->fd = -1;
+		return SCARD_E_NO_SERVICE;
+	}
+
+	hello.magic = CARDSRV_MAGIC;
+	hello.version = CARDSRV_VERSION;
+	hello.max_batch = 0;
+	hello.max_body = 0;
+
+	r = _call(c, CARDSRV_OP_HELLO, 0, &hello, sizeof(hello), NULL, 0, &hello, sizeof(hello), &len, NULL);
+	if (r == SCARD_S_SUCCESS && (len != sizeof(hello) || hello.magic != CARDSRV_MAGIC))
+		r = SCARD_F_COMM_ERROR;
+
+	if (r != SCARD_S_SUCCESS) {
+		cardsrv_close(c);
+		return r;
+	}
+
+	c->max_batch = hello.max_batch;
+	c->max_body = hello.max_body;
+
+	return SCARD_S_SUCCESS;
+}
+
+void cardsrv_close(cardsrv_client *const c)
+{
+	// the server disconnects the cards of the connection
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	c->pending_num = 0;
+	c->pending_size = 0;
+}
+
+LONG cardsrv_list_readers(cardsrv_client *const c, char *const readers, uint32_t *const len)
+{
+	char buf[CARDSRV_MAX_READERS_SIZE];
+	uint32_t n = 0;
+	LONG r;
+
+	if (len == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	r = _call(c, CARDSRV_OP_LIST_READERS, 0, NULL, 0, NULL, 0, buf, sizeof(buf), &n, NULL);
+	if (r != SCARD_S_SUCCESS)
+		return r;
+
+	if (readers != NULL) {
+		if (*len < n) {
+			*len = n;
+			return SCARD_E_INSUFFICIENT_BUFFER;
+		}
+
+		memcpy(readers, buf, n);
+	}
+
+	*len = n;
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG cardsrv_connect(cardsrv_client *const c, const char *const reader, const DWORD share, const DWORD protocols, uint16_t *const session, DWORD *const protocol)
+{
+	struct cardsrv_connect conn;
+	struct cardsrv_protocol proto;
+	uint32_t len = 0;
+	LONG r;
+
+	if (reader == NULL || session == NULL || protocol == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	*session = 0;
+	*protocol = SCARD_PROTOCOL_UNDEFINED;
+
+	conn.share = (uint32_t)share;
+	conn.protocols = (uint32_t)protocols;
+	conn.init = 0;
+
+	r = _call(c, CARDSRV_OP_CONNECT, 0, &conn, sizeof(conn), reader, strlen(reader) + 1, &proto, sizeof(proto), &len, session);
+	if (r != SCARD_S_SUCCESS) {
+		*session = 0;
+		return r;
+	}
+
+	if (len == sizeof(proto))
+		*protocol = proto.protocol;
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG cardsrv_reconnect(cardsrv_client *const c, const uint16_t session, const DWORD share, const DWORD protocols, const DWORD init, DWORD *const protocol)
+{
+	struct cardsrv_connect conn;
+	struct cardsrv_protocol proto;
+	uint32_t len = 0;
+	LONG r;
+
+	if (protocol == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	*protocol = SCARD_PROTOCOL_UNDEFINED;
+
+	conn.share = (uint32_t)share;
+	conn.protocols = (uint32_t)protocols;
+	conn.init = (uint32_t)init;
+
+	r = _call(c, CARDSRV_OP_RECONNECT, session, &conn, sizeof(conn), NULL, 0, &proto, sizeof(proto), &len, NULL);
+
+	if (len == sizeof(proto))
+		*protocol = proto.protocol;
+
+	return r;
+}
+
+LONG cardsrv_disconnect(cardsrv_client *const c, const uint16_t session, const DWORD disposition)
+{
+	struct cardsrv_disposition disp = { (uint32_t)disposition };
+
+	return _call(c, CARDSRV_OP_DISCONNECT, session, &disp, sizeof(disp), NULL, 0, NULL, 0, NULL, NULL);
+}
+
+LONG cardsrv_status(cardsrv_client *const c, const uint16_t session, DWORD *const state, DWORD *const protocol, uint8_t *const atr, uint32_t *const atr_len)
+{
+	uint8_t buf[_MAX_STATUS_SIZE];
+	struct cardsrv_status status;
+	uint32_t len = 0;
+	LONG r;
+
+	r = _call(c, CARDSRV_OP_STATUS, session, NULL, 0, NULL, 0, buf, sizeof(buf), &len, NULL);
+	if (r != SCARD_S_SUCCESS)
+		return r;
+
+	if (len < sizeof(status))
+		return _broken(c);
+
+	memcpy(&status, buf, sizeof(status));
+
+	if (status.atr_len > MAX_ATR_SIZE || len < sizeof(status) + status.atr_len)
+		return _broken(c);
+
+	if (state != NULL)
+		*state = status.state;
+
+	if (protocol != NULL)
+		*protocol = status.protocol;
+
+	if (atr_len != NULL) {
+		if (atr != NULL) {
+			if (*atr_len < status.atr_len) {
+				*atr_len = status.atr_len;
+				return SCARD_E_INSUFFICIENT_BUFFER;
+			}
+
+			memcpy(atr, buf + sizeof(status), status.atr_len);
+		}
+
+		*atr_len = status.atr_len;
+	}
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG cardsrv_begin_transaction(cardsrv_client *const c, const uint16_t session)
+{
+	return _call(c, CARDSRV_OP_BEGIN_TRANSACTION, session, NULL, 0, NULL, 0, NULL, 0, NULL, NULL);
+}
+
+LONG cardsrv_end_transaction(cardsrv_client *const c, const uint16_t session, const DWORD disposition)
+{
+	struct cardsrv_disposition disp = { (uint32_t)disposition };
+
+	return _call(c, CARDSRV_OP_END_TRANSACTION, session, &disp, sizeof(disp), NULL, 0, NULL, 0, NULL, NULL);
+}
+
+LONG cardsrv_transmit(cardsrv_client *const c, const uint16_t session, const uint8_t *const send, const uint32_t send_len, uint8_t *const recv, uint32_t *const recv_len)
+{
+	struct cardsrv_apdu apdu;
+	LONG r;
+
+	if (recv_len == NULL)
+		return SCARD_E_INVALID_PARAMETER;
+
+	apdu.send = send;
+	apdu.send_len = send_len;
+	apdu.recv = recv;
+	apdu.recv_size = *recv_len;
+
+	r = cardsrv_transmit_batch(c, session, &apdu, 1, 0);
+
+	*recv_len = (r == SCARD_S_SUCCESS) ? apdu.recv_len : 0;
+
+	return r;
+}
+
+LONG cardsrv_transmit_batch(cardsrv_client *const c, const uint16_t session, struct cardsrv_apdu *const apdu, const uint16_t count, const uint16_t flags)
+{
+	LONG r;
+
+	r = _drain(c);
+	if (r != SCARD_S_SUCCESS)
+		return r;
+
+	r = cardsrv_submit(c, session, apdu, count, flags);
+	if (r != SCARD_S_SUCCESS)
+		return r;
+
+	return cardsrv_complete(c);
+}
+
+LONG cardsrv_submit(cardsrv_client *const c, const uint16_t session, struct cardsrv_apdu *const apdu, const uint16_t count, const uint16_t flags)
+{
+	uint8_t buf[sizeof(struct cardsrv_header) + sizeof(struct cardsrv_transmit) + CARDSRV_MAX_BATCH_NUM * sizeof(struct cardsrv_apdu_req)];
+	struct iovec iov[1 + CARDSRV_MAX_BATCH_NUM];
+	struct cardsrv_header hdr;
+	struct cardsrv_transmit tx;
+	struct cardsrv_apdu_req areq;
+	uint32_t req_len, res_len, prefix;
+	int num = 1;
+
+	if (c->fd < 0)
+		return SCARD_E_NO_SERVICE;
+
+	if (apdu == NULL || count == 0 || count > c->max_batch || count > CARDSRV_MAX_BATCH_NUM)
+		return SCARD_E_INVALID_PARAMETER;
+
+	if (c->pending_num >= CARDSRV_CLIENT_MAX_PENDING_NUM)
+		return SCARD_E_SERVER_TOO_BUSY;
+
+	prefix = sizeof(tx) + count * sizeof(areq);
+	req_len = prefix;
+	res_len = sizeof(tx) + count * sizeof(struct cardsrv_apdu_res);
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		if (apdu[i].send == NULL || apdu[i].send_len == 0 || apdu[i].send_len > UINT16_MAX || apdu[i].recv == NULL)
+			return SCARD_E_INVALID_PARAMETER;
+
+		areq.len = (uint16_t)apdu[i].send_len;
+		areq.size = (apdu[i].recv_size > UINT16_MAX) ? UINT16_MAX : (uint16_t)apdu[i].recv_size;
+		memcpy(buf + sizeof(hdr) + sizeof(tx) + i * sizeof(areq), &areq, sizeof(areq));
+
+		req_len += areq.len;
+		res_len += areq.size;
+
+		// the commands are sent from the buffers of the caller
+		iov[num].iov_base = (void *)apdu[i].send;
+		iov[num].iov_len = apdu[i].send_len;
+		num++;
+
+		apdu[i].recv_len = 0;
+		apdu[i].result = SCARD_E_NOT_TRANSACTED;
+	}
+
+	if (req_len > c->max_body || res_len > c->max_body)
+		return SCARD_E_INVALID_PARAMETER;
+
+	// the server waits to send a response while the socket is full, and would no more take requests
+	if (c->pending_num != 0 && c->pending_size + sizeof(hdr) + res_len > CARDSRV_CLIENT_MAX_PENDING_SIZE)
+		return SCARD_E_SERVER_TOO_BUSY;
+
+	hdr.len = req_len;
+	hdr.op = CARDSRV_OP_TRANSMIT;
+	hdr.session = session;
+	hdr.seq = c->seq++;
+	hdr.result = 0;
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	tx.count = count;
+	tx.flags = flags;
+	memcpy(buf + sizeof(hdr), &tx, sizeof(tx));
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(hdr) + prefix;
+
+	if (_sendv(c->fd, iov, num) == false)
+		return _broken(c);
+
+	struct cardsrv_pending *p = &c->pending[(c->head + c->pending_num) % CARDSRV_CLIENT_MAX_PENDING_NUM];
+
+	p->seq = hdr.seq;
+	p->size = sizeof(hdr) + res_len;
+	p->count = count;
+	p->apdu = apdu;
+
+	c->pending_num++;
+	c->pending_size += p->size;
+
+	return SCARD_S_SUCCESS;
+}
+
+LONG cardsrv_complete(cardsrv_client *const c)
+{
+	uint8_t buf[sizeof(struct cardsrv_header) + sizeof(struct cardsrv_transmit) + CARDSRV_MAX_BATCH_NUM * sizeof(struct cardsrv_apdu_res)];
+	struct iovec iov[CARDSRV_MAX_BATCH_NUM];
+	struct cardsrv_header hdr;
+	struct cardsrv_transmit tx;
+	struct cardsrv_apdu_res ares;
+	struct cardsrv_pending *p;
+	uint32_t prefix, data_len = 0;
+	int num = 0;
+
+	if (c->fd < 0)
+		return SCARD_E_NO_SERVICE;
+
+	if (c->pending_num == 0)
+		return SCARD_E_INVALID_VALUE;
+
+	p = &c->pending[c->head];
+	prefix = sizeof(tx) + p->count * sizeof(ares);
+
+	// the response up to the data has a known size, and the data is received into the buffers of the APDUs
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(hdr) + prefix;
+
+	if (_recvv(c->fd, iov, 1) == false)
+		return _broken(c);
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	memcpy(&tx, buf + sizeof(hdr), sizeof(tx));
+
+	if (hdr.seq != p->seq || hdr.op != CARDSRV_OP_TRANSMIT || hdr.len < prefix || tx.count != p->count)
+		return _broken(c);
+
+	for (uint16_t i = 0; i < p->count; i++)
+	{
+		struct cardsrv_apdu *a = &p->apdu[i];
+
+		memcpy(&ares, buf + sizeof(hdr) + sizeof(tx) + i * sizeof(ares), sizeof(ares));
+
+		if (ares.len > a->recv_size)
+			return _broken(c);
+
+		a->result = ares.result;
+		a->recv_len = ares.len;
+
+		if (ares.len != 0) {
+			iov[num].iov_base = a->recv;
+			iov[num].iov_len = ares.len;
+			num++;
+		}
+
+		data_len += ares.len;
+	}
+
+	if (hdr.len != prefix + data_len || _recvv(c->fd, iov, num) == false)
+		return _broken(c);
+
+	c->head = (c->head + 1) % CARDSRV_CLIENT_MAX_PENDING_NUM;
+	c->pending_num--;
+	c->pending_size -= p->size;
+
+	return hdr.result;
+}
+
+uint32_t cardsrv_pending(const cardsrv_client *const c)
+{
+	return c->pending_num;
+}
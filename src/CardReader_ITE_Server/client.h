@@ -0,0 +1,69 @@
+// client.h
+
+#pragma once
+
+// calls like those of the SCard API, on a connection to the card server. they return
+// the SCARD_* values of pcsc-lite. a connection is used by one thread at a time.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../CardReader_ITE_PCSC/pcsclite.h"
+#include "cardsrv.h"
+
+#define CARDSRV_CLIENT_MAX_PENDING_NUM	16		// requests sent and not completed
+#define CARDSRV_CLIENT_MAX_PENDING_SIZE	65536	// of their responses, which the socket holds until they are completed
+
+// an APDU of a batch. the response is received from the socket into recv directly.
+struct cardsrv_apdu
+{
+	const uint8_t *send;
+	uint32_t send_len;
+	uint8_t *recv;
+	uint32_t recv_size;
+	uint32_t recv_len;		// set when it is completed
+	LONG result;			// likewise
+};
+
+struct cardsrv_pending
+{
+	uint32_t seq;
+	uint32_t size;		// of the response
+	uint16_t count;
+	struct cardsrv_apdu *apdu;
+};
+
+typedef struct _cardsrv_client
+{
+	int fd;
+	uint32_t seq;			// of the next request
+	uint32_t max_batch;		// of the server
+	uint32_t max_body;		// likewise
+	uint32_t head;			// the oldest pending request
+	uint32_t pending_num;
+	uint32_t pending_size;
+	struct cardsrv_pending pending[CARDSRV_CLIENT_MAX_PENDING_NUM];
+} cardsrv_client;
+
+// path: the socket, or NULL for that of ITECARD_CARDSRV_SOCKET, or CARDSRV_DEFAULT_SOCKET
+extern LONG cardsrv_open(cardsrv_client *const c, const char *const path);
+extern void cardsrv_close(cardsrv_client *const c);
+
+extern LONG cardsrv_list_readers(cardsrv_client *const c, char *const readers, uint32_t *const len);
+extern LONG cardsrv_connect(cardsrv_client *const c, const char *const reader, const DWORD share, const DWORD protocols, uint16_t *const session, DWORD *const protocol);
+extern LONG cardsrv_reconnect(cardsrv_client *const c, const uint16_t session, const DWORD share, const DWORD protocols, const DWORD init, DWORD *const protocol);
+extern LONG cardsrv_disconnect(cardsrv_client *const c, const uint16_t session, const DWORD disposition);
+extern LONG cardsrv_status(cardsrv_client *const c, const uint16_t session, DWORD *const state, DWORD *const protocol, uint8_t *const atr, uint32_t *const atr_len);
+extern LONG cardsrv_begin_transaction(cardsrv_client *const c, const uint16_t session);
+extern LONG cardsrv_end_transaction(cardsrv_client *const c, const uint16_t session, const DWORD disposition);
+
+extern LONG cardsrv_transmit(cardsrv_client *const c, const uint16_t session, const uint8_t *const send, const uint32_t send_len, uint8_t *const recv, uint32_t *const recv_len);
+// the APDUs are exchanged in order in one request. returns the result of the first which failed.
+extern LONG cardsrv_transmit_batch(cardsrv_client *const c, const uint16_t session, struct cardsrv_apdu *const apdu, const uint16_t count, const uint16_t flags);
+
+// pipelining: cardsrv_submit sends a batch without waiting for its response, and
+// cardsrv_complete waits for the response of the oldest one which was submitted. apdu
+// is kept until then. the other calls complete the pending requests first.
+extern LONG cardsrv_submit(cardsrv_client *const c, const uint16_t session, struct cardsrv_apdu *const apdu, const uint16_t count, const uint16_t flags);
+extern LONG cardsrv_complete(cardsrv_client *const c);
+extern uint32_t cardsrv_pending(const cardsrv_client *const c);
@@ -0,0 +1,664 @@
+// server.c
+//
+// the card server: a daemon which serves the cards of CardReader_ITE over a Unix-domain
+// socket, to the processes which do not reach the devices themselves, such as those in
+// the containers which share the cards of the host. it runs the engine of the pcsc-lite
+// compatible library (CardReader_ITE_PCSC), and the client library (client.c) gives
+// calls like those of the SCard API on the socket.
+//
+//   cc -O2 -o itecard_cardsrv server.c ../CardReader_ITE_PCSC/pcsclite.c
+//       ../CardReader_ITE/memory.c ../CardReader_ITE/logring.c ../CardReader_ITE/card.c ../CardReader_ITE/handle.c ../CardReader_ITE/string.c
+//       ../CardReader_ITE/itecard.c ../CardReader_ITE/ite.c ../CardReader_ITE/iterec.c ../CardReader_ITE/itefault.c ../CardReader_ITE/itesim.c
+//       ../CardReader_ITE/profile.c ../CardReader_ITE/devdb.c ../CardReader_ITE/iteloop.c ../CardReader_ITE/stats.c ../CardReader_ITE/trace.c
+//       ../CardReader_ITE/reader.c -lpthread -ldl
+//   itecard_cardsrv [--socket path]
+//
+// the settings are those of the library (ITECARD_PCSC_CONFIG), with ServerSocket and
+// ServerMaxClients of [CardReader]. the socket is given to the containers by mounting
+// it, and it may be used by the user and the group of the server (0660).
+//
+// a connection is served by a thread of its own, which takes its requests in order. the
+// cards it connects are its sessions, each a handle of the library on a device of devdb,
+// and they are disconnected when the connection is closed. the requests are received
+// into a buffer which may hold several of them, the commands of a batch are sent to the
+// card from there, and the card writes its responses into the response to the client.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "../CardReader_ITE/memory.h"
+#include "../CardReader_ITE/string.h"
+#include "../CardReader_ITE/profile.h"
+#include "../CardReader_ITE_PCSC/pcsclite.h"
+#include "cardsrv.h"
+
+/* macros */
+
+#define _DEFAULT_CONFIG			L"/etc/itecard/CardReader_ITE.ini"
+#define _DEFAULT_MAX_CLIENT_NUM	16
+
+#define _MAX_REQUEST_SIZE	(sizeof(struct cardsrv_header) + CARDSRV_MAX_BODY_SIZE)
+#define _IN_BUFFER_SIZE		(_MAX_REQUEST_SIZE * 2)		// a request and a part of the next ones
+
+/* structures */
+
+struct _client
+{
+	struct _client *next;
+	int fd;
+	SCARDCONTEXT ctx;
+	SCARDHANDLE card[CARDSRV_MAX_SESSION_NUM];	// 0 if the session is not in use
+	uint32_t in_len;
+	uint8_t in[_IN_BUFFER_SIZE];
+	uint8_t out[_MAX_REQUEST_SIZE];
+};
+
+/* variables */
+
+static volatile sig_atomic_t _stop = 0;
+
+static pthread_mutex_t _client_sct = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _client_cond = PTHREAD_COND_INITIALIZER;
+static struct _client *_client_list = NULL;
+static uint32_t _client_num = 0;
+
+/* functions */
+
+static void _signal_handler(int sig)
+{
+	_stop = 1;
+}
+
+static bool _send_all(const int fd, const uint8_t *buf, size_t len)
+{
+	while (len != 0)
+	{
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static SCARDHANDLE _session_get(const struct _client *const cl, const uint16_t session)
+{
+	if (session == 0 || session > CARDSRV_MAX_SESSION_NUM)
+		return 0;
+
+	return cl->card[session - 1];
+}
+
+// the body of the response is written at res by the functions below, which return its length
+
+static uint32_t _op_hello(struct _client *const cl, const uint8_t *const req, const uint32_t req_len, struct cardsrv_header *const hdr, uint8_t *const res)
+{
+	struct cardsrv_hello hello;
+
+	if (req_len < sizeof(hello)) {
+		hdr->result = SCARD_E_INVALID_PARAMETER;
+		return 0;
+	}
+
+	memcpy(&hello, req, sizeof(hello));
+
+	if (hello.magic != CARDSRV_MAGIC || hello.version != CARDSRV_VERSION)
+		hdr->result = SCARD_E_UNSUPPORTED_FEATURE;
+
+	hello.magic = CARDSRV_MAGIC;
+	hello.version = CARDSRV_VERSION;
+	hello.max_batch = CARDSRV_MAX_BATCH_NUM;
+	hello.max_body = CARDSRV_MAX_BODY_SIZE;
+	memcpy(res, &hello, sizeof(hello));
+
+	return sizeof(hello);
+}
+
+static uint32_t _op_list_readers(struct _client *const cl, struct cardsrv_header *const hdr, uint8_t *const res)
+{
+	DWORD len = CARDSRV_MAX_READERS_SIZE;
+
+	hdr->result = SCardListReaders(cl->ctx, NULL, (LPSTR)res, &len);
+
+	return (hdr->result == SCARD_S_SUCCESS) ? len : 0;
+}
+
+static uint32_t _op_connect(struct _client *const cl, const uint8_t *const req, const uint32_t req_len, struct cardsrv_header *const hdr, uint8_t *const res)
+{
+	struct cardsrv_connect conn;
+	struct cardsrv_protocol proto;
+	const char *reader = (const char *)req + sizeof(conn);
+	DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+	uint32_t i;
+
+	// the name of the reader ends within the body
+	if (req_len <= sizeof(conn) || req[req_len - 1] != '\0') {
+		hdr->result = SCARD_E_INVALID_PARAMETER;
+		return 0;
+	}
+
+	memcpy(&conn, req, sizeof(conn));
+
+	for (i = 0; i < CARDSRV_MAX_SESSION_NUM; i++) {
+		if (cl->card[i] == 0)
+			break;
+	}
+
+	if (i >= CARDSRV_MAX_SESSION_NUM) {
+		hdr->result = SCARD_E_NO_MEMORY;
+		return 0;
+	}
+
+	hdr->result = SCardConnect(cl->ctx, reader, conn.share, conn.protocols, &cl->card[i], &protocol);
+	if (hdr->result != SCARD_S_SUCCESS) {
+		cl->card[i] = 0;
+		return 0;
+	}
+
+	hdr->session = (uint16_t)(i + 1);
+
+	proto.protocol = (uint32_t)protocol;
+	memcpy(res, &proto, sizeof(proto));
+
+	return sizeof(proto);
+}
+
+static uint32_t _op_reconnect(struct _client *const cl, const SCARDHANDLE card, const uint8_t *const req, const uint32_t req_len, struct cardsrv_header *const hdr, uint8_t *const res)
+{
+	struct cardsrv_connect conn;
+	struct cardsrv_protocol proto;
+	DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+
+	if (req_len < sizeof(conn)) {
+		hdr->result = SCARD_E_INVALID_PARAMETER;
+		return 0;
+	}
+
+	memcpy(&conn, req, sizeof(conn));
+
+	hdr->result = SCardReconnect(card, conn.share, conn.protocols, conn.init, &protocol);
+
+	proto.protocol = (uint32_t)protocol;
+	memcpy(res, &proto, sizeof(proto));
+
+	return sizeof(proto);
+}
+
+static uint32_t _op_status(struct _client *const cl, const SCARDHANDLE card, struct cardsrv_header *const hdr, uint8_t *const res)
+{
+	struct cardsrv_status status;
+	DWORD state = 0, protocol = SCARD_PROTOCOL_UNDEFINED, atr_len = MAX_ATR_SIZE, name_len;
+	uint8_t *atr = res + sizeof(status);
+	char *name = (char *)atr + MAX_ATR_SIZE;
+
+	name_len = CARDSRV_MAX_BODY_SIZE - sizeof(status) - MAX_ATR_SIZE;
+
+	hdr->result = SCardStatus(card, name, &name_len, &state, &protocol, atr, &atr_len);
+	if (hdr->result != SCARD_S_SUCCESS)
+		return 0;
+
+	// the name follows the ATR
+	memmove(atr + atr_len, name, name_len);
+
+	status.state = (uint32_t)state;
+	status.protocol = (uint32_t)protocol;
+	status.atr_len = (uint32_t)atr_len;
+	memcpy(res, &status, sizeof(status));
+
+	return sizeof(status) + atr_len + name_len;
+}
+
+// returns false if the request is malformed, which closes the connection, as the client
+// could not take the response
+static bool _op_transmit(struct _client *const cl, const SCARDHANDLE card, const uint8_t *const req, const uint32_t req_len, struct cardsrv_header *const hdr, uint8_t *const res, uint32_t *const res_len)
+{
+	struct cardsrv_transmit tx;
+	struct cardsrv_apdu_req areq[CARDSRV_MAX_BATCH_NUM];
+	struct cardsrv_apdu_res ares;
+	const uint8_t *cmd;
+	uint8_t *data;
+	uint32_t req_total, res_total;
+
+	if (req_len < sizeof(tx))
+		return false;
+
+	memcpy(&tx, req, sizeof(tx));
+
+	if (tx.count == 0 || tx.count > CARDSRV_MAX_BATCH_NUM || req_len < sizeof(tx) + tx.count * sizeof(areq[0]))
+		return false;
+
+	memcpy(areq, req + sizeof(tx), tx.count * sizeof(areq[0]));
+
+	req_total = sizeof(tx) + tx.count * sizeof(areq[0]);
+	res_total = sizeof(tx) + tx.count * sizeof(ares);
+
+	for (uint32_t i = 0; i < tx.count; i++) {
+		req_total += areq[i].len;
+		res_total += areq[i].size;
+	}
+
+	if (req_total != req_len || res_total > CARDSRV_MAX_BODY_SIZE)
+		return false;
+
+	cmd = req + sizeof(tx) + tx.count * sizeof(areq[0]);
+	data = res + sizeof(tx) + tx.count * sizeof(ares);
+
+	uint16_t flags = tx.flags;
+
+	tx.sent = 0;
+
+	for (uint32_t i = 0; i < tx.count; i++)
+	{
+		DWORD len = areq[i].size;
+
+		if (card == 0) {
+			ares.result = SCARD_E_INVALID_HANDLE;
+		}
+		else if (hdr->result != SCARD_S_SUCCESS && (flags & CARDSRV_TRANSMIT_STOP_ON_ERROR)) {
+			ares.result = SCARD_E_NOT_TRANSACTED;
+		}
+		else {
+			// the response is written where the client takes it from
+			ares.result = SCardTransmit(card, SCARD_PCI_T1, cmd, areq[i].len, NULL, data, &len);
+			tx.sent++;
+		}
+
+		ares.len = (ares.result == SCARD_S_SUCCESS) ? (uint16_t)len : 0;
+		ares.reserved = 0;
+		memcpy(res + sizeof(tx) + i * sizeof(ares), &ares, sizeof(ares));
+
+		if (ares.result != SCARD_S_SUCCESS && hdr->result == SCARD_S_SUCCESS)
+			hdr->result = ares.result;
+
+		cmd += areq[i].len;
+		data += ares.len;
+	}
+
+	memcpy(res, &tx, sizeof(tx));
+
+	*res_len = (uint32_t)(data - res);
+
+	return true;
+}
+
+// returns false if the connection is to be closed
+static bool _execute(struct _client *const cl, const struct cardsrv_header *const req_hdr, const uint8_t *const req)
+{
+	struct cardsrv_header hdr;
+	uint8_t *res = cl->out + sizeof(hdr);
+	uint32_t res_len = 0;
+	SCARDHANDLE card = _session_get(cl, req_hdr->session);
+	struct cardsrv_disposition disp = { SCARD_LEAVE_CARD };
+
+	hdr.len = 0;
+	hdr.op = req_hdr->op;
+	hdr.session = req_hdr->session;
+	hdr.seq = req_hdr->seq;
+	hdr.result = SCARD_S_SUCCESS;
+
+	switch (req_hdr->op)
+	{
+	case CARDSRV_OP_HELLO:
+		res_len = _op_hello(cl, req, req_hdr->len, &hdr, res);
+		break;
+
+	case CARDSRV_OP_LIST_READERS:
+		res_len = _op_list_readers(cl, &hdr, res);
+		break;
+
+	case CARDSRV_OP_CONNECT:
+		res_len = _op_connect(cl, req, req_hdr->len, &hdr, res);
+		break;
+
+	case CARDSRV_OP_TRANSMIT:
+		if (_op_transmit(cl, card, req, req_hdr->len, &hdr, res, &res_len) == false)
+			return false;
+		break;
+
+	default:
+		if (card == 0) {
+			hdr.result = SCARD_E_INVALID_HANDLE;
+			break;
+		}
+
+		if (req_hdr->op == CARDSRV_OP_DISCONNECT || req_hdr->op == CARDSRV_OP_END_TRANSACTION) {
+			if (req_hdr->len >= sizeof(disp))
+				memcpy(&disp, req, sizeof(disp));
+		}
+
+		switch (req_hdr->op)
+		{
+		case CARDSRV_OP_RECONNECT:
+			res_len = _op_reconnect(cl, card, req, req_hdr->len, &hdr, res);
+			break;
+
+		case CARDSRV_OP_DISCONNECT:
+			hdr.result = SCardDisconnect(card, disp.disposition);
+			cl->card[req_hdr->session - 1] = 0;
+			break;
+
+		case CARDSRV_OP_STATUS:
+			res_len = _op_status(cl, card, &hdr, res);
+			break;
+
+		case CARDSRV_OP_BEGIN_TRANSACTION:
+			hdr.result = SCardBeginTransaction(card);
+			break;
+
+		case CARDSRV_OP_END_TRANSACTION:
+			hdr.result = SCardEndTransaction(card, disp.disposition);
+			break;
+
+		default:
+			hdr.result = SCARD_E_UNSUPPORTED_FEATURE;
+			break;
+		}
+		break;
+	}
+
+	hdr.len = res_len;
+	memcpy(cl->out, &hdr, sizeof(hdr));
+
+	// the response is sent at once: the next request may wait for the card for long
+	if (_send_all(cl->fd, cl->out, sizeof(hdr) + res_len) == false)
+		return false;
+
+	// a client which does not speak the protocol is not served
+	if (req_hdr->op == CARDSRV_OP_HELLO && hdr.result != SCARD_S_SUCCESS)
+		return false;
+
+	return true;
+}
+
+static void _client_close(struct _client *const cl)
+{
+	for (uint32_t i = 0; i < CARDSRV_MAX_SESSION_NUM; i++) {
+		if (cl->card[i] != 0)
+			SCardDisconnect(cl->card[i], SCARD_LEAVE_CARD);
+	}
+
+	SCardReleaseContext(cl->ctx);
+
+	pthread_mutex_lock(&_client_sct);
+
+	for (struct _client **p = &_client_list; *p != NULL; p = &(*p)->next) {
+		if (*p == cl) {
+			*p = cl->next;
+			break;
+		}
+	}
+
+	_client_num--;
+	pthread_cond_broadcast(&_client_cond);
+
+	// the socket is closed under the lock, so that the server does not shut a descriptor which has been reused
+	close(cl->fd);
+
+	pthread_mutex_unlock(&_client_sct);
+
+	memFree(cl);
+}
+
+static void * _client_thread(void *prm)
+{
+	struct _client *cl = prm;
+	uint32_t pos = 0;
+
+	while (1)
+	{
+		struct cardsrv_header hdr;
+		uint32_t avail = cl->in_len - pos;
+
+		if (avail >= sizeof(hdr))
+		{
+			memcpy(&hdr, cl->in + pos, sizeof(hdr));
+
+			if (hdr.len > CARDSRV_MAX_BODY_SIZE)
+				break;
+
+			// the requests which have been received are executed before receiving again
+			if (avail >= sizeof(hdr) + hdr.len) {
+				if (_execute(cl, &hdr, cl->in + pos + sizeof(hdr)) == false)
+					break;
+
+				pos += sizeof(hdr) + hdr.len;
+				continue;
+			}
+		}
+
+		if (pos != 0) {
+			memmove(cl->in, cl->in + pos, avail);
+			cl->in_len = avail;
+			pos = 0;
+		}
+
+		ssize_t n = recv(cl->fd, cl->in + cl->in_len, _IN_BUFFER_SIZE - cl->in_len, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		cl->in_len += (uint32_t)n;
+	}
+
+	_client_close(cl);
+
+	return NULL;
+}
+
+static bool _client_start(const int fd, const uint32_t max_client)
+{
+	struct _client *cl;
+	pthread_t thread;
+	pthread_attr_t attr;
+	sigset_t set, old;
+	int ret;
+
+	pthread_mutex_lock(&_client_sct);
+
+	if (_client_num >= max_client) {
+		pthread_mutex_unlock(&_client_sct);
+		return false;
+	}
+
+	_client_num++;
+
+	pthread_mutex_unlock(&_client_sct);
+
+	cl = memAlloc(sizeof(struct _client));
+	if (cl == NULL)
+		goto err1;
+
+	cl->fd = fd;
+
+	if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &cl->ctx) != SCARD_S_SUCCESS)
+		goto err2;
+
+	pthread_mutex_lock(&_client_sct);
+	cl->next = _client_list;
+	_client_list = cl;
+	pthread_mutex_unlock(&_client_sct);
+
+	// the signals are taken by the main thread
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, _client_thread, cl);
+	pthread_attr_destroy(&attr);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	// the socket is closed with the client, by the thread or here
+	if (ret != 0)
+		_client_close(cl);
+
+	return true;
+
+err2:
+	memFree(cl);
+err1:
+	pthread_mutex_lock(&_client_sct);
+	_client_num--;
+	pthread_mutex_unlock(&_client_sct);
+
+	return false;
+}
+
+static int _listen(const char *const path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "the path of the socket is too long: %s\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	// a socket left by a server which has gone is taken over, one which is served is not
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "another server serves %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	chmod(path, 0660);
+
+	if (listen(fd, SOMAXCONN) != 0) {
+		perror("listen");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	wchar_t config[512], value[512];
+	char path[512];
+	const char *env = getenv("ITECARD_PCSC_CONFIG");
+	uint32_t max_client;
+	SCARDCONTEXT ctx;
+	struct sigaction sa;
+	int fd;
+
+	if (env == NULL || wstrFromUtf8(config, 512, env) == 0) {
+		wstrCopy(config, _DEFAULT_CONFIG);
+	}
+
+	// the engine is set up as the library is loaded
+	if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &ctx) != SCARD_S_SUCCESS) {
+		fprintf(stderr, "the settings could not be loaded\n");
+		return 1;
+	}
+
+	SCardReleaseContext(ctx);
+
+	max_client = profile_get_int(L"CardReader", L"ServerMaxClients", _DEFAULT_MAX_CLIENT_NUM, config);
+	if (max_client == 0) {
+		max_client = _DEFAULT_MAX_CLIENT_NUM;
+	}
+
+	strcpy(path, CARDSRV_DEFAULT_SOCKET);
+
+	if (profile_get_string(L"CardReader", L"ServerSocket", L"", value, 512, config) != 0) {
+		wstrToUtf8(path, sizeof(path), value);
+	}
+
+	for (int i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--socket") == 0) {
+			snprintf(path, sizeof(path), "%s", argv[i + 1]);
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _signal_handler;
+	sigemptyset(&sa.sa_mask);
+	// without SA_RESTART, so that accept returns
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = _listen(path);
+	if (fd < 0)
+		return 1;
+
+	fprintf(stderr, "serving %s\n", path);
+
+	while (_stop == 0)
+	{
+		int cfd = accept(fd, NULL, NULL);
+
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("accept");
+			break;
+		}
+
+		if (_client_start(cfd, max_client) == false)
+			close(cfd);
+	}
+
+	close(fd);
+	unlink(path);
+
+	// the connections are closed, and their cards disconnected, before the engine goes
+	pthread_mutex_lock(&_client_sct);
+
+	for (struct _client *cl = _client_list; cl != NULL; cl = cl->next) {
+		shutdown(cl->fd, SHUT_RDWR);
+	}
+
+	while (_client_num != 0) {
+		pthread_cond_wait(&_client_cond, &_client_sct);
+	}
+
+	pthread_mutex_unlock(&_client_sct);
+
+	return 0;
+}